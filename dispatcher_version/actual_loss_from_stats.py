@@ -15,6 +15,7 @@ import time
 import signal
 import sys
 import subprocess
+import urllib.request
 from scapy.all import PcapReader, IP, UDP
 import struct
 
@@ -73,29 +74,42 @@ def is_p_slice(pkt):
         return False
 
 
-def read_xdp_stat(stat_key):
-    """Read XDP stat from BPF map"""
+XDP_STATS_BIN = os.path.join(os.path.dirname(os.path.abspath(__file__)), "xdp_stats")
+METRICS_URL = "http://localhost:9101/metrics"
+
+
+def read_exporter_stats(stat_keys):
+    """video_stats counters from a running xdp_exporter, listed in enum order"""
+    with urllib.request.urlopen(METRICS_URL, timeout=1) as response:
+        lines = [line for line in response.read().decode().splitlines()
+                 if line.startswith("xdp_video_stat_total{")]
+    return {key: int(lines[key].split()[1]) if key < len(lines) else 0 for key in stat_keys}
+
+
+def read_xdp_stats(*stat_keys):
+    """Read XDP stats (summed over CPUs) from xdp_exporter, or through the
+    xdp_stats reader when no exporter runs"""
+    values = {key: 0 for key in stat_keys}
+    try:
+        return read_exporter_stats(stat_keys)
+    except (OSError, ValueError):
+        pass
     try:
         result = subprocess.run(
-            ["sudo", "bpftool", "map", "dump", "pinned", "/sys/fs/bpf/xdp_pipeline/video_stats"],
+            ["sudo", XDP_STATS_BIN, "-j", "video_stats"] + [str(key) for key in stat_keys],
             capture_output=True,
             text=True,
             timeout=2
         )
         if result.returncode != 0:
-            return 0
-        
-        lines = result.stdout.split('\n')
-        for i, line in enumerate(lines):
-            if f'"key": {stat_key},' in line:
-                if i + 1 < len(lines):
-                    value_line = lines[i + 1]
-                    if '"value":' in value_line:
-                        value_str = value_line.split('"value":')[1].strip().rstrip(',')
-                        return int(value_str)
-        return 0
+            return values
+
+        snapshot = json.loads(result.stdout)
+        for key in stat_keys:
+            values[key] = int(snapshot["values"].get(str(key), 0))
+        return values
     except Exception:
-        return 0
+        return values
 
 
 class ActualLossMonitor:
@@ -148,8 +162,9 @@ class ActualLossMonitor:
         if not self.tx_packets:
             return
 
-        xdp_dropped = read_xdp_stat(4)
-        xdp_forwarded = read_xdp_stat(5)
+        stats = read_xdp_stats(4, 5)
+        xdp_dropped = stats[4]
+        xdp_forwarded = stats[5]
         
         dropped_delta = xdp_dropped - self.prev_xdp_dropped
         forwarded_delta = xdp_forwarded - self.prev_xdp_forwarded
@@ -215,8 +230,9 @@ class ActualLossMonitor:
     def run(self):
         print(f"[STARTUP] Monitoring TX={self.tx_pcap}, RX={self.rx_pcap}, + XDP stats", file=sys.stderr, flush=True)
         
-        self.prev_xdp_dropped = read_xdp_stat(4)
-        self.prev_xdp_forwarded = read_xdp_stat(5)
+        stats = read_xdp_stats(4, 5)
+        self.prev_xdp_dropped = stats[4]
+        self.prev_xdp_forwarded = stats[5]
         print(f"[STARTUP] XDP baseline: {self.prev_xdp_dropped} dropped, {self.prev_xdp_forwarded} forwarded", file=sys.stderr, flush=True)
         
         while not os.path.exists(self.tx_pcap) or not os.path.exists(self.rx_pcap):
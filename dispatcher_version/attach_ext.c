@@ -3,22 +3,338 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <bpf/libbpf.h>
 #include <bpf/bpf.h>
+#include <bpf/btf.h>
+
+#include "xdp_obj.h"
+
+/* Writes value into the load-time constant `name`. Must be called before
+ * bpf_object__load. */
+static int set_rodata_var(struct bpf_object *obj, const char *name, unsigned long long value) {
+    __u32 size;
+    void *var = rodata_var(obj, name, &size);
+
+    if (!var)
+        return -ENOENT;
+    switch (size) {
+    case 1: *(__u8 *)var = value; break;
+    case 2: *(__u16 *)var = value; break;
+    case 4: *(__u32 *)var = value; break;
+    case 8: *(__u64 *)var = value; break;
+    default: return -EINVAL;
+    }
+    return 0;
+}
+
+#define MAX_PROG_MAPS 64
+
+/* Ids of the maps the loaded program prog_fd uses, at most MAX_PROG_MAPS */
+static int prog_map_ids(int prog_fd, __u32 *ids, __u32 *nr_ids) {
+    struct bpf_prog_info prog_info;
+    __u32 len = sizeof(prog_info);
+
+    memset(&prog_info, 0, sizeof(prog_info));
+    prog_info.nr_map_ids = MAX_PROG_MAPS;
+    prog_info.map_ids = (__u64)(unsigned long)ids;
+    if (bpf_prog_get_info_by_fd(prog_fd, &prog_info, &len))
+        return -errno;
+    *nr_ids = prog_info.nr_map_ids < MAX_PROG_MAPS ? prog_info.nr_map_ids : MAX_PROG_MAPS;
+    return 0;
+}
+
+/* Copies load-time constants from the .rodata of the loaded program
+ * prog_fd into obj: those whose name starts with prefix (every one with
+ * NULL) and that obj declares with the same size. The others stay at
+ * their defaults. */
+static int inherit_rodata(struct bpf_object *obj, int prog_fd, const char *prefix) {
+    struct bpf_map_info map_info;
+    __u32 map_ids[MAX_PROG_MAPS], nr_ids, len, i, key = 0;
+    const struct btf_type *sec;
+    struct btf_var_secinfo *vsi;
+    struct btf *btf = NULL;
+    char *value = NULL;
+    int map_fd = -1, err;
+
+    err = prog_map_ids(prog_fd, map_ids, &nr_ids);
+    if (err)
+        return err;
+
+    for (i = 0; i < nr_ids; i++) {
+        size_t name_len;
+
+        map_fd = bpf_map_get_fd_by_id(map_ids[i]);
+        if (map_fd < 0)
+            continue;
+        memset(&map_info, 0, sizeof(map_info));
+        len = sizeof(map_info);
+        name_len = 0;
+        if (!bpf_map_get_info_by_fd(map_fd, &map_info, &len))
+            name_len = strlen(map_info.name);
+        if (name_len >= 7 && !strcmp(map_info.name + name_len - 7, ".rodata") && map_info.btf_id)
+            break;
+        close(map_fd);
+        map_fd = -1;
+    }
+    if (map_fd < 0)
+        goto out;
+
+    btf = btf__load_from_kernel_by_id(map_info.btf_id);
+    value = malloc(map_info.value_size);
+    if (!btf || !value) {
+        err = btf ? -ENOMEM : -errno;
+        goto out;
+    }
+    if (bpf_map_lookup_elem(map_fd, &key, value)) {
+        err = -errno;
+        goto out;
+    }
+
+    sec = btf__type_by_id(btf, map_info.btf_value_type_id);
+    if (!sec || !btf_is_datasec(sec))
+        goto out;
+    vsi = btf_var_secinfos(sec);
+    for (i = 0; i < btf_vlen(sec); i++, vsi++) {
+        const struct btf_type *var = btf__type_by_id(btf, vsi->type);
+        const char *name = btf__name_by_offset(btf, var->name_off);
+        __u32 size;
+        void *dst;
+
+        if ((prefix && strncmp(name, prefix, strlen(prefix))) || vsi->offset + vsi->size > map_info.value_size)
+            continue;
+        dst = rodata_var(obj, name, &size);
+        if (dst && size == vsi->size)
+            memcpy(dst, value + vsi->offset, size);
+    }
+
+out:
+    free(value);
+    btf__free(btf);
+    if (map_fd >= 0)
+        close(map_fd);
+    return err;
+}
+
+/* Copies the cfg_* constants of bpf/pipeline.h from the running
+ * dispatcher into obj, so a stage installed on its own is specialised
+ * like the rest of the pipeline (see pipeline_loader). Without a pinned
+ * dispatcher there is nothing to copy. */
+static int inherit_pipeline_rodata(struct bpf_object *obj) {
+    int prog_fd = bpf_obj_get("/sys/fs/bpf/xdp_disp"), err;
+
+    if (prog_fd < 0)
+        return 0;
+    err = inherit_rodata(obj, prog_fd, "cfg_");
+    close(prog_fd);
+    return err;
+}
+
+/* -u: the stage running in slot keeps its own load-time constants
+ * (lazy_visibility, gop_drop, ...) in the upgraded object, for every one
+ * the new object still declares. An empty slot has nothing to copy. */
+static int inherit_stage_rodata(struct bpf_object *obj, __u32 slot) {
+    int map_fd = bpf_obj_get("/sys/fs/bpf/xdp_pipeline/stage_progs"), prog_fd, err;
+    __u32 prog_id;
+
+    if (map_fd < 0)
+        return -errno;
+    err = bpf_map_lookup_elem(map_fd, &slot, &prog_id);
+    close(map_fd);
+    if (err)
+        return 0;
+
+    prog_fd = bpf_prog_get_fd_by_id(prog_id);
+    if (prog_fd < 0)
+        return -errno;
+    err = inherit_rodata(obj, prog_fd, NULL);
+    close(prog_fd);
+    return err;
+}
+
+/* Ids of the dispatcher's maps: stage_progs, counters, pipeline_config,
+ * ... are shared by every stage, so -u can only reuse them as they are */
+static int dispatcher_map_ids(__u32 *ids, __u32 *nr_ids) {
+    int prog_fd = bpf_obj_get("/sys/fs/bpf/xdp_disp"), err;
+
+    *nr_ids = 0;
+    if (prog_fd < 0)
+        return 0;
+    err = prog_map_ids(prog_fd, ids, nr_ids);
+    close(prog_fd);
+    return err;
+}
+
+/* Installs prog_fd into slot of the pinned stage_progs array. The update is
+ * atomic: packets see either the old or the new stage, never an empty slot. */
+static int install_stage(int prog_fd, __u32 slot) {
+    int map_fd = bpf_obj_get("/sys/fs/bpf/xdp_pipeline/stage_progs");
+    int err;
+
+    if (map_fd < 0) {
+        fprintf(stderr, "Failed to open stage_progs: %s\n", strerror(errno));
+        return -errno;
+    }
+
+    err = bpf_map_update_elem(map_fd, &slot, &prog_fd, BPF_ANY);
+    if (err) {
+        err = -errno;
+        fprintf(stderr, "Failed to install stage into slot %u: %s\n", slot, strerror(-err));
+    }
+    close(map_fd);
+    return err;
+}
+
+/* A pinned map that the upgraded object cannot share because its layout changed */
+struct map_migration {
+    struct bpf_map *map;
+    struct bpf_map_info old_info;
+    int old_fd;
+    char pin_path[256];
+};
+
+#define MAX_MIGRATIONS 32
+
+static int map_compatible(const struct bpf_map *map, const struct bpf_map_info *info) {
+    return info->type == bpf_map__type(map) &&
+           info->key_size == bpf_map__key_size(map) &&
+           info->value_size == bpf_map__value_size(map) &&
+           info->max_entries == bpf_map__max_entries(map) &&
+           info->map_flags == bpf_map__map_flags(map);
+}
+
+static int map_is_percpu(__u32 type) {
+    return type == BPF_MAP_TYPE_PERCPU_ARRAY ||
+           type == BPF_MAP_TYPE_PERCPU_HASH ||
+           type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+}
+
+static int map_migratable(__u32 type) {
+    return type == BPF_MAP_TYPE_ARRAY || type == BPF_MAP_TYPE_HASH ||
+           type == BPF_MAP_TYPE_LRU_HASH || map_is_percpu(type);
+}
+
+/* Copies every entry of the old pinned map into the freshly created one.
+ * Values are copied up to the smaller of the two sizes: fields appended to
+ * a value struct start at zero, the existing ones keep their contents.
+ * Entries that no longer fit (array shrank, hash full) are dropped.
+ * Returns the number of entries copied. */
+static int migrate_map(const struct map_migration *mig) {
+    const struct bpf_map_info *old = &mig->old_info;
+    int new_fd = bpf_map__fd(mig->map);
+    __u32 new_size = bpf_map__value_size(mig->map);
+    int percpu = map_is_percpu(old->type);
+    int nr_cpus = percpu ? libbpf_num_possible_cpus() : 1;
+    /* the kernel lays out per-CPU values at 8-byte strides */
+    size_t old_stride = percpu ? (old->value_size + 7) & ~7U : old->value_size;
+    size_t new_stride = percpu ? (new_size + 7) & ~7U : new_size;
+    size_t copy = old->value_size < new_size ? old->value_size : new_size;
+    char *key, *next, *old_val, *new_val;
+    int first = 1, count = 0, err = 0, cpu;
+
+    if (old->type != bpf_map__type(mig->map) || old->key_size != bpf_map__key_size(mig->map) ||
+        !map_migratable(old->type))
+        return -EOPNOTSUPP;
+    if (nr_cpus <= 0)
+        return -EINVAL;
+
+    key = calloc(1, old->key_size);
+    next = calloc(1, old->key_size);
+    old_val = calloc(nr_cpus, old_stride);
+    new_val = calloc(nr_cpus, new_stride);
+    if (!key || !next || !old_val || !new_val) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    while (!bpf_map_get_next_key(mig->old_fd, first ? NULL : key, next)) {
+        first = 0;
+        memcpy(key, next, old->key_size);
+        if (bpf_map_lookup_elem(mig->old_fd, key, old_val))
+            continue;
+
+        memset(new_val, 0, nr_cpus * new_stride);
+        for (cpu = 0; cpu < nr_cpus; cpu++)
+            memcpy(new_val + cpu * new_stride, old_val + cpu * old_stride, copy);
+
+        if (bpf_map_update_elem(new_fd, key, new_val, BPF_ANY)) {
+            if (errno == E2BIG)
+                continue;
+            err = -errno;
+            break;
+        }
+        count++;
+    }
+
+out:
+    free(key);
+    free(next);
+    free(old_val);
+    free(new_val);
+    return err ? err : count;
+}
+
+/* Pins fd next to path and renames it over the existing pin, so that the
+ * path never disappears for readers such as xdp_stats */
+static int replace_pin(int fd, const char *path) {
+    char tmp_path[512];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+    unlink(tmp_path);
+    if (bpf_obj_pin(fd, tmp_path))
+        return -errno;
+    if (rename(tmp_path, path)) {
+        unlink(tmp_path);
+        return -errno;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-u] <obj> slot:<n> <prog_name> <pin_path> [const=value ...]\n"
+            "  slot:<n>  load prog_name as a pipeline stage into stage_progs[n]\n"
+            "  -u  upgrade the stage running in slot n without dropping traffic:\n"
+            "      the stage's load-time constants are kept, pinned maps with a\n"
+            "      matching layout are shared, the stage's changed ones are migrated\n"
+            "      into new maps (counters may miss the packets of the last\n"
+            "      moments), then the slot is swapped atomically. Maps shared with\n"
+            "      the dispatcher must keep their layout.\n",
+            prog);
+}
 
 int main(int argc, char **argv) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s <ext_obj> <target_prog_id> <target_func> <pin_path>\n", argv[0]);
+    int upgrade = 0, opt;
+
+    while ((opt = getopt(argc, argv, "+uh")) != -1) {
+        switch (opt) {
+        case 'u':
+            upgrade = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    argc -= optind - 1;
+    argv += optind - 1;
+
+    if (argc < 5 || strncmp(argv[2], "slot:", 5)) {
+        usage(argv[0]);
         return 1;
     }
 
     const char *obj_file = argv[1];
-    int target_prog_id = atoi(argv[2]);
-    const char *target_func = argv[3];
+    __u32 slot = strtoul(argv[2] + 5, NULL, 0);
+    const char *prog_name = argv[3];
     const char *pin_path = argv[4];
 
     struct bpf_object *obj;
     struct bpf_program *prog;
+    struct map_migration migrations[MAX_MIGRATIONS];
+    __u32 disp_map_ids[MAX_PROG_MAPS], nr_disp_maps = 0;
+    int nr_migrations = 0;
+    char new_pin_path[512];
     int prog_fd, err;
 
     // Open BPF object
@@ -28,38 +344,102 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    struct bpf_map *map;
-    bpf_object__for_each_map(map, obj) {
-        const char *map_name = bpf_map__name(map);
-        char map_pin_path[256];
-        snprintf(map_pin_path, sizeof(map_pin_path), "/sys/fs/bpf/xdp_pipeline/%s", map_name);
-        
-        // Try to reuse the pinned map from dispatcher
-        int fd = bpf_obj_get(map_pin_path);
-        if (fd >= 0) {
-            bpf_map__reuse_fd(map, fd);
+    // An upgrade keeps the running stage's own constants
+    if (upgrade) {
+        err = inherit_stage_rodata(obj, slot);
+        if (err) {
+            fprintf(stderr, "Failed to read the configuration of slot %u: %s\n", slot, strerror(-err));
+            bpf_object__close(obj);
+            return 1;
         }
     }
 
-    prog = bpf_object__next_program(obj, NULL);
-    if (!prog) {
-        fprintf(stderr, "No program found in %s\n", obj_file);
+    // Same load-time configuration as the running pipeline, unless overridden below
+    err = inherit_pipeline_rodata(obj);
+    if (err) {
+        fprintf(stderr, "Failed to read the dispatcher's configuration: %s\n", strerror(-err));
         bpf_object__close(obj);
         return 1;
     }
 
-    bpf_program__set_type(prog, BPF_PROG_TYPE_EXT);
+    for (int i = 5; i < argc; i++) {
+        char *sep = strchr(argv[i], '=');
+        if (!sep) {
+            fprintf(stderr, "Expected const=value, got %s\n", argv[i]);
+            bpf_object__close(obj);
+            return 1;
+        }
+        *sep = '\0';
+        err = set_rodata_var(obj, argv[i], strtoull(sep + 1, NULL, 0));
+        if (err) {
+            fprintf(stderr, "Failed to set %s: %s\n", argv[i], strerror(-err));
+            bpf_object__close(obj);
+            return 1;
+        }
+    }
 
-    int target_fd = bpf_prog_get_fd_by_id(target_prog_id);
-    if (target_fd < 0) {
-        fprintf(stderr, "Failed to get fd for prog %d: %s\n", target_prog_id, strerror(errno));
+    if (upgrade && dispatcher_map_ids(disp_map_ids, &nr_disp_maps)) {
+        fprintf(stderr, "Failed to read the dispatcher's maps: %s\n", strerror(errno));
         bpf_object__close(obj);
         return 1;
     }
 
-    err = bpf_program__set_attach_target(prog, target_fd, target_func);
-    if (err) {
-        fprintf(stderr, "Failed to set attach target: %s\n", strerror(-err));
+    struct bpf_map *map;
+    bpf_object__for_each_map(map, obj) {
+        const char *map_name = bpf_map__name(map);
+        char map_pin_path[256];
+        snprintf(map_pin_path, sizeof(map_pin_path), "/sys/fs/bpf/xdp_pipeline/%s", map_name);
+        
+        // .rodata/.data/.bss belong to this object only
+        if (bpf_map__is_internal(map))
+            continue;
+        
+        // Try to reuse the pinned map from dispatcher
+        int fd = bpf_obj_get(map_pin_path);
+        if (fd < 0)
+            continue;
+
+        if (upgrade) {
+            struct bpf_map_info info;
+            __u32 info_len = sizeof(info);
+
+            memset(&info, 0, sizeof(info));
+            if (bpf_map_get_info_by_fd(fd, &info, &info_len)) {
+                fprintf(stderr, "Failed to query %s: %s\n", map_pin_path, strerror(errno));
+                bpf_object__close(obj);
+                return 1;
+            }
+            if (!map_compatible(map, &info)) {
+                // The dispatcher and the other stages would keep the old one
+                for (__u32 i = 0; i < nr_disp_maps; i++) {
+                    if (disp_map_ids[i] == info.id) {
+                        fprintf(stderr, "%s is shared with the dispatcher and changed layout, "
+                                "reload the pipeline instead\n", map_name);
+                        bpf_object__close(obj);
+                        return 1;
+                    }
+                }
+                // Layout changed: create a new map, copy the state over before the swap
+                if (nr_migrations == MAX_MIGRATIONS) {
+                    fprintf(stderr, "Too many maps to migrate\n");
+                    bpf_object__close(obj);
+                    return 1;
+                }
+                migrations[nr_migrations].map = map;
+                migrations[nr_migrations].old_info = info;
+                migrations[nr_migrations].old_fd = fd;
+                snprintf(migrations[nr_migrations].pin_path, sizeof(migrations[nr_migrations].pin_path),
+                         "%s", map_pin_path);
+                nr_migrations++;
+                continue;
+            }
+        }
+        bpf_map__reuse_fd(map, fd);
+    }
+
+    prog = bpf_object__find_program_by_name(obj, prog_name);
+    if (!prog) {
+        fprintf(stderr, "No program %s in %s\n", prog_name, obj_file);
         bpf_object__close(obj);
         return 1;
     }
@@ -78,9 +458,14 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    err = bpf_obj_pin(prog_fd, pin_path);
+    // An upgrade keeps the running stage pinned until the swap
+    snprintf(new_pin_path, sizeof(new_pin_path), "%s%s", pin_path, upgrade ? ".new" : "");
+    if (upgrade)
+        unlink(new_pin_path);
+
+    err = bpf_obj_pin(prog_fd, new_pin_path);
     if (err) {
-        fprintf(stderr, "Failed to pin program to %s: %s\n", pin_path, strerror(errno));
+        fprintf(stderr, "Failed to pin program to %s: %s\n", new_pin_path, strerror(errno));
         bpf_object__close(obj);
         return 1;
     }
@@ -90,6 +475,9 @@ int main(int argc, char **argv) {
         char map_pin_path[256];
         snprintf(map_pin_path, sizeof(map_pin_path), "/sys/fs/bpf/xdp_pipeline/%s", map_name);
         
+        if (bpf_map__is_internal(map))
+            continue;
+        
         int existing_fd = bpf_obj_get(map_pin_path);
         if (existing_fd >= 0) {
             close(existing_fd);
@@ -105,25 +493,45 @@ int main(int argc, char **argv) {
         }
     }
 
-    struct bpf_link *link = bpf_program__attach(prog);
-    if (!link) {
-        fprintf(stderr, "Failed to attach program: %s\n", strerror(errno));
-        bpf_object__close(obj);
-        return 1;
+    /* Right before the swap, to keep the window short in which the
+     * old stage still updates what was already copied: per-CPU
+     * counters lose those updates. */
+    for (int i = 0; i < nr_migrations; i++) {
+        err = migrate_map(&migrations[i]);
+        if (err < 0) {
+            fprintf(stderr, "Failed to migrate %s: %s\n", migrations[i].pin_path, strerror(-err));
+            unlink(new_pin_path);
+            bpf_object__close(obj);
+            return 1;
+        }
+        printf("Migrated %s: %d entries\n", migrations[i].pin_path, err);
     }
 
-    char link_pin_path[512];
-    snprintf(link_pin_path, sizeof(link_pin_path), "%s_link", pin_path);
-    
-    err = bpf_link__pin(link, link_pin_path);
-    if (err) {
-        fprintf(stderr, "Failed to pin link to %s: %s\n", link_pin_path, strerror(-err));
-        bpf_link__destroy(link);
+    if (install_stage(prog_fd, slot)) {
+        if (upgrade)
+            unlink(new_pin_path);
         bpf_object__close(obj);
         return 1;
     }
 
-    printf("Successfully attached and pinned to %s (link: %s)\n", pin_path, link_pin_path);
-    
+    if (!upgrade) {
+        printf("Successfully pinned %s and installed it into stage slot %u\n", pin_path, slot);
+        return 0;
+    }
+
+    /* The new stage is live; move the pins over. Updates the old stage
+     * made between the copy and the swap (packets in flight) stay in
+     * the old maps: a migrated map's counters can lag by those. */
+    for (int i = 0; i < nr_migrations; i++) {
+        err = replace_pin(bpf_map__fd(migrations[i].map), migrations[i].pin_path);
+        if (err)
+            fprintf(stderr, "Warning: Failed to re-pin %s: %s\n", migrations[i].pin_path, strerror(-err));
+        close(migrations[i].old_fd);
+    }
+    if (rename(new_pin_path, pin_path))
+        fprintf(stderr, "Warning: Failed to move %s to %s: %s\n", new_pin_path, pin_path, strerror(errno));
+
+    printf("Upgraded stage slot %u in place (%d maps migrated), pinned at %s\n",
+           slot, nr_migrations, pin_path);
     return 0;
 }
@@ -0,0 +1,116 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "bench.h"
+#include "xdp_obj.h"
+#include "pipeline_defs.h"
+
+struct bpf_object *load_object(const char *dir, const char *file, struct bpf_object *disp,
+                               prepare_fn prepare, const void *arg)
+{
+    struct bpf_object *obj;
+    char path[256];
+    int err = 0;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    obj = bpf_object__open(path);
+    if (!obj) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (prepare)
+        err = prepare(obj, arg);
+    if (!err && disp)
+        err = share_maps(obj, disp);
+    if (!err)
+        err = bpf_object__load(obj);
+    if (err) {
+        fprintf(stderr, "Failed to load %s: %s\n", path, strerror(-err));
+        bpf_object__close(obj);
+        return NULL;
+    }
+    return obj;
+}
+
+int install_pipeline(struct bpf_object *disp, const int *prog_fds, __u32 nr)
+{
+    struct pipeline_config pcfg = { .nr_stages = nr, .enabled = (1U << nr) - 1 };
+    int progs_fd = bpf_object__find_map_fd_by_name(disp, "stage_progs");
+    int config_fd = bpf_object__find_map_fd_by_name(disp, "pipeline_config");
+    __u32 zero = 0, i;
+
+    if (progs_fd < 0 || config_fd < 0 || nr > PIPELINE_MAX_STAGES) {
+        fprintf(stderr, "The dispatcher has no stage_progs or pipeline_config\n");
+        return -EINVAL;
+    }
+    for (i = 0; i < nr; i++) {
+        pcfg.order[i] = i;
+        if (bpf_map_update_elem(progs_fd, &i, &prog_fds[i], BPF_ANY))
+            goto fail;
+    }
+    if (bpf_map_update_elem(config_fd, &zero, &pcfg, BPF_ANY))
+        goto fail;
+    return 0;
+
+fail:
+    fprintf(stderr, "Failed to set up the pipeline: %s\n", strerror(errno));
+    return -errno;
+}
+
+unsigned char *build_ip_pkt(unsigned char *pkt, __u32 size, __u8 proto, __be32 saddr, __be32 daddr,
+                            __u16 sport, __u16 dport)
+{
+    struct ethhdr *eth = (void *)pkt;
+    struct iphdr *iph = (void *)(eth + 1);
+    struct udphdr *udph = (void *)(iph + 1);
+
+    memset(pkt, 0, size);
+    eth->h_proto = htons(ETH_P_IP);
+    iph->version = 4;
+    iph->ihl = 5;
+    iph->ttl = 64;
+    iph->protocol = proto;
+    iph->tot_len = htons(size - sizeof(*eth));
+    iph->saddr = saddr;
+    iph->daddr = daddr;
+    udph->source = htons(sport);
+    udph->dest = htons(dport);
+    udph->len = htons(size - sizeof(*eth) - sizeof(*iph));
+    return (void *)(udph + 1);
+}
+
+void build_rtp(unsigned char *rtp, __u16 seq, __u32 ts, __u32 ssrc, __u8 nal_type, __u8 tid)
+{
+    rtp[0] = 0x80;              /* version 2 */
+    rtp[1] = 96;                /* H.265 */
+    rtp[2] = seq >> 8;
+    rtp[3] = seq;
+    rtp[4] = ts >> 24;
+    rtp[5] = ts >> 16;
+    rtp[6] = ts >> 8;
+    rtp[7] = ts;
+    rtp[8] = ssrc >> 24;
+    rtp[9] = ssrc >> 16;
+    rtp[10] = ssrc >> 8;
+    rtp[11] = ssrc;
+    rtp[12] = nal_type << 1;
+    rtp[13] = tid + 1;
+}
+
+__u32 verified_insns(int prog_fd)
+{
+    struct bpf_prog_info info;
+    __u32 len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if (bpf_prog_get_info_by_fd(prog_fd, &info, &len))
+        return 0;
+    return info.verified_insns;
+}
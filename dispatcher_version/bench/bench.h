@@ -0,0 +1,49 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <linux/types.h>
+
+struct bpf_object;
+
+/* Fixtures shared by the BPF_PROG_TEST_RUN benches: loading the objects
+ * of a pipeline and building its test packets. Errors are printed here,
+ * the benches only check the result. */
+
+/* Source and destination of every test packet; the destination is the
+ * camera address of stage2's built-in flow layout */
+#define BENCH_SADDR 0x0A010101      /* 10.1.1.1 */
+#define BENCH_DADDR 0x0A010102      /* 10.1.1.2 */
+
+/* H.265 NAL unit types of the test packets */
+#define NAL_TRAIL_R 1
+#define NAL_TSA_R 3
+#define NAL_IDR_W_RADL 19
+#define NAL_FU 49
+
+/* Runs on an opened object before it is loaded, e.g. to set its .rodata */
+typedef int (*prepare_fn)(struct bpf_object *obj, const void *arg);
+
+/* Opens dir/file, calls prepare(obj, arg) if given, lets it use the maps
+ * of disp (if not NULL, see share_maps()) and loads it. NULL on error. */
+struct bpf_object *load_object(const char *dir, const char *file, struct bpf_object *disp,
+                               prepare_fn prepare, const void *arg);
+
+/* Puts the programs prog_fds into disp's stage_progs slots 0 to nr - 1
+ * and makes them pipeline 0, in that order, all enabled */
+int install_pipeline(struct bpf_object *disp, const int *prog_fds, __u32 nr);
+
+/* Ethernet / IPv4 / proto (UDP, or one with the ports at the same
+ * offsets) from saddr to daddr (network order), size bytes in all.
+ * Zeroes the packet; returns the transport payload. */
+unsigned char *build_ip_pkt(unsigned char *pkt, __u32 size, __u8 proto, __be32 saddr, __be32 daddr,
+                            __u16 sport, __u16 dport);
+
+/* RTP fixed header (version 2, H.265 payload type 96) and the H.265
+ * payload header of nal_type and TemporalId tid; the payload starts 14
+ * bytes in. */
+void build_rtp(unsigned char *rtp, __u16 seq, __u32 ts, __u32 ssrc, __u8 nal_type, __u8 tid);
+
+/* Instructions the verifier processed for prog_fd, 0 if unknown */
+__u32 verified_insns(int prog_fd);
+
+#endif /* BENCH_H */
@@ -0,0 +1,196 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "bench.h"
+#include "video_filter_defs.h"
+
+/* Per-packet cost of the whole pipeline while 1, 4 and 16 CPUs run it at
+ * once. Loads the dispatcher with the parser and stage2 in slots 0 and 1
+ * (the pipeline.conf layout); one thread per CPU, pinned to it, runs
+ * P-slices of its own camera through BPF_PROG_TEST_RUN, as RSS would
+ * spread the camera flows. Every packet still updates the counters,
+ * stage_counters, video_stats and camera_stats maps, so the ns/packet
+ * growing with the CPUs is what their shared cache lines cost. Run it on
+ * a build with the shared atomic counters and on the per-CPU one (-d) to
+ * compare them. CPU counts above the online CPUs are skipped. */
+
+#define ROUNDS 3
+#define PKT_SIZE 1200
+#define MAX_THREADS 16
+
+static const int cpu_counts[] = { 1, 4, MAX_THREADS };
+
+#define NR_CPU_COUNTS (sizeof(cpu_counts) / sizeof(cpu_counts[0]))
+
+struct worker {
+    pthread_t thread;
+    int cpu;
+    int prog_fd;
+    int repeat;
+    pthread_barrier_t *start;
+    __u32 ns;           /* best of ROUNDS, ns/packet */
+    int err;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r repeat] [-d bpf_dir]\n"
+            "  -r  BPF_PROG_TEST_RUN repetitions per measurement and CPU (default: 1000000)\n"
+            "  -d  directory with xdp_dispatcher.o, stage0_parser.o and stage2_video_filter.o (default: bpf)\n",
+            prog);
+}
+
+/* Ethernet / IPv4 / UDP / RTP / H.265 P-slice to camera */
+static void build_pkt(unsigned char *pkt, __u32 camera)
+{
+    unsigned char *rtp = build_ip_pkt(pkt, PKT_SIZE, IPPROTO_UDP, htonl(BENCH_SADDR), htonl(BENCH_DADDR),
+                                      40000 + camera, CAMERA_PORT_BASE + camera);
+
+    build_rtp(rtp, 0, 0, camera, NAL_TRAIL_R, 0);
+}
+
+static void *worker_run(void *arg)
+{
+    struct worker *w = arg;
+    unsigned char pkt[PKT_SIZE];
+    cpu_set_t set;
+    int round;
+
+    CPU_ZERO(&set);
+    CPU_SET(w->cpu, &set);
+    w->err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    build_pkt(pkt, w->cpu);
+    w->ns = ~0U;
+
+    for (round = 0; round < ROUNDS; round++) {
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = pkt,
+                    .data_size_in = sizeof(pkt),
+                    .repeat = w->repeat);
+
+        /* All CPUs start every round together, so their runs overlap */
+        pthread_barrier_wait(w->start);
+        if (w->err)
+            continue;
+        if (bpf_prog_test_run_opts(w->prog_fd, &opts))
+            w->err = errno;
+        else if (opts.duration < w->ns)
+            w->ns = opts.duration;
+    }
+    return NULL;
+}
+
+/* Mean ns/packet of nr_cpus CPUs running prog_fd at once */
+static int measure(int prog_fd, int repeat, int nr_cpus, double *ns)
+{
+    struct worker workers[MAX_THREADS];
+    pthread_barrier_t start;
+    int i, err = 0, started;
+
+    pthread_barrier_init(&start, NULL, nr_cpus);
+    for (started = 0; started < nr_cpus; started++) {
+        struct worker *w = &workers[started];
+
+        memset(w, 0, sizeof(*w));
+        w->cpu = started;
+        w->prog_fd = prog_fd;
+        w->repeat = repeat;
+        w->start = &start;
+        err = pthread_create(&w->thread, NULL, worker_run, w);
+        if (err)
+            break;
+    }
+    /* A thread that could not start leaves the others at the barrier */
+    if (err) {
+        fprintf(stderr, "Failed to start a thread: %s\n", strerror(err));
+        exit(1);
+    }
+
+    *ns = 0;
+    for (i = 0; i < nr_cpus; i++) {
+        pthread_join(workers[i].thread, NULL);
+        if (workers[i].err && !err)
+            err = workers[i].err;
+        *ns += workers[i].ns;
+    }
+    *ns /= nr_cpus;
+    pthread_barrier_destroy(&start);
+    return -err;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "bpf";
+    int repeat = 1000000, opt, err, rc = 1, online;
+    struct bpf_object *disp = NULL, *parser = NULL, *stage2 = NULL;
+    int disp_fd, stage_fds[2];
+    double ns, base = 0;
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "r:d:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    disp = load_object(dir, "xdp_dispatcher.o", NULL, NULL, NULL);
+    if (!disp)
+        return 1;
+    parser = load_object(dir, "stage0_parser.o", disp, NULL, NULL);
+    stage2 = load_object(dir, "stage2_video_filter.o", disp, NULL, NULL);
+    if (!parser || !stage2)
+        goto out;
+
+    disp_fd = bpf_program__fd(bpf_object__find_program_by_name(disp, "xdp_dispatcher"));
+    stage_fds[0] = bpf_program__fd(bpf_object__find_program_by_name(parser, "parser"));
+    stage_fds[1] = bpf_program__fd(bpf_object__find_program_by_name(stage2, "stage2"));
+    if (disp_fd < 0 || stage_fds[0] < 0 || stage_fds[1] < 0) {
+        fprintf(stderr, "Objects in %s are missing programs\n", dir);
+        goto out;
+    }
+    if (install_pipeline(disp, stage_fds, 2))
+        goto out;
+
+    online = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%-8s %10s %10s\n", "CPUs", "ns/pkt", "vs 1 CPU");
+    for (i = 0; i < NR_CPU_COUNTS; i++) {
+        if (cpu_counts[i] > online) {
+            printf("%-8d %10s %10s\n", cpu_counts[i], "-", "-");
+            continue;
+        }
+        err = measure(disp_fd, repeat, cpu_counts[i], &ns);
+        if (err) {
+            fprintf(stderr, "Test run failed: %s\n", strerror(-err));
+            goto out;
+        }
+        if (!base)
+            base = ns;
+        printf("%-8d %10.1f %9.2fx\n", cpu_counts[i], ns, ns / base);
+    }
+    rc = 0;
+
+out:
+    bpf_object__close(stage2);
+    bpf_object__close(parser);
+    bpf_object__close(disp);
+    return rc;
+}
@@ -0,0 +1,202 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "bench.h"
+#include "video_filter_defs.h"
+
+/* Cost of the stage2 flow classifier with 10k flows. Runs the dispatcher
+ * with stage2 in slot 0 through BPF_PROG_TEST_RUN, once per lookup path:
+ * built-in layout (empty tables), a static flow among 10k, a learned flow
+ * among 10k learned with 10k static flows missed first, and an unknown
+ * flow. Every path but the static one learns on the first run, so the
+ * figures are steady-state per-packet costs. */
+
+#define ROUNDS 5
+#define NR_FLOWS 10000
+#define PKT_SIZE 128
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r repeat] [-d bpf_dir]\n"
+            "  -r  BPF_PROG_TEST_RUN repetitions per measurement (default: 1000000)\n"
+            "  -d  directory with xdp_dispatcher.o and stage2_video_filter.o (default: bpf)\n",
+            prog);
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* The i-th flow */
+static void flow_of(__u32 i, struct flow_key *key)
+{
+    key->saddr = htonl(0x0A000000 | (i + 1));     /* 10.0.0.0/8 */
+    key->daddr = htonl(BENCH_DADDR);
+    key->sport = 40000 + i % 20000;
+    key->dport = CAMERA_PORT_BASE + i % CAMERA_PORTS;
+    key->proto = IPPROTO_UDP;
+}
+
+/* Ethernet / IPv4 / UDP / RTP / H.265 P-slice of the flow */
+static void build_pkt(unsigned char *pkt, const struct flow_key *key)
+{
+    unsigned char *rtp = build_ip_pkt(pkt, PKT_SIZE, key->proto, key->saddr, key->daddr,
+                                      key->sport, key->dport);
+
+    build_rtp(rtp, 0, 0, 0x12345678, NAL_TRAIL_R, 0);
+}
+
+/* Best of ROUNDS average run times, in ns */
+static int measure(int prog_fd, const struct flow_key *key, int repeat, __u32 *ns)
+{
+    unsigned char pkt[PKT_SIZE];
+    int round;
+
+    build_pkt(pkt, key);
+
+    *ns = ~0U;
+    for (round = 0; round < ROUNDS; round++) {
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = pkt,
+                    .data_size_in = sizeof(pkt),
+                    .repeat = repeat);
+
+        if (bpf_prog_test_run_opts(prog_fd, &opts))
+            return -errno;
+        if (opts.retval != XDP_PASS) {
+            fprintf(stderr, "Unexpected verdict %u\n", opts.retval);
+            return -EINVAL;
+        }
+        if (opts.duration < *ns)
+            *ns = opts.duration;
+    }
+    return 0;
+}
+
+/* NR_FLOWS entries starting at flow first, in one batch */
+static int fill_flows(int map_fd, __u32 first, __u32 flags, double *ms)
+{
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    struct flow_key *keys = calloc(NR_FLOWS, sizeof(*keys));
+    struct flow_policy *values = calloc(NR_FLOWS, sizeof(*values));
+    __u32 n = NR_FLOWS, i;
+    double start;
+    int err = 0;
+
+    if (!keys || !values) {
+        free(keys);
+        free(values);
+        return -ENOMEM;
+    }
+    for (i = 0; i < NR_FLOWS; i++) {
+        flow_of(first + i, &keys[i]);
+        values[i].camera_id = keys[i].dport - CAMERA_PORT_BASE;
+        values[i].flags = flags;
+    }
+
+    start = now_ms();
+    if (bpf_map_update_batch(map_fd, keys, values, &n, &opts)) {
+        for (i = 0; i < NR_FLOWS && !err; i++)
+            if (bpf_map_update_elem(map_fd, &keys[i], &values[i], BPF_ANY))
+                err = -errno;
+    }
+    *ms = now_ms() - start;
+
+    free(keys);
+    free(values);
+    return err;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "bpf";
+    int repeat = 1000000, opt, err, rc = 1;
+    struct bpf_object *disp = NULL, *stage2 = NULL;
+    int disp_fd, stage2_fd, static_fd, learned_fd;
+    struct flow_key key;
+    __u32 ns[4];
+    double static_ms, learned_ms;
+
+    while ((opt = getopt(argc, argv, "r:d:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    disp = load_object(dir, "xdp_dispatcher.o", NULL, NULL, NULL);
+    if (!disp)
+        return 1;
+    stage2 = load_object(dir, "stage2_video_filter.o", disp, NULL, NULL);
+    if (!stage2)
+        goto out;
+
+    disp_fd = bpf_program__fd(bpf_object__find_program_by_name(disp, "xdp_dispatcher"));
+    stage2_fd = bpf_program__fd(bpf_object__find_program_by_name(stage2, "stage2"));
+    static_fd = bpf_object__find_map_fd_by_name(stage2, "flow_classifier");
+    learned_fd = bpf_object__find_map_fd_by_name(stage2, "flow_learned");
+    if (disp_fd < 0 || stage2_fd < 0 || static_fd < 0 || learned_fd < 0) {
+        fprintf(stderr, "Objects in %s are missing programs or maps\n", dir);
+        goto out;
+    }
+    if (install_pipeline(disp, &stage2_fd, 1))
+        goto out;
+
+    /* Flow numbers: [0, NR_FLOWS) static, [NR_FLOWS, 2 * NR_FLOWS) learned */
+    flow_of(3 * NR_FLOWS, &key);
+    err = measure(disp_fd, &key, repeat, &ns[0]);
+    if (!err)
+        err = fill_flows(static_fd, 0, 0, &static_ms);
+    if (!err) {
+        flow_of(NR_FLOWS / 2, &key);
+        err = measure(disp_fd, &key, repeat, &ns[1]);
+    }
+    if (!err)
+        err = fill_flows(learned_fd, NR_FLOWS, FLOW_LEARNED, &learned_ms);
+    if (!err) {
+        flow_of(NR_FLOWS + NR_FLOWS / 2, &key);
+        err = measure(disp_fd, &key, repeat, &ns[2]);
+    }
+    if (!err) {
+        flow_of(3 * NR_FLOWS + 1, &key);
+        key.daddr = htonl(0x0A090909);
+        err = measure(disp_fd, &key, repeat, &ns[3]);
+    }
+    if (err) {
+        fprintf(stderr, "Benchmark failed: %s\n", strerror(-err));
+        goto out;
+    }
+
+    printf("%-36s %10s\n", "lookup path", "ns/pkt");
+    printf("%-36s %10u\n", "built-in layout, learned", ns[0]);
+    printf("%-36s %10u\n", "static hit (10k static)", ns[1]);
+    printf("%-36s %10u\n", "learned hit (10k static, 10k learned)", ns[2]);
+    printf("%-36s %10u\n", "unknown, learned", ns[3]);
+    printf("\n%d static flows inserted in %.2f ms, %d learned in %.2f ms\n",
+           NR_FLOWS, static_ms, NR_FLOWS, learned_ms);
+    rc = 0;
+
+out:
+    bpf_object__close(stage2);
+    bpf_object__close(disp);
+    return rc;
+}
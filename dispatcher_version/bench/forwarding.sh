@@ -0,0 +1,73 @@
+#!/bin/bash
+#
+# Forwarding benchmark: PPS and CPU per Mpps of the dispatcher's output path
+# for FORWARD_PASS (kernel stack), FORWARD_REDIRECT (bpf_redirect) and
+# FORWARD_DEVMAP (bpf_redirect_map, bulk flushed).
+# Testbed: see bench/testbed.sh.
+#
+# Usage: sudo ./bench/forwarding.sh [seconds_per_mode] [pkt_size]
+
+SCRIPT_DIR=$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")" && pwd)
+cd "$SCRIPT_DIR/.."
+
+if [ "$EUID" -ne 0 ]; then
+    echo "Run with sudo"
+    exit 1
+fi
+
+DURATION=${1:-10}
+PKT_SIZE=${2:-1200}
+
+. bench/testbed.sh
+trap testbed_cleanup EXIT
+
+# Busy and total jiffies over all CPUs. pktgen and the veth NAPI that runs
+# the dispatcher share a core, so the figure includes the generator's own
+# (mode independent) cost; compare modes rather than absolute values.
+cpu_jiffies() {
+    awk '/^cpu / { print $2+$3+$4+$7+$8+$9, $2+$3+$4+$5+$6+$7+$8+$9 }' /proc/stat
+}
+
+testbed_setup
+pgset src0 "count 0"
+pgset src0 "pkt_size $PKT_SIZE"
+pgset src0 "dst 10.10.2.2"
+pgset src0 "udp_dst_min 5000"
+pgset src0 "udp_dst_max 5099"
+
+run_mode() {
+    local name=$1 mode=$2
+    local pkts0 pkts1 busy0 total0 busy1 total1 nr_cpus
+
+    testbed_respecialise forward_mode=$mode
+
+    ip netns exec $SRC_NS sh -c "echo start > /proc/net/pktgen/pgctrl" &
+    local pg_pid=$!
+    sleep 1
+
+    pkts0=$(sink_count)
+    read busy0 total0 < <(cpu_jiffies)
+    sleep $DURATION
+    pkts1=$(sink_count)
+    read busy1 total1 < <(cpu_jiffies)
+
+    pgset pgctrl "stop"
+    wait $pg_pid 2>/dev/null
+    sleep 1
+
+    nr_cpus=$(nproc)
+    awk -v name="$name" -v pkts=$((pkts1 - pkts0)) -v secs=$DURATION \
+        -v busy=$((busy1 - busy0)) -v total=$((total1 - total0)) -v cpus=$nr_cpus '
+        BEGIN {
+            mpps = pkts / secs / 1e6
+            cores = total > 0 ? busy / total * cpus : 0
+            printf "%-9s %10.3f Mpps %8.2f cores %10.2f cores/Mpps\n",
+                   name, mpps, cores, mpps > 0 ? cores / mpps : 0
+        }'
+}
+
+echo
+echo "pktgen ${PKT_SIZE}B frames, ${DURATION}s per mode"
+run_mode pass 0
+run_mode redirect 1
+run_mode devmap 2
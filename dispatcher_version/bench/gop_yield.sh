@@ -0,0 +1,125 @@
+#!/bin/bash
+#
+# Decodable frames per Mbit with and without stage2's gop_drop. Streams
+# NUM_STREAMS H.265 cameras (keyint KEYINT) through the pipeline with the
+# aggregate meter as the bottleneck, at half of the offered load measured
+# in a first unmetered run. Without gop_drop the slices that reference a
+# frame the meter cut still take their share of the bottleneck; with it
+# they are dropped before the meter, which leaves the bandwidth to frames
+# the receivers can decode (-flags -output_corrupt). Mbit is what the
+# pipeline forwarded (camera_stats rx_bytes - dropped_bytes).
+#
+# Usage: sudo ./bench/gop_yield.sh [num_streams] [seconds]
+
+SCRIPT_DIR=$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")" && pwd)
+cd "$SCRIPT_DIR/.."
+
+if [ "$EUID" -ne 0 ]; then
+    echo "Run with sudo"
+    exit 1
+fi
+
+ACTUAL_USER=${SUDO_USER:-$USER}
+NUM_STREAMS=${1:-10}
+DURATION=${2:-30}
+KEYINT=${KEYINT:-30}
+LOG_DIR=logs/gop_yield
+
+cleanup() {
+    pkill -f "ffmpeg.*rtp://10.1.1.2:50" 2>/dev/null || true
+    pkill -f "ffmpeg.*udp://10.1.1.2:50" 2>/dev/null || true
+    ip link set veth1 xdp off 2>/dev/null || true
+    ip netns del testns 2>/dev/null || true
+    ip link del veth0 2>/dev/null || true
+    rm -rf /sys/fs/bpf/xdp* /sys/fs/bpf/stage* /sys/fs/bpf/parser_prog 2>/dev/null || true
+}
+
+trap cleanup EXIT
+
+# Last "frame=" count of an ffmpeg log
+frames_of() {
+    local value
+    value=$(tr '\r' '\n' < "$1" | grep -o 'frame= *[0-9]*' | tail -1 | grep -o '[0-9]*')
+    echo "${value:-0}"
+}
+
+# Bytes the pipeline received and forwarded for the streams' cameras
+camera_bytes() {
+    ./xdp_stats camera_stats $(seq 0 $((NUM_STREAMS - 1))) |
+        awk '{ rx += $3; fwd += $3 - $5 } END { printf "%d %d\n", rx, fwd }'
+}
+
+# Testbed of start_measurement.sh; pipeline_loader arguments are passed on
+setup() {
+    cleanup
+    ip netns add testns
+    ip link add veth0 type veth peer name veth1
+    ip addr add 10.1.1.1/24 dev veth0
+    ip link set veth0 up
+    ip link set veth1 up
+
+    ./pipeline_loader -c pipeline.conf iface=veth1 "$@" > /dev/null 2>&1 || exit 1
+
+    ip link set veth1 down
+    ip link set veth1 netns testns
+    ip netns exec testns ip addr add 10.1.1.2/24 dev veth1
+    ip netns exec testns ip link set veth1 up
+    ip netns exec testns ip link set lo up
+}
+
+# Streams all cameras once; leaves the logs as $LOG_DIR/$1_*.log
+stream() {
+    local name=$1 i
+
+    rm -f $LOG_DIR/${name}_*.log
+    for i in $(seq 0 $((NUM_STREAMS - 1))); do
+        ip netns exec testns ffmpeg -flags -output_corrupt -i "udp://10.1.1.2:$((5000 + i))" \
+            -f null - > $LOG_DIR/${name}_receiver${i}.log 2>&1 &
+    done
+    sleep 1
+    for i in $(seq 0 $((NUM_STREAMS - 1))); do
+        sudo -u $ACTUAL_USER ffmpeg -re -f lavfi -i testsrc=size=1280x720:rate=30 -t $DURATION \
+            -c:v libx265 -preset ultrafast \
+            -x265-params "keyint=$KEYINT:min-keyint=$KEYINT:scenecut=0:bframes=0" \
+            -pix_fmt yuv420p -f rtp rtp://10.1.1.2:$((5000 + i)) \
+            > $LOG_DIR/${name}_streamer${i}.log 2>&1 &
+    done
+
+    sleep $((DURATION + 3))
+    pkill -INT -f "ffmpeg.*udp://10.1.1.2:50" 2>/dev/null || true
+    sleep 2
+}
+
+run_gop() {
+    local gop_drop=$1 i sent=0 decoded=0 bytes
+
+    setup gop_drop=$gop_drop
+    python3 meter_config.py --aggregate --pir $BOTTLENECK_MBPS > /dev/null
+    stream gop$gop_drop
+    bytes=$(camera_bytes)
+
+    for i in $(seq 0 $((NUM_STREAMS - 1))); do
+        sent=$((sent + $(frames_of $LOG_DIR/gop${gop_drop}_streamer${i}.log)))
+        decoded=$((decoded + $(frames_of $LOG_DIR/gop${gop_drop}_receiver${i}.log)))
+    done
+
+    awk -v gop=$gop_drop -v sent=$sent -v decoded=$decoded -v fwd=${bytes#* } \
+        'BEGIN { mbit = fwd * 8 / 1e6;
+                 printf "%-9d %12d %12d %9.1f%% %10.1f %12.2f\n", gop, sent, decoded,
+                        sent ? 100 * decoded / sent : 0, mbit, mbit ? decoded / mbit : 0 }'
+}
+
+make -s attach_ext xdp_stats pipeline_loader || exit 1
+mkdir -p $LOG_DIR
+
+echo "Measuring the offered load of $NUM_STREAMS streams..."
+setup
+stream offered
+OFFERED_MBPS=$(camera_bytes | awk -v d=$DURATION '{ printf "%.2f", $1 * 8 / 1e6 / d }')
+BOTTLENECK_MBPS=$(awk -v o=$OFFERED_MBPS 'BEGIN { printf "%.2f", o / 2 }')
+
+echo "$NUM_STREAMS streams, keyint $KEYINT, offered ${OFFERED_MBPS} Mbit/s," \
+    "bottleneck ${BOTTLENECK_MBPS} Mbit/s, ${DURATION}s per run"
+printf "%-9s %12s %12s %10s %10s %12s\n" "gop_drop" "frames sent" "decodable" "yield" "Mbit" "frames/Mbit"
+run_gop 0
+run_gop 1
@@ -0,0 +1,166 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+/* Per-hop cost of freplace versus tail calls, see hop_bench_xdp.c.
+ * Runs each variant through BPF_PROG_TEST_RUN with 0, 2, 4 and 8 hops and
+ * reports ns per packet plus the cost of one hop over the 0-hop baseline. */
+
+#define ROUNDS 5
+
+static const __u32 hop_counts[] = { 0, 2, 4, 8 };
+#define NR_HOP_COUNTS (sizeof(hop_counts) / sizeof(hop_counts[0]))
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r repeat] [-d bpf_dir]\n"
+            "  -r  BPF_PROG_TEST_RUN repetitions per measurement (default: 1000000)\n"
+            "  -d  directory with hop_bench_xdp.o and hop_bench_ext.o (default: bench)\n",
+            prog);
+}
+
+/* Best of ROUNDS average run times, in ns */
+static int measure(int prog_fd, int repeat, __u32 *ns)
+{
+    unsigned char pkt[64] = { 0 };
+    int round;
+
+    /* Ethernet header with an IPv4 ethertype, the rest is not parsed */
+    pkt[12] = 0x08;
+
+    *ns = ~0U;
+    for (round = 0; round < ROUNDS; round++) {
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = pkt,
+                    .data_size_in = sizeof(pkt),
+                    .repeat = repeat);
+
+        if (bpf_prog_test_run_opts(prog_fd, &opts))
+            return -errno;
+        if (opts.retval != XDP_PASS) {
+            fprintf(stderr, "Unexpected verdict %u\n", opts.retval);
+            return -EINVAL;
+        }
+        if (opts.duration < *ns)
+            *ns = opts.duration;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "bench";
+    int repeat = 1000000, opt, err, rc = 1;
+    struct bpf_object *obj = NULL, *ext_obj = NULL;
+    struct bpf_program *ext_prog;
+    struct bpf_link *link = NULL;
+    int freplace_fd, tail_fd, hop_fd, config_fd, progs_fd;
+    __u32 key = 0, ns[2][NR_HOP_COUNTS];
+    char path[256];
+    size_t i;
+
+    while ((opt = getopt(argc, argv, "r:d:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s/hop_bench_xdp.o", dir);
+    obj = bpf_object__open(path);
+    if (!obj) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+    err = bpf_object__load(obj);
+    if (err) {
+        fprintf(stderr, "Failed to load %s: %s\n", path, strerror(-err));
+        goto out;
+    }
+
+    freplace_fd = bpf_program__fd(bpf_object__find_program_by_name(obj, "bench_freplace"));
+    tail_fd = bpf_program__fd(bpf_object__find_program_by_name(obj, "bench_tail"));
+    hop_fd = bpf_program__fd(bpf_object__find_program_by_name(obj, "hop_tail"));
+    config_fd = bpf_object__find_map_fd_by_name(obj, "hop_config");
+    progs_fd = bpf_object__find_map_fd_by_name(obj, "hop_progs");
+    if (freplace_fd < 0 || tail_fd < 0 || hop_fd < 0 || config_fd < 0 || progs_fd < 0) {
+        fprintf(stderr, "%s is missing programs or maps\n", path);
+        goto out;
+    }
+
+    if (bpf_map_update_elem(progs_fd, &key, &hop_fd, BPF_ANY)) {
+        fprintf(stderr, "Failed to install hop_tail: %s\n", strerror(errno));
+        goto out;
+    }
+
+    snprintf(path, sizeof(path), "%s/hop_bench_ext.o", dir);
+    ext_obj = bpf_object__open(path);
+    if (!ext_obj) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        goto out;
+    }
+    ext_prog = bpf_object__next_program(ext_obj, NULL);
+    if (!ext_prog) {
+        fprintf(stderr, "No program found in %s\n", path);
+        goto out;
+    }
+    bpf_program__set_type(ext_prog, BPF_PROG_TYPE_EXT);
+    err = bpf_program__set_attach_target(ext_prog, freplace_fd, "hop");
+    if (!err)
+        err = bpf_object__load(ext_obj);
+    if (err) {
+        fprintf(stderr, "Failed to load %s: %s\n", path, strerror(-err));
+        goto out;
+    }
+    link = bpf_program__attach_freplace(ext_prog, freplace_fd, "hop");
+    if (!link) {
+        fprintf(stderr, "Failed to attach freplace: %s\n", strerror(errno));
+        goto out;
+    }
+
+    for (i = 0; i < NR_HOP_COUNTS; i++) {
+        if (bpf_map_update_elem(config_fd, &key, &hop_counts[i], BPF_ANY)) {
+            fprintf(stderr, "Failed to set hop count: %s\n", strerror(errno));
+            goto out;
+        }
+        err = measure(freplace_fd, repeat, &ns[0][i]);
+        if (!err)
+            err = measure(tail_fd, repeat, &ns[1][i]);
+        if (err) {
+            fprintf(stderr, "Test run failed: %s\n", strerror(-err));
+            goto out;
+        }
+    }
+
+    printf("%-6s %14s %14s %16s %16s\n",
+           "hops", "freplace ns", "tailcall ns", "freplace ns/hop", "tailcall ns/hop");
+    for (i = 0; i < NR_HOP_COUNTS; i++) {
+        if (hop_counts[i] == 0) {
+            printf("%-6u %14u %14u %16s %16s\n", hop_counts[i], ns[0][i], ns[1][i], "-", "-");
+            continue;
+        }
+        printf("%-6u %14u %14u %16.2f %16.2f\n", hop_counts[i], ns[0][i], ns[1][i],
+               ((double)ns[0][i] - ns[0][0]) / hop_counts[i],
+               ((double)ns[1][i] - ns[1][0]) / hop_counts[i]);
+    }
+    rc = 0;
+
+out:
+    bpf_link__destroy(link);
+    bpf_object__close(ext_obj);
+    bpf_object__close(obj);
+    return rc;
+}
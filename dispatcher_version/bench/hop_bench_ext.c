@@ -0,0 +1,19 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+/* Must match hop_bench_xdp.c */
+struct hop_state {
+    __u32 remaining;
+    __u32 work;
+};
+
+SEC("freplace/hop")
+int hop(struct xdp_md *ctx, struct hop_state *st)
+{
+    if (!st)
+        return XDP_ABORTED;
+    st->work++;
+    return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
@@ -0,0 +1,99 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+/* Per-hop cost of the two ways of chaining stages: a __weak hook replaced
+ * via freplace (the old dispatcher) and tail calls through a prog array
+ * (bpf/pipeline.h). Both variants do the same work per hop: touch a
+ * per-CPU state word. Driven by hop_bench.c through BPF_PROG_TEST_RUN. */
+
+#define HOP_MAX 8
+
+struct hop_state {
+    __u32 remaining;
+    __u32 work;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, 1);
+} hop_config SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct hop_state);
+    __uint(max_entries, 1);
+} hop_state_map SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, 1);
+} hop_progs SEC(".maps");
+
+/* Weak default implementation - replaced by hop_bench_ext.c */
+__weak int hop(struct xdp_md *ctx, struct hop_state *st) {
+    if (!st)
+        return XDP_ABORTED;
+    st->work++;
+    return XDP_PASS;
+}
+
+SEC("xdp")
+int bench_freplace(struct xdp_md *ctx)
+{
+    __u32 key = 0;
+    __u32 *nr_hops = bpf_map_lookup_elem(&hop_config, &key);
+    struct hop_state *st = bpf_map_lookup_elem(&hop_state_map, &key);
+    int i;
+
+    if (!nr_hops || !st)
+        return XDP_ABORTED;
+
+    for (i = 0; i < HOP_MAX; i++) {
+        if (i >= *nr_hops)
+            break;
+        if (hop(ctx, st) != XDP_PASS)
+            return XDP_DROP;
+    }
+    return XDP_PASS;
+}
+
+SEC("xdp")
+int bench_tail(struct xdp_md *ctx)
+{
+    __u32 key = 0;
+    __u32 *nr_hops = bpf_map_lookup_elem(&hop_config, &key);
+    struct hop_state *st = bpf_map_lookup_elem(&hop_state_map, &key);
+
+    if (!nr_hops || !st)
+        return XDP_ABORTED;
+
+    st->remaining = *nr_hops;
+    if (st->remaining == 0)
+        return XDP_PASS;
+
+    bpf_tail_call(ctx, &hop_progs, 0);
+    return XDP_ABORTED;
+}
+
+/* Installed into hop_progs[0], calls itself until the hops are used up */
+SEC("xdp")
+int hop_tail(struct xdp_md *ctx)
+{
+    __u32 key = 0;
+    struct hop_state *st = bpf_map_lookup_elem(&hop_state_map, &key);
+
+    if (!st)
+        return XDP_ABORTED;
+
+    st->work++;
+    if (--st->remaining > 0)
+        bpf_tail_call(ctx, &hop_progs, 0);
+    return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
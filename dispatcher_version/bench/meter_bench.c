@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "bench.h"
+#include "video_filter_defs.h"
+
+/* Per-packet cost of the stage2 meters. Runs the dispatcher with stage2 in
+ * slot 0 through BPF_PROG_TEST_RUN on a P-slice of camera 0 (built-in
+ * layout, FILTER_OFF): meters off, the camera meter green, the camera and
+ * aggregate meters green, and both red. Once red drops the first packet,
+ * the rest of its frame is dropped without touching the buckets. All runs
+ * are on one CPU, so the spin locks are uncontended. */
+
+#define ROUNDS 5
+#define PKT_SIZE 1200
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r repeat] [-d bpf_dir]\n"
+            "  -r  BPF_PROG_TEST_RUN repetitions per measurement (default: 1000000)\n"
+            "  -d  directory with xdp_dispatcher.o and stage2_video_filter.o (default: bpf)\n",
+            prog);
+}
+
+/* Ethernet / IPv4 / UDP / RTP / H.265 P-slice to camera 0 */
+static void build_pkt(unsigned char *pkt)
+{
+    unsigned char *rtp = build_ip_pkt(pkt, PKT_SIZE, IPPROTO_UDP, htonl(BENCH_SADDR), htonl(BENCH_DADDR),
+                                      40000, CAMERA_PORT_BASE);
+
+    build_rtp(rtp, 0, 0, 0, NAL_TRAIL_R, 0);
+}
+
+/* Best of ROUNDS average run times, in ns */
+static int measure(int prog_fd, int repeat, __u32 verdict, __u32 *ns)
+{
+    unsigned char pkt[PKT_SIZE];
+    int round;
+
+    build_pkt(pkt);
+
+    *ns = ~0U;
+    for (round = 0; round < ROUNDS; round++) {
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = pkt,
+                    .data_size_in = sizeof(pkt),
+                    .repeat = repeat);
+
+        if (bpf_prog_test_run_opts(prog_fd, &opts))
+            return -errno;
+        if (opts.retval != verdict) {
+            fprintf(stderr, "Unexpected verdict %u\n", opts.retval);
+            return -EINVAL;
+        }
+        if (opts.duration < *ns)
+            *ns = opts.duration;
+    }
+    return 0;
+}
+
+/* Meter index at rate bytes/s with burst bytes, rate 0 turns it off */
+static int set_meter(int map_fd, __u32 index, __u64 rate, __u64 burst)
+{
+    struct meter_config mc = { .cir = rate, .cbs = burst, .pir = rate, .pbs = burst };
+
+    return bpf_map_update_elem(map_fd, &index, &mc, BPF_ANY) ? -errno : 0;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "bpf";
+    int repeat = 1000000, opt, err, rc = 1;
+    struct bpf_object *disp = NULL, *stage2 = NULL;
+    int disp_fd, stage2_fd, meter_fd;
+    __u32 ns[4];
+
+    while ((opt = getopt(argc, argv, "r:d:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    disp = load_object(dir, "xdp_dispatcher.o", NULL, NULL, NULL);
+    if (!disp)
+        return 1;
+    stage2 = load_object(dir, "stage2_video_filter.o", disp, NULL, NULL);
+    if (!stage2)
+        goto out;
+
+    disp_fd = bpf_program__fd(bpf_object__find_program_by_name(disp, "xdp_dispatcher"));
+    stage2_fd = bpf_program__fd(bpf_object__find_program_by_name(stage2, "stage2"));
+    meter_fd = bpf_object__find_map_fd_by_name(stage2, "meter_config");
+    if (disp_fd < 0 || stage2_fd < 0 || meter_fd < 0) {
+        fprintf(stderr, "Objects in %s are missing programs or maps\n", dir);
+        goto out;
+    }
+    if (install_pipeline(disp, &stage2_fd, 1))
+        goto out;
+
+    err = measure(disp_fd, repeat, XDP_PASS, &ns[0]);
+    /* The largest meter: its 9 GB bucket keeps back-to-back test runs
+     * green far beyond the packets a measurement sends */
+    if (!err)
+        err = set_meter(meter_fd, 0, METER_MAX_TOKENS, METER_MAX_TOKENS);
+    if (!err)
+        err = measure(disp_fd, repeat, XDP_PASS, &ns[1]);
+    if (!err)
+        err = set_meter(meter_fd, METER_AGGREGATE, METER_MAX_TOKENS, METER_MAX_TOKENS);
+    if (!err)
+        err = measure(disp_fd, repeat, XDP_PASS, &ns[2]);
+    /* 1 byte/s: red after the first packet, P-slices are dropped */
+    if (!err)
+        err = set_meter(meter_fd, 0, 1, PKT_SIZE);
+    if (!err)
+        err = set_meter(meter_fd, METER_AGGREGATE, 1, PKT_SIZE);
+    if (!err)
+        err = measure(disp_fd, repeat, XDP_DROP, &ns[3]);
+    if (err) {
+        fprintf(stderr, "Benchmark failed: %s\n", strerror(-err));
+        goto out;
+    }
+
+    printf("%-36s %10s %10s\n", "meters", "ns/pkt", "overhead");
+    printf("%-36s %10u %10s\n", "off", ns[0], "-");
+    printf("%-36s %10u %10d\n", "camera, green", ns[1], (int)(ns[1] - ns[0]));
+    printf("%-36s %10u %10d\n", "camera + aggregate, green", ns[2], (int)(ns[2] - ns[0]));
+    printf("%-36s %10u %10d\n", "red, rest of frame dropped", ns[3], (int)(ns[3] - ns[0]));
+    rc = 0;
+
+out:
+    bpf_object__close(stage2);
+    bpf_object__close(disp);
+    return rc;
+}
@@ -0,0 +1,116 @@
+#!/bin/bash
+#
+# Decodable-frame yield of the stage2 meters against the ifb+tbf bottleneck
+# of start_measurement.sh at the same rate. Streams NUM_STREAMS H.265
+# cameras (keyint 4, like start_measurement.sh) through the pipeline in
+# both modes and counts the frames the receivers decode without
+# corruption (-flags -output_corrupt), against the frames sent.
+#
+# Usage: sudo ./bench/meter_yield.sh [num_streams] [bottleneck_mbps] [seconds]
+
+SCRIPT_DIR=$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")" && pwd)
+cd "$SCRIPT_DIR/.."
+
+if [ "$EUID" -ne 0 ]; then
+    echo "Run with sudo"
+    exit 1
+fi
+
+ACTUAL_USER=${SUDO_USER:-$USER}
+NUM_STREAMS=${1:-20}
+BOTTLENECK_MBPS=${2:-20}
+DURATION=${3:-30}
+LOG_DIR=logs/meter_yield
+
+cleanup() {
+    pkill -f "ffmpeg.*rtp://10.1.1.2:50" 2>/dev/null || true
+    pkill -f "ffmpeg.*udp://10.1.1.2:50" 2>/dev/null || true
+    ip netns exec testns tc qdisc del dev veth1 ingress 2>/dev/null || true
+    ip netns exec testns ip link del ifb0 2>/dev/null || true
+    ip link set veth1 xdp off 2>/dev/null || true
+    ip netns del testns 2>/dev/null || true
+    ip link del veth0 2>/dev/null || true
+    rm -rf /sys/fs/bpf/xdp* /sys/fs/bpf/stage* /sys/fs/bpf/parser_prog 2>/dev/null || true
+}
+
+trap cleanup EXIT
+
+# Last "frame=" count of an ffmpeg log
+frames_of() {
+    local value
+    value=$(tr '\r' '\n' < "$1" | grep -o 'frame= *[0-9]*' | tail -1 | grep -o '[0-9]*')
+    echo "${value:-0}"
+}
+
+# Testbed of start_measurement.sh, with the bottleneck as tbf or meter
+setup() {
+    local mode=$1
+
+    cleanup
+    ip netns add testns
+    ip link add veth0 type veth peer name veth1
+    ip addr add 10.1.1.1/24 dev veth0
+    ip link set veth0 up
+    ip link set veth1 up
+
+    ./pipeline_loader -c pipeline.conf iface=veth1 > /dev/null 2>&1 || exit 1
+
+    ip link set veth1 down
+    ip link set veth1 netns testns
+    ip netns exec testns ip addr add 10.1.1.2/24 dev veth1
+    ip netns exec testns ip link set veth1 up
+    ip netns exec testns ip link set lo up
+
+    if [ "$mode" = "tbf" ]; then
+        modprobe ifb numifbs=1 2>/dev/null || true
+        ip netns exec testns ip link add ifb0 type ifb
+        ip netns exec testns ip link set ifb0 up
+        ip netns exec testns tc qdisc add dev veth1 ingress
+        ip netns exec testns tc filter add dev veth1 parent ffff: protocol ip u32 match u32 0 0 \
+            flowid 1:1 action mirred egress redirect dev ifb0
+        ip netns exec testns tc qdisc add dev ifb0 root tbf rate ${BOTTLENECK_MBPS}mbit \
+            burst 32kbit latency 400ms
+    else
+        python3 meter_config.py --aggregate --pir $BOTTLENECK_MBPS --pbs 4000 > /dev/null
+    fi
+}
+
+run_mode() {
+    local mode=$1 i sent=0 decoded=0
+
+    setup $mode
+    rm -f $LOG_DIR/${mode}_*.log
+
+    for i in $(seq 0 $((NUM_STREAMS - 1))); do
+        ip netns exec testns ffmpeg -flags -output_corrupt -i "udp://10.1.1.2:$((5000 + i))" \
+            -f null - > $LOG_DIR/${mode}_receiver${i}.log 2>&1 &
+    done
+    sleep 1
+    for i in $(seq 0 $((NUM_STREAMS - 1))); do
+        sudo -u $ACTUAL_USER ffmpeg -re -f lavfi -i testsrc=size=1280x720:rate=30 -t $DURATION \
+            -c:v libx265 -preset ultrafast \
+            -x265-params "keyint=4:min-keyint=4:scenecut=0:bframes=0" \
+            -pix_fmt yuv420p -f rtp rtp://10.1.1.2:$((5000 + i)) \
+            > $LOG_DIR/${mode}_streamer${i}.log 2>&1 &
+    done
+
+    sleep $((DURATION + 3))
+    pkill -INT -f "ffmpeg.*udp://10.1.1.2:50" 2>/dev/null || true
+    sleep 2
+
+    for i in $(seq 0 $((NUM_STREAMS - 1))); do
+        sent=$((sent + $(frames_of $LOG_DIR/${mode}_streamer${i}.log)))
+        decoded=$((decoded + $(frames_of $LOG_DIR/${mode}_receiver${i}.log)))
+    done
+
+    awk -v mode=$mode -v sent=$sent -v decoded=$decoded \
+        'BEGIN { printf "%-8s %12d %12d %9.1f%%\n", mode, sent, decoded, sent ? 100 * decoded / sent : 0 }'
+}
+
+make -s attach_ext xdp_stats pipeline_loader || exit 1
+mkdir -p $LOG_DIR
+
+echo "$NUM_STREAMS streams, ${BOTTLENECK_MBPS} Mbit/s, ${DURATION}s per mode"
+printf "%-8s %12s %12s %10s\n" "mode" "frames sent" "decodable" "yield"
+run_mode tbf
+run_mode meter
@@ -0,0 +1,806 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "bench.h"
+#include "xdp_obj.h"
+#include "pipeline_defs.h"
+#include "video_filter_defs.h"
+
+/* Per-packet cost and verdicts of the whole pipeline without a testbed.
+ * Loads the dispatcher with the parser and stage2 in slots 0 and 1 (the
+ * pipeline.conf layout) and runs synthetic frames through it with
+ * BPF_PROG_TEST_RUN, once per camera filtering mode:
+ *
+ *  1. every scenario once, in order, with its verdict checked against the
+ *     expected one (FU fragments and frame decisions depend on the packets
+ *     before them, so the order matters);
+ *  2. every scenario repeated, reporting ns/packet.
+ *
+ * A last sequence checks the resync after a P-dropping mode: P-slices are
+ * held back until the next IRAP slice, and the first of them comes back
+ * as an RTCP PLI to the camera (XDP_TX). Another one checks that a raised
+ * camera_max_tid only lets FILTER_TEMPORAL forward a sub-layer again from
+ * its next TSA or IRAP picture on, and only from a TSA one layer above
+ * the forwarded ones, and a third one that a lost packet takes down
+ * the rest of its frame and the frames after it up to the next IRAP
+ * (gop_drop), also after the sequence restarts, and that rtp_monitor
+ * counts it as lost before the verdict.
+ *
+ * Cameras 1 to 3 then send their FU fragments interleaved, two of them
+ * dropping P-frames, to check that every camera's P-frame state is its
+ * own; the dropped packets and bytes saved per camera are printed and
+ * checked against camera_stats.
+ *
+ * Last, the robot is moved back and forth between a grid cell every
+ * camera sees and one none sees (load_camera_geometry.py's grid), and
+ * the ns per move over all NUM_CAMERAS cameras is printed. stage2's
+ * instruction counts include the grid's bpf_loop walk.
+ *
+ * Exits non-zero if any verdict or grid reference count is wrong, so it doubles as a regression
+ * test. FILTER_DECIMATE runs with a drop probability of ~1, FILTER_TEMPORAL
+ * with camera_max_tid 0 (only the base sub-layer).
+ *
+ * The translated and verified instruction counts of the programs are
+ * printed first; run it on two builds (or with and without -F, which
+ * freezes the stage order into the programs like pipeline_loader's
+ * freeze_pipeline) to compare them. */
+
+#define ROUNDS 3
+#define PKT_SIZE 1200
+
+enum {
+    PKT_NON_RTP,        /* TCP to the camera address */
+    PKT_WRONG_PORT,     /* RTP outside the camera ports and the robot port */
+    PKT_IRAP,           /* single NAL unit IDR slice */
+    PKT_P,              /* single NAL unit P-slice */
+    PKT_FU_P_START,
+    PKT_FU_P_MIDDLE,
+    PKT_FU_P_END,
+    PKT_FU_IRAP_START,
+    PKT_FU_IRAP_MIDDLE,
+    PKT_FU_IRAP_END,
+    PKT_P_TID1,         /* P-slice of temporal sub-layer 1 */
+    PKT_FU_P_TID1,
+    PKT_TSA_TID1,       /* sub-layer switching point to TemporalId 1 */
+    PKT_P_TID2,
+    PKT_TSA_TID2,
+    PKT_ROBOT,          /* last: robot packets may rewrite camera modes */
+    PKT_MAX
+};
+
+struct scenario {
+    const char *name;
+    int proto;
+    __u16 dport;
+    __u32 rtp_ts;
+    __u8 nal_type;      /* 0: no RTP payload (robot, non-RTP) */
+    __u8 fu_type;
+    __u8 fu_flags;      /* FU header S (0x80) / E (0x40) bits */
+    __u8 tid;           /* TemporalId */
+};
+
+static const struct scenario scenarios[PKT_MAX] = {
+    [PKT_NON_RTP]        = { "non-RTP (TCP)",    IPPROTO_TCP, 5000, 0,    0, 0, 0 },
+    [PKT_WRONG_PORT]     = { "wrong port",       IPPROTO_UDP, 6000, 100,  NAL_TRAIL_R, 0, 0 },
+    [PKT_IRAP]           = { "IRAP slice",       IPPROTO_UDP, 5000, 200,  NAL_IDR_W_RADL, 0, 0 },
+    [PKT_P]              = { "P-slice",          IPPROTO_UDP, 5000, 300,  NAL_TRAIL_R, 0, 0 },
+    [PKT_FU_P_START]     = { "FU start, P",      IPPROTO_UDP, 5000, 400,  NAL_FU, NAL_TRAIL_R, 0x80 },
+    [PKT_FU_P_MIDDLE]    = { "FU middle, P",     IPPROTO_UDP, 5000, 400,  NAL_FU, NAL_TRAIL_R, 0x00 },
+    [PKT_FU_P_END]       = { "FU end, P",        IPPROTO_UDP, 5000, 400,  NAL_FU, NAL_TRAIL_R, 0x40 },
+    [PKT_FU_IRAP_START]  = { "FU start, IRAP",   IPPROTO_UDP, 5000, 500,  NAL_FU, NAL_IDR_W_RADL, 0x80 },
+    [PKT_FU_IRAP_MIDDLE] = { "FU middle, IRAP",  IPPROTO_UDP, 5000, 500,  NAL_FU, NAL_IDR_W_RADL, 0x00 },
+    [PKT_FU_IRAP_END]    = { "FU end, IRAP",     IPPROTO_UDP, 5000, 500,  NAL_FU, NAL_IDR_W_RADL, 0x40 },
+    [PKT_P_TID1]         = { "P-slice, TID 1",   IPPROTO_UDP, 5000, 600,  NAL_TRAIL_R, 0, 0, 1 },
+    [PKT_FU_P_TID1]      = { "FU start, TID 1",  IPPROTO_UDP, 5000, 700,  NAL_FU, NAL_TRAIL_R, 0x80, 1 },
+    [PKT_TSA_TID1]       = { "TSA, TID 1",       IPPROTO_UDP, 5000, 800,  NAL_TSA_R, 0, 0, 1 },
+    [PKT_P_TID2]         = { "P-slice, TID 2",   IPPROTO_UDP, 5000, 900,  NAL_TRAIL_R, 0, 0, 2 },
+    [PKT_TSA_TID2]       = { "TSA, TID 2",       IPPROTO_UDP, 5000, 1000, NAL_TSA_R, 0, 0, 2 },
+    [PKT_ROBOT]          = { "robot position",   IPPROTO_UDP, ROBOT_POSITION_PORT, 0, 0, 0, 0 },
+};
+
+struct mode {
+    const char *name;
+    __u32 mode;
+    __u32 drops_p;      /* P-slices (and their FU fragments) are dropped */
+    __u32 drops_tid;    /* slices above TemporalId 0 are dropped */
+};
+
+static const struct mode modes[] = {
+    { "OFF",       FILTER_OFF,       0, 0 },
+    { "DROP_P",    FILTER_DROP_P,    1, 1 },
+    { "FORWARD_P", FILTER_FORWARD_P, 0, 0 },
+    { "DECIMATE",  FILTER_DECIMATE,  1, 1 },
+    { "TEMPORAL",  FILTER_TEMPORAL,  0, 1 },
+};
+
+#define NR_MODES (sizeof(modes) / sizeof(modes[0]))
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-F] [-r repeat] [-d bpf_dir]\n"
+            "  -F  freeze the stage order into the programs (cfg_frozen_pipeline)\n"
+            "  -r  BPF_PROG_TEST_RUN repetitions per measurement (default: 1000000)\n"
+            "  -d  directory with xdp_dispatcher.o, stage0_parser.o and stage2_video_filter.o (default: bpf)\n",
+            prog);
+}
+
+static __u32 expected_verdict(int pkt, const struct mode *m)
+{
+    switch (pkt) {
+    case PKT_P:
+    case PKT_FU_P_START:
+    case PKT_FU_P_MIDDLE:
+    case PKT_FU_P_END:
+        return m->drops_p ? XDP_DROP : XDP_PASS;
+    case PKT_P_TID1:
+    case PKT_FU_P_TID1:
+    case PKT_TSA_TID1:
+    case PKT_P_TID2:
+    case PKT_TSA_TID2:
+        return m->drops_tid ? XDP_DROP : XDP_PASS;
+    default:
+        return XDP_PASS;
+    }
+}
+
+/* x of build_pkt()'s robot position; bench_grid() moves it */
+static __u32 robot_x = 500;
+
+/* Cameras check_interleave() sends, after camera 0 */
+#define NR_INTERLEAVED 3
+
+/* RTP sequence number of each camera's next packet. Consecutive, so that
+ * stage2 sees no loss, unless a sequence skips some. */
+static __u16 camera_seq[1 + NR_INTERLEAVED];
+
+/* Ethernet / IPv4 / UDP or TCP / RTP / H.265, PKT_SIZE bytes. Scenarios
+ * to CAMERA_PORT_BASE go to camera's port instead. */
+static void build_camera_pkt(unsigned char *pkt, const struct scenario *sc, __u32 camera)
+{
+    __u16 dport = sc->dport == CAMERA_PORT_BASE ? CAMERA_PORT_BASE + camera : sc->dport;
+    unsigned char *rtp = build_ip_pkt(pkt, PKT_SIZE, sc->proto, htonl(BENCH_SADDR), htonl(BENCH_DADDR),
+                                      40000, dport);
+    __u16 seq = 0;
+
+    if (sc->dport == ROBOT_POSITION_PORT) {
+        /* robot_coords_hdr: x, y, robot id */
+        __u32 coords[3] = { htonl(robot_x), htonl(500), htonl(1) };
+        memcpy(rtp, coords, sizeof(coords));
+        return;
+    }
+    if (!sc->nal_type)
+        return;
+
+    if (sc->dport == CAMERA_PORT_BASE)
+        seq = camera_seq[camera]++;
+    build_rtp(rtp, seq, sc->rtp_ts, 0x12345678, sc->nal_type, sc->tid);
+    if (sc->nal_type == NAL_FU)
+        rtp[14] = sc->fu_flags | sc->fu_type;
+}
+
+/* build_camera_pkt() for camera 0 */
+static void build_pkt(unsigned char *pkt, const struct scenario *sc)
+{
+    build_camera_pkt(pkt, sc, 0);
+}
+
+static int run(int prog_fd, int pkt, int repeat, __u32 *verdict, __u32 *ns)
+{
+    unsigned char data[PKT_SIZE];
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+                .data_in = data,
+                .data_size_in = sizeof(data),
+                .repeat = repeat);
+
+    build_pkt(data, &scenarios[pkt]);
+    if (bpf_prog_test_run_opts(prog_fd, &opts))
+        return -errno;
+    *verdict = opts.retval;
+    *ns = opts.duration;
+    return 0;
+}
+
+static const char *verdict_name(__u32 verdict)
+{
+    switch (verdict) {
+    case XDP_ABORTED:
+        return "ABORTED";
+    case XDP_DROP:
+        return "DROP";
+    case XDP_PASS:
+        return "PASS";
+    case XDP_TX:
+        return "TX";
+    case XDP_REDIRECT:
+        return "REDIRECT";
+    default:
+        return "?";
+    }
+}
+
+struct resync_step {
+    int pkt;
+    __u32 mode;         /* camera mode while the packet is run */
+    __u32 verdict;
+};
+
+static const struct resync_step resync_steps[] = {
+    { PKT_P,           FILTER_DROP_P, XDP_DROP },
+    { PKT_P,           FILTER_OFF,    XDP_TX },     /* resync starts, PLI */
+    { PKT_FU_P_MIDDLE, FILTER_OFF,    XDP_DROP },   /* next PLI not due yet */
+    { PKT_IRAP,        FILTER_OFF,    XDP_PASS },   /* decodable again */
+    { PKT_P,           FILTER_OFF,    XDP_PASS },
+};
+
+#define NR_RESYNC_STEPS (sizeof(resync_steps) / sizeof(resync_steps[0]))
+
+/* The PLI that build_pkt()'s camera should get: RR + PLI from the
+ * receiver's RTCP port to the camera's, media SSRC 0x12345678 */
+static int check_pli(const unsigned char *pkt, __u32 len)
+{
+    const struct iphdr *iph = (const void *)(pkt + sizeof(struct ethhdr));
+    const struct udphdr *udph = (const void *)(iph + 1);
+    const unsigned char *rtcp = (const void *)(udph + 1);
+    static const unsigned char media_ssrc[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+    if (len != sizeof(struct ethhdr) + sizeof(*iph) + sizeof(*udph) + 20)
+        return 0;
+    return iph->saddr == htonl(BENCH_DADDR) && iph->daddr == htonl(BENCH_SADDR) &&
+           ntohs(udph->source) == 5001 && ntohs(udph->dest) == 40001 &&
+           rtcp[0] == 0x80 && rtcp[1] == 201 && rtcp[8] == 0x81 && rtcp[9] == 206 &&
+           !memcmp(rtcp + 16, media_ssrc, sizeof(media_ssrc));
+}
+
+/* Runs resync_steps, returns the number of wrong verdicts */
+static int check_resync(int disp_fd, int mode_fd)
+{
+    unsigned char data[PKT_SIZE], out[PKT_SIZE];
+    __u32 camera = 0;
+    int failures = 0;
+    size_t i;
+
+    for (i = 0; i < NR_RESYNC_STEPS; i++) {
+        const struct resync_step *st = &resync_steps[i];
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = data,
+                    .data_size_in = sizeof(data),
+                    .data_out = out,
+                    .data_size_out = sizeof(out));
+
+        build_pkt(data, &scenarios[st->pkt]);
+        if (bpf_map_update_elem(mode_fd, &camera, &st->mode, BPF_ANY) ||
+            bpf_prog_test_run_opts(disp_fd, &opts)) {
+            fprintf(stderr, "Resync step %zu failed: %s\n", i, strerror(errno));
+            return failures + 1;
+        }
+        if (opts.retval != st->verdict) {
+            fprintf(stderr, "FAIL resync step %zu / %s: %s, expected %s\n", i, scenarios[st->pkt].name,
+                    verdict_name(opts.retval), verdict_name(st->verdict));
+            failures++;
+        } else if (st->verdict == XDP_TX && !check_pli(out, opts.data_size_out)) {
+            fprintf(stderr, "FAIL resync step %zu: the packet sent back is no PLI to the camera\n", i);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+struct temporal_step {
+    int pkt;
+    __u32 max_tid;      /* camera_max_tid while the packet is run */
+    __u32 verdict;
+};
+
+static const struct temporal_step temporal_steps[] = {
+    { PKT_P_TID1,   0, XDP_DROP },
+    { PKT_P_TID1,   1, XDP_DROP },  /* may reference dropped TID 1 pictures */
+    { PKT_TSA_TID1, 1, XDP_PASS },  /* switching point */
+    { PKT_P_TID1,   1, XDP_PASS },
+    { PKT_P_TID1,   0, XDP_DROP },  /* lowered at once */
+    { PKT_P_TID1,   1, XDP_DROP },
+    { PKT_IRAP,     1, XDP_PASS },  /* raised at the IRAP picture */
+    { PKT_P_TID1,   1, XDP_PASS },
+    { PKT_P_TID1,   0, XDP_DROP },
+    { PKT_TSA_TID2, 2, XDP_DROP },  /* TID 1 is not forwarded yet */
+    { PKT_P_TID2,   2, XDP_DROP },
+    { PKT_TSA_TID1, 2, XDP_PASS },  /* switches up to TID 2 at once */
+    { PKT_P_TID2,   2, XDP_PASS },
+};
+
+#define NR_TEMPORAL_STEPS (sizeof(temporal_steps) / sizeof(temporal_steps[0]))
+
+/* Runs temporal_steps in FILTER_TEMPORAL, returns the number of wrong verdicts */
+static int check_temporal(int disp_fd, int mode_fd, int max_tid_fd)
+{
+    unsigned char data[PKT_SIZE];
+    __u32 camera = 0, mode = FILTER_TEMPORAL;
+    int failures = 0;
+    size_t i;
+
+    if (bpf_map_update_elem(mode_fd, &camera, &mode, BPF_ANY)) {
+        fprintf(stderr, "Failed to set the camera mode: %s\n", strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < NR_TEMPORAL_STEPS; i++) {
+        const struct temporal_step *st = &temporal_steps[i];
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = data,
+                    .data_size_in = sizeof(data));
+
+        build_pkt(data, &scenarios[st->pkt]);
+        if (bpf_map_update_elem(max_tid_fd, &camera, &st->max_tid, BPF_ANY) ||
+            bpf_prog_test_run_opts(disp_fd, &opts)) {
+            fprintf(stderr, "Temporal step %zu failed: %s\n", i, strerror(errno));
+            return failures + 1;
+        }
+        if (opts.retval != st->verdict) {
+            fprintf(stderr, "FAIL temporal step %zu / %s, max_tid %u: %s, expected %s\n", i,
+                    scenarios[st->pkt].name, st->max_tid, verdict_name(opts.retval), verdict_name(st->verdict));
+            failures++;
+        }
+    }
+    return failures;
+}
+
+struct gop_step {
+    int pkt;
+    __s16 lost;         /* packets lost before this one, < 0: sequence jumps back */
+    __u32 verdict;
+};
+
+static const struct gop_step gop_steps[] = {
+    { PKT_IRAP,          0, XDP_PASS },
+    { PKT_FU_P_START,    0, XDP_PASS },
+    { PKT_FU_P_END,      1, XDP_DROP },     /* the middle fragment is lost */
+    { PKT_P,             0, XDP_DROP },     /* references the damaged frame */
+    { PKT_FU_IRAP_START, 0, XDP_PASS },     /* next GOP */
+    { PKT_P,             0, XDP_PASS },
+    { PKT_P,         -5000, XDP_PASS },     /* restarted sequence, not late */
+    { PKT_FU_P_START,    0, XDP_PASS },
+    { PKT_FU_P_END,      1, XDP_DROP },     /* loss is seen again */
+    { PKT_P,             0, XDP_DROP },
+    { PKT_IRAP,          0, XDP_PASS },
+};
+
+#define NR_GOP_STEPS (sizeof(gop_steps) / sizeof(gop_steps[0]))
+
+/* Sequence numbers camera 0 received and spanned before stage2's verdict,
+ * summed over the CPUs */
+static int rtp_counts(int monitor_fd, __u64 *received, __u64 *expected)
+{
+    int nr_cpus = libbpf_num_possible_cpus(), i;
+    struct rtp_monitor *values;
+    __u32 camera = 0;
+
+    if (nr_cpus < 0)
+        return nr_cpus;
+    values = calloc(nr_cpus, sizeof(*values));
+    if (!values)
+        return -ENOMEM;
+    if (bpf_map_lookup_elem(monitor_fd, &camera, values)) {
+        free(values);
+        return -errno;
+    }
+    *received = *expected = 0;
+    for (i = 0; i < nr_cpus; i++) {
+        *received += values[i].received;
+        *expected += values[i].expected;
+    }
+    free(values);
+    return 0;
+}
+
+/* Runs gop_steps in FILTER_OFF, returns the number of wrong verdicts and
+ * loss counts */
+static int check_gop(int disp_fd, int mode_fd, int monitor_fd)
+{
+    unsigned char data[PKT_SIZE];
+    __u32 camera = 0, mode = FILTER_OFF;
+    __u64 received, expected, received_after, expected_after, lost = 0;
+    int failures = 0;
+    size_t i;
+
+    if (bpf_map_update_elem(mode_fd, &camera, &mode, BPF_ANY)) {
+        fprintf(stderr, "Failed to set the camera mode: %s\n", strerror(errno));
+        return 1;
+    }
+    if (rtp_counts(monitor_fd, &received, &expected)) {
+        fprintf(stderr, "Failed to read rtp_monitor: %s\n", strerror(errno));
+        return 1;
+    }
+    for (i = 0; i < NR_GOP_STEPS; i++) {
+        const struct gop_step *st = &gop_steps[i];
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = data,
+                    .data_size_in = sizeof(data));
+
+        camera_seq[0] += st->lost;
+        if (st->lost > 0)
+            lost += st->lost;
+        build_pkt(data, &scenarios[st->pkt]);
+        if (bpf_prog_test_run_opts(disp_fd, &opts)) {
+            fprintf(stderr, "GOP step %zu failed: %s\n", i, strerror(errno));
+            return failures + 1;
+        }
+        if (opts.retval != st->verdict) {
+            fprintf(stderr, "FAIL GOP step %zu / %s: %s, expected %s\n", i, scenarios[st->pkt].name,
+                    verdict_name(opts.retval), verdict_name(st->verdict));
+            failures++;
+        }
+    }
+
+    if (rtp_counts(monitor_fd, &received_after, &expected_after)) {
+        fprintf(stderr, "Failed to read rtp_monitor: %s\n", strerror(errno));
+        return failures + 1;
+    }
+    if (received_after - received != NR_GOP_STEPS || expected_after - expected != NR_GOP_STEPS + lost) {
+        fprintf(stderr, "FAIL rtp_monitor: %llu received / %llu expected, expected %zu / %llu\n",
+                (unsigned long long)(received_after - received), (unsigned long long)(expected_after - expected),
+                NR_GOP_STEPS, (unsigned long long)(NR_GOP_STEPS + lost));
+        failures++;
+    }
+    return failures;
+}
+
+/* The cfg_* constants of bpf/pipeline.h for a pipeline frozen to the
+ * struct pipeline_config arg */
+static int freeze_pipeline(struct bpf_object *obj, const void *arg)
+{
+    const struct pipeline_config *pcfg = arg;
+    __u32 frozen = 1;
+    int err;
+
+    err = set_rodata(obj, "cfg_frozen_pipeline", &frozen, sizeof(frozen));
+    if (!err)
+        err = set_rodata(obj, "cfg_nr_stages", &pcfg->nr_stages, sizeof(pcfg->nr_stages));
+    if (!err)
+        err = set_rodata(obj, "cfg_stages_enabled", &pcfg->enabled, sizeof(pcfg->enabled));
+    if (!err)
+        err = set_rodata(obj, "cfg_stage_order", pcfg->order, sizeof(pcfg->order));
+    return err;
+}
+
+struct interleave_step {
+    __u32 camera;       /* 1..NR_INTERLEAVED */
+    int pkt;
+    __u32 verdict;
+};
+
+/* Camera modes of check_interleave(), by camera - 1 */
+static const __u32 interleaved_modes[NR_INTERLEAVED] = { FILTER_DROP_P, FILTER_OFF, FILTER_DROP_P };
+
+/* The fragments of three cameras' frames in turn, as the cameras' flows
+ * arrive mixed. With one P-frame state shared by all cameras, camera 1's
+ * P-frame start would take down cameras 2 and 3's IRAP fragments, and
+ * camera 1's IRAP start would let camera 3's P fragments through. */
+static const struct interleave_step interleave_steps[] = {
+    { 1, PKT_FU_P_START,     XDP_DROP },
+    { 2, PKT_FU_IRAP_START,  XDP_PASS },
+    { 3, PKT_FU_IRAP_START,  XDP_PASS },
+    { 1, PKT_FU_P_MIDDLE,    XDP_DROP },
+    { 2, PKT_FU_IRAP_MIDDLE, XDP_PASS },
+    { 3, PKT_FU_IRAP_MIDDLE, XDP_PASS },
+    { 1, PKT_FU_P_END,       XDP_DROP },
+    { 2, PKT_FU_IRAP_END,    XDP_PASS },
+    { 3, PKT_FU_IRAP_END,    XDP_PASS },
+    { 2, PKT_FU_P_START,     XDP_PASS },
+    { 1, PKT_FU_IRAP_START,  XDP_PASS },
+    { 3, PKT_FU_P_START,     XDP_DROP },
+    { 2, PKT_FU_P_MIDDLE,    XDP_PASS },
+    { 1, PKT_FU_IRAP_MIDDLE, XDP_PASS },
+    { 3, PKT_FU_P_MIDDLE,    XDP_DROP },
+    { 2, PKT_FU_P_END,       XDP_PASS },
+    { 1, PKT_FU_IRAP_END,    XDP_PASS },
+    { 3, PKT_FU_P_END,       XDP_DROP },
+};
+
+#define NR_INTERLEAVE_STEPS (sizeof(interleave_steps) / sizeof(interleave_steps[0]))
+
+/* camera_stats of camera, summed over the CPUs */
+static int camera_counts(int stats_fd, __u32 camera, struct camera_stats *sum)
+{
+    int nr_cpus = libbpf_num_possible_cpus(), i;
+    struct camera_stats *values;
+
+    if (nr_cpus < 0)
+        return nr_cpus;
+    values = calloc(nr_cpus, sizeof(*values));
+    if (!values)
+        return -ENOMEM;
+    if (bpf_map_lookup_elem(stats_fd, &camera, values)) {
+        free(values);
+        return -errno;
+    }
+    memset(sum, 0, sizeof(*sum));
+    for (i = 0; i < nr_cpus; i++) {
+        sum->rx_pkts += values[i].rx_pkts;
+        sum->rx_bytes += values[i].rx_bytes;
+        sum->dropped_pkts += values[i].dropped_pkts;
+        sum->dropped_bytes += values[i].dropped_bytes;
+    }
+    free(values);
+    return 0;
+}
+
+/* Runs interleave_steps and prints the bytes each camera saved. Returns
+ * the number of wrong verdicts and camera_stats counts. */
+static int check_interleave(int disp_fd, int mode_fd, int stats_fd)
+{
+    struct camera_stats before[NR_INTERLEAVED], after;
+    __u64 rx[NR_INTERLEAVED] = { 0 }, dropped[NR_INTERLEAVED] = { 0 };
+    unsigned char data[PKT_SIZE];
+    int failures = 0;
+    __u32 c;
+    size_t i;
+
+    for (c = 0; c < NR_INTERLEAVED; c++) {
+        __u32 camera = c + 1;
+
+        if (bpf_map_update_elem(mode_fd, &camera, &interleaved_modes[c], BPF_ANY) ||
+            camera_counts(stats_fd, camera, &before[c])) {
+            fprintf(stderr, "Failed to set up camera %u: %s\n", camera, strerror(errno));
+            return 1;
+        }
+    }
+    for (i = 0; i < NR_INTERLEAVE_STEPS; i++) {
+        const struct interleave_step *st = &interleave_steps[i];
+        LIBBPF_OPTS(bpf_test_run_opts, opts,
+                    .data_in = data,
+                    .data_size_in = sizeof(data));
+
+        build_camera_pkt(data, &scenarios[st->pkt], st->camera);
+        if (bpf_prog_test_run_opts(disp_fd, &opts)) {
+            fprintf(stderr, "Interleave step %zu failed: %s\n", i, strerror(errno));
+            return failures + 1;
+        }
+        if (opts.retval != st->verdict) {
+            fprintf(stderr, "FAIL interleave step %zu / camera %u %s: %s, expected %s\n", i, st->camera,
+                    scenarios[st->pkt].name, verdict_name(opts.retval), verdict_name(st->verdict));
+            failures++;
+        }
+        rx[st->camera - 1]++;
+        if (st->verdict == XDP_DROP)
+            dropped[st->camera - 1]++;
+    }
+
+    printf("\n%-18s %10s %10s %10s %12s\n", "interleaved", "mode", "rx pkts", "dropped", "saved bytes");
+    for (c = 0; c < NR_INTERLEAVED; c++) {
+        __u32 camera = c + 1;
+        __u64 rx_pkts, dropped_pkts, dropped_bytes;
+
+        if (camera_counts(stats_fd, camera, &after)) {
+            fprintf(stderr, "Failed to read camera_stats: %s\n", strerror(errno));
+            return failures + 1;
+        }
+        rx_pkts = after.rx_pkts - before[c].rx_pkts;
+        dropped_pkts = after.dropped_pkts - before[c].dropped_pkts;
+        dropped_bytes = after.dropped_bytes - before[c].dropped_bytes;
+        printf("camera %-11u %10u %10llu %10llu %12llu\n", camera, interleaved_modes[c],
+               (unsigned long long)rx_pkts, (unsigned long long)dropped_pkts,
+               (unsigned long long)dropped_bytes);
+        if (rx_pkts != rx[c] || dropped_pkts != dropped[c] || dropped_bytes != dropped[c] * PKT_SIZE) {
+            fprintf(stderr, "FAIL camera_stats of camera %u: %llu rx / %llu dropped / %llu bytes, "
+                    "expected %llu / %llu / %llu\n", camera, (unsigned long long)rx_pkts,
+                    (unsigned long long)dropped_pkts, (unsigned long long)dropped_bytes,
+                    (unsigned long long)rx[c], (unsigned long long)dropped[c],
+                    (unsigned long long)(dropped[c] * PKT_SIZE));
+            failures++;
+        }
+    }
+    return failures;
+}
+
+/* Grid moves bench_grid() times */
+#define GRID_MOVES 1000
+
+/* Robot 1's camera_robot_refs count of every camera is refs */
+static int check_grid_refs(int refs_fd, __u32 refs)
+{
+    __u32 camera, value;
+
+    for (camera = 0; camera < NUM_CAMERAS; camera++) {
+        if (bpf_map_lookup_elem(refs_fd, &camera, &value) || value != refs) {
+            fprintf(stderr, "FAIL grid: camera %u sees %u robots, expected %u\n", camera, value, refs);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Worst case of the camera geometry grid: moves the robot back and forth
+ * between a cell every camera sees and one no camera sees, so that each
+ * move flips all NUM_CAMERAS reference counts. Prints ns/move, returns
+ * the number of wrong reference counts. */
+static int bench_grid(int disp_fd, int grid_fd, int cells_fd, int refs_fd)
+{
+    /* 2 x 2 cells of 500; the robot's y of 500 is in row 1 */
+    struct grid_config gc = { .enabled = 1, .cell_size = 500, .cols = 2, .rows = 2 };
+    struct camera_bitmap all, none;
+    __u32 zero = 0, seen_cell = 2, unseen_cell = 3, verdict, ns;
+    __u64 total = 0;
+    int err, i, failures = 0;
+
+    memset(&all, 0xFF, sizeof(all));
+    memset(&none, 0, sizeof(none));
+    if (bpf_map_update_elem(cells_fd, &seen_cell, &all, BPF_ANY) ||
+        bpf_map_update_elem(cells_fd, &unseen_cell, &none, BPF_ANY) ||
+        bpf_map_update_elem(grid_fd, &zero, &gc, BPF_ANY)) {
+        fprintf(stderr, "Failed to set up the grid: %s\n", strerror(errno));
+        return 1;
+    }
+
+    for (i = 0; i < 2 * GRID_MOVES; i++) {
+        robot_x = i % 2 ? 600 : 100;
+        err = run(disp_fd, PKT_ROBOT, 1, &verdict, &ns);
+        if (err) {
+            fprintf(stderr, "Grid move %d failed: %s\n", i, strerror(-err));
+            return failures + 1;
+        }
+        /* The first move leaves the strip layout */
+        if (i)
+            total += ns;
+        if (i < 2)
+            failures += check_grid_refs(refs_fd, i % 2 ? 0 : 1);
+    }
+    robot_x = 500;
+
+    printf("\n%-18s %10llu ns/move, %d cameras\n", "grid move",
+           (unsigned long long)(total / (2 * GRID_MOVES - 1)), NUM_CAMERAS);
+    return failures;
+}
+
+static void print_insns(const char *name, int prog_fd)
+{
+    struct bpf_prog_info info;
+    __u32 len = sizeof(info);
+
+    memset(&info, 0, sizeof(info));
+    if (bpf_prog_get_info_by_fd(prog_fd, &info, &len))
+        return;
+    printf("%-18s %10u %10u\n", name, info.xlated_prog_len / 8, info.verified_insns);
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "bpf";
+    int repeat = 1000000, frozen = 0, opt, err, rc = 1, failures = 0, pkt, round;
+    struct bpf_object *disp = NULL, *parser = NULL, *stage2 = NULL;
+    struct pipeline_config pcfg = { .nr_stages = 2, .enabled = 0x3, .order = { 0, 1 } };
+    struct decimation_policy drop_all = { .drop_threshold = 0xFFFFFFFF };
+    int disp_fd, stage_fds[2], mode_fd, decimation_fd, max_tid_fd, monitor_fd;
+    int grid_fd, cells_fd, refs_fd, stats_fd;
+    __u32 camera = 0, verdict, ns, best;
+    __u32 results[PKT_MAX][NR_MODES];
+    size_t m;
+
+    while ((opt = getopt(argc, argv, "Fr:d:h")) != -1) {
+        switch (opt) {
+        case 'F':
+            frozen = 1;
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    /* The pipeline install_pipeline() sets up below */
+    disp = load_object(dir, "xdp_dispatcher.o", NULL, frozen ? freeze_pipeline : NULL, &pcfg);
+    if (!disp)
+        return 1;
+    parser = load_object(dir, "stage0_parser.o", disp, frozen ? freeze_pipeline : NULL, &pcfg);
+    stage2 = load_object(dir, "stage2_video_filter.o", disp, frozen ? freeze_pipeline : NULL, &pcfg);
+    if (!parser || !stage2)
+        goto out;
+
+    disp_fd = bpf_program__fd(bpf_object__find_program_by_name(disp, "xdp_dispatcher"));
+    stage_fds[0] = bpf_program__fd(bpf_object__find_program_by_name(parser, "parser"));
+    stage_fds[1] = bpf_program__fd(bpf_object__find_program_by_name(stage2, "stage2"));
+    mode_fd = bpf_object__find_map_fd_by_name(stage2, "camera_filtering_mode");
+    decimation_fd = bpf_object__find_map_fd_by_name(stage2, "camera_decimation");
+    max_tid_fd = bpf_object__find_map_fd_by_name(stage2, "camera_max_tid");
+    monitor_fd = bpf_object__find_map_fd_by_name(stage2, "rtp_monitor");
+    grid_fd = bpf_object__find_map_fd_by_name(stage2, "grid_config");
+    cells_fd = bpf_object__find_map_fd_by_name(stage2, "visibility_grid");
+    refs_fd = bpf_object__find_map_fd_by_name(stage2, "camera_robot_refs");
+    stats_fd = bpf_object__find_map_fd_by_name(stage2, "camera_stats");
+    if (disp_fd < 0 || stage_fds[0] < 0 || stage_fds[1] < 0 || mode_fd < 0 || decimation_fd < 0 ||
+        max_tid_fd < 0 || monitor_fd < 0 || grid_fd < 0 || cells_fd < 0 || refs_fd < 0 || stats_fd < 0) {
+        fprintf(stderr, "Objects in %s are missing programs or maps\n", dir);
+        goto out;
+    }
+    if (install_pipeline(disp, stage_fds, 2))
+        goto out;
+    if (bpf_map_update_elem(decimation_fd, &camera, &drop_all, BPF_ANY)) {
+        fprintf(stderr, "Failed to set up the pipeline: %s\n", strerror(errno));
+        goto out;
+    }
+
+    printf("%-18s %10s %10s\n", frozen ? "insns (frozen)" : "insns", "xlated", "verified");
+    print_insns("xdp_dispatcher", disp_fd);
+    print_insns("parser", stage_fds[0]);
+    print_insns("stage2", stage_fds[1]);
+    printf("\n");
+
+    for (m = 0; m < NR_MODES; m++) {
+        if (bpf_map_update_elem(mode_fd, &camera, &modes[m].mode, BPF_ANY)) {
+            fprintf(stderr, "Failed to set the camera mode: %s\n", strerror(errno));
+            goto out;
+        }
+
+        for (pkt = 0; pkt < PKT_MAX; pkt++) {
+            err = run(disp_fd, pkt, 1, &verdict, &ns);
+            if (err)
+                goto fail;
+            if (verdict != expected_verdict(pkt, &modes[m])) {
+                fprintf(stderr, "FAIL %s / %s: %s, expected %s\n", modes[m].name, scenarios[pkt].name,
+                        verdict_name(verdict), verdict_name(expected_verdict(pkt, &modes[m])));
+                failures++;
+            }
+        }
+
+        for (pkt = 0; pkt < PKT_MAX; pkt++) {
+            best = ~0U;
+            for (round = 0; round < ROUNDS; round++) {
+                err = run(disp_fd, pkt, repeat, &verdict, &ns);
+                if (err)
+                    goto fail;
+                if (ns < best)
+                    best = ns;
+            }
+            results[pkt][m] = best;
+        }
+    }
+
+    failures += check_resync(disp_fd, mode_fd);
+    failures += check_temporal(disp_fd, mode_fd, max_tid_fd);
+    failures += check_gop(disp_fd, mode_fd, monitor_fd);
+
+    printf("%-18s", "ns/pkt");
+    for (m = 0; m < NR_MODES; m++)
+        printf(" %10s", modes[m].name);
+    printf("\n");
+    for (pkt = 0; pkt < PKT_MAX; pkt++) {
+        printf("%-18s", scenarios[pkt].name);
+        for (m = 0; m < NR_MODES; m++)
+            printf(" %10u", results[pkt][m]);
+        printf("\n");
+    }
+
+    failures += check_interleave(disp_fd, mode_fd, stats_fd);
+    failures += bench_grid(disp_fd, grid_fd, cells_fd, refs_fd);
+
+    if (failures) {
+        printf("\n%d verdict(s) wrong\n", failures);
+        goto out;
+    }
+    printf("\nAll %zu verdicts as expected\n", NR_MODES * PKT_MAX + NR_RESYNC_STEPS + NR_TEMPORAL_STEPS +
+           NR_GOP_STEPS + NR_INTERLEAVE_STEPS + 1);
+    rc = 0;
+    goto out;
+
+fail:
+    fprintf(stderr, "Test run failed: %s\n", strerror(-err));
+out:
+    bpf_object__close(stage2);
+    bpf_object__close(parser);
+    bpf_object__close(disp);
+    return rc;
+}
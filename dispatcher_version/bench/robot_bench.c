@@ -0,0 +1,406 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <arpa/inet.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "bench.h"
+#include "xdp_obj.h"
+#include "video_filter_defs.h"
+
+/* Cost of stage2's robot position path, with fan-out visibility (robot
+ * packets rewrite camera_filtering_mode) and with lazy_visibility (robot
+ * packets only store the robot's visible set, and a FILTER_AUTO camera
+ * evaluates the stored sets on its next video packet). For
+ * each, loads the dispatcher with the parser and stage2 in slots 0 and 1
+ * (the pipeline.conf layout), prints stage2's verified instruction count
+ * and runs packets through BPF_PROG_TEST_RUN in the built-in strip
+ * layout:
+ *
+ *  - robot positions: the same one over and over, nothing to update, and
+ *    a robot moving back and forth between two strips in both directions,
+ *    which flips the most cameras a strip move can (the old and new
+ *    horizontal and vertical strip cameras). After the first moves, fan-out
+ *    is checked on the cameras' reference counts and modes, lazy on the
+ *    verdict for a P-slice of camera 0 (FILTER_AUTO);
+ *  - P-slices of camera 0, which sees one of the two strips, alone and
+ *    mixed with the robot's moves at 10 Hz and 1 kHz against VIDEO_PPS
+ *    video packets/s, as ns per packet of the mix.
+ *
+ * Run it on two builds (-d) to compare them, e.g. before and after the
+ * incremental visibility update; builds without lazy_visibility only get
+ * the fan-out row. stage2 runs with resync_timeout_ns and gop_drop at 0,
+ * so a P-slice's verdict is its camera's mode alone. Exits non-zero if a
+ * count, camera mode or verdict is wrong. */
+
+#define ROUNDS 3
+#define PKT_SIZE 1200
+/* Even, like RATE_UPDATES, so that every run of moves starts and ends at
+ * strip_positions[0] */
+#define STRIP_MOVES 10000
+/* Video packets/s the robot's position updates are mixed into: about 100
+ * cameras at 1000 packets/s */
+#define VIDEO_PPS 100000
+#define RATE_UPDATES 100
+
+struct position {
+    __u32 x;
+    __u32 y;
+};
+
+/* One strip apart in both directions */
+static const struct position strip_positions[2] = {
+    { STRIP_WIDTH / 2, STRIP_WIDTH / 2 },
+    { STRIP_WIDTH + STRIP_WIDTH / 2, STRIP_WIDTH + STRIP_WIDTH / 2 },
+};
+
+struct design {
+    const char *name;
+    __u32 lazy;         /* lazy_visibility */
+};
+
+static const struct design designs[] = {
+    { "fan-out", 0 },
+    { "lazy",    1 },
+};
+
+#define NR_DESIGNS (sizeof(designs) / sizeof(designs[0]))
+
+static const __u32 position_rates[] = { 10, 1000 };
+
+#define NR_RATES (sizeof(position_rates) / sizeof(position_rates[0]))
+
+struct pipeline {
+    struct bpf_object *disp;
+    struct bpf_object *parser;
+    struct bpf_object *stage2;
+    int disp_fd;
+    int stage2_fd;
+    int mode_fd;
+    int refs_fd;        /* camera_robot_refs, -1 in builds without it */
+    __u32 lazy;
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r repeat] [-d bpf_dir]\n"
+            "  -r  BPF_PROG_TEST_RUN repetitions per measurement (default: 1000000)\n"
+            "  -d  directory with xdp_dispatcher.o, stage0_parser.o and stage2_video_filter.o (default: bpf)\n",
+            prog);
+}
+
+/* Ethernet / IPv4 / UDP / RTP / H.265 P-slice to camera 0 */
+static void build_video_pkt(unsigned char *pkt)
+{
+    unsigned char *rtp = build_ip_pkt(pkt, PKT_SIZE, IPPROTO_UDP, htonl(BENCH_SADDR), htonl(BENCH_DADDR),
+                                      40000, CAMERA_PORT_BASE);
+
+    build_rtp(rtp, 0, 0, 0, NAL_TRAIL_R, 0);
+}
+
+/* Ethernet / IPv4 / UDP / robot_coords_hdr of robot 1 */
+static void build_robot_pkt(unsigned char *pkt, const struct position *pos)
+{
+    unsigned char *payload = build_ip_pkt(pkt, PKT_SIZE, IPPROTO_UDP, htonl(BENCH_SADDR), htonl(BENCH_DADDR),
+                                          40000, ROBOT_POSITION_PORT);
+    __u32 coords[3] = { htonl(pos->x), htonl(pos->y), htonl(1) };
+
+    memcpy(payload, coords, sizeof(coords));
+}
+
+static int run_robot(int prog_fd, const struct position *pos, int repeat, __u32 *ns)
+{
+    unsigned char pkt[PKT_SIZE];
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+                .data_in = pkt,
+                .data_size_in = sizeof(pkt),
+                .repeat = repeat);
+
+    build_robot_pkt(pkt, pos);
+    if (bpf_prog_test_run_opts(prog_fd, &opts))
+        return -errno;
+    *ns = opts.duration;
+    return 0;
+}
+
+/* Mean ns/packet of repeat P-slices of camera 0, and the verdict */
+static int run_video(int prog_fd, int repeat, __u32 *ns, __u32 *verdict)
+{
+    unsigned char pkt[PKT_SIZE];
+    LIBBPF_OPTS(bpf_test_run_opts, opts,
+                .data_in = pkt,
+                .data_size_in = sizeof(pkt),
+                .repeat = repeat);
+
+    build_video_pkt(pkt);
+    if (bpf_prog_test_run_opts(prog_fd, &opts))
+        return -errno;
+    *ns = opts.duration;
+    *verdict = opts.retval;
+    return 0;
+}
+
+/* The strip cameras that see the robot at strip_positions[at] count it,
+ * those of the other entry do not, and they are FILTER_OFF and
+ * FILTER_DROP_P. Lazy keeps neither, so there camera 0, which sees
+ * strip_positions[0] only, must pass a P-slice at 0 and drop it at 1.
+ * Returns the number of cameras that are wrong. */
+static int check_strips(const struct pipeline *pl, int at)
+{
+    int failures = 0, i;
+    __u32 ns, verdict;
+
+    if (pl->lazy) {
+        __u32 expected = at ? XDP_DROP : XDP_PASS;
+
+        if (run_video(pl->disp_fd, 1, &ns, &verdict))
+            return 1;
+        if (verdict != expected) {
+            fprintf(stderr, "FAIL camera 0: verdict %u, expected %u\n", verdict, expected);
+            failures++;
+        }
+        return failures;
+    }
+
+    for (i = 0; i < 2; i++) {
+        const struct position *pos = &strip_positions[i];
+        __u32 cameras[2] = { pos->y / STRIP_WIDTH, NUM_HORIZONTAL_STRIPS + pos->x / STRIP_WIDTH };
+        __u32 refs = i == at, mode_expected = i == at ? FILTER_OFF : FILTER_DROP_P, value;
+        int c;
+
+        for (c = 0; c < 2; c++) {
+            value = ~0U;
+            if (pl->refs_fd >= 0 &&
+                (bpf_map_lookup_elem(pl->refs_fd, &cameras[c], &value) || value != refs)) {
+                fprintf(stderr, "FAIL camera %u: sees %u robots, expected %u\n", cameras[c], value, refs);
+                failures++;
+                continue;
+            }
+            value = ~0U;
+            if (bpf_map_lookup_elem(pl->mode_fd, &cameras[c], &value) || value != mode_expected) {
+                fprintf(stderr, "FAIL camera %u: mode %u, expected %u\n", cameras[c], value, mode_expected);
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+/* Best of ROUNDS ns/update at an unchanged position */
+static int measure_still(int prog_fd, int repeat, __u32 *ns)
+{
+    __u32 round_ns;
+    int round, err;
+
+    *ns = ~0U;
+    for (round = 0; round < ROUNDS; round++) {
+        err = run_robot(prog_fd, &strip_positions[0], repeat, &round_ns);
+        if (err)
+            return err;
+        if (round_ns < *ns)
+            *ns = round_ns;
+    }
+    return 0;
+}
+
+/* Mean ns/update over STRIP_MOVES moves between strip_positions, checking
+ * the cameras after the first two */
+static int measure_moves(const struct pipeline *pl, __u32 *ns, int *failures)
+{
+    __u64 total = 0;
+    __u32 move_ns;
+    int i, err;
+
+    for (i = 0; i < STRIP_MOVES; i++) {
+        err = run_robot(pl->disp_fd, &strip_positions[(i + 1) % 2], 1, &move_ns);
+        if (err)
+            return err;
+        total += move_ns;
+        if (i < 2)
+            *failures += check_strips(pl, (i + 1) % 2);
+    }
+    *ns = total / STRIP_MOVES;
+    return 0;
+}
+
+/* Best of ROUNDS ns/packet of camera 0's P-slices */
+static int measure_video(int prog_fd, int repeat, __u32 *ns)
+{
+    __u32 round_ns, verdict;
+    int round, err;
+
+    *ns = ~0U;
+    for (round = 0; round < ROUNDS; round++) {
+        err = run_video(prog_fd, repeat, &round_ns, &verdict);
+        if (err)
+            return err;
+        if (round_ns < *ns)
+            *ns = round_ns;
+    }
+    return 0;
+}
+
+/* Mean ns/packet of VIDEO_PPS P-slices/s with a strip move at rate Hz in
+ * between, over RATE_UPDATES moves */
+static int measure_rate(int prog_fd, __u32 rate, double *ns)
+{
+    __u32 per_update = VIDEO_PPS / rate, video_ns, move_ns, verdict;
+    double total = 0;
+    int i, err;
+
+    for (i = 0; i < RATE_UPDATES; i++) {
+        err = run_video(prog_fd, per_update, &video_ns, &verdict);
+        if (!err)
+            err = run_robot(prog_fd, &strip_positions[(i + 1) % 2], 1, &move_ns);
+        if (err)
+            return err;
+        total += (double)video_ns * per_update + move_ns;
+    }
+    *ns = total / ((double)RATE_UPDATES * (per_update + 1));
+    return 0;
+}
+
+/* stage2 with lazy_visibility = the __u32 arg and no resync hold or GOP
+ * drop, so its verdicts follow the camera modes */
+static int prepare_stage2(struct bpf_object *obj, const void *arg)
+{
+    const __u32 *lazy = arg;
+    const __u64 no_resync = 0;
+    const __u32 no_gop_drop = 0;
+    int err;
+
+    err = *lazy ? set_rodata(obj, "lazy_visibility", lazy, sizeof(*lazy)) : 0;
+    if (err == -ENOENT)
+        fprintf(stderr, "%s has no lazy_visibility\n", bpf_object__name(obj));
+    if (err)
+        return err;
+
+    /* Older builds have neither */
+    err = set_rodata(obj, "resync_timeout_ns", &no_resync, sizeof(no_resync));
+    if (!err || err == -ENOENT)
+        err = set_rodata(obj, "gop_drop", &no_gop_drop, sizeof(no_gop_drop));
+    return err == -ENOENT ? 0 : err;
+}
+
+static void close_pipeline(struct pipeline *pl)
+{
+    bpf_object__close(pl->stage2);
+    bpf_object__close(pl->parser);
+    bpf_object__close(pl->disp);
+    memset(pl, 0, sizeof(*pl));
+}
+
+/* A fresh dispatcher, parser and stage2 with its own maps. With lazy, camera
+ * 0 is FILTER_AUTO. */
+static int load_pipeline(const char *dir, __u32 lazy, struct pipeline *pl)
+{
+    __u32 zero = 0, auto_mode = FILTER_AUTO;
+    int stage_fds[2];
+
+    memset(pl, 0, sizeof(*pl));
+    pl->lazy = lazy;
+    pl->disp = load_object(dir, "xdp_dispatcher.o", NULL, NULL, NULL);
+    if (!pl->disp)
+        return -1;
+    pl->parser = load_object(dir, "stage0_parser.o", pl->disp, NULL, NULL);
+    pl->stage2 = load_object(dir, "stage2_video_filter.o", pl->disp, prepare_stage2, &lazy);
+    if (!pl->parser || !pl->stage2)
+        goto fail;
+
+    pl->disp_fd = bpf_program__fd(bpf_object__find_program_by_name(pl->disp, "xdp_dispatcher"));
+    stage_fds[0] = bpf_program__fd(bpf_object__find_program_by_name(pl->parser, "parser"));
+    stage_fds[1] = pl->stage2_fd = bpf_program__fd(bpf_object__find_program_by_name(pl->stage2, "stage2"));
+    pl->mode_fd = bpf_object__find_map_fd_by_name(pl->stage2, "camera_filtering_mode");
+    pl->refs_fd = bpf_object__find_map_fd_by_name(pl->stage2, "camera_robot_refs");
+    if (pl->disp_fd < 0 || stage_fds[0] < 0 || stage_fds[1] < 0 || pl->mode_fd < 0) {
+        fprintf(stderr, "Objects in %s are missing programs or maps\n", dir);
+        goto fail;
+    }
+    if (install_pipeline(pl->disp, stage_fds, 2))
+        goto fail;
+    if (lazy && bpf_map_update_elem(pl->mode_fd, &zero, &auto_mode, BPF_ANY)) {
+        fprintf(stderr, "Failed to set up the pipeline: %s\n", strerror(errno));
+        goto fail;
+    }
+    return 0;
+
+fail:
+    close_pipeline(pl);
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *dir = "bpf";
+    int repeat = 1000000, opt, err, failures = 0;
+    struct pipeline pl;
+    __u32 still_ns, move_ns, video_ns;
+    double rate_ns[NR_RATES];
+    size_t d, r;
+
+    while ((opt = getopt(argc, argv, "r:d:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    printf("%-10s %10s %10s %10s %10s", "design", "verified", "unchanged", "strip move", "video");
+    for (r = 0; r < NR_RATES; r++)
+        printf(" %8u Hz", position_rates[r]);
+    printf("\n%-10s %10s %10s %10s %10s", "", "insns", "ns/update", "ns/update", "ns/pkt");
+    for (r = 0; r < NR_RATES; r++)
+        printf(" %11s", "ns/pkt");
+    printf("\n");
+
+    for (d = 0; d < NR_DESIGNS; d++) {
+        if (load_pipeline(dir, designs[d].lazy, &pl)) {
+            /* Builds from before lazy_visibility still compare fan-out */
+            if (d)
+                continue;
+            return 1;
+        }
+
+        /* The first robot packet arms the sweep and, with fan-out, sets
+         * every camera's mode once */
+        err = run_robot(pl.disp_fd, &strip_positions[0], 1, &still_ns);
+        if (!err)
+            err = measure_still(pl.disp_fd, repeat, &still_ns);
+        if (!err)
+            err = measure_moves(&pl, &move_ns, &failures);
+        if (!err)
+            err = measure_video(pl.disp_fd, repeat, &video_ns);
+        for (r = 0; r < NR_RATES && !err; r++)
+            err = measure_rate(pl.disp_fd, position_rates[r], &rate_ns[r]);
+        if (err) {
+            fprintf(stderr, "Test run failed: %s\n", strerror(-err));
+            close_pipeline(&pl);
+            return 1;
+        }
+
+        printf("%-10s %10u %10u %10u %10u", designs[d].name, verified_insns(pl.stage2_fd),
+               still_ns, move_ns, video_ns);
+        for (r = 0; r < NR_RATES; r++)
+            printf(" %11.1f", rate_ns[r]);
+        printf("\n");
+        close_pipeline(&pl);
+    }
+
+    if (failures) {
+        printf("\n%d camera(s) wrong\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/bash
+#
+# Per-stage cost: ns per packet (kernel.bpf_stats_enabled run_time_ns /
+# run_cnt) and instructions per packet (bpftool prog profile) of every
+# pinned pipeline program, under 200-camera RTP traffic. Run it on two
+# builds to compare them, e.g. before and after the parse cache.
+# Testbed: see bench/testbed.sh.
+#
+# Usage: sudo ./bench/stage_cost.sh [seconds] [pps]
+
+SCRIPT_DIR=$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")" && pwd)
+cd "$SCRIPT_DIR/.."
+
+if [ "$EUID" -ne 0 ]; then
+    echo "Run with sudo"
+    exit 1
+fi
+
+DURATION=${1:-5}
+PPS=${2:-500000}
+NUM_CAMERAS=200
+PROGS="xdp_disp parser_prog stage1_prog stage2_prog"
+
+. bench/testbed.sh
+trap 'sysctl -qw kernel.bpf_stats_enabled=0; testbed_cleanup' EXIT
+
+testbed_setup
+pgset src0 "count 0"
+pgset src0 "ratep $PPS"
+pgset src0 "pkt_size 1200"
+pgset src0 "dst 10.1.1.2"
+pgset src0 "udp_dst_min 5000"
+pgset src0 "udp_dst_max $((5000 + NUM_CAMERAS - 1))"
+
+# run_cnt and run_time_ns, as "cnt ns"
+prog_stats() {
+    bpftool prog show pinned /sys/fs/bpf/$1 -j |
+        python3 -c 'import json, sys; p = json.load(sys.stdin); print(p.get("run_cnt", 0), p.get("run_time_ns", 0))'
+}
+
+sysctl -qw kernel.bpf_stats_enabled=1
+ip netns exec $SRC_NS sh -c "echo start > /proc/net/pktgen/pgctrl" &
+PG_PID=$!
+sleep 1
+
+printf "%-12s %12s %10s %12s\n" "program" "runs" "ns/pkt" "insns/pkt"
+for prog in $PROGS; do
+    [ -e /sys/fs/bpf/$prog ] || continue
+
+    read cnt0 ns0 < <(prog_stats $prog)
+    # Counts the instructions retired while the program runs
+    PROFILE=$(bpftool prog profile pinned /sys/fs/bpf/$prog duration $DURATION instructions 2>/dev/null)
+    read cnt1 ns1 < <(prog_stats $prog)
+
+    echo "$PROFILE" | awk -v name=$prog -v runs=$((cnt1 - cnt0)) -v ns=$((ns1 - ns0)) '
+        $2 == "run_cnt" { profiled = $1 }
+        $2 == "instructions" { insns = $1 }
+        END {
+            printf "%-12s %12d %10.1f %12.1f\n", name, runs,
+                   runs > 0 ? ns / runs : 0, profiled > 0 ? insns / profiled : 0
+        }'
+done
+
+pgset pgctrl "stop"
+wait $PG_PID 2>/dev/null
@@ -0,0 +1,105 @@
+#!/bin/bash
+#
+# Frame-rate steps of FILTER_TEMPORAL. Streams one H.265 camera encoded
+# with LAYERS dyadic temporal sub-layers (hierarchical B-frames) through
+# the pipeline once per camera_max_tid, from all sub-layers down to the
+# base one, and counts the frames the receiver decodes without corruption
+# (-flags -output_corrupt) and the decoder errors it logs. Each step down
+# should halve the frame rate (1/2, 1/4, 1/8 of the sent frames with 4
+# layers) with no errors.
+#
+# Usage: sudo ./bench/temporal_yield.sh [layers] [seconds]
+
+SCRIPT_DIR=$(cd -- "$(dirname -- "${BASH_SOURCE[0]}")" && pwd)
+cd "$SCRIPT_DIR/.."
+
+if [ "$EUID" -ne 0 ]; then
+    echo "Run with sudo"
+    exit 1
+fi
+
+ACTUAL_USER=${SUDO_USER:-$USER}
+LAYERS=${1:-4}
+DURATION=${2:-20}
+LOG_DIR=logs/temporal_yield
+
+cleanup() {
+    pkill -f "ffmpeg.*rtp://10.1.1.2:50" 2>/dev/null || true
+    pkill -f "ffmpeg.*udp://10.1.1.2:50" 2>/dev/null || true
+    ip link set veth1 xdp off 2>/dev/null || true
+    ip netns del testns 2>/dev/null || true
+    ip link del veth0 2>/dev/null || true
+    rm -rf /sys/fs/bpf/xdp* /sys/fs/bpf/stage* /sys/fs/bpf/parser_prog 2>/dev/null || true
+}
+
+trap cleanup EXIT
+
+# Last "frame=" count of an ffmpeg log
+frames_of() {
+    local value
+    value=$(tr '\r' '\n' < "$1" | grep -o 'frame= *[0-9]*' | tail -1 | grep -o '[0-9]*')
+    echo "${value:-0}"
+}
+
+# Testbed of start_measurement.sh, camera 0 in FILTER_TEMPORAL
+setup() {
+    cleanup
+    ip netns add testns
+    ip link add veth0 type veth peer name veth1
+    ip addr add 10.1.1.1/24 dev veth0
+    ip link set veth0 up
+    ip link set veth1 up
+
+    ./pipeline_loader -c pipeline.conf iface=veth1 > /dev/null 2>&1 || exit 1
+    python3 camera_temporal.py --cameras 0 --apply > /dev/null || exit 1
+
+    ip link set veth1 down
+    ip link set veth1 netns testns
+    ip netns exec testns ip addr add 10.1.1.2/24 dev veth1
+    ip netns exec testns ip link set veth1 up
+    ip netns exec testns ip link set lo up
+}
+
+run_tid() {
+    local max_tid=$1 sent decoded errors
+
+    python3 camera_temporal.py --cameras 0 --max-tid $max_tid > /dev/null || exit 1
+
+    ip netns exec testns ffmpeg -flags -output_corrupt -i "udp://10.1.1.2:5000" \
+        -f null - > $LOG_DIR/tid${max_tid}_receiver.log 2>&1 &
+    sleep 1
+    # keyint is a multiple of the mini-GOP, so every IRAP starts one
+    sudo -u $ACTUAL_USER ffmpeg -re -f lavfi -i testsrc=size=1280x720:rate=30 -t $DURATION \
+        -c:v libx265 -preset ultrafast \
+        -x265-params "keyint=$((4 * GOP)):min-keyint=$((4 * GOP)):scenecut=0:bframes=$((GOP - 1)):b-adapt=0:b-pyramid=1:temporal-layers=$LAYERS" \
+        -pix_fmt yuv420p -f rtp rtp://10.1.1.2:5000 \
+        > $LOG_DIR/tid${max_tid}_streamer.log 2>&1
+
+    sleep 2
+    pkill -INT -f "ffmpeg.*udp://10.1.1.2:50" 2>/dev/null || true
+    sleep 2
+
+    sent=$(frames_of $LOG_DIR/tid${max_tid}_streamer.log)
+    decoded=$(frames_of $LOG_DIR/tid${max_tid}_receiver.log)
+    errors=$(grep -ci "error\|corrupt\|missing" $LOG_DIR/tid${max_tid}_receiver.log)
+    awk -v tid=$max_tid -v top=$((LAYERS - 1)) -v sent=$sent -v decoded=$decoded -v errors=$errors \
+        'BEGIN { printf "%-8d %12d %12d %9.1f%% %9.1f%% %8d\n", tid, sent, decoded,
+                 100 / 2 ^ (top - tid), sent ? 100 * decoded / sent : 0, errors }'
+}
+
+if [ "$LAYERS" -lt 2 ] || [ "$LAYERS" -gt 5 ]; then
+    echo "layers must be 2..5"
+    exit 1
+fi
+# Mini-GOP of a dyadic hierarchy of LAYERS sub-layers
+GOP=$((1 << (LAYERS - 1)))
+
+make -s attach_ext xdp_stats pipeline_loader || exit 1
+mkdir -p $LOG_DIR
+setup
+
+echo "$LAYERS temporal layers, ${DURATION}s per camera_max_tid"
+printf "%-8s %12s %12s %10s %10s %8s\n" "max_tid" "frames sent" "decodable" "expected" "yield" "errors"
+for max_tid in $(seq $((LAYERS - 1)) -1 0); do
+    run_tid $max_tid
+done
@@ -0,0 +1,99 @@
+# Shared by the bench scripts (source it from dispatcher_version/):
+#
+#   fwd_src: src0 --pktgen--> in0 [XDP pipeline] --> out0 --> sink0 [xdp_sink] :fwd_sink
+#
+# The root namespace routes in0 -> out0, so every forward mode delivers the
+# frames to sink0, where they are counted and dropped.
+
+PIN_DIR=/sys/fs/bpf/xdp_pipeline
+SINK_PIN_DIR=/sys/fs/bpf/xdp_bench
+SRC_NS=fwd_src
+SINK_NS=fwd_sink
+
+testbed_cleanup() {
+    ip netns exec $SRC_NS sh -c "echo stop > /proc/net/pktgen/pgctrl" 2>/dev/null || true
+    ip link set in0 xdp off 2>/dev/null || true
+    ip link del in0 2>/dev/null || true
+    ip link del out0 2>/dev/null || true
+    ip netns del $SRC_NS 2>/dev/null || true
+    ip netns del $SINK_NS 2>/dev/null || true
+    rm -rf /sys/fs/bpf/xdp* /sys/fs/bpf/stage* /sys/fs/bpf/parser_prog 2>/dev/null || true
+}
+
+# 32-bit little-endian value as bpftool hex bytes
+le32() {
+    printf "%02x %02x %02x %02x" $(($1 & 0xFF)) $((($1 >> 8) & 0xFF)) \
+        $((($1 >> 16) & 0xFF)) $((($1 >> 24) & 0xFF))
+}
+
+map_set() {
+    bpftool map update pinned $PIN_DIR/$1 key hex $(le32 $2) value hex $(le32 $3)
+}
+
+pgset() {
+    ip netns exec $SRC_NS sh -c "echo '$2' > /proc/net/pktgen/$1"
+}
+
+sink_count() {
+    local value
+    value=$(./xdp_stats $SINK_PIN_DIR/sink_counters 0 2>/dev/null | awk '{print $2}')
+    echo "${value:-0}"
+}
+
+# The pipeline_loader arguments of the testbed; extra key=value arguments
+# (forward_mode=devmap, cameras=200, ...) override them
+LOADER_ARGS="-c pipeline.conf iface=in0 xdp_mode=native output_iface=out0"
+
+# Builds everything, loads the dispatcher with the parser and stage2 in
+# slots 0 and 1 (pipeline.conf) and points tx_ports / output_ifindex at
+# out0. Arguments are passed on to pipeline_loader.
+testbed_setup() {
+    testbed_cleanup
+
+    echo "Building..."
+    make -s attach_ext xdp_stats pipeline_loader bench/xdp_sink.o || exit 1
+
+    echo "Setting up testbed..."
+    ip netns add $SRC_NS
+    ip netns add $SINK_NS
+    ip link add in0 type veth peer name src0
+    ip link add out0 type veth peer name sink0
+    ip addr add 10.10.1.1/24 dev in0
+    ip addr add 10.10.2.1/24 dev out0
+    ip link set in0 up
+    ip link set out0 up
+    sysctl -qw net.ipv4.ip_forward=1
+
+    mkdir -p $PIN_DIR $SINK_PIN_DIR
+    bpftool prog load bench/xdp_sink.o /sys/fs/bpf/xdp_sink \
+        type xdp pinmaps $SINK_PIN_DIR 2>&1 | grep -v "libbpf:"
+    ip link set dev sink0 xdpdrv pinned /sys/fs/bpf/xdp_sink
+
+    ./pipeline_loader $LOADER_ARGS "$@" 2>&1 | grep -v "libbpf:"
+
+    ip link set src0 netns $SRC_NS
+    ip netns exec $SRC_NS ip addr add 10.10.1.2/24 dev src0
+    ip netns exec $SRC_NS ip link set src0 up
+    ip link set sink0 netns $SINK_NS
+    ip netns exec $SINK_NS ip addr add 10.10.2.2/24 dev sink0
+    ip netns exec $SINK_NS ip link set sink0 up
+
+    IN_MAC=$(cat /sys/class/net/in0/address)
+    SINK_MAC=$(ip netns exec $SINK_NS cat /sys/class/net/sink0/address)
+    # Redirected frames keep their ingress MACs; sink0 drops them in XDP
+    # before the stack could complain
+    ip neigh replace 10.10.2.2 lladdr $SINK_MAC dev out0
+
+    modprobe pktgen
+    pgset kpktgend_0 "rem_device_all"
+    pgset kpktgend_0 "add_device src0"
+    pgset src0 "clone_skb 0"
+    pgset src0 "delay 0"
+    pgset src0 "dst_mac $IN_MAC"
+}
+
+# Loads the pipeline again with changed load-time settings (key=value
+# arguments) on its pinned maps and swaps it in atomically
+testbed_respecialise() {
+    ./pipeline_loader -r $LOADER_ARGS "$@" 2>&1 | grep -v "libbpf:"
+}
@@ -0,0 +1,24 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+/* Counts and drops everything that reaches the sink veth. Also gives the
+ * veth peer the XDP receive queue that redirected frames need. */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, 1);
+} sink_counters SEC(".maps");
+
+SEC("xdp")
+int xdp_sink(struct xdp_md *ctx)
+{
+    __u32 key = 0;
+    __u64 *pcnt = bpf_map_lookup_elem(&sink_counters, &key);
+
+    if (pcnt)
+        *pcnt += 1;
+    return XDP_DROP;
+}
+
+char _license[] SEC("license") = "GPL";
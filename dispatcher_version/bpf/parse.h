@@ -0,0 +1,112 @@
+/* Header walk shared by the stages. The first stage that needs the
+ * headers calls pipeline_parse(); every later stage of the same packet
+ * gets the cached result from pkt_metadata (see struct pkt_parse). The
+ * parser stage (stage0_parser.c) just does this up front. */
+#ifndef PARSE_H
+#define PARSE_H
+
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <linux/in.h>
+#include <bpf/bpf_endian.h>
+
+#include "pipeline.h"
+
+/* Cached offsets beyond this are not dereferenced */
+#define PARSE_MAX_OFF 512
+
+struct rtp_hdr {
+    __u8 vpxcc;
+    __u8 mpt;
+    __be16 sequence;
+    __be32 timestamp;
+    __be32 ssrc;
+} __attribute__((packed));
+
+struct rtp_ext_hdr {
+    __be16 profile;
+    __be16 length;      /* in 32-bit words */
+} __attribute__((packed));
+
+static __always_inline void parse_packet(struct xdp_md *ctx, struct pkt_parse *p)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    __u32 off;
+
+    p->flags = PARSED_DONE;
+
+    struct ethhdr *eth = data;
+    if ((void *)(eth + 1) > data_end)
+        return;
+    if (eth->h_proto != bpf_htons(ETH_P_IP))
+        return;
+
+    struct iphdr *iph = (void *)(eth + 1);
+    if ((void *)(iph + 1) > data_end)
+        return;
+
+    p->flags |= PARSED_IPV4;
+    p->l3_off = sizeof(*eth);
+    p->ip_proto = iph->protocol;
+    p->saddr = iph->saddr;
+    p->daddr = iph->daddr;
+
+    if (iph->protocol != IPPROTO_UDP || iph->ihl < 5)
+        return;
+
+    struct udphdr *udph = (void *)iph + (iph->ihl * 4);
+    if ((void *)(udph + 1) > data_end)
+        return;
+
+    p->flags |= PARSED_UDP;
+    p->l4_off = sizeof(*eth) + iph->ihl * 4;
+    p->rtp_off = p->l4_off + sizeof(*udph);
+    p->src_port = bpf_ntohs(udph->source);
+    p->dst_port = bpf_ntohs(udph->dest);
+
+    struct rtp_hdr *rtp = (void *)(udph + 1);
+    if ((void *)(rtp + 1) > data_end)
+        return;
+
+    p->flags |= PARSED_RTP;
+    p->rtp_version = (rtp->vpxcc >> 6) & 0x03;
+    p->rtp_pt = rtp->mpt & 0x7F;
+    p->rtp_marker = rtp->mpt >> 7;
+    p->rtp_seq = bpf_ntohs(rtp->sequence);
+    p->rtp_ts = bpf_ntohl(rtp->timestamp);
+    p->rtp_ssrc = bpf_ntohl(rtp->ssrc);
+
+    off = p->rtp_off + sizeof(*rtp) + (rtp->vpxcc & 0x0F) * 4;
+    if (rtp->vpxcc & 0x10) {
+        struct rtp_ext_hdr *ext = data + (off & 0xFFFF);
+        if (off > PARSE_MAX_OFF || (void *)(ext + 1) > data_end)
+            off = PARSE_MAX_OFF + 1;
+        else
+            off += sizeof(*ext) + bpf_ntohs(ext->length) * 4;
+    }
+    p->payload_off = off > PARSE_MAX_OFF ? PARSE_MAX_OFF + 1 : off;
+}
+
+/* len bytes of packet data at a cached offset, 0 if they are not there */
+static __always_inline void *parse_ptr(struct xdp_md *ctx, __u32 off, __u32 len)
+{
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+
+    if (off > PARSE_MAX_OFF)
+        return (void *)0;
+    if (data + off + len > data_end)
+        return (void *)0;
+    return data + off;
+}
+
+static __always_inline struct pkt_parse *pipeline_parse(struct xdp_md *ctx, struct pkt_metadata *meta)
+{
+    if (!(meta->parse.flags & PARSED_DONE))
+        parse_packet(ctx, &meta->parse);
+    return &meta->parse;
+}
+
+#endif /* PARSE_H */
@@ -0,0 +1,356 @@
+/* Tail-call pipeline shared by the dispatcher and every stage.
+ *
+ * Stages are SEC("xdp") programs installed into the stage_progs slots
+ * (attach_ext <obj> slot:N ...). A pipeline is an ordered list of slots
+ * plus an enable bitmask over them (pipeline_config, see
+ * pipeline_config.py), so stages can be added, reordered or switched off
+ * without rebuilding the dispatcher. pipeline_loader can instead freeze
+ * pipeline 0's order into the programs (cfg_frozen_pipeline).
+ *
+ * A stage looks up its pkt_metadata with pipeline_meta(), leaves a
+ * routing decision in it and ends with
+ *
+ *     return pipeline_continue(ctx, meta, rc);
+ *
+ * which tail-calls the next stage or produces the final verdict. Every
+ * object that includes this header defines the maps below; the loaders
+ * reuse the dispatcher's pinned instances by name.
+ */
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "pipeline_defs.h"
+
+/* Routing decisions left in meta->routing_decision */
+#define STAGE_PASS       0  /* done, forward the packet */
+#define STAGE_DROP       1
+#define STAGE_CALL_NEXT  2  /* continue with the next enabled stage */
+#define STAGE_RETURN     3  /* go back to the stage that called this one */
+#define STAGE_JUMP       4  /* continue at position meta->jump_target */
+
+/* Loop protection for STAGE_RETURN / STAGE_JUMP. The kernel stops at 33
+ * tail calls anyway; this keeps a looping pipeline from ending in a drop. */
+#define PIPELINE_MAX_HOPS     16
+
+#define FLOW_ID_NONE 0
+
+/* Parse cache flags (bpf/parse.h) */
+#define PARSED_DONE  (1U << 0)  /* parse_packet() ran for this packet */
+#define PARSED_IPV4  (1U << 1)  /* Ethernet + IPv4 header present */
+#define PARSED_UDP   (1U << 2)  /* ... + UDP header */
+#define PARSED_RTP   (1U << 3)  /* ... + RTP fixed header */
+
+/* Header offsets and fields, parsed once per packet by the first stage
+ * that needs them. Offsets are from ctx->data, multi-byte fields are in
+ * host order except the addresses. A stage that moves the packet data
+ * (bpf_xdp_adjust_head/tail) must clear flags. */
+struct pkt_parse {
+    __u32 flags;
+    __u16 l3_off;
+    __u16 l4_off;
+    __u16 rtp_off;      /* UDP payload */
+    __u16 payload_off;  /* RTP payload, past CSRCs and header extension */
+    __u16 src_port;
+    __u16 dst_port;
+    __be32 saddr;
+    __be32 daddr;
+    __u8 ip_proto;
+    __u8 rtp_version;
+    __u8 rtp_pt;
+    __u8 rtp_marker;
+    __u16 rtp_seq;
+    __u16 pad;
+    __u32 rtp_ts;
+    __u32 rtp_ssrc;
+};
+
+struct pkt_metadata {
+    __u32 routing_decision;
+    __u32 flow_id;      /* 1 + camera of the classified flow, FLOW_ID_NONE if not */
+    __u32 egress_port;  /* tx_ports key, chosen by the stages */
+    __u32 pipeline;     /* pipeline_config key */
+    __u32 pos;          /* position of the running stage */
+    __u32 caller_pos;   /* position that handed over to it (STAGE_RETURN) */
+    __u32 jump_target;  /* position to continue at (STAGE_JUMP) */
+    __u32 hops;         /* stages run so far */
+    __u32 prof_slot;    /* stage_progs slot of the running stage */
+    __u64 prof_start;   /* dispatcher entry, 0 when profiling is off */
+    __u64 prof_stage_start;
+    struct pkt_parse parse;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PROG_ARRAY);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, PIPELINE_MAX_STAGES);
+} stage_progs SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __type(key, __u32);
+    __type(value, struct pipeline_config);
+    __uint(max_entries, PIPELINE_MAX);
+} pipeline_config SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct pkt_metadata);
+    __uint(max_entries, 1);
+} pkt_meta_map SEC(".maps");
+
+/* Per-CPU so that cores never bounce the same cache line on every packet;
+ * readers sum the slots (see xdp_stats.h). */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, PIPELINE_CNT_MAX);
+} counters SEC(".maps");
+
+/* Entries per stage_progs slot */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, __u64);
+    __uint(max_entries, PIPELINE_MAX_STAGES);
+} stage_counters SEC(".maps");
+
+/* Load-time configuration. These values change maybe once a day, so
+ * instead of map lookups on every packet they are constants: pipeline_loader
+ * writes the same values into the .rodata of the dispatcher and of every
+ * stage before loading them, and the verifier prunes the branches of the
+ * modes that are not in use (bridge mode, the other forward modes, disabled
+ * stages). Changing one means loading new programs, which
+ * pipeline_loader -r swaps in atomically; attach_ext copies them from the
+ * running dispatcher into upgraded stages. */
+const volatile __u32 cfg_bridge_mode = 0;       /* 1 = hand every packet to the peer */
+const volatile __u32 cfg_peer_ifindex = 0;      /* bridge peer, without FORWARD_DEVMAP */
+const volatile __u32 cfg_output_ifindex = 0;    /* FORWARD_REDIRECT target */
+const volatile __u32 cfg_forward_mode = FORWARD_PASS;
+/* 1 = pipeline 0 runs the stages below instead of pipeline_config[0],
+ * which pipeline_config.py then no longer changes */
+const volatile __u32 cfg_frozen_pipeline = 0;
+const volatile __u32 cfg_nr_stages = 0;
+const volatile __u32 cfg_stages_enabled = 0;
+const volatile __u32 cfg_stage_order[PIPELINE_MAX_STAGES] = {};
+
+/* Settings that do change at run time (struct pipeline_runtime) */
+volatile struct pipeline_runtime pipeline_runtime SEC(".data") = {};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_DEVMAP);
+    __type(key, __u32);
+    __type(value, __u32);
+    __uint(max_entries, TX_PORTS_MAX);
+} tx_ports SEC(".maps");
+
+static __always_inline void pipeline_count(__u32 key)
+{
+    __u64 *pcnt = bpf_map_lookup_elem(&counters, &key);
+    if (pcnt)
+        *pcnt += 1;
+}
+
+static __always_inline struct pkt_metadata *pipeline_meta(void)
+{
+    __u32 key = 0;
+    return bpf_map_lookup_elem(&pkt_meta_map, &key);
+}
+
+/* Latency profiling, toggled at run time through pipeline_runtime.prof_enabled
+ * (xdp_profile -e / -d). The dispatcher stamps meta->prof_start, every
+ * hand-off in pipeline_run stamps the stage start and the stage's
+ * pipeline_continue closes its interval; the final verdict closes the
+ * whole packet. Durations go into per-CPU log2(ns) histograms: one per
+ * stage_progs slot and one per final routing decision. With profiling off
+ * the stages only test meta->prof_start. */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __type(key, __u32);
+    __type(value, struct prof_hist);
+    __uint(max_entries, PROF_HISTS);
+} prof_hist SEC(".maps");
+
+static __always_inline __u32 prof_log2(__u64 v)
+{
+    __u32 r = 0;
+
+    if (v >> 32) { v >>= 32; r += 32; }
+    if (v >> 16) { v >>= 16; r += 16; }
+    if (v >> 8)  { v >>= 8;  r += 8; }
+    if (v >> 4)  { v >>= 4;  r += 4; }
+    if (v >> 2)  { v >>= 2;  r += 2; }
+    if (v >> 1)  { r += 1; }
+    return r;
+}
+
+static __always_inline void prof_record(__u32 hist, __u64 ns)
+{
+    struct prof_hist *h = bpf_map_lookup_elem(&prof_hist, &hist);
+    __u32 bucket = prof_log2(ns);
+
+    if (!h)
+        return;
+    if (bucket >= PROF_BUCKETS)
+        bucket = PROF_BUCKETS - 1;
+    h->buckets[bucket & (PROF_BUCKETS - 1)] += 1;
+}
+
+/* Start of the packet, in the dispatcher */
+static __always_inline void prof_begin(struct pkt_metadata *meta)
+{
+    meta->prof_start = pipeline_runtime.prof_enabled ? bpf_ktime_get_ns() : 0;
+}
+
+/* The running stage handed the packet back to the pipeline */
+static __always_inline void prof_stage_end(struct pkt_metadata *meta)
+{
+    if (meta->prof_start)
+        prof_record(PROF_HIST_STAGE + (meta->prof_slot & (PIPELINE_MAX_STAGES - 1)),
+                    bpf_ktime_get_ns() - meta->prof_stage_start);
+}
+
+/* Final verdict of the packet, returned unchanged */
+static __always_inline int prof_exit(struct pkt_metadata *meta, __u32 decision, int verdict)
+{
+    if (meta->prof_start)
+        prof_record(PROF_HIST_TOTAL + (decision & (PROF_DECISIONS - 1)),
+                    bpf_ktime_get_ns() - meta->prof_start);
+    return verdict;
+}
+
+/* Helper function to redirect packet to output interface */
+static __always_inline int redirect_to_output(struct xdp_md *ctx, struct pkt_metadata *meta)
+{
+    if (cfg_forward_mode == FORWARD_DEVMAP)
+        /* Empty slots fall back to the stack */
+        return bpf_redirect_map(&tx_ports, meta->egress_port, XDP_PASS);
+
+    if (cfg_forward_mode == FORWARD_REDIRECT && cfg_output_ifindex > 0)
+        return bpf_redirect(cfg_output_ifindex, 0);
+
+    return XDP_PASS;
+}
+
+/* First position >= pos whose slot is enabled, nr_stages if none is */
+static __always_inline __u32 pipeline_next_enabled(const struct pipeline_config *cfg, __u32 pos)
+{
+    int i;
+
+    for (i = 0; i < PIPELINE_MAX_STAGES; i++, pos++) {
+        if (pos >= cfg->nr_stages || pos >= PIPELINE_MAX_STAGES)
+            break;
+        __u32 slot = cfg->order[pos];
+        if (slot < 32 && (cfg->enabled & (1U << slot)))
+            return pos;
+    }
+    return cfg->nr_stages;
+}
+
+/* pipeline_next_enabled() over the frozen stage list */
+static __always_inline __u32 pipeline_next_frozen(__u32 pos)
+{
+    int i;
+
+    for (i = 0; i < PIPELINE_MAX_STAGES; i++, pos++) {
+        if (pos >= cfg_nr_stages || pos >= PIPELINE_MAX_STAGES)
+            break;
+        __u32 slot = cfg_stage_order[pos];
+        if (slot < 32 && (cfg_stages_enabled & (1U << slot)))
+            return pos;
+    }
+    return cfg_nr_stages;
+}
+
+/* Tail-calls the first enabled stage at or after pos. Only returns when
+ * there is none left or its slot is empty; the packet is then forwarded. */
+static __always_inline int pipeline_run(struct xdp_md *ctx, struct pkt_metadata *meta, __u32 pos)
+{
+    struct pipeline_config *cfg;
+    __u32 key = meta->pipeline;
+    __u32 slot;
+    __u64 *pcnt;
+
+    if (cfg_frozen_pipeline && !key) {
+        pos = pipeline_next_frozen(pos);
+        if (pos >= cfg_nr_stages || pos >= PIPELINE_MAX_STAGES)
+            return prof_exit(meta, meta->routing_decision, redirect_to_output(ctx, meta));
+        slot = cfg_stage_order[pos];
+    } else {
+        cfg = bpf_map_lookup_elem(&pipeline_config, &key);
+        if (!cfg)
+            return prof_exit(meta, meta->routing_decision, redirect_to_output(ctx, meta));
+
+        pos = pipeline_next_enabled(cfg, pos);
+        if (pos >= cfg->nr_stages || pos >= PIPELINE_MAX_STAGES)
+            return prof_exit(meta, meta->routing_decision, redirect_to_output(ctx, meta));
+        slot = cfg->order[pos];
+    }
+
+    if (meta->hops >= PIPELINE_MAX_HOPS) {
+        pipeline_count(PIPELINE_CNT_HOP_LIMIT);
+        return prof_exit(meta, meta->routing_decision, redirect_to_output(ctx, meta));
+    }
+    meta->hops++;
+
+    pcnt = bpf_map_lookup_elem(&stage_counters, &slot);
+    if (pcnt)
+        *pcnt += 1;
+
+    meta->caller_pos = meta->pos;
+    meta->pos = pos;
+    /* A stage that leaves the decision alone continues the pipeline */
+    meta->routing_decision = STAGE_CALL_NEXT;
+
+    if (meta->prof_start) {
+        meta->prof_slot = slot;
+        meta->prof_stage_start = bpf_ktime_get_ns();
+    }
+
+    bpf_tail_call(ctx, &stage_progs, slot);
+
+    pipeline_count(PIPELINE_CNT_EMPTY_SLOT);
+    return prof_exit(meta, meta->routing_decision, redirect_to_output(ctx, meta));
+}
+
+/* Turns a stage's return code and routing decision into the next hop */
+static __always_inline int pipeline_continue(struct xdp_md *ctx, struct pkt_metadata *meta, int rc)
+{
+    __u32 target;
+
+    if (!meta)
+        return rc;
+
+    prof_stage_end(meta);
+
+    if (rc == XDP_DROP || meta->routing_decision == STAGE_DROP)
+        return prof_exit(meta, STAGE_DROP, XDP_DROP);
+
+    /* The stage already decided where the packet goes (XDP_TX, redirect) */
+    if (rc != XDP_PASS)
+        return prof_exit(meta, meta->routing_decision, rc);
+
+    switch (meta->routing_decision) {
+    case STAGE_CALL_NEXT:
+        target = meta->pos + 1;
+        break;
+    case STAGE_RETURN:
+        target = meta->caller_pos;
+        break;
+    case STAGE_JUMP:
+        target = meta->jump_target;
+        break;
+    default:
+        /* STAGE_PASS or unknown decision, forward to output interface */
+        return prof_exit(meta, meta->routing_decision, redirect_to_output(ctx, meta));
+    }
+
+    return pipeline_run(ctx, meta, target);
+}
+
+#endif /* PIPELINE_H */
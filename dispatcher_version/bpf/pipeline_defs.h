@@ -0,0 +1,55 @@
+/* Types and constants of bpf/pipeline.h that user space needs as well:
+ * the loaders, xdp_profile and the benches include this header instead of
+ * repeating them. Nothing here may depend on BPF helpers. Include it
+ * before the skeletons, which refer to struct pipeline_runtime by name.
+ */
+#ifndef PIPELINE_DEFS_H
+#define PIPELINE_DEFS_H
+
+#include <linux/types.h>
+
+#define PIPELINE_MAX          4   /* independent pipelines (meta->pipeline) */
+#define PIPELINE_MAX_STAGES   16  /* positions per pipeline and stage_progs slots */
+
+struct pipeline_config {
+    __u32 nr_stages;                    /* valid entries of order[] */
+    __u32 enabled;                      /* bitmask over stage_progs slots */
+    __u32 order[PIPELINE_MAX_STAGES];   /* stage_progs slot per position */
+};
+
+enum {
+    PIPELINE_CNT_PACKETS = 0,
+    PIPELINE_CNT_EMPTY_SLOT,    /* tail call into a slot without a program */
+    PIPELINE_CNT_HOP_LIMIT,
+    PIPELINE_CNT_MAX
+};
+
+/* How surviving packets leave the pipeline */
+#define FORWARD_PASS      0  /* up the kernel stack */
+#define FORWARD_REDIRECT  1  /* bpf_redirect() to output_ifindex, no bulking */
+#define FORWARD_DEVMAP    2  /* bpf_redirect_map() through tx_ports, bulk flushed */
+
+/* Egress ports for FORWARD_DEVMAP, value = ifindex.
+ * Stages pick the slot through meta->egress_port (stage2 per camera). */
+#define TX_PORT_OUTPUT 0
+#define TX_PORT_PEER   1
+#define TX_PORTS_MAX   64
+
+/* Settings that do change at run time, in the dispatcher's .data (pinned as
+ * dispatcher_data next to the maps, kept across pipeline_loader -r) */
+struct pipeline_runtime {
+    __u32 prof_enabled;     /* xdp_profile -e / -d */
+};
+
+/* Latency histograms (prof_hist), see the profiling helpers in pipeline.h */
+#define PROF_BUCKETS     32     /* bucket i: [2^i, 2^(i+1)) ns, 0 also holds 0 */
+#define PROF_DECISIONS   8
+#define PROF_HIST_STAGE  0                      /* + slot */
+#define PROF_HIST_TOTAL  PIPELINE_MAX_STAGES    /* + routing decision */
+#define PROF_HISTS       (PIPELINE_MAX_STAGES + PROF_DECISIONS)
+
+struct prof_hist {
+    __u64 buckets[PROF_BUCKETS];
+};
+
+#endif /* PIPELINE_DEFS_H */
@@ -0,0 +1,19 @@
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "pipeline.h"
+#include "parse.h"
+
+/* Walks the headers once and leaves the offsets in pkt_metadata for the
+ * stages after it */
+SEC("xdp")
+int parser(struct xdp_md *ctx) {
+    struct pkt_metadata *meta = pipeline_meta();
+    if (!meta)
+        return XDP_PASS;
+    
+    pipeline_parse(ctx, meta);
+    return pipeline_continue(ctx, meta, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
@@ -1,43 +1,22 @@
 #include <linux/bpf.h>
-#include <linux/if_ether.h>
-#include <linux/ip.h>
-#include <linux/udp.h>
-#include <linux/in.h>
 #include <bpf/bpf_helpers.h>
 #include <bpf/bpf_endian.h>
 
+#include "pipeline.h"
+#include "parse.h"
+#include "video_filter_defs.h"
+
 #define RTP_PORT 6970
 #define RTP_PAYLOAD_TYPE_H265 96
-#define ROBOT_POSITION_PORT 5555
-
-
-#define NUM_CAMERAS 200
-#define NUM_HORIZONTAL_STRIPS 50
-#define NUM_VERTICAL_STRIPS 50
-
-#define COORD_MIN 0
-#define COORD_MAX 1000
-#define STRIP_WIDTH 20
-
-struct pkt_metadata {
-    __u32 stage1_visits;
-    __u32 stage2_visits;
-    __u32 routing_decision;
-    __u32 flow_id;
-};
 
+/* robot_id was added later: 8-byte packets without it are robot 0 */
 struct robot_coords_hdr {
     __be32 coord_x;
     __be32 coord_y;
+    __be32 robot_id;
 } __attribute__((packed));
 
-struct rtp_hdr {
-    __u8 vpxcc;
-    __u8 mpt;
-    __be16 sequence;
-    __be32 timestamp;
-    __be32 ssrc;
-} __attribute__((packed));
+#define ROBOT_COORDS_LEGACY_LEN 8
 
 struct h265_payload_hdr {
     __u8 byte0;
@@ -52,9 +31,32 @@ struct h265_nal_hdr {
     __be16 data;
 } __attribute__((packed));
 
-#define FILTER_OFF 0
-#define FILTER_DROP_P 1
-#define FILTER_FORWARD_P 2
+/* Set at load time (attach_ext ... lazy_visibility=1). When enabled, a
+ * robot packet only stores the robot's visible set and bumps
+ * visibility_state.epoch, and a FILTER_AUTO camera evaluates the stored
+ * sets for itself on its next video packet (see resolve_auto_mode);
+ * camera_filtering_mode entries other than FILTER_AUTO act as manual
+ * overrides. camera_robot_refs is not kept (bw_controller counts the
+ * stored sets itself). Otherwise robot packets update camera_robot_refs
+ * and rewrite the modes of the cameras whose visibility changed. */
+const volatile __u32 lazy_visibility = 0;
+
+/* Robots that stay silent this long no longer keep cameras unfiltered */
+const volatile __u64 robot_timeout_ns = 2000000000ULL;
+
+/* After a P-dropping mode ends, hold back a camera's P-slices for at most
+ * this long while waiting for the IRAP frame requested with a PLI.
+ * 0 = forward them right away and send no PLI (resyncs are still timed). */
+const volatile __u64 resync_timeout_ns = 1000000000ULL;
+
+/* Once a reference frame of a camera is damaged, by loss before us, a
+ * meter or FILTER_DROP_P, its remaining slices and every slice up to the
+ * next IRAP frame cannot be decoded. With gop_drop they are dropped
+ * instead of taking bandwidth (see gop_state). FILTER_DECIMATE's drops are
+ * deliberate and do not break the GOP: the P-frames it keeps are forwarded
+ * for the receiver to conceal, which is the 1/keep_every share of P bytes
+ * bw_controller's levels are built on. */
+const volatile __u32 gop_drop = 1;
 
 
 enum {
@@ -79,6 +81,35 @@ enum {
     STAT_WRONG_IP,
     STAT_WRONG_PORT_RANGE,
     STAT_RTP_VERSION_FAIL,
+    STAT_FRAME_STATE_RESET,
+    STAT_CAMERA_MODE_WRITES,
+    STAT_ROBOT_STATE_RACE,
+    STAT_MODE_AUTO,
+    STAT_NEW_ROBOT,
+    STAT_ROBOT_EXPIRED,
+    STAT_FLOW_STATIC,
+    STAT_FLOW_LEARNED_HIT,
+    STAT_FLOW_NEW,
+    STAT_FLOW_UNKNOWN,
+    STAT_MODE_DECIMATE,
+    STAT_DECIMATE_KEPT,
+    STAT_DECIMATE_DROPPED,
+    STAT_METER_YELLOW,
+    STAT_METER_RED,
+    STAT_METER_DROPPED,
+    STAT_RESYNC_START,
+    STAT_RESYNC_DONE,
+    STAT_RESYNC_TIMEOUT,
+    STAT_RESYNC_DROPPED,
+    STAT_PLI_SENT,
+    STAT_MODE_TEMPORAL,
+    STAT_TEMPORAL_DROPPED,
+    STAT_TEMPORAL_SWITCH_UP,
+    STAT_GOP_SEQ_GAP,
+    STAT_GOP_BROKEN,
+    STAT_GOP_FRAME_DROPPED,
+    STAT_GOP_DEPENDENT_DROPPED,
+    STAT_CAMERA_CPU_MOVED,
     STAT_MAX
 };
 
@@ -98,27 +129,249 @@ struct {
     __type(value, __u32);
 } camera_filtering_mode SEC(".maps");
 
+/* tx_ports slot (FORWARD_DEVMAP) that a camera's
+ * surviving packets leave through; 0 = the default output port */
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, __u32);
+} camera_egress SEC(".maps");
+
+/* Per-CPU: bumped several times per packet, summed by xdp_stats in user space */
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
     __uint(max_entries, STAT_MAX);
     __type(key, __u32);
     __type(value, __u64);
 } video_stats SEC(".maps");
 
+/* FU reassembly state of the frame currently in flight, per camera.
+ * Per-CPU, see camera_cpu: fragments of a frame never race with each
+ * other. A frame is identified by its RTP timestamp;
+ * a packet carrying a different timestamp means the end fragment of the
+ * previous frame was lost and the state is reset. */
+struct frame_state {
+    __u32 rtp_ts;
+    __u32 in_p_frame;
+};
+
 struct {
-    __uint(type, BPF_MAP_TYPE_ARRAY);
-    __uint(max_entries, 1);
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
     __type(key, __u32);
-    __type(value, __u32);
+    __type(value, struct frame_state);
 } p_frame_state SEC(".maps");
 
+/* FILTER_DECIMATE policy of a camera, set by camera_decimation.py. A
+ * P-frame is kept only if it passes every criterion that is set:
+ * keep_every N keeps the 1st of every N P-frames, drop_threshold drops
+ * with probability drop_threshold / 2^32, max_fps keeps at most that many
+ * P-frames per second. IRAP frames are never dropped. */
+
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
-    __uint(max_entries, 1);
+    __uint(max_entries, NUM_CAMERAS);
     __type(key, __u32);
-    __type(value, __u32);
+    __type(value, struct decimation_policy);
+} camera_decimation SEC(".maps");
+
+/* FILTER_DECIMATE verdict of the P-frame in flight, per camera. Decided on
+ * the first packet of a frame (new RTP timestamp), so every slice and FU
+ * fragment of the frame shares it. Per-CPU, see camera_cpu. */
+struct drop_state {
+    __u32 rtp_ts;
+    __u32 valid;
+    __u32 drop;
+    __u32 phase;            /* P-frames since the last one kept by keep_every */
+    __u64 window_start_ns;  /* max_fps window */
+    __u32 window_frames;
+    __u32 pad;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, struct drop_state);
 } drop_state SEC(".maps");
 
+/* FILTER_TEMPORAL: highest H.265 TemporalId a camera forwards, set at run
+ * time by camera_temporal.py. With dyadic temporal layers every step down
+ * halves the frame rate. Pictures never reference higher sub-layers, so
+ * dropping those keeps the rest decodable; the TemporalId sits in the
+ * payload header of every packet, FU fragments included. */
+#define TID_MAX 6
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, __u32);
+} camera_max_tid SEC(".maps");
+
+/* Sub-layers a camera actually forwards. A picture of a newly allowed
+ * sub-layer may reference earlier ones that were dropped, so a raised
+ * camera_max_tid only takes effect at a sub-layer switching point: a TSA
+ * picture (all layers from its own up), an STSA picture (its own layer)
+ * or an IRAP picture (everything). Lowering takes effect at once. Per-CPU,
+ * see camera_cpu. */
+struct temporal_state {
+    __u32 max_tid;
+    __u32 valid;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, struct temporal_state);
+} temporal_state SEC(".maps");
+
+/* Decodability of a camera's GOP. A frame is damaged when packets of it
+ * are lost before us (RTP sequence gap) or dropped by stage2; what is left
+ * of it is useless. A damaged reference frame breaks the GOP: every slice
+ * up to the next IRAP frame references it. Sub-layer non-reference slices
+ * (even NAL types up to 14) only take their own frame down. A gap at a
+ * frame boundary is charged to the frame whose packets are missing: the
+ * old one unless its last packet (RTP marker) arrived. Late packets are
+ * ignored, their gap has been charged already. A new SSRC or a sequence
+ * jump of more than RTP_MAX_DROPOUT (either way) restarts the sequence
+ * state like in monitor_rtp(); a new SSRC also forgets the broken GOP of
+ * the old stream. Per-CPU, see camera_cpu. */
+struct gop_state {
+    __u32 frame_ts;         /* RTP timestamp of the frame in flight */
+    __u32 broken_ts;        /* frame that broke the GOP */
+    __u32 ssrc;
+    __u16 next_seq;
+    __u8 valid;
+    __u8 frame_ended;       /* the last packet had the marker bit */
+    __u8 frame_vcl;         /* a slice of the frame was seen */
+    __u8 frame_ref;         /* ... and a reference slice */
+    __u8 frame_damaged;
+    __u8 broken;            /* dropping slices until the next IRAP frame */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, struct gop_state);
+} gop_state SEC(".maps");
+
+/* Two-rate three-colour meters (RFC 2698) on the video that survives the
+ * filtering modes: one per camera and METER_AGGREGATE for all cameras
+ * together, set by meter_config.py. Rates in bytes/s, bursts in bytes; a
+ * meter with pir 0 is off. Packets are coloured against the peak (red) and
+ * committed (yellow) buckets without consuming them; only forwarded
+ * packets take tokens. Yellow drops sub-layer non-reference slices, red
+ * drops every non-IRAP slice, IRAP slices and non-VCL NAL units always
+ * pass. Once a slice of a frame is dropped, the rest of that frame is
+ * dropped too, as it could not be decoded anyway. */
+
+struct meter_state {
+    struct bpf_spin_lock lock;
+    __u32 pad;
+    __u64 last_ns;
+    __u64 tc;               /* committed tokens, scaled */
+    __u64 tp;               /* peak tokens, scaled */
+};
+
+/* Frame of a camera that a meter started dropping, per-CPU (see
+ * camera_cpu) */
+struct meter_frame {
+    __u32 rtp_ts;
+    __u32 valid;
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, METER_MAX);
+    __type(key, __u32);
+    __type(value, struct meter_config);
+} meter_config SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, METER_MAX);
+    __type(key, __u32);
+    __type(value, struct meter_state);
+} meter_state SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, struct meter_frame);
+} meter_frame SEC(".maps");
+
+/* Per-camera traffic, lets the effect of a filtering mode be read per
+ * camera. resync_ns / resyncs is the mean time from the end of a
+ * P-dropping mode to the first IRAP frame forwarded, i.e. until the
+ * receiver can decode again. */
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, struct camera_stats);
+} camera_stats SEC(".maps");
+
+/* RTP receiver statistics of a camera's stream (RFC 3550 6.4.1 and A.1)
+ * at two points: entry camera_id counts every packet stage2 receives,
+ * RTP_MONITOR_OUT + camera_id every packet it forwards. Gaps before the
+ * verdict are loss upstream of us; the extra gaps after it are our own
+ * drops. A sequence jump of more than RTP_MAX_DROPOUT or a new SSRC
+ * restarts the sequence state, not the counters. Per-CPU: the counters
+ * are summed over the CPUs, the sequence state from jitter on is read
+ * from the camera's camera_cpu entry. */
+#define RTP_MAX_DROPOUT 3000
+#define RTP_SEQ_WINDOW 64
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, 2 * NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, struct rtp_monitor);
+} rtp_monitor SEC(".maps");
+
+/* Stream resynchronisation, per camera. While a camera is in FILTER_DROP_P
+ * or FILTER_DECIMATE its P-frames reference frames the receiver never got,
+ * so after switching back everything up to the next IRAP frame is
+ * undecodable. The first packet after a P-dropping period starts a
+ * resync: P-slices are dropped, and one of them is turned into an RTCP PLI
+ * to the camera (every RESYNC_PLI_INTERVAL_NS) so that it sends an IRAP
+ * frame now instead of at the end of its GOP. Per-CPU, see camera_cpu. */
+#define RESYNC_PLI_INTERVAL_NS 200000000ULL
+
+struct resync_state {
+    __u64 start_ns;     /* first packet after the filtered period, 0 = decodable */
+    __u64 pli_ns;       /* last PLI of this resync, 0 = none yet */
+    __u32 filtered;     /* the previous packet went through a P-dropping mode */
+    __u32 timed_out;    /* resync_timeout_ns passed, P-slices flow again */
+};
+
+struct {
+    __uint(type, BPF_MAP_TYPE_PERCPU_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, struct resync_state);
+} resync_state SEC(".maps");
+
+/* CPU that holds a camera's per-CPU flow state, + 1 (0 = none yet). The
+ * per-camera state maps are per-CPU and lock-free because RSS keeps a
+ * camera's flow on one CPU. When the flow moves (RSS rehash, changed IRQ
+ * affinity), the first packet on the new CPU copies the state over from
+ * the old one (camera_follow_cpu()). Packets of one camera spread over
+ * several CPUs at once are not supported; STAT_CAMERA_CPU_MOVED then
+ * rises with the packet rate. Readers take state fields from this CPU
+ * instead of summing them. */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, __u32);
+} camera_cpu SEC(".maps");
 
 struct {
     __uint(type, BPF_MAP_TYPE_ARRAY);
@@ -127,260 +380,1079 @@ struct {
     __type(value, __u32);
 } robot_coords_debug SEC(".maps");
 
+/* Flow -> camera classification. A UDP flow is looked up in
+ * flow_classifier (static 5-tuples, filled by flow_classifier.py), then in
+ * flow_learned. A flow found in neither is resolved through
+ * ssrc_classifier and, failing that, the built-in layout (10.1.1.2, camera
+ * = UDP port - CAMERA_PORT_BASE), and the result is learned into flow_learned, also
+ * when nothing matched (FLOW_UNKNOWN), so every later packet of the flow
+ * costs at most two lookups. flow_classifier.py flushes flow_learned
+ * whenever it changes a table. */
+#define MAX_FLOWS 16384
+#define MAX_LEARNED_FLOWS 65536
+
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_FLOWS);
+    __type(key, struct flow_key);
+    __type(value, struct flow_policy);
+} flow_classifier SEC(".maps");
+
+/* Keyed by the RTP SSRC in host order */
+struct {
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, MAX_FLOWS);
+    __type(key, __u32);
+    __type(value, struct flow_policy);
+} ssrc_classifier SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_LEARNED_FLOWS);
+    __type(key, struct flow_key);
+    __type(value, struct flow_policy);
+} flow_learned SEC(".maps");
+
+/* Optional camera geometry loaded by load_camera_geometry.py: the floor is
+ * split into cols x rows square cells of cell_size units, and every cell
+ * holds the bitmap of cameras that can see it. While enabled it replaces
+ * the built-in strip layout. */
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct grid_config);
+} grid_config SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, GRID_MAX_CELLS);
+    __type(key, __u32);
+    __type(value, struct camera_bitmap);
+} visibility_grid SEC(".maps");
+
+#define MAX_ROBOTS 1024
+#define ROBOT_SWEEP_INTERVAL_NS 100000000ULL
+#define CLOCK_MONOTONIC 1
+
+/* Per robot: its visible set (VIS_*, one word so that it moves with a
+ * single compare-and-swap), position and last report. Sized well above
+ * the fleet: the sweep removes silent robots long before LRU eviction
+ * could drop one without releasing its cameras */
+struct {
+    __uint(type, BPF_MAP_TYPE_LRU_HASH);
+    __uint(max_entries, MAX_ROBOTS);
+    __type(key, __u32);
+    __type(value, struct robot_state);
+} robot_state SEC(".maps");
+
+/* Number of live robots each camera can see; unfiltered while non-zero.
+ * Fan-out only. */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, __u32);
+} camera_robot_refs SEC(".maps");
+
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, 1);
+    __type(key, __u32);
+    __type(value, struct visibility_state);
+} visibility_state SEC(".maps");
+
+/* lazy_visibility: a camera's last evaluation, epoch << 1 | seen by a
+ * robot. One word, so other CPUs never read a torn pair. */
+struct {
+    __uint(type, BPF_MAP_TYPE_ARRAY);
+    __uint(max_entries, NUM_CAMERAS);
+    __type(key, __u32);
+    __type(value, __u64);
+} camera_auto_cache SEC(".maps");
+
 static __always_inline void inc_stat(__u32 stat_id) {
     __u64 *count = bpf_map_lookup_elem(&video_stats, &stat_id);
     if (count) {
-        __sync_fetch_and_add(count, 1);
+        *count += 1;
     }
 }
 
 
-static __always_inline __u32 camera_can_see_position(__u32 camera_id, __u32 x, __u32 y)
-{
+static __always_inline struct camera_stats *account_camera_rx(__u32 camera_id, __u64 bytes) {
+    struct camera_stats *cs = bpf_map_lookup_elem(&camera_stats, &camera_id);
+    if (cs) {
+        cs->rx_pkts += 1;
+        cs->rx_bytes += bytes;
+    }
+    return cs;
+}
 
-    if (camera_id < NUM_HORIZONTAL_STRIPS) {
-        __u32 y_min = camera_id * STRIP_WIDTH;
-        __u32 y_max = (camera_id + 1) * STRIP_WIDTH;
-        
-        if (y >= y_min && y < y_max) {
+static __always_inline void account_camera_drop(struct camera_stats *cs, __u64 bytes) {
+    if (cs) {
+        cs->dropped_pkts += 1;
+        cs->dropped_bytes += bytes;
+    }
+}
+
+
+static __always_inline void set_camera_mode(__u32 camera_id, __u32 mode) {
+    if (camera_id >= NUM_CAMERAS)
+        return;
+    bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
+    inc_stat(STAT_CAMERA_MODE_WRITES);
+}
+
+/* Cell under (x, y), GRID_NO_CELL outside the configured floor */
+static __always_inline __u32 grid_cell_of(const struct grid_config *gc, __u32 x, __u32 y) {
+    if (!gc->cell_size)
+        return GRID_NO_CELL;
+    
+    __u32 col = x / gc->cell_size;
+    __u32 row = y / gc->cell_size;
+    if (col >= gc->cols || row >= gc->rows)
+        return GRID_NO_CELL;
+    
+    __u32 cell = row * gc->cols + col;
+    return cell < GRID_MAX_CELLS ? cell : GRID_NO_CELL;
+}
+
+struct camera_view {
+    __u32 camera_id;
+    __u32 seen;
+};
+
+/* bpf_for_each_map_elem callback: does this robot's visible set hold the
+ * camera */
+static long robot_sees_camera(void *map, __u32 *robot_id, struct robot_state *rs, struct camera_view *cv) {
+    __u64 vis = rs->vis;
+    __u32 camera_id = cv->camera_id;
+    
+    if (!(vis & VIS_VALID))
+        return 0;
+    
+    if (vis & VIS_GRID) {
+        __u32 cell = vis & 0xFFFFFFFF;
+        __u32 w = camera_id / 64;
+        struct camera_bitmap *bm = bpf_map_lookup_elem(&visibility_grid, &cell);
+        if (!bm || w >= CAMERA_BITMAP_WORDS || !((bm->words[w] >> (camera_id % 64)) & 1))
             return 0;
-        }
-        return 1;
+    } else if (((vis >> 16) & 0xFFFF) != camera_id &&
+               NUM_HORIZONTAL_STRIPS + (vis & 0xFFFF) != camera_id) {
+        return 0;
     }
     
-    if (camera_id < NUM_CAMERAS) {
-        __u32 strip_index = camera_id - NUM_HORIZONTAL_STRIPS;
-        __u32 x_min = strip_index * STRIP_WIDTH;
-        __u32 x_max = (strip_index + 1) * STRIP_WIDTH;
+    cv->seen = 1;
+    return 1;
+}
+
+/* FILTER_AUTO: the camera is unfiltered while it can see a robot (and
+ * until the first robot reports). With lazy_visibility the robots' stored
+ * sets are walked once per camera after every change, later packets only
+ * read camera_auto_cache. */
+static __always_inline __u32 resolve_auto_mode(__u32 camera_id) {
+    __u32 state_key = 0;
+    struct visibility_state *vs = bpf_map_lookup_elem(&visibility_state, &state_key);
+    if (!vs || vs->robots_seen == ROBOTS_NONE)
+        return FILTER_OFF;
+    
+    if (!lazy_visibility) {
+        __u32 *refs = bpf_map_lookup_elem(&camera_robot_refs, &camera_id);
+        return refs && *refs ? FILTER_OFF : FILTER_DROP_P;
+    }
+    
+    __u64 *cache = bpf_map_lookup_elem(&camera_auto_cache, &camera_id);
+    if (!cache)
+        return FILTER_OFF;
+    
+    /* Read before the walk: a change during it makes the next packet
+     * evaluate again */
+    __u64 epoch = vs->epoch;
+    if ((*cache >> 1) != epoch) {
+        struct camera_view cv = { .camera_id = camera_id };
         
-        if (x >= x_min && x < x_max) {
-            return 0;
-        }
+        bpf_for_each_map_elem(&robot_state, robot_sees_camera, &cv, 0);
+        *cache = epoch << 1 | cv.seen;
+    }
+    return (*cache & 1) ? FILTER_OFF : FILTER_DROP_P;
+}
+
+/* lazy_visibility: makes every FILTER_AUTO camera evaluate again */
+static __always_inline void visibility_changed(void) {
+    __u32 state_key = 0;
+    struct visibility_state *vs = bpf_map_lookup_elem(&visibility_state, &state_key);
+    if (vs)
+        __sync_fetch_and_add(&vs->epoch, 1);
+}
+
+/* Compare-and-swap attempts of camera_ref() before it gives up; a camera's
+ * count is only contended by robots moving in and out of it at once */
+#define CAMERA_REF_RETRIES 16
+
+/* Adds delta (+1/-1) to the robots camera_id can see, never below 0, so
+ * other CPUs never read a wrapped count, and rewrites the camera's mode
+ * when it flips between seen and unseen. Fan-out only. */
+static __always_inline void camera_ref(__u32 camera_id, __s32 delta) {
+    if (camera_id >= NUM_CAMERAS)
+        return;
+    
+    __u32 *refs = bpf_map_lookup_elem(&camera_robot_refs, &camera_id);
+    if (!refs)
+        return;
+    
+    __u32 old = *refs;
+    for (__u32 i = 0; i < CAMERA_REF_RETRIES; i++) {
+        if (delta < 0 && old == 0)
+            return;
+        __u32 seen = __sync_val_compare_and_swap(refs, old, old + delta);
+        if (seen == old)
+            goto applied;
+        old = seen;
+    }
+    inc_stat(STAT_ROBOT_STATE_RACE);
+    return;
+    
+applied:
+    if (delta > 0 && old == 0)
+        set_camera_mode(camera_id, FILTER_OFF);
+    else if (delta < 0 && old == 1)
+        set_camera_mode(camera_id, FILTER_DROP_P);
+}
+
+/* One bitmap word of a move between two cells; GRID_NO_CELL stands for
+ * the empty set, so entering or leaving the grid is a move too */
+struct grid_walk {
+    __u32 old_cell;
+    __u32 new_cell;
+};
+
+/* bpf_loop callback, so the verifier checks the bit walk once instead of
+ * once per word. Only cameras whose bit differs between the two cells
+ * change. */
+static long grid_walk_word(__u32 w, struct grid_walk *gw) {
+    if (w >= CAMERA_BITMAP_WORDS)
         return 1;
+    
+    struct camera_bitmap *ob = bpf_map_lookup_elem(&visibility_grid, &gw->old_cell);
+    struct camera_bitmap *nb = bpf_map_lookup_elem(&visibility_grid, &gw->new_cell);
+    __u64 visible = nb ? nb->words[w] : 0;
+    __u64 changed = (ob ? ob->words[w] : 0) ^ visible;
+    
+    for (__u32 b = 0; b < 64 && changed; b++, changed >>= 1, visible >>= 1) {
+        if (changed & 1)
+            camera_ref(w * 64 + b, (visible & 1) ? 1 : -1);
     }
+    return 0;
+}
+
+static __always_inline void grid_move(__u32 old_cell, __u32 new_cell) {
+    struct grid_walk gw = { .old_cell = old_cell, .new_cell = new_cell };
     
-    return 1;
+    bpf_loop(CAMERA_BITMAP_WORDS, grid_walk_word, &gw, 0);
 }
 
-static __always_inline int process_robot_coordinates(struct xdp_md *ctx) {
-    void *data_end = (void *)(long)ctx->data_end;
-    void *data = (void *)(long)ctx->data;
+static __always_inline void vis_refs(__u64 vis, __s32 delta) {
+    if (!(vis & VIS_VALID))
+        return;
     
-    inc_stat(STAT_ROBOT_POSITION_PKTS);
+    if (vis & VIS_GRID) {
+        if (delta > 0)
+            grid_move(GRID_NO_CELL, vis & 0xFFFFFFFF);
+        else
+            grid_move(vis & 0xFFFFFFFF, GRID_NO_CELL);
+        return;
+    }
     
-    struct ethhdr *eth = data;
-    if ((void *)(eth + 1) > data_end)
-        return XDP_PASS;
+    camera_ref((vis >> 16) & 0xFFFF, delta);
+    camera_ref(NUM_HORIZONTAL_STRIPS + (vis & 0xFFFF), delta);
+}
+
+/* Moves one robot's contribution from the cameras of old_vis to those of
+ * new_vis. Cameras in both sets are left alone, so a camera seen by the
+ * robot before and after the move never flickers to filtered. */
+static __always_inline void move_visibility(__u64 old_vis, __u64 new_vis) {
+    if (old_vis == new_vis)
+        return;
     
-    if (eth->h_proto != bpf_htons(ETH_P_IP))
-        return XDP_PASS;
+    if ((old_vis & VIS_GRID) && (new_vis & VIS_GRID)) {
+        grid_move(old_vis & 0xFFFFFFFF, new_vis & 0xFFFFFFFF);
+        return;
+    }
+    
+    if ((old_vis & VIS_VALID) && (new_vis & VIS_VALID) &&
+        !(old_vis & VIS_GRID) && !(new_vis & VIS_GRID)) {
+        /* A move flips at most the old and new strip camera of each direction */
+        __u32 old_h = (old_vis >> 16) & 0xFFFF, new_h = (new_vis >> 16) & 0xFFFF;
+        __u32 old_v = old_vis & 0xFFFF, new_v = new_vis & 0xFFFF;
+        if (old_h != new_h) {
+            camera_ref(new_h, 1);
+            camera_ref(old_h, -1);
+        }
+        if (old_v != new_v) {
+            camera_ref(NUM_HORIZONTAL_STRIPS + new_v, 1);
+            camera_ref(NUM_HORIZONTAL_STRIPS + old_v, -1);
+        }
+        return;
+    }
+    
+    vis_refs(new_vis, 1);
+    vis_refs(old_vis, -1);
+}
 
-    struct iphdr *iph = (void *)(eth + 1);
-    if ((void *)(iph + 1) > data_end)
-        return XDP_PASS;
+struct sweep_ctx {
+    __u64 now;
+};
+
+static long expire_robot(void *map, __u32 *robot_id, struct robot_state *rs, struct sweep_ctx *ctx) {
+    __u64 vis = rs->vis;
     
-    if (iph->protocol != IPPROTO_UDP)
-        return XDP_PASS;
+    if (ctx->now - rs->last_seen_ns < robot_timeout_ns)
+        return 0;
     
-    struct udphdr *udph = (void *)iph + (iph->ihl * 4);
-    if ((void *)(udph + 1) > data_end)
-        return XDP_PASS;
+    if (__sync_val_compare_and_swap(&rs->vis, vis, 0) != vis)
+        return 0;
+    
+    if (lazy_visibility)
+        visibility_changed();
+    else
+        move_visibility(vis, 0);
+    bpf_map_delete_elem(map, robot_id);
+    inc_stat(STAT_ROBOT_EXPIRED);
+    return 0;
+}
+
+/* Runs every ROBOT_SWEEP_INTERVAL_NS, independent of packet arrivals */
+static int sweep_robots(void *map, __u32 *key, struct visibility_state *vs) {
+    struct sweep_ctx ctx = { .now = bpf_ktime_get_ns() };
+    
+    bpf_for_each_map_elem(&robot_state, expire_robot, &ctx, 0);
+    bpf_timer_start(&vs->sweep_timer, ROBOT_SWEEP_INTERVAL_NS, 0);
+    return 0;
+}
+
+/* bpf_loop callback of init_visibility() */
+static long init_camera_mode(__u32 camera_id, void *ctx) {
+    __u32 *refs = bpf_map_lookup_elem(&camera_robot_refs, &camera_id);
+    
+    set_camera_mode(camera_id, refs && *refs ? FILTER_OFF : FILTER_DROP_P);
+    return 0;
+}
+
+/* First robot since load, or since pipeline_loader -r: arm the sweep timer
+ * with this program's callback (and so its robot_timeout_ns) and, in
+ * fan-out mode, bring every camera in line with the reference counts once */
+static __always_inline void init_visibility(void) {
+    __u32 state_key = 0;
+    struct visibility_state *vs = bpf_map_lookup_elem(&visibility_state, &state_key);
+    if (!vs)
+        return;
+    
+    __u32 seen = vs->robots_seen;
+    if (seen != ROBOTS_SWEPT && __sync_val_compare_and_swap(&vs->robots_seen, seen, ROBOTS_SWEPT) == seen) {
+        /* -EBUSY if the loader's rewrite did not free the old timer; the
+         * callback and start below still move it to this program */
+        bpf_timer_init(&vs->sweep_timer, &visibility_state, CLOCK_MONOTONIC);
+        bpf_timer_set_callback(&vs->sweep_timer, sweep_robots);
+        bpf_timer_start(&vs->sweep_timer, ROBOT_SWEEP_INTERVAL_NS, 0);
+    }
     
-    if (bpf_ntohs(udph->dest) != ROBOT_POSITION_PORT)
+    if (lazy_visibility || vs->modes_initialised)
+        return;
+    if (__sync_val_compare_and_swap(&vs->modes_initialised, 0, 1) != 0)
+        return;
+    
+    bpf_loop(NUM_CAMERAS, init_camera_mode, 0, 0);
+}
+
+static __always_inline int process_robot_coordinates(struct xdp_md *ctx, struct pkt_parse *p) {
+    void *data_end = (void *)(long)ctx->data_end;
+    
+    inc_stat(STAT_ROBOT_POSITION_PKTS);
+    
+    if (!(p->flags & PARSED_UDP) || p->dst_port != ROBOT_POSITION_PORT)
         return XDP_PASS;
     
-    struct robot_coords_hdr *coords = (void *)(udph + 1);
-    if ((void *)(coords + 1) > data_end)
+    struct robot_coords_hdr *coords = parse_ptr(ctx, p->rtp_off, ROBOT_COORDS_LEGACY_LEN);
+    if (!coords)
         return XDP_PASS;
     
     __u32 coord_x = bpf_ntohl(coords->coord_x);
     __u32 coord_y = bpf_ntohl(coords->coord_y);
+    __u32 robot_id = 0;
+    if ((void *)(coords + 1) <= data_end)
+        robot_id = bpf_ntohl(coords->robot_id);
     
     __u32 key_x = 0, key_y = 1;
     bpf_map_update_elem(&robot_coords_debug, &key_x, &coord_x, BPF_ANY);
     bpf_map_update_elem(&robot_coords_debug, &key_y, &coord_y, BPF_ANY);
     
-    if (coord_x >= COORD_MAX || coord_y >= COORD_MAX)
+    __u32 state_key = 0;
+    __u32 cell = GRID_NO_CELL;
+    struct grid_config *gc = bpf_map_lookup_elem(&grid_config, &state_key);
+    if (gc && gc->enabled) {
+        cell = grid_cell_of(gc, coord_x, coord_y);
+        if (cell == GRID_NO_CELL)
+            return XDP_PASS;
+    } else if (coord_x >= COORD_MAX || coord_y >= COORD_MAX) {
         return XDP_PASS;
+    }
     
+    __u64 new_vis;
+    if (cell != GRID_NO_CELL)
+        new_vis = VIS_VALID | VIS_GRID | cell;
+    else
+        new_vis = VIS_VALID | ((__u64)(coord_y / STRIP_WIDTH) << 16) | (coord_x / STRIP_WIDTH);
     
-    __u32 camera_id;
-    __u32 mode;
-    
-    // Cameras 0-9
-    camera_id = 0; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 1; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 2; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 3; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 4; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 5; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 6; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 7; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 8; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 9; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 10-19
-    camera_id = 10; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 11; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 12; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 13; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 14; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 15; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 16; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 17; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 18; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 19; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 20-29
-    camera_id = 20; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 21; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 22; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 23; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 24; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 25; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 26; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 27; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 28; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 29; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 30-39
-    camera_id = 30; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 31; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 32; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 33; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 34; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 35; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 36; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 37; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 38; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 39; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 40-49
-    camera_id = 40; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 41; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 42; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 43; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 44; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 45; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 46; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 47; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 48; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 49; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 50-59
-    camera_id = 50; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 51; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 52; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 53; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 54; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 55; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 56; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 57; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 58; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 59; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 60-69
-    camera_id = 60; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 61; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 62; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 63; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 64; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 65; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 66; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 67; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 68; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 69; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 70-79
-    camera_id = 70; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 71; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 72; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 73; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 74; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 75; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 76; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 77; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 78; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 79; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 80-89
-    camera_id = 80; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 81; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 82; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 83; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 84; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 85; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 86; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 87; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 88; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 89; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    
-    // Cameras 90-99
-    camera_id = 90; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 91; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 92; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 93; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 94; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 95; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 96; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 97; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 98; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
-    camera_id = 99; mode = camera_can_see_position(camera_id, coord_x, coord_y); bpf_map_update_elem(&camera_filtering_mode, &camera_id, &mode, BPF_ANY);
+    struct robot_state *rs = bpf_map_lookup_elem(&robot_state, &robot_id);
+    if (!rs) {
+        struct robot_state fresh = {};
+        bpf_map_update_elem(&robot_state, &robot_id, &fresh, BPF_NOEXIST);
+        rs = bpf_map_lookup_elem(&robot_state, &robot_id);
+        if (!rs) {
+            inc_stat(STAT_MAP_LOOKUP_FAILED);
+            return XDP_PASS;
+        }
+        inc_stat(STAT_NEW_ROBOT);
+    }
+    
+    rs->pos = ((__u64)coord_x << 32) | coord_y;
+    rs->last_seen_ns = bpf_ktime_get_ns();
+    rs->seq += 1;
     
+    __u64 old_vis = rs->vis;
+    if (old_vis != new_vis) {
+        /* Only the CPU that moves the state forward applies the difference */
+        if (__sync_val_compare_and_swap(&rs->vis, old_vis, new_vis) != old_vis) {
+            inc_stat(STAT_ROBOT_STATE_RACE);
+            return XDP_PASS;
+        }
+        if (lazy_visibility)
+            visibility_changed();
+        else
+            move_visibility(old_vis, new_vis);
+    }
+    
+    init_visibility();
     inc_stat(STAT_ROBOT_COORDS_UPDATED);
     
     return XDP_PASS;
 }
 
-static __always_inline int process_video_filter(struct xdp_md *ctx, struct pkt_metadata *meta) {
+/* Arrival time in the 90 kHz RTP clock of H.265 (RFC 7798) */
+static __always_inline __u32 rtp_arrival(void) {
+    return bpf_ktime_get_ns() * 9 / 100000;
+}
+
+/* One packet at monitoring point index, arrival as from rtp_arrival() */
+static __always_inline void monitor_rtp(__u32 index, struct pkt_parse *p, __u32 arrival) {
+    struct rtp_monitor *m = bpf_map_lookup_elem(&rtp_monitor, &index);
+    if (!m)
+        return;
+    
+    __u32 transit = arrival - p->rtp_ts;
+    if (!m->received || m->ssrc != p->rtp_ssrc) {
+        m->ssrc = p->rtp_ssrc;
+        m->transit = transit;
+        goto restart;
+    }
+    
+    /* J += (|D| - J) / 16, kept as 16 * J (RFC 3550 A.8) */
+    __s32 d = (__s32)(transit - (__u32)m->transit);
+    m->transit = transit;
+    if (d < 0)
+        d = -d;
+    m->jitter += d - ((m->jitter + 8) >> 4);
+    
+    __s16 delta = (__s16)(p->rtp_seq - (__u16)m->max_seq);
+    if (delta > RTP_MAX_DROPOUT || delta < -RTP_MAX_DROPOUT)
+        goto restart;
+    
+    if (delta > 0) {
+        m->max_seq += delta;
+        m->seen = delta < RTP_SEQ_WINDOW ? (m->seen << delta) | 1 : 1;
+        m->expected += delta;
+        m->received += 1;
+    } else if (delta > -RTP_SEQ_WINDOW) {
+        __u64 bit = 1ULL << -delta;
+        if (m->seen & bit) {
+            m->duplicates += 1;
+        } else {
+            m->seen |= bit;
+            m->reordered += 1;
+            m->received += 1;
+        }
+    } else {
+        m->reordered += 1;
+        m->received += 1;
+    }
+    return;
+    
+restart:
+    m->max_seq = (m->max_seq & ~0xFFFFULL) | p->rtp_seq;
+    m->seen = 1;
+    m->expected += 1;
+    m->received += 1;
+}
+
+/* Copies the sequence state of rtp_monitor entry index from cpu; the
+ * counters stay where they were counted */
+static __always_inline void monitor_migrate(__u32 index, __u32 cpu) {
+    struct rtp_monitor *from = bpf_map_lookup_percpu_elem(&rtp_monitor, &index, cpu);
+    struct rtp_monitor *to = bpf_map_lookup_elem(&rtp_monitor, &index);
+    if (!from || !to)
+        return;
+    
+    to->jitter = from->jitter;
+    to->max_seq = from->max_seq;
+    to->seen = from->seen;
+    to->transit = from->transit;
+    to->ssrc = from->ssrc;
+}
+
+#define MIGRATE_STATE(map, key, cpu) do {                                   \
+        void *from_ = bpf_map_lookup_percpu_elem(&map, key, cpu);           \
+        void *to_ = bpf_map_lookup_elem(&map, key);                         \
+        if (from_ && to_)                                                   \
+            __builtin_memcpy(to_, from_, sizeof(*map.value));              \
+    } while (0)
+
+/* Makes this CPU the owner of the camera's flow state, see camera_cpu */
+static __always_inline void camera_follow_cpu(__u32 camera_id) {
+    __u32 *owner = bpf_map_lookup_elem(&camera_cpu, &camera_id);
+    __u32 cpu = bpf_get_smp_processor_id();
+    if (!owner || *owner == cpu + 1)
+        return;
+    
+    __u32 old = *owner;
+    *owner = cpu + 1;
+    if (!old)
+        return;
+    
+    inc_stat(STAT_CAMERA_CPU_MOVED);
+    MIGRATE_STATE(p_frame_state, &camera_id, old - 1);
+    MIGRATE_STATE(drop_state, &camera_id, old - 1);
+    MIGRATE_STATE(temporal_state, &camera_id, old - 1);
+    MIGRATE_STATE(gop_state, &camera_id, old - 1);
+    MIGRATE_STATE(meter_frame, &camera_id, old - 1);
+    MIGRATE_STATE(resync_state, &camera_id, old - 1);
+    monitor_migrate(camera_id, old - 1);
+    monitor_migrate(RTP_MONITOR_OUT + camera_id, old - 1);
+}
+
+/* NAL unit type of an H.265 RTP packet or, for FU fragments, the type in
+ * the FU header; 0xFF if the payload is too short */
+static __always_inline __u8 rtp_nal_type(struct xdp_md *ctx, struct pkt_parse *p) {
+    struct h265_payload_hdr *ph = parse_ptr(ctx, p->payload_off, sizeof(*ph) + sizeof(struct h265_fu_hdr));
+    if (!ph)
+        return 0xFF;
+    
+    __u8 nal_type = (ph->byte0 >> 1) & 0x3F;
+    if (nal_type == 49) {
+        struct h265_fu_hdr *fu = (void *)(ph + 1);
+        nal_type = fu->s_e_r_type & 0x3F;
+    }
+    return nal_type;
+}
+
+#define METER_PRIO_DISCARDABLE 0   /* sub-layer non-reference slice */
+#define METER_PRIO_P           1   /* other non-IRAP slice */
+#define METER_PRIO_PROTECTED   2   /* IRAP slice, non-VCL, unparsable */
+
+/* Meter priority of an H.265 RTP packet of NAL type nal_type */
+static __always_inline __u32 meter_prio(__u8 nal_type) {
+    if (nal_type > 9)
+        return METER_PRIO_PROTECTED;
+    return nal_type & 1 ? METER_PRIO_P : METER_PRIO_DISCARDABLE;
+}
+
+/* 1 if meter index drops a packet of len bytes and priority prio */
+static __always_inline int meter_drop(__u32 index, __u64 len, __u32 prio) {
+    struct meter_config *mc = bpf_map_lookup_elem(&meter_config, &index);
+    if (!mc || !mc->pir)
+        return 0;
+    
+    struct meter_state *ms = bpf_map_lookup_elem(&meter_state, &index);
+    if (!ms)
+        return 0;
+    
+    __u64 cir = mc->cir, cbs = mc->cbs, pir = mc->pir, pbs = mc->pbs;
+    if (cir > METER_MAX_TOKENS)
+        cir = METER_MAX_TOKENS;
+    if (pir > METER_MAX_TOKENS)
+        pir = METER_MAX_TOKENS;
+    if (cbs > METER_MAX_TOKENS)
+        cbs = METER_MAX_TOKENS;
+    if (pbs > METER_MAX_TOKENS)
+        pbs = METER_MAX_TOKENS;
+    cbs *= METER_SCALE;
+    pbs *= METER_SCALE;
+    __u64 now = bpf_ktime_get_ns();
+    __u64 cost = len * METER_SCALE;
+    int drop = 0, red = 0, yellow = 0;
+    
+    bpf_spin_lock(&ms->lock);
+    
+    __u64 elapsed = now - ms->last_ns;
+    if (elapsed > 1000000000ULL)
+        elapsed = 1000000000ULL;
+    ms->last_ns = now;
+    /* elapsed is in ns, so elapsed * rate is already bytes * METER_SCALE */
+    ms->tc += elapsed * cir;
+    if (ms->tc > cbs)
+        ms->tc = cbs;
+    ms->tp += elapsed * pir;
+    if (ms->tp > pbs)
+        ms->tp = pbs;
+    
+    if (ms->tp < cost) {
+        red = 1;
+        drop = prio != METER_PRIO_PROTECTED;
+    } else if (ms->tc < cost) {
+        yellow = 1;
+        drop = prio == METER_PRIO_DISCARDABLE;
+    }
+    
+    if (!drop) {
+        ms->tp = ms->tp > cost ? ms->tp - cost : 0;
+        if (!red && !yellow)
+            ms->tc -= cost;
+    }
+    
+    bpf_spin_unlock(&ms->lock);
+    
+    if (red)
+        inc_stat(STAT_METER_RED);
+    else if (yellow)
+        inc_stat(STAT_METER_YELLOW);
+    return drop;
+}
+
+static __always_inline void gop_damage(struct gop_state *gs) {
+    gs->frame_damaged = 1;
+    if ((gs->frame_ref || !gs->frame_vcl) && !gs->broken) {
+        gs->broken = 1;
+        gs->broken_ts = gs->frame_ts;
+        inc_stat(STAT_GOP_BROKEN);
+    }
+}
+
+/* Every RTP packet of a camera, before any verdict: follows its frames
+ * and sequence numbers */
+static __always_inline void gop_track(__u32 camera_id, struct pkt_parse *p, __u8 nal_type) {
+    if (!gop_drop)
+        return;
+    
+    struct gop_state *gs = bpf_map_lookup_elem(&gop_state, &camera_id);
+    if (!gs)
+        return;
+    
+    if (gs->valid && gs->ssrc != p->rtp_ssrc) {
+        gs->valid = 0;
+        gs->broken = 0;
+    }
+    if (gs->valid) {
+        __s16 delta = (__s16)(p->rtp_seq - gs->next_seq);
+        if (delta > RTP_MAX_DROPOUT || delta < -RTP_MAX_DROPOUT)
+            gs->valid = 0;
+        else if (delta < 0)
+            return;
+    }
+    
+    int gap = gs->valid && p->rtp_seq != gs->next_seq;
+    int new_frame = !gs->valid || p->rtp_ts != gs->frame_ts, ended = gs->frame_ended;
+    gs->valid = 1;
+    gs->ssrc = p->rtp_ssrc;
+    gs->next_seq = p->rtp_seq + 1;
+    
+    if (gap) {
+        inc_stat(STAT_GOP_SEQ_GAP);
+        if (!new_frame || !ended)
+            gop_damage(gs);
+    }
+    if (new_frame) {
+        gs->frame_ts = p->rtp_ts;
+        gs->frame_vcl = 0;
+        gs->frame_ref = 0;
+        gs->frame_damaged = 0;
+    }
+    gs->frame_ended = p->rtp_marker;
+    
+    if (nal_type < 32) {
+        gs->frame_vcl = 1;
+        if (nal_type >= 16 || (nal_type & 1))
+            gs->frame_ref = 1;
+        if (nal_type >= 16 && nal_type <= 21 && gs->broken && p->rtp_ts != gs->broken_ts)
+            gs->broken = 0;
+    }
+    
+    /* The lost packets started this frame */
+    if (gap && new_frame && ended)
+        gop_damage(gs);
+}
+
+/* A slice of the camera's frame in flight was dropped by stage2 */
+static __always_inline void gop_dropped(__u32 camera_id) {
+    if (!gop_drop)
+        return;
+    
+    struct gop_state *gs = bpf_map_lookup_elem(&gop_state, &camera_id);
+    if (gs)
+        gop_damage(gs);
+}
+
+/* Drop reason (STAT_GOP_*) of a slice the receiver could not decode, 0 to
+ * forward it. Parameter sets and SEI are kept for the next IRAP frame. */
+static __always_inline __u32 gop_useless(__u32 camera_id, struct pkt_parse *p, __u8 nal_type) {
+    if (!gop_drop || nal_type > 31)
+        return 0;
+    
+    struct gop_state *gs = bpf_map_lookup_elem(&gop_state, &camera_id);
+    if (!gs)
+        return 0;
+    if (gs->frame_damaged && gs->frame_ts == p->rtp_ts)
+        return STAT_GOP_FRAME_DROPPED;
+    if (gs->broken)
+        return STAT_GOP_DEPENDENT_DROPPED;
+    return 0;
+}
+
+/* Last step of a camera's packet that the filtering mode keeps: slices
+ * of a damaged GOP are dropped, the rest goes through the camera meter,
+ * then the aggregate one. A packet the aggregate meter drops has already
+ * taken tokens from its camera's meter. arrival is for monitor_rtp(). */
+static __always_inline int forward_video(struct xdp_md *ctx, struct pkt_parse *p, __u32 camera_id,
+                                         struct camera_stats *cs, __u64 pkt_len, __u32 arrival) {
+    __u8 nal_type = rtp_nal_type(ctx, p);
+    __u32 prio = meter_prio(nal_type);
+    __u32 reason = gop_useless(camera_id, p, nal_type);
+    
+    if (reason) {
+        inc_stat(reason);
+        inc_stat(STAT_DROPPED);
+        account_camera_drop(cs, pkt_len);
+        return XDP_DROP;
+    }
+    
+    struct meter_frame *mf = bpf_map_lookup_elem(&meter_frame, &camera_id);
+    int drop;
+    
+    if (prio != METER_PRIO_PROTECTED && mf && mf->valid && mf->rtp_ts == p->rtp_ts) {
+        drop = 1;
+    } else {
+        drop = meter_drop(camera_id, pkt_len, prio) || meter_drop(METER_AGGREGATE, pkt_len, prio);
+        if (drop && mf) {
+            mf->rtp_ts = p->rtp_ts;
+            mf->valid = 1;
+        }
+    }
+    
+    if (drop) {
+        gop_dropped(camera_id);
+        inc_stat(STAT_METER_DROPPED);
+        inc_stat(STAT_DROPPED);
+        account_camera_drop(cs, pkt_len);
+        return XDP_DROP;
+    }
+    
+    monitor_rtp(RTP_MONITOR_OUT + camera_id, p, arrival);
+    inc_stat(STAT_FORWARDED);
+    return XDP_PASS;
+}
+
+/* RTCP receiver report without report blocks followed by a Picture Loss
+ * Indication (RFC 4585 6.3.1): the shortest compound RTCP packet */
+struct rtcp_pli {
+    __u8 rr_vrc;            /* V=2, RC=0 */
+    __u8 rr_pt;             /* 201 */
+    __be16 rr_len;          /* in 32-bit words - 1 */
+    __be32 rr_ssrc;
+    __u8 pli_vfmt;          /* V=2, FMT=1 */
+    __u8 pli_pt;            /* 206, payload-specific feedback */
+    __be16 pli_len;
+    __be32 pli_ssrc;        /* sender of the feedback */
+    __be32 media_ssrc;      /* the camera */
+} __attribute__((packed));
+
+#define PLI_PKT_LEN (sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + \
+                     sizeof(struct rtcp_pli))
+
+/* Turns the packet, a slice that is dropped anyway, into a PLI from the
+ * receiver's RTCP port to the camera's and leaves it ready for XDP_TX,
+ * which sends it back to the camera. RTCP runs on the RTP ports + 1 (no
+ * rtcp-mux). Returns non-zero if the packet cannot be rewritten. */
+static __always_inline int make_pli(struct xdp_md *ctx, struct pkt_parse *p) {
     void *data_end = (void *)(long)ctx->data_end;
     void *data = (void *)(long)ctx->data;
     
-    inc_stat(STAT_TOTAL_PKTS);
+    /* No IP options, so the headers sit at fixed offsets */
+    if (p->l4_off != sizeof(struct ethhdr) + sizeof(struct iphdr))
+        return -1;
+    if (bpf_xdp_adjust_tail(ctx, (int)PLI_PKT_LEN - (int)(data_end - data)))
+        return -1;
     
+    data_end = (void *)(long)ctx->data_end;
+    data = (void *)(long)ctx->data;
     struct ethhdr *eth = data;
-    if ((void *)(eth + 1) > data_end) {
-        inc_stat(STAT_FORWARDED);
-        return XDP_PASS;
+    struct iphdr *iph = (void *)(eth + 1);
+    struct udphdr *udph = (void *)(iph + 1);
+    struct rtcp_pli *pli = (void *)(udph + 1);
+    if ((void *)(pli + 1) > data_end)
+        return -1;
+    
+    __u8 mac[ETH_ALEN];
+    __builtin_memcpy(mac, eth->h_source, ETH_ALEN);
+    __builtin_memcpy(eth->h_source, eth->h_dest, ETH_ALEN);
+    __builtin_memcpy(eth->h_dest, mac, ETH_ALEN);
+    
+    iph->tot_len = bpf_htons(PLI_PKT_LEN - sizeof(*eth));
+    iph->id = 0;
+    iph->frag_off = bpf_htons(0x4000);     /* DF */
+    iph->ttl = 64;
+    iph->saddr = p->daddr;
+    iph->daddr = p->saddr;
+    iph->check = 0;
+    
+    __u16 *word = (void *)iph;
+    __u32 csum = 0;
+    for (int i = 0; i < sizeof(*iph) / 2; i++)
+        csum += word[i];
+    csum = (csum & 0xFFFF) + (csum >> 16);
+    csum = (csum & 0xFFFF) + (csum >> 16);
+    iph->check = ~csum;
+    
+    udph->source = bpf_htons(p->dst_port + 1);
+    udph->dest = bpf_htons(p->src_port + 1);
+    udph->len = bpf_htons(sizeof(*udph) + sizeof(*pli));
+    udph->check = 0;
+    
+    /* The receiver's address doubles as its RTCP SSRC */
+    pli->rr_vrc = 0x80;
+    pli->rr_pt = 201;
+    pli->rr_len = bpf_htons(1);
+    pli->rr_ssrc = p->daddr;
+    pli->pli_vfmt = 0x81;
+    pli->pli_pt = 206;
+    pli->pli_len = bpf_htons(2);
+    pli->pli_ssrc = p->daddr;
+    pli->media_ssrc = bpf_htonl(p->rtp_ssrc);
+    return 0;
+}
+
+/* Every packet of a camera outside a P-dropping mode. Returns XDP_PASS to
+ * let the filtering continue, otherwise the packet's verdict. */
+static __always_inline int resync_video(struct xdp_md *ctx, struct pkt_parse *p, struct resync_state *rs,
+                                        struct camera_stats *cs, __u64 pkt_len) {
+    if (rs->filtered) {
+        rs->filtered = 0;
+        rs->start_ns = bpf_ktime_get_ns();
+        rs->pli_ns = 0;
+        rs->timed_out = 0;
+        inc_stat(STAT_RESYNC_START);
     }
+    if (!rs->start_ns)
+        return XDP_PASS;
     
-    if (eth->h_proto != bpf_htons(ETH_P_IP)) {
-        inc_stat(STAT_FORWARDED);
+    __u8 nal_type = rtp_nal_type(ctx, p);
+    __u64 now;
+    
+    if (nal_type >= 16 && nal_type <= 21) {
+        now = bpf_ktime_get_ns();
+        if (cs) {
+            cs->resyncs += 1;
+            cs->resync_ns += now - rs->start_ns;
+        }
+        rs->start_ns = 0;
+        inc_stat(STAT_RESYNC_DONE);
         return XDP_PASS;
     }
     
-    struct iphdr *iph = (void *)(eth + 1);
-    if ((void *)(iph + 1) > data_end) {
-        inc_stat(STAT_FORWARDED);
+    /* Parameter sets and SEI are needed to decode the IRAP frame */
+    if (nal_type > 9 || !resync_timeout_ns || rs->timed_out)
         return XDP_PASS;
-    }
     
-    if (iph->protocol != IPPROTO_UDP) {
-        inc_stat(STAT_FORWARDED);
+    now = bpf_ktime_get_ns();
+    if (now - rs->start_ns >= resync_timeout_ns) {
+        rs->timed_out = 1;
+        inc_stat(STAT_RESYNC_TIMEOUT);
         return XDP_PASS;
     }
     
-    inc_stat(STAT_UDP_PACKETS);
+    inc_stat(STAT_RESYNC_DROPPED);
+    inc_stat(STAT_DROPPED);
+    account_camera_drop(cs, pkt_len);
     
-    if (iph->daddr != bpf_htonl(0x0A010102)) {  // 10.1.1.2
+    if ((!rs->pli_ns || now - rs->pli_ns >= RESYNC_PLI_INTERVAL_NS) && !make_pli(ctx, p)) {
+        rs->pli_ns = now;
+        if (cs)
+            cs->plis_sent += 1;
+        inc_stat(STAT_PLI_SENT);
+        return XDP_TX;
+    }
+    return XDP_DROP;
+}
+
+/* FILTER_TEMPORAL: 1 if a packet of sub-layer tid with NAL type nal_type
+ * (for FU fragments the fragmented unit's) is dropped */
+static __always_inline int temporal_drop(__u32 camera_id, __u32 tid, __u8 nal_type) {
+    __u32 *limit = bpf_map_lookup_elem(&camera_max_tid, &camera_id);
+    struct temporal_state *ts = bpf_map_lookup_elem(&temporal_state, &camera_id);
+    if (!limit || !ts) {
+        inc_stat(STAT_MAP_LOOKUP_FAILED);
+        return 0;
+    }
+    
+    __u32 target = *limit < TID_MAX ? *limit : TID_MAX;
+    if (!ts->valid || target < ts->max_tid) {
+        ts->max_tid = target;
+        ts->valid = 1;
+    }
+    
+    /* An IRAP picture (TemporalId 0) resets every reference, all layers
+     * up to the target are decodable from it on */
+    if (nal_type >= 16 && nal_type <= 21 && ts->max_tid < target) {
+        ts->max_tid = target;
+        inc_stat(STAT_TEMPORAL_SWITCH_UP);
+    }
+    
+    if (tid <= ts->max_tid)
+        return 0;
+    if (tid > target)
+        return 1;
+    
+    /* Up-switch, tid is one of the layers being added. Both switching
+     * points only make tid decodable if tid - 1 is already forwarded; a
+     * TSA also covers every layer above it. */
+    if (tid != ts->max_tid + 1)
+        return 1;
+    if (nal_type == 2 || nal_type == 3)                   /* TSA */
+        ts->max_tid = target;
+    else if (nal_type == 4 || nal_type == 5)              /* STSA */
+        ts->max_tid = tid;
+    else
+        return 1;
+    inc_stat(STAT_TEMPORAL_SWITCH_UP);
+    return 0;
+}
+
+/* FILTER_DECIMATE: 1 if the P-frame with this RTP timestamp is dropped */
+static __always_inline int decimate_frame(__u32 camera_id, __u32 rtp_ts) {
+    struct decimation_policy *dp = bpf_map_lookup_elem(&camera_decimation, &camera_id);
+    struct drop_state *ds = bpf_map_lookup_elem(&drop_state, &camera_id);
+    if (!dp || !ds) {
+        inc_stat(STAT_MAP_LOOKUP_FAILED);
+        return 0;
+    }
+    
+    if (ds->valid && ds->rtp_ts == rtp_ts)
+        return ds->drop;
+    
+    __u32 drop = 0;
+    
+    if (dp->keep_every > 1) {
+        drop = ds->phase != 0;
+        ds->phase = ds->phase + 1 >= dp->keep_every ? 0 : ds->phase + 1;
+    }
+    
+    if (!drop && dp->drop_threshold && bpf_get_prandom_u32() < dp->drop_threshold)
+        drop = 1;
+    
+    if (!drop && dp->max_fps) {
+        __u64 now = bpf_ktime_get_ns();
+        if (now - ds->window_start_ns >= 1000000000ULL) {
+            ds->window_start_ns = now;
+            ds->window_frames = 0;
+        }
+        if (ds->window_frames >= dp->max_fps)
+            drop = 1;
+        else
+            ds->window_frames += 1;
+    }
+    
+    ds->rtp_ts = rtp_ts;
+    ds->valid = 1;
+    ds->drop = drop;
+    inc_stat(drop ? STAT_DECIMATE_DROPPED : STAT_DECIMATE_KEPT);
+    return drop;
+}
+
+static __always_inline void classify_flow(struct pkt_parse *p, struct flow_policy *out) {
+    struct flow_key key = {
+        .saddr = p->saddr,
+        .daddr = p->daddr,
+        .sport = p->src_port,
+        .dport = p->dst_port,
+        .proto = p->ip_proto,
+    };
+    
+    struct flow_policy *fp = bpf_map_lookup_elem(&flow_classifier, &key);
+    if (fp) {
+        inc_stat(STAT_FLOW_STATIC);
+        *out = *fp;
+        return;
+    }
+    
+    fp = bpf_map_lookup_elem(&flow_learned, &key);
+    if (fp) {
+        inc_stat(STAT_FLOW_LEARNED_HIT);
+        *out = *fp;
+        return;
+    }
+    
+    inc_stat(STAT_FLOW_NEW);
+    out->camera_id = 0;
+    out->mode = FILTER_OFF;
+    out->flags = FLOW_LEARNED;
+    
+    if ((p->flags & PARSED_RTP) && p->rtp_version == 2) {
+        __u32 ssrc = p->rtp_ssrc;
+        fp = bpf_map_lookup_elem(&ssrc_classifier, &ssrc);
+    }
+    
+    if (fp) {
+        out->camera_id = fp->camera_id;
+        out->mode = fp->mode;
+        out->flags |= fp->flags & (FLOW_MODE_SET | FLOW_BYPASS);
+    } else if (p->daddr != bpf_htonl(0x0A010102)) {  // 10.1.1.2
         inc_stat(STAT_WRONG_IP);
+        out->flags |= FLOW_UNKNOWN;
+    } else if (p->dst_port < CAMERA_PORT_BASE || p->dst_port >= CAMERA_PORT_BASE + CAMERA_PORTS) {
+        inc_stat(STAT_WRONG_PORT_RANGE);
+        out->flags |= FLOW_UNKNOWN;
+    } else {
+        out->camera_id = p->dst_port - CAMERA_PORT_BASE;
+    }
+    
+    bpf_map_update_elem(&flow_learned, &key, out, BPF_ANY);
+}
+
+static __always_inline int process_video_filter(struct xdp_md *ctx, struct pkt_metadata *meta,
+                                                struct pkt_parse *p) {
+    void *data_end = (void *)(long)ctx->data_end;
+    void *data = (void *)(long)ctx->data;
+    
+    inc_stat(STAT_TOTAL_PKTS);
+    
+    if (!(p->flags & PARSED_IPV4) || p->ip_proto != IPPROTO_UDP) {
         inc_stat(STAT_FORWARDED);
         return XDP_PASS;
     }
     
-    struct udphdr *udph = (void *)iph + (iph->ihl * 4);
-    if ((void *)(udph + 1) > data_end)
+    inc_stat(STAT_UDP_PACKETS);
+    
+    if (!(p->flags & PARSED_UDP))
         return XDP_PASS;
     
-
-    __u32 dst_port = bpf_ntohs(udph->dest);
-    if (dst_port < 5000 || dst_port >= 5000 + NUM_CAMERAS) {
-        inc_stat(STAT_WRONG_PORT_RANGE);
+    struct flow_policy policy;
+    classify_flow(p, &policy);
+    if (policy.flags & (FLOW_UNKNOWN | FLOW_BYPASS)) {
+        if (policy.flags & FLOW_UNKNOWN)
+            inc_stat(STAT_FLOW_UNKNOWN);
         inc_stat(STAT_FORWARDED);
         return XDP_PASS;
     }
     
-    __u32 camera_id = dst_port - 5000;
+    __u32 camera_id = policy.camera_id;
     
     if (camera_id >= NUM_CAMERAS) {
         inc_stat(STAT_CAMERA_OUT_OF_RANGE);
@@ -388,22 +1460,35 @@ static __always_inline int process_video_filter(struct xdp_md *ctx, struct pkt_m
         return XDP_PASS;
     }
     
-    struct rtp_hdr *rtp = (void *)(udph + 1);
-    if ((void *)(rtp + 1) > data_end)
+    meta->flow_id = camera_id + 1;
+    
+    if (!(p->flags & PARSED_RTP))
         return XDP_PASS;
     
-    __u8 version = (rtp->vpxcc >> 6) & 0x03;
-    if (version != 2) {
+    if (p->rtp_version != 2) {
         inc_stat(STAT_RTP_VERSION_FAIL);
         return XDP_PASS;
     }
     
     inc_stat(STAT_RTP_PKTS);
     
+    __u64 pkt_len = data_end - data;
+    struct camera_stats *cs = account_camera_rx(camera_id, pkt_len);
+    __u32 arrival = rtp_arrival();
+    camera_follow_cpu(camera_id);
+    monitor_rtp(camera_id, p, arrival);
+    gop_track(camera_id, p, rtp_nal_type(ctx, p));
+    
+    __u32 *egress = bpf_map_lookup_elem(&camera_egress, &camera_id);
+    if (egress)
+        meta->egress_port = *egress;
+    
     __u32 *camera_mode = bpf_map_lookup_elem(&camera_filtering_mode, &camera_id);
     
     __u32 active_mode = FILTER_OFF;
-    if (camera_mode) {
+    if (policy.flags & FLOW_MODE_SET) {
+        active_mode = policy.mode;
+    } else if (camera_mode) {
         active_mode = *camera_mode;
     } else {
         inc_stat(STAT_MAP_LOOKUP_FAILED);
@@ -414,30 +1499,58 @@ static __always_inline int process_video_filter(struct xdp_md *ctx, struct pkt_m
         }
     }
     
+    if (active_mode == FILTER_AUTO) {
+        inc_stat(STAT_MODE_AUTO);
+        active_mode = resolve_auto_mode(camera_id);
+    }
+    
+    struct resync_state *rs = bpf_map_lookup_elem(&resync_state, &camera_id);
+    if (rs) {
+        if (active_mode == FILTER_DROP_P || active_mode == FILTER_DECIMATE) {
+            rs->filtered = 1;
+            rs->start_ns = 0;
+        } else if (active_mode != FILTER_TEMPORAL) {
+            int verdict = resync_video(ctx, p, rs, cs, pkt_len);
+            if (verdict != XDP_PASS)
+                return verdict;
+        }
+    }
+    
     if (active_mode == FILTER_OFF) {
         inc_stat(STAT_MODE_OFF);
-        inc_stat(STAT_FORWARDED);
-        return XDP_PASS;
+        return forward_video(ctx, p, camera_id, cs, pkt_len, arrival);
     } else if (active_mode == FILTER_DROP_P) {
         inc_stat(STAT_MODE_DROP_P);
     } else if (active_mode == FILTER_FORWARD_P) {
         inc_stat(STAT_MODE_FORWARD_P);
+    } else if (active_mode == FILTER_DECIMATE) {
+        inc_stat(STAT_MODE_DECIMATE);
+    } else if (active_mode == FILTER_TEMPORAL) {
+        inc_stat(STAT_MODE_TEMPORAL);
     }
     
-    struct h265_payload_hdr *ph = (void *)(rtp + 1);
-    if ((void *)(ph + 1) > data_end) {
+    struct h265_payload_hdr *ph = parse_ptr(ctx, p->payload_off, sizeof(*ph));
+    if (!ph) {
         inc_stat(STAT_FORWARDED);
         return XDP_PASS;
     }
     
     __u8 nal_type = (ph->byte0 >> 1) & 0x3F;
     
-    __u32 state_key = 0;
-    __u32 *p_frame_flag = bpf_map_lookup_elem(&p_frame_state, &state_key);
-    __u32 is_p_frame = p_frame_flag ? *p_frame_flag : 0;
-    
     if (active_mode == FILTER_DROP_P) {
-        __u8 is_p_slice = 0;
+        struct frame_state *fs = bpf_map_lookup_elem(&p_frame_state, &camera_id);
+        if (!fs) {
+            inc_stat(STAT_MAP_LOOKUP_FAILED);
+            inc_stat(STAT_FORWARDED);
+            return XDP_PASS;
+        }
+        
+        __u32 rtp_ts = p->rtp_ts;
+        if (fs->in_p_frame && fs->rtp_ts != rtp_ts) {
+            /* End fragment of the previous P-frame never arrived */
+            inc_stat(STAT_FRAME_STATE_RESET);
+            fs->in_p_frame = 0;
+        }
         
         if (nal_type == 49) {
             struct h265_fu_hdr *fu = (void *)(ph + 1);
@@ -454,81 +1567,117 @@ static __always_inline int process_video_filter(struct xdp_md *ctx, struct pkt_m
                 
                 __u8 fu_nal_type = fu->s_e_r_type & 0x3F;
                 
-                if (fu_nal_type >= 1 && fu_nal_type <= 9) {
-                    is_p_slice = 1;
-                    __u32 new_state = 1;
-                    bpf_map_update_elem(&p_frame_state, &state_key, &new_state, BPF_ANY);
-                    is_p_frame = 1;
-                }
+                fs->rtp_ts = rtp_ts;
+                fs->in_p_frame = fu_nal_type >= 1 && fu_nal_type <= 9;
             }
             
-            if (is_p_frame) {
+            if (fs->in_p_frame) {
+                gop_dropped(camera_id);
                 inc_stat(STAT_P_SLICES);
                 inc_stat(STAT_DROPPED);
+                account_camera_drop(cs, pkt_len);
                 
-                if (end_bit) {
-                    __u32 new_state = 0;
-                    bpf_map_update_elem(&p_frame_state, &state_key, &new_state, BPF_ANY);
-                }
+                if (end_bit)
+                    fs->in_p_frame = 0;
                 
                 return XDP_DROP;
             }
         } else {
             if (nal_type >= 1 && nal_type <= 9) {
+                gop_dropped(camera_id);
                 inc_stat(STAT_P_SLICES);
                 inc_stat(STAT_DROPPED);
+                account_camera_drop(cs, pkt_len);
                 return XDP_DROP;
             }
         }
+    } else if (active_mode == FILTER_DECIMATE) {
+        /* FU fragments carry the slice type in every FU header */
+        __u8 slice_type = nal_type;
+        if (nal_type == 49) {
+            struct h265_fu_hdr *fu = (void *)(ph + 1);
+            if ((void *)(fu + 1) > data_end) {
+                inc_stat(STAT_FORWARDED);
+                return XDP_PASS;
+            }
+            slice_type = fu->s_e_r_type & 0x3F;
+        }
+        
+        /* No gop_dropped(), see gop_drop */
+        if (slice_type >= 1 && slice_type <= 9 && decimate_frame(camera_id, p->rtp_ts)) {
+            inc_stat(STAT_P_SLICES);
+            inc_stat(STAT_DROPPED);
+            account_camera_drop(cs, pkt_len);
+            return XDP_DROP;
+        }
+    } else if (active_mode == FILTER_TEMPORAL) {
+        /* TemporalIdPlus1, 0 is forbidden */
+        __u32 tid_plus1 = ph->byte1 & 0x07;
+        __u8 unit_type = nal_type;
+        if (nal_type == 49) {
+            struct h265_fu_hdr *fu = (void *)(ph + 1);
+            if ((void *)(fu + 1) <= data_end)
+                unit_type = fu->s_e_r_type & 0x3F;
+        }
+        
+        if (tid_plus1 && temporal_drop(camera_id, tid_plus1 - 1, unit_type)) {
+            inc_stat(STAT_TEMPORAL_DROPPED);
+            inc_stat(STAT_DROPPED);
+            account_camera_drop(cs, pkt_len);
+            /* No gop_dropped(): the sub-layers kept never reference it.
+             * Switching back to FILTER_OFF needs the layers' references. */
+            if (rs) {
+                rs->filtered = 1;
+                rs->start_ns = 0;
+            }
+            return XDP_DROP;
+        }
     }
     
-    inc_stat(STAT_FORWARDED);
-    return XDP_PASS;
+    return forward_video(ctx, p, camera_id, cs, pkt_len, arrival);
 }
 
-SEC("freplace/stage2")
-int stage2(struct xdp_md *ctx, struct pkt_metadata *meta) {
-    void *data_end = (void *)(long)ctx->data_end;
-    void *data = (void *)(long)ctx->data;
-    
+static __always_inline int video_filter(struct xdp_md *ctx, struct pkt_metadata *meta) {
     inc_stat(STAT_STAGE2_ENTRY);
     
     __u32 key = 0;
     __u64 *count = bpf_map_lookup_elem(&video_stats, &key);
     if (count)
-        __sync_fetch_and_add(count, 1);
+        *count += 1;
     
-    struct ethhdr *eth = data;
-    if ((void *)(eth + 1) > data_end)
-        return process_video_filter(ctx, meta);
+    /* Cached if the parser stage ran before us */
+    struct pkt_parse *p = pipeline_parse(ctx, meta);
     
-    if (eth->h_proto != bpf_htons(ETH_P_IP))
-        return process_video_filter(ctx, meta);
+    if (!(p->flags & PARSED_IPV4))
+        return process_video_filter(ctx, meta, p);
     
     inc_stat(STAT_IPV4_PACKETS);
     
-    struct iphdr *iph = (void *)(eth + 1);
-    if ((void *)(iph + 1) > data_end)
-        return process_video_filter(ctx, meta);
-    
-    if (iph->protocol != IPPROTO_UDP)
-        return process_video_filter(ctx, meta);
+    if (p->ip_proto != IPPROTO_UDP)
+        return process_video_filter(ctx, meta, p);
     
     inc_stat(STAT_UDP_PACKETS);
     
-    struct udphdr *udph = (void *)iph + (iph->ihl * 4);
-    if ((void *)(udph + 1) > data_end)
-        return process_video_filter(ctx, meta);
+    if (!(p->flags & PARSED_UDP))
+        return process_video_filter(ctx, meta, p);
     
     inc_stat(STAT_PRE_PORT_CHECK);
-    __u32 dst_port = bpf_ntohs(udph->dest);
     
-    if (dst_port == ROBOT_POSITION_PORT) {
+    if (p->dst_port == ROBOT_POSITION_PORT) {
         inc_stat(STAT_ROBOT_PORT_MATCHED);
-        return process_robot_coordinates(ctx);
+        return process_robot_coordinates(ctx, p);
     }
     
-    return process_video_filter(ctx, meta);
+    return process_video_filter(ctx, meta, p);
+}
+
+SEC("xdp")
+int stage2(struct xdp_md *ctx) {
+    struct pkt_metadata *meta = pipeline_meta();
+    if (!meta)
+        return XDP_PASS;
+    
+    return pipeline_continue(ctx, meta, video_filter(ctx, meta));
 }
 
 char _license[] SEC("license") = "GPL";
@@ -0,0 +1,162 @@
+/* Map layouts and constants of stage2_video_filter.c that user space
+ * needs as well: bw_controller, xdp_exporter, pipeline_loader and the
+ * benches include this header instead of repeating them. The maps
+ * themselves and what their fields mean are documented in
+ * stage2_video_filter.c. Nothing here may depend on BPF helpers; the
+ * Python tools still keep their own copies.
+ */
+#ifndef VIDEO_FILTER_DEFS_H
+#define VIDEO_FILTER_DEFS_H
+
+#include <linux/types.h>
+#include <linux/bpf.h>
+
+#define ROBOT_POSITION_PORT 5555
+
+/* Sizes every per-camera map, the grid's camera bitmaps included */
+#define NUM_CAMERAS 1024
+
+/* Built-in flow layout: UDP port CAMERA_PORT_BASE + i to 10.1.1.2 is
+ * camera i for the first CAMERA_PORTS cameras. Cameras above need an
+ * entry in flow_classifier or ssrc_classifier. */
+#define CAMERA_PORT_BASE 5000
+#define CAMERA_PORTS 200
+
+/* Built-in layout: camera i < NUM_HORIZONTAL_STRIPS sees the horizontal
+ * strip y in [i * STRIP_WIDTH, (i + 1) * STRIP_WIDTH), the next
+ * NUM_VERTICAL_STRIPS cameras see the vertical strips of x the same way */
+#define NUM_HORIZONTAL_STRIPS 50
+#define NUM_VERTICAL_STRIPS 50
+#define COORD_MIN 0
+#define COORD_MAX 1000
+#define STRIP_WIDTH 20
+
+/* camera_filtering_mode values */
+#define FILTER_OFF 0
+#define FILTER_DROP_P 1
+#define FILTER_FORWARD_P 2
+/* Drops part of the P-frames as set in camera_decimation */
+#define FILTER_DECIMATE 3
+/* Drops the temporal sub-layers above camera_max_tid */
+#define FILTER_TEMPORAL 4
+/* Decided per packet from the stored robot position (lazy_visibility) */
+#define FILTER_AUTO 0xFF
+
+/* camera_decimation */
+struct decimation_policy {
+    __u32 keep_every;
+    __u32 drop_threshold;
+    __u32 max_fps;
+    __u32 pad;
+};
+
+/* meter_config: per camera, then METER_AGGREGATE */
+#define METER_AGGREGATE NUM_CAMERAS
+#define METER_MAX (NUM_CAMERAS + 1)
+
+struct meter_config {
+    __u64 cir;
+    __u64 cbs;
+    __u64 pir;
+    __u64 pbs;
+};
+
+/* Tokens are kept in bytes * METER_SCALE in a __u64, so that the refill
+ * of a packet arriving a few ns after the last one is not truncated away.
+ * A full bucket plus a second of refill must still fit: rates (bytes/s,
+ * about 73 Gbit/s) and bursts (bytes) above METER_MAX_TOKENS are cut to
+ * it. */
+#define METER_SCALE 1000000000ULL
+#define METER_MAX_TOKENS ((1ULL << 63) / METER_SCALE)
+
+/* camera_stats */
+struct camera_stats {
+    __u64 rx_pkts;
+    __u64 rx_bytes;
+    __u64 dropped_pkts;
+    __u64 dropped_bytes;
+    __u64 resyncs;
+    __u64 resync_ns;
+    __u64 plis_sent;
+};
+
+/* rtp_monitor: camera_id before the verdict, RTP_MONITOR_OUT + camera_id
+ * after it */
+#define RTP_MONITOR_OUT NUM_CAMERAS
+
+struct rtp_monitor {
+    __u64 received;     /* packets, duplicates not counted */
+    __u64 expected;     /* sequence numbers spanned */
+    __u64 reordered;    /* arrived after a higher sequence number */
+    __u64 duplicates;
+    __u64 jitter;       /* interarrival jitter in 90 kHz units, << 4 */
+    __u64 max_seq;      /* extended highest sequence number */
+    __u64 seen;         /* bit i: max_seq - i arrived */
+    __u64 transit;      /* arrival - RTP timestamp of the last packet */
+    __u64 ssrc;
+};
+
+/* flow_classifier, ssrc_classifier and flow_learned */
+struct flow_key {
+    __be32 saddr;
+    __be32 daddr;
+    __u16 sport;
+    __u16 dport;
+    __u32 proto;
+};
+
+#define FLOW_MODE_SET (1U << 0)     /* mode overrides camera_filtering_mode */
+#define FLOW_BYPASS   (1U << 1)     /* not video, forwarded untouched */
+#define FLOW_UNKNOWN  (1U << 2)     /* learned, matched nothing */
+#define FLOW_LEARNED  (1U << 3)
+
+struct flow_policy {
+    __u32 camera_id;
+    __u32 mode;         /* FILTER_*, used with FLOW_MODE_SET */
+    __u32 flags;
+};
+
+/* grid_config and visibility_grid */
+#define CAMERA_BITMAP_WORDS (NUM_CAMERAS / 64)
+#define GRID_MAX_CELLS 16384
+#define GRID_NO_CELL 0xFFFFFFFF
+
+struct grid_config {
+    __u32 enabled;
+    __u32 cell_size;
+    __u32 cols;
+    __u32 rows;
+};
+
+struct camera_bitmap {
+    __u64 words[CAMERA_BITMAP_WORDS];
+};
+
+/* robot_state. Visible set of a position, packed into one word so a
+ * robot's state moves with a single compare-and-swap. Strip layout: bit
+ * 32 = valid, bits 16-31 = horizontal strip, bits 0-15 = vertical strip.
+ * Grid layout: bits 32 and 33 set, bits 0-31 = cell. 0 = sees nothing. */
+#define VIS_VALID (1ULL << 32)
+#define VIS_GRID (1ULL << 33)
+
+struct robot_state {
+    __u64 vis;
+    __u64 pos;              /* x << 32 | y */
+    __u64 seq;
+    __u64 last_seen_ns;
+};
+
+/* visibility_state.robots_seen */
+#define ROBOTS_NONE 0       /* no robot since load: FILTER_AUTO is unfiltered */
+#define ROBOTS_SWEPT 1      /* the sweep timer runs */
+#define ROBOTS_REARM 2      /* pipeline_loader -r swapped the programs: the
+                             * next report arms the sweep of the new stage2 */
+
+struct visibility_state {
+    struct bpf_timer sweep_timer;
+    __u32 robots_seen;
+    __u32 modes_initialised;
+    __u64 epoch;            /* lazy_visibility: robot visible set changes */
+};
+
+#endif /* VIDEO_FILTER_DEFS_H */
@@ -0,0 +1,145 @@
+#!/usr/bin/env python3
+"""
+Minimal access to pinned BPF maps through the bpf() syscall (x86-64),
+shared by the user-space helpers of the dispatcher pipeline.
+"""
+
+import ctypes
+import errno
+import os
+from ctypes import c_uint32, c_uint64, c_void_p
+
+libc = ctypes.CDLL("libc.so.6", use_errno=True)
+
+SYS_BPF = 321
+BPF_MAP_LOOKUP_ELEM = 1
+BPF_MAP_UPDATE_ELEM = 2
+BPF_MAP_DELETE_ELEM = 3
+BPF_MAP_GET_NEXT_KEY = 4
+BPF_OBJ_GET = 7
+BPF_ANY = 0
+
+PIN_DIR = "/sys/fs/bpf/xdp_pipeline"
+
+
+class bpf_attr_obj_get(ctypes.Structure):
+    _fields_ = [
+        ("pathname", c_uint64),
+        ("bpf_fd", c_uint32),
+        ("file_flags", c_uint32),
+    ]
+
+
+class bpf_attr_map_elem(ctypes.Structure):
+    _fields_ = [
+        ("map_fd", c_uint32),
+        ("_pad1", c_uint32),
+        ("key", c_uint64),
+        ("value", c_uint64),
+        ("flags", c_uint64),
+    ]
+
+
+def bpf_obj_get(pathname):
+    """Open a pinned BPF object and return its file descriptor"""
+    path_buf = ctypes.create_string_buffer(pathname.encode('utf-8') + b'\0')
+
+    attr = bpf_attr_obj_get()
+    attr.pathname = ctypes.cast(path_buf, c_void_p).value
+
+    fd = libc.syscall(SYS_BPF, BPF_OBJ_GET, ctypes.byref(attr), ctypes.sizeof(attr))
+    if fd < 0:
+        errno = ctypes.get_errno()
+        raise OSError(errno, f"Failed to open pinned BPF map {pathname}: {os.strerror(errno)}")
+    return fd
+
+
+def _map_elem_op(cmd, map_fd, key, value, flags=BPF_ANY):
+    attr = bpf_attr_map_elem()
+    attr.map_fd = map_fd
+    attr.key = ctypes.cast(ctypes.byref(key), c_void_p).value if key is not None else 0
+    attr.value = ctypes.cast(ctypes.byref(value), c_void_p).value if value is not None else 0
+    attr.flags = flags
+
+    ret = libc.syscall(SYS_BPF, cmd, ctypes.byref(attr), ctypes.sizeof(attr))
+    if ret < 0:
+        errno = ctypes.get_errno()
+        raise OSError(errno, f"BPF map operation {cmd} failed: {os.strerror(errno)}")
+
+
+def bpf_map_update(map_fd, key, value):
+    """Update BPF map element"""
+    _map_elem_op(BPF_MAP_UPDATE_ELEM, map_fd, key, value)
+
+
+def bpf_map_lookup(map_fd, key, value):
+    """Look up BPF map element into the ctypes object value"""
+    _map_elem_op(BPF_MAP_LOOKUP_ELEM, map_fd, key, value, 0)
+
+
+def bpf_map_delete(map_fd, key):
+    """Delete BPF map element"""
+    _map_elem_op(BPF_MAP_DELETE_ELEM, map_fd, key, None, 0)
+
+
+def bpf_map_get_next_key(map_fd, key, next_key):
+    """Key after key (the first one when key is None) into next_key; False at the end"""
+    try:
+        _map_elem_op(BPF_MAP_GET_NEXT_KEY, map_fd, key, next_key, 0)
+    except OSError as e:
+        if e.errno == errno.ENOENT:
+            return False
+        raise
+    return True
+
+
+def _key(key):
+    """ctypes key: ints are __u32 keys, bytes are packed struct keys"""
+    if isinstance(key, (bytes, bytearray)):
+        return ctypes.create_string_buffer(bytes(key), len(key))
+    if not isinstance(key, c_uint32):
+        return c_uint32(key)
+    return key
+
+
+class BPFMap:
+    """Pinned BPF map with __u32 (int) or packed struct (bytes) keys;
+    values are __u32 ints or raw bytes"""
+    def __init__(self, path):
+        if not path.startswith('/'):
+            path = os.path.join(PIN_DIR, path)
+        self.fd = bpf_obj_get(path)
+        self.path = path
+
+    def __setitem__(self, key, value):
+        key = _key(key)
+        if isinstance(value, (bytes, bytearray)):
+            value = ctypes.create_string_buffer(bytes(value), len(value))
+        elif not isinstance(value, ctypes._SimpleCData) and not isinstance(value, ctypes.Array):
+            value = c_uint32(value)
+        bpf_map_update(self.fd, key, value)
+
+    def lookup(self, key, value_size):
+        """Raw value bytes of key"""
+        value = ctypes.create_string_buffer(value_size)
+        bpf_map_lookup(self.fd, _key(key), value)
+        return value.raw
+
+    def __delitem__(self, key):
+        bpf_map_delete(self.fd, _key(key))
+
+    def keys(self, key_size=4):
+        """All keys as raw bytes. Deleting the current key while iterating
+        restarts the walk in the kernel, so collect first, then delete."""
+        keys = []
+        key = None
+        next_key = ctypes.create_string_buffer(key_size)
+        while bpf_map_get_next_key(self.fd, key, next_key):
+            keys.append(next_key.raw)
+            key = ctypes.create_string_buffer(next_key.raw, key_size)
+        return keys
+
+    def close(self):
+        if self.fd >= 0:
+            os.close(self.fd)
+            self.fd = -1
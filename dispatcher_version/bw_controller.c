@@ -0,0 +1,539 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "xdp_stats.h"
+#include "video_filter_defs.h"
+
+/* Closed-loop bandwidth controller. Every interval it reads the per-camera
+ * byte rates from camera_stats and counts the robots that see each camera
+ * from their stored visible sets in robot_state, picks a decimation level per camera so that the
+ * estimated egress stays under the budget, and writes the changed cameras
+ * into camera_decimation and camera_filtering_mode with one batched update
+ * each. Cameras no robot sees are cut first.
+ *
+ * Levels, from no cut to the deepest: FILTER_OFF, FILTER_DECIMATE keeping
+ * 1 of 2, 3 or 4 P-frames (stage2 forwards the kept ones whatever
+ * gop_drop says), FILTER_DROP_P. A camera's egress at a level is
+ * estimated as rate * (key_share + (1 - key_share) * kept P share), with
+ * key_share the byte share of IRAP frames (-k).
+ *
+ * Hysteresis: levels go up as soon as the estimate exceeds the budget, but
+ * only come down when the estimate after the step stays hysteresis percent
+ * below the budget, and not before the camera has held its level for
+ * hold_ms.
+ *
+ * Run the pipeline with lazy_visibility=1, otherwise robot packets keep
+ * rewriting camera_filtering_mode under the controller. Lazy visibility
+ * keeps no camera_robot_refs, hence the counting here, once per interval.
+ *
+ * -w records the rates and visibility as CSV, -s replays such a file
+ * offline (no maps needed) and reports budget violations, mode changes and
+ * the solver cost. */
+
+/* camera_stats field */
+#define CAM_RX_BYTES (offsetof(struct camera_stats, rx_bytes) / sizeof(__u64))
+
+struct level {
+    __u32 mode;
+    __u32 keep_every;
+    double p_share;         /* share of P-frame bytes kept */
+};
+
+static const struct level levels[] = {
+    { FILTER_OFF,      0, 1.0 },
+    { FILTER_DECIMATE, 2, 1.0 / 2 },
+    { FILTER_DECIMATE, 3, 1.0 / 3 },
+    { FILTER_DECIMATE, 4, 1.0 / 4 },
+    { FILTER_DROP_P,   0, 0.0 },
+};
+
+#define NR_LEVELS (sizeof(levels) / sizeof(levels[0]))
+
+/* Weight of a new rate sample in the smoothed rate */
+#define RATE_ALPHA 0.3
+
+struct controller {
+    __u32 cameras;
+    double budget;          /* bytes/s */
+    double hysteresis;      /* fraction of the budget */
+    double key_share;
+    __u64 hold_ns;
+
+    double rate[NUM_CAMERAS];       /* smoothed demand, bytes/s */
+    __u32 visible[NUM_CAMERAS];
+    __u32 level[NUM_CAMERAS];
+    __u64 since_ns[NUM_CAMERAS];    /* when level last changed */
+    int changed[NUM_CAMERAS];
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -b budget_mbps [-i interval_ms] [-H percent] [-t hold_ms] [-k key_share]\n"
+            "          [-n cameras] [-w record.csv] [-s replay.csv] [-v]\n"
+            "  -b  egress budget of all cameras, Mbit/s\n"
+            "  -i  control interval (default: 100)\n"
+            "  -H  levels only come down below budget - percent (default: 10)\n"
+            "  -t  minimum time a camera holds a level before it comes down (default: 1000)\n"
+            "  -k  byte share of IRAP frames in a stream (default: 0.4)\n"
+            "  -n  control cameras [0, n) (default: %d)\n"
+            "  -w  record rates and visibility to a CSV file\n"
+            "  -s  replay a recorded CSV file offline instead of controlling the maps\n"
+            "  -v  print every tick\n",
+            prog, NUM_CAMERAS);
+}
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double egress_at(const struct controller *c, __u32 camera, __u32 level)
+{
+    return c->rate[camera] * (c->key_share + (1.0 - c->key_share) * levels[level].p_share);
+}
+
+static double total_egress(const struct controller *c)
+{
+    double total = 0;
+    __u32 i;
+
+    for (i = 0; i < c->cameras; i++)
+        total += egress_at(c, i, c->level[i]);
+    return total;
+}
+
+/* Raises levels until the estimate fits the budget: cameras without a
+ * robot before the others, and within each group the step that saves the
+ * most bytes first */
+static double solve_up(struct controller *c, double total, __u64 now)
+{
+    int visible;
+
+    for (visible = 0; visible <= 1 && total > c->budget; visible++) {
+        while (total > c->budget) {
+            double best_saving = 0;
+            __u32 best = c->cameras, i;
+
+            for (i = 0; i < c->cameras; i++) {
+                double saving;
+
+                if (!c->visible[i] != !visible || c->level[i] + 1 >= NR_LEVELS)
+                    continue;
+                saving = egress_at(c, i, c->level[i]) - egress_at(c, i, c->level[i] + 1);
+                if (saving > best_saving) {
+                    best_saving = saving;
+                    best = i;
+                }
+            }
+            if (best == c->cameras)
+                break;
+            c->level[best]++;
+            c->since_ns[best] = now;
+            c->changed[best] = 1;
+            total -= best_saving;
+        }
+    }
+    return total;
+}
+
+/* Lowers levels while the estimate stays under the hysteresis band: cameras
+ * a robot sees first, cheapest step first */
+static double solve_down(struct controller *c, double total, __u64 now)
+{
+    double limit = c->budget * (1.0 - c->hysteresis);
+    int visible;
+
+    for (visible = 1; visible >= 0; visible--) {
+        for (;;) {
+            double best_cost = limit - total;
+            __u32 best = c->cameras, i;
+
+            for (i = 0; i < c->cameras; i++) {
+                double cost;
+
+                if (!c->visible[i] != !visible || !c->level[i] || now - c->since_ns[i] < c->hold_ns)
+                    continue;
+                cost = egress_at(c, i, c->level[i] - 1) - egress_at(c, i, c->level[i]);
+                if (cost <= best_cost) {
+                    best_cost = cost;
+                    best = i;
+                }
+            }
+            if (best == c->cameras)
+                break;
+            c->level[best]--;
+            c->since_ns[best] = now;
+            c->changed[best] = 1;
+            total += best_cost;
+        }
+    }
+    return total;
+}
+
+/* One control step on the current rates, returns the estimated egress */
+static double solve(struct controller *c, __u64 now)
+{
+    double total = total_egress(c);
+
+    memset(c->changed, 0, sizeof(c->changed));
+    if (total > c->budget)
+        return solve_up(c, total, now);
+    return solve_down(c, total, now);
+}
+
+static void update_rate(struct controller *c, __u32 camera, double sample)
+{
+    c->rate[camera] = c->rate[camera] ? RATE_ALPHA * sample + (1 - RATE_ALPHA) * c->rate[camera] : sample;
+}
+
+/* Batch update of count entries, element by element on kernels without
+ * batch support for the map type */
+static int update_batch(int fd, const __u32 *keys, const void *values, size_t value_size, __u32 count)
+{
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 n = count, i;
+
+    if (!count || !bpf_map_update_batch(fd, keys, values, &n, &opts))
+        return 0;
+
+    for (i = 0; i < count; i++)
+        if (bpf_map_update_elem(fd, &keys[i], (const char *)values + i * value_size, BPF_ANY))
+            return -errno;
+    return 0;
+}
+
+/* Writes the changed cameras: their decimation policies first, so a camera
+ * never runs FILTER_DECIMATE with a stale policy, then their modes */
+static int push_modes(const struct controller *c, int modes_fd, int decimation_fd)
+{
+    __u32 keys[NUM_CAMERAS], modes[NUM_CAMERAS], dkeys[NUM_CAMERAS];
+    struct decimation_policy policies[NUM_CAMERAS];
+    __u32 n = 0, nd = 0, i;
+    int err;
+
+    for (i = 0; i < c->cameras; i++) {
+        const struct level *l = &levels[c->level[i]];
+
+        if (!c->changed[i])
+            continue;
+        keys[n] = i;
+        modes[n++] = l->mode;
+        if (l->mode == FILTER_DECIMATE) {
+            dkeys[nd] = i;
+            memset(&policies[nd], 0, sizeof(policies[nd]));
+            policies[nd++].keep_every = l->keep_every;
+        }
+    }
+
+    err = update_batch(decimation_fd, dkeys, policies, sizeof(policies[0]), nd);
+    if (!err)
+        err = update_batch(modes_fd, keys, modes, sizeof(modes[0]), n);
+    if (err)
+        fprintf(stderr, "Failed to push modes: %s\n", strerror(-err));
+    return err;
+}
+
+static void see_camera(struct controller *c, __u32 camera)
+{
+    if (camera < c->cameras)
+        c->visible[camera]++;
+}
+
+/* Robots that see each camera, from every robot's visible set */
+static int read_visibility(int robots_fd, int grid_fd, struct controller *c)
+{
+    struct robot_state rs;
+    struct camera_bitmap bm;
+    __u32 key, next, cell, w, b;
+    void *prev = NULL;
+
+    memset(c->visible, 0, sizeof(c->visible));
+    while (!bpf_map_get_next_key(robots_fd, prev, &next)) {
+        key = next;
+        prev = &key;
+        /* Expired by the sweep since get_next_key */
+        if (bpf_map_lookup_elem(robots_fd, &key, &rs) || !(rs.vis & VIS_VALID))
+            continue;
+        if (!(rs.vis & VIS_GRID)) {
+            see_camera(c, (rs.vis >> 16) & 0xFFFF);
+            see_camera(c, NUM_HORIZONTAL_STRIPS + (rs.vis & 0xFFFF));
+            continue;
+        }
+        cell = (__u32)rs.vis;
+        if (bpf_map_lookup_elem(grid_fd, &cell, &bm))
+            return -errno;
+        for (w = 0; w < CAMERA_BITMAP_WORDS; w++)
+            for (b = 0; b < 64; b++)
+                if ((bm.words[w] >> b) & 1)
+                    see_camera(c, w * 64 + b);
+    }
+    return errno == ENOENT ? 0 : -errno;
+}
+
+static __u32 count_changed(const struct controller *c)
+{
+    __u32 n = 0, i;
+
+    for (i = 0; i < c->cameras; i++)
+        n += c->changed[i];
+    return n;
+}
+
+static void print_tick(const struct controller *c, double t_ms, double total)
+{
+    __u32 per_level[NR_LEVELS] = { 0 }, i;
+
+    for (i = 0; i < c->cameras; i++)
+        per_level[c->level[i]]++;
+    printf("t=%.0fms egress %.1f/%.1f Mbit/s changed %u levels",
+           t_ms, total * 8 / 1e6, c->budget * 8 / 1e6, count_changed(c));
+    for (i = 0; i < NR_LEVELS; i++)
+        printf(" %u", per_level[i]);
+    printf("\n");
+}
+
+/* CSV: t_ms,camera,rate_bytes_per_s,robot_refs, one line per camera and tick */
+static void record_tick(FILE *f, const struct controller *c, double t_ms, const double *sample)
+{
+    __u32 i;
+
+    for (i = 0; i < c->cameras; i++)
+        fprintf(f, "%.0f,%u,%.0f,%u\n", t_ms, i, sample[i], c->visible[i]);
+}
+
+static int run_live(struct controller *c, int interval_ms, FILE *record, int verbose)
+{
+    struct xdp_stats_map stats;
+    struct xdp_stats_snapshot snap;
+    __u64 prev_bytes[NUM_CAMERAS], t0, prev_ts;
+    double sample[NUM_CAMERAS];
+    int modes_fd, decimation_fd, robots_fd, grid_fd, err = 0;
+    __u32 i;
+
+    if (xdp_stats_open(&stats, "camera_stats"))
+        return 1;
+    if (xdp_stats_snapshot_init(&stats, &snap)) {
+        xdp_stats_close(&stats);
+        return 1;
+    }
+
+    modes_fd = bpf_obj_get(XDP_PIPELINE_PIN_DIR "/camera_filtering_mode");
+    decimation_fd = bpf_obj_get(XDP_PIPELINE_PIN_DIR "/camera_decimation");
+    robots_fd = bpf_obj_get(XDP_PIPELINE_PIN_DIR "/robot_state");
+    grid_fd = bpf_obj_get(XDP_PIPELINE_PIN_DIR "/visibility_grid");
+    if (modes_fd < 0 || decimation_fd < 0 || robots_fd < 0 || grid_fd < 0) {
+        fprintf(stderr, "Failed to open the camera maps in %s: %s\n", XDP_PIPELINE_PIN_DIR, strerror(errno));
+        err = -errno;
+        goto out;
+    }
+
+    /* Start from a known state: every camera unfiltered */
+    for (i = 0; i < c->cameras; i++)
+        c->changed[i] = 1;
+    err = push_modes(c, modes_fd, decimation_fd);
+    if (err || (err = xdp_stats_read(&stats, &snap)))
+        goto out;
+    for (i = 0; i < c->cameras; i++)
+        prev_bytes[i] = xdp_stats_get(&snap, i, CAM_RX_BYTES);
+    t0 = prev_ts = snap.ts_ns;
+
+    while (!stop) {
+        double dt, total;
+
+        usleep(interval_ms * 1000);
+        err = xdp_stats_read(&stats, &snap);
+        if (!err)
+            err = read_visibility(robots_fd, grid_fd, c);
+        if (err)
+            break;
+
+        dt = (snap.ts_ns - prev_ts) / 1e9;
+        prev_ts = snap.ts_ns;
+        for (i = 0; i < c->cameras; i++) {
+            __u64 bytes = xdp_stats_get(&snap, i, CAM_RX_BYTES);
+
+            sample[i] = dt > 0 ? (bytes - prev_bytes[i]) / dt : 0;
+            prev_bytes[i] = bytes;
+            update_rate(c, i, sample[i]);
+        }
+
+        total = solve(c, snap.ts_ns);
+        if (count_changed(c) && (err = push_modes(c, modes_fd, decimation_fd)))
+            break;
+        if (record)
+            record_tick(record, c, (snap.ts_ns - t0) / 1e6, sample);
+        if (verbose)
+            print_tick(c, (snap.ts_ns - t0) / 1e6, total);
+    }
+
+out:
+    if (modes_fd >= 0)
+        close(modes_fd);
+    if (decimation_fd >= 0)
+        close(decimation_fd);
+    if (robots_fd >= 0)
+        close(robots_fd);
+    if (grid_fd >= 0)
+        close(grid_fd);
+    xdp_stats_snapshot_free(&snap);
+    xdp_stats_close(&stats);
+    return err ? 1 : 0;
+}
+
+/* Runs the solver over a recorded file. Egress is the model's estimate,
+ * so the figures compare controller settings, not the real link. */
+static int run_replay(struct controller *c, const char *path, int verbose)
+{
+    FILE *f = fopen(path, "r");
+    double t_ms, cur_ms = -1, rate, total, worst = 0;
+    __u64 ticks = 0, over = 0, changes = 0, solve_ns = 0, start;
+    __u32 camera, refs;
+    int more = 1;
+
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return 1;
+    }
+
+    while (more) {
+        more = fscanf(f, "%lf,%u,%lf,%u", &t_ms, &camera, &rate, &refs) == 4;
+
+        /* A new timestamp closes the previous tick */
+        if (cur_ms >= 0 && (!more || t_ms != cur_ms)) {
+            start = now_ns();
+            total = solve(c, (__u64)(cur_ms * 1e6));
+            solve_ns += now_ns() - start;
+            ticks++;
+            changes += count_changed(c);
+            if (total > c->budget) {
+                over++;
+                if (total - c->budget > worst)
+                    worst = total - c->budget;
+            }
+            if (verbose)
+                print_tick(c, cur_ms, total);
+        }
+        if (!more)
+            break;
+        cur_ms = t_ms;
+        if (camera < c->cameras) {
+            update_rate(c, camera, rate);
+            c->visible[camera] = refs;
+        }
+    }
+    fclose(f);
+
+    if (!ticks) {
+        fprintf(stderr, "No samples in %s\n", path);
+        return 1;
+    }
+    printf("ticks %llu, over budget %llu (worst by %.2f Mbit/s), mode changes %llu (%.2f per tick)\n",
+           (unsigned long long)ticks, (unsigned long long)over, worst * 8 / 1e6,
+           (unsigned long long)changes, (double)changes / ticks);
+    printf("solver %.0f ns per tick for %u cameras\n", (double)solve_ns / ticks, c->cameras);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct controller *c;
+    const char *record_path = NULL, *replay_path = NULL;
+    int interval_ms = 100, hold_ms = 1000, verbose = 0, opt, rc;
+    double budget_mbps = 0, hysteresis = 10, key_share = 0.4;
+    __u32 cameras = NUM_CAMERAS;
+    FILE *record = NULL;
+
+    while ((opt = getopt(argc, argv, "b:i:H:t:k:n:w:s:vh")) != -1) {
+        switch (opt) {
+        case 'b':
+            budget_mbps = atof(optarg);
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'H':
+            hysteresis = atof(optarg);
+            break;
+        case 't':
+            hold_ms = atoi(optarg);
+            break;
+        case 'k':
+            key_share = atof(optarg);
+            break;
+        case 'n':
+            cameras = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            record_path = optarg;
+            break;
+        case 's':
+            replay_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (budget_mbps <= 0 || interval_ms <= 0 || hold_ms < 0 || hysteresis < 0 || hysteresis >= 100 ||
+        key_share < 0 || key_share > 1 || !cameras || cameras > NUM_CAMERAS) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return 1;
+    c->cameras = cameras;
+    c->budget = budget_mbps * 1e6 / 8;
+    c->hysteresis = hysteresis / 100;
+    c->key_share = key_share;
+    c->hold_ns = (__u64)hold_ms * 1000000ULL;
+
+    if (replay_path) {
+        rc = run_replay(c, replay_path, verbose);
+        free(c);
+        return rc;
+    }
+
+    if (record_path) {
+        record = fopen(record_path, "w");
+        if (!record) {
+            fprintf(stderr, "Failed to open %s: %s\n", record_path, strerror(errno));
+            free(c);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    rc = run_live(c, interval_ms, record, verbose);
+
+    if (record)
+        fclose(record);
+    free(c);
+    return rc;
+}
@@ -0,0 +1,89 @@
+#!/usr/bin/env python3
+"""
+Set the FILTER_DECIMATE policy of cameras (camera_decimation map, see
+bpf/stage2_video_filter.c) and optionally switch them to FILTER_DECIMATE.
+
+A P-frame is kept only if it passes every criterion that is set; whole
+frames are kept or dropped, never single fragments. The P4 modes map to
+--keep-every 2 (drop_state_r) and --drop-prob 0.5 (rnd05).
+
+Usage:
+    sudo python3 camera_decimation.py --cameras 0-99 --keep-every 3 --apply
+    sudo python3 camera_decimation.py --cameras 5 --drop-prob 0.25
+    sudo python3 camera_decimation.py --cameras 0-199 --max-fps 5 --apply
+    sudo python3 camera_decimation.py --cameras 0-3 --show
+"""
+
+import argparse
+import struct
+import sys
+
+from bpf_maps import BPFMap
+
+# Must match stage2_video_filter.c
+NUM_CAMERAS = 1024
+FILTER_DECIMATE = 3
+POLICY_FMT = "<IIII"
+POLICY_SIZE = struct.calcsize(POLICY_FMT)
+
+
+def parse_cameras(text):
+    cameras = []
+    for part in text.split(","):
+        lo, _, hi = part.partition("-")
+        cameras.extend(range(int(lo), int(hi or lo) + 1))
+    for camera in cameras:
+        if not 0 <= camera < NUM_CAMERAS:
+            raise ValueError(f"camera {camera} out of range 0..{NUM_CAMERAS - 1}")
+    return cameras
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Configure per-camera P-frame decimation")
+    parser.add_argument("--cameras", required=True, help="e.g. 0-99 or 1,5,7")
+    parser.add_argument("--keep-every", type=int, default=0, metavar="N",
+                        help="keep 1 of every N P-frames")
+    parser.add_argument("--drop-prob", type=float, default=0.0, metavar="P",
+                        help="drop each P-frame with probability P")
+    parser.add_argument("--max-fps", type=int, default=0, help="at most this many P-frames per second")
+    parser.add_argument("--apply", action="store_true", help="also set the cameras to FILTER_DECIMATE")
+    parser.add_argument("--show", action="store_true", help="print the policies instead")
+    args = parser.parse_args()
+
+    try:
+        cameras = parse_cameras(args.cameras)
+    except ValueError as e:
+        parser.error(str(e))
+    if not 0.0 <= args.drop_prob <= 1.0:
+        parser.error("--drop-prob must be in [0, 1]")
+    if args.keep_every < 0 or args.max_fps < 0:
+        parser.error("--keep-every and --max-fps must not be negative")
+
+    policies = BPFMap("camera_decimation")
+
+    if args.show:
+        for camera in cameras:
+            keep_every, threshold, max_fps, _ = struct.unpack(POLICY_FMT, policies.lookup(camera, POLICY_SIZE))
+            print(f"camera {camera}: keep_every {keep_every}, drop_prob {threshold / 2**32:.3f}, max_fps {max_fps}")
+        policies.close()
+        return 0
+
+    threshold = min(int(args.drop_prob * 2**32), 2**32 - 1)
+    value = struct.pack(POLICY_FMT, args.keep_every, threshold, args.max_fps, 0)
+    for camera in cameras:
+        policies[camera] = value
+    policies.close()
+
+    if args.apply:
+        modes = BPFMap("camera_filtering_mode")
+        for camera in cameras:
+            modes[camera] = FILTER_DECIMATE
+        modes.close()
+
+    print(f"Set decimation of {len(cameras)} cameras"
+          f"{' and switched them to FILTER_DECIMATE' if args.apply else ''}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,71 @@
+#!/usr/bin/env python3
+"""
+Set the highest H.265 TemporalId that FILTER_TEMPORAL forwards per camera
+(camera_max_tid map, see bpf/stage2_video_filter.c) and optionally switch
+the cameras to FILTER_TEMPORAL.
+
+With N dyadic temporal layers (x265 temporal-layers=N), --max-tid N-2 keeps
+1/2 of the frame rate, N-3 1/4 and N-4 1/8; every kept picture stays
+decodable. Lowering the threshold takes effect at once, raising it at the
+next TSA / STSA / IRAP picture of the camera.
+
+Usage:
+    sudo python3 camera_temporal.py --cameras 0-99 --max-tid 1 --apply
+    sudo python3 camera_temporal.py --cameras 5 --max-tid 6
+    sudo python3 camera_temporal.py --cameras 0-3 --show
+"""
+
+import argparse
+import struct
+import sys
+
+from bpf_maps import BPFMap
+from camera_decimation import parse_cameras
+
+# Must match stage2_video_filter.c
+FILTER_TEMPORAL = 4
+TID_MAX = 6
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Configure per-camera temporal sub-layer dropping")
+    parser.add_argument("--cameras", required=True, help="e.g. 0-99 or 1,5,7")
+    parser.add_argument("--max-tid", type=int, default=TID_MAX, metavar="TID",
+                        help=f"forward sub-layers 0..TID (default {TID_MAX}, all)")
+    parser.add_argument("--apply", action="store_true", help="also set the cameras to FILTER_TEMPORAL")
+    parser.add_argument("--show", action="store_true", help="print the thresholds instead")
+    args = parser.parse_args()
+
+    try:
+        cameras = parse_cameras(args.cameras)
+    except ValueError as e:
+        parser.error(str(e))
+    if not 0 <= args.max_tid <= TID_MAX:
+        parser.error(f"--max-tid must be in [0, {TID_MAX}]")
+
+    limits = BPFMap("camera_max_tid")
+
+    if args.show:
+        for camera in cameras:
+            max_tid, = struct.unpack("<I", limits.lookup(camera, 4))
+            print(f"camera {camera}: max_tid {max_tid}")
+        limits.close()
+        return 0
+
+    for camera in cameras:
+        limits[camera] = args.max_tid
+    limits.close()
+
+    if args.apply:
+        modes = BPFMap("camera_filtering_mode")
+        for camera in cameras:
+            modes[camera] = FILTER_TEMPORAL
+        modes.close()
+
+    print(f"Set max_tid {args.max_tid} on {len(cameras)} cameras"
+          f"{' and switched them to FILTER_TEMPORAL' if args.apply else ''}")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,181 @@
+#!/usr/bin/env python3
+"""
+Manage the flow -> camera classification of stage2 (flow_classifier,
+ssrc_classifier and flow_learned maps, see bpf/stage2_video_filter.c).
+
+Static flows are UDP 5-tuples, SSRC entries match any flow whose RTP SSRC
+they name. Flows that match neither are learned by stage2 into the
+flow_learned LRU, as unknown if the built-in 10.1.1.2:5000+id layout does
+not apply either; --list shows them so they can be promoted. Every change
+flushes flow_learned, so that flows learned under the old tables are
+classified again.
+
+Flow file (JSON), for --load:
+    {
+        "flows": [{"src": "10.0.0.5:40000", "dst": "10.1.1.2:6000", "camera": 3}],
+        "ssrcs": [{"ssrc": "0x1234abcd", "camera": 7, "mode": "drop_p"}]
+    }
+
+Usage:
+    sudo python3 flow_classifier.py --add-flow 10.0.0.5:40000 10.1.1.2:6000 3
+    sudo python3 flow_classifier.py --add-ssrc 0x1234abcd 7 --mode drop_p
+    sudo python3 flow_classifier.py --del-flow 10.0.0.5:40000 10.1.1.2:6000
+    sudo python3 flow_classifier.py --load flows.json
+    sudo python3 flow_classifier.py --list
+    sudo python3 flow_classifier.py --flush-learned
+"""
+
+import argparse
+import ipaddress
+import json
+import socket
+import struct
+import sys
+
+from bpf_maps import BPFMap
+
+# Must match stage2_video_filter.c
+KEY_FMT = "<4s4sHHI"            # struct flow_key, addresses in network order
+POLICY_FMT = "<III"             # struct flow_policy
+KEY_SIZE = struct.calcsize(KEY_FMT)
+POLICY_SIZE = struct.calcsize(POLICY_FMT)
+
+FLOW_MODE_SET = 1 << 0
+FLOW_BYPASS = 1 << 1
+FLOW_UNKNOWN = 1 << 2
+FLOW_LEARNED = 1 << 3
+
+MODES = {"off": 0, "drop_p": 1, "forward_p": 2, "decimate": 3, "temporal": 4, "auto": 0xFF}
+MODE_NAMES = {v: k for k, v in MODES.items()}
+
+
+def parse_endpoint(text):
+    addr, _, port = text.rpartition(":")
+    if not addr:
+        raise ValueError(f"expected addr:port, got {text}")
+    port = int(port, 0)
+    if not 0 <= port <= 0xFFFF:
+        raise ValueError(f"port {port} out of range")
+    return ipaddress.IPv4Address(addr).packed, port
+
+
+def flow_key(src, dst):
+    saddr, sport = parse_endpoint(src)
+    daddr, dport = parse_endpoint(dst)
+    return struct.pack(KEY_FMT, saddr, daddr, sport, dport, socket.IPPROTO_UDP)
+
+
+def ssrc_key(ssrc):
+    return struct.pack("<I", int(ssrc, 0) if isinstance(ssrc, str) else ssrc)
+
+
+def policy(camera, mode=None, bypass=False):
+    flags = (FLOW_MODE_SET if mode is not None else 0) | (FLOW_BYPASS if bypass else 0)
+    return struct.pack(POLICY_FMT, camera, MODES[mode] if mode is not None else 0, flags)
+
+
+def format_key(key):
+    saddr, daddr, sport, dport, _ = struct.unpack(KEY_FMT, key)
+    return f"{socket.inet_ntoa(saddr)}:{sport} -> {socket.inet_ntoa(daddr)}:{dport}"
+
+
+def format_policy(value):
+    camera, mode, flags = struct.unpack(POLICY_FMT, value)
+    if flags & FLOW_UNKNOWN:
+        return "unknown"
+    if flags & FLOW_BYPASS:
+        return "bypass"
+    text = f"camera {camera}"
+    if flags & FLOW_MODE_SET:
+        text += f", mode {MODE_NAMES.get(mode, mode)}"
+    return text
+
+
+def flush(learned):
+    keys = learned.keys(KEY_SIZE)
+    for key in keys:
+        try:
+            del learned[key]
+        except FileNotFoundError:
+            pass    # evicted meanwhile
+    return len(keys)
+
+
+def load_file(path, flows, ssrcs):
+    with open(path) as f:
+        spec = json.load(f)
+    for entry in spec.get("flows", []):
+        flows[flow_key(entry["src"], entry["dst"])] = policy(
+            entry.get("camera", 0), entry.get("mode"), entry.get("bypass", False))
+    for entry in spec.get("ssrcs", []):
+        ssrcs[ssrc_key(entry["ssrc"])] = policy(
+            entry.get("camera", 0), entry.get("mode"), entry.get("bypass", False))
+    return len(spec.get("flows", [])), len(spec.get("ssrcs", []))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Manage stage2 flow classification")
+    parser.add_argument("--add-flow", nargs=3, metavar=("SRC:PORT", "DST:PORT", "CAMERA"))
+    parser.add_argument("--del-flow", nargs=2, metavar=("SRC:PORT", "DST:PORT"))
+    parser.add_argument("--add-ssrc", nargs=2, metavar=("SSRC", "CAMERA"))
+    parser.add_argument("--del-ssrc", metavar="SSRC")
+    parser.add_argument("--mode", choices=MODES, help="filtering mode overriding camera_filtering_mode")
+    parser.add_argument("--bypass", action="store_true", help="forward the flow untouched")
+    parser.add_argument("--load", metavar="FILE", help="JSON file of flows and SSRCs")
+    parser.add_argument("--list", action="store_true", help="print all tables")
+    parser.add_argument("--flush-learned", action="store_true")
+    args = parser.parse_args()
+
+    flows = BPFMap("flow_classifier")
+    ssrcs = BPFMap("ssrc_classifier")
+    learned = BPFMap("flow_learned")
+    changed = False
+
+    try:
+        if args.add_flow:
+            flows[flow_key(args.add_flow[0], args.add_flow[1])] = policy(
+                int(args.add_flow[2], 0), args.mode, args.bypass)
+            changed = True
+        if args.del_flow:
+            del flows[flow_key(*args.del_flow)]
+            changed = True
+        if args.add_ssrc:
+            ssrcs[ssrc_key(args.add_ssrc[0])] = policy(int(args.add_ssrc[1], 0), args.mode, args.bypass)
+            changed = True
+        if args.del_ssrc:
+            del ssrcs[ssrc_key(args.del_ssrc)]
+            changed = True
+        if args.load:
+            nr_flows, nr_ssrcs = load_file(args.load, flows, ssrcs)
+            print(f"Loaded {nr_flows} flows and {nr_ssrcs} SSRCs")
+            changed = True
+    except (ValueError, KeyError) as e:
+        parser.error(str(e))
+    except FileNotFoundError:
+        print("No such entry", file=sys.stderr)
+        return 1
+
+    if changed or args.flush_learned:
+        print(f"Flushed {flush(learned)} learned flows")
+
+    if args.list:
+        print("static flows:")
+        for key in flows.keys(KEY_SIZE):
+            print(f"  {format_key(key)}: {format_policy(flows.lookup(key, POLICY_SIZE))}")
+        print("ssrcs:")
+        for key in ssrcs.keys(4):
+            print(f"  0x{struct.unpack('<I', key)[0]:08x}: {format_policy(ssrcs.lookup(key, POLICY_SIZE))}")
+        print("learned flows:")
+        for key in learned.keys(KEY_SIZE):
+            try:
+                print(f"  {format_key(key)}: {format_policy(learned.lookup(key, POLICY_SIZE))}")
+            except FileNotFoundError:
+                pass
+
+    for m in (flows, ssrcs, learned):
+        m.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -8,7 +8,7 @@ import sys
 import json
 from datetime import datetime
 from influxdb_client import InfluxDBClient, Point
-from influxdb_client.client.write_api import SYNCHRONOUS
+from influxdb_client.client.write_api import WriteOptions
 
 # InfluxDB Configuration
 INFLUXDB_URL = "http://localhost:8086"
@@ -24,7 +24,8 @@ def main():
         token=INFLUXDB_TOKEN,
         org=INFLUXDB_ORG
     )
-    write_api = client.write_api(write_options=SYNCHRONOUS)
+    # Batched in the background instead of one blocking request per point
+    write_api = client.write_api(write_options=WriteOptions(batch_size=100, flush_interval=1000))
     
     try:
         health = client.health()
@@ -54,6 +55,9 @@ def main():
                     .field("total_unintended_lost_packets", data["total_unintended_lost_packets"])
                 )
 
+                # Per-camera records of pcap_loss -C
+                if "camera" in data:
+                    point = point.tag("camera", str(data["camera"]))
                 if "intended_loss_percent" in data:
                     point = point.field("intended_loss_percent", data["intended_loss_percent"])
                 if "intended_lost_packets" in data:
@@ -70,6 +74,7 @@ def main():
                 print(f"Error forwarding to InfluxDB: {e}", file=sys.stderr)
                 
     finally:
+        write_api.close()
         client.close()
 
 if __name__ == "__main__":
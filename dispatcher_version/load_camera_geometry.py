@@ -0,0 +1,182 @@
+#!/usr/bin/env python3
+"""
+Build the grid-cell -> camera-bitmap index used by stage2 from a camera
+geometry file and load it into the pinned visibility_grid / grid_config maps.
+
+Geometry file (JSON):
+    {
+        "cell_size": 10,
+        "width": 1000,
+        "height": 1000,
+        "cameras": [
+            {"id": 0, "rect": [0, 0, 1000, 20]},
+            {"id": 1, "polygon": [[100, 100], [300, 120], [250, 400]]},
+            {"id": 2, "areas": [{"rect": [...]}, {"polygon": [...]}]}
+        ]
+    }
+
+A cell belongs to a camera's view when the centre of the cell lies inside
+one of the camera's rectangles or polygons.
+
+Usage:
+    sudo python3 load_camera_geometry.py geometry.json
+    sudo python3 load_camera_geometry.py --synthetic 1000 --cell-size 10
+    sudo python3 load_camera_geometry.py --disable
+"""
+
+import argparse
+import json
+import random
+import struct
+import sys
+import time
+
+from bpf_maps import BPFMap
+from camera_decimation import NUM_CAMERAS
+
+# Must match stage2_video_filter.c
+CAMERA_BITMAP_WORDS = NUM_CAMERAS // 64
+GRID_MAX_CELLS = 16384
+
+
+def point_in_rect(px, py, rect):
+    x0, y0, x1, y1 = rect
+    return min(x0, x1) <= px < max(x0, x1) and min(y0, y1) <= py < max(y0, y1)
+
+
+def point_in_polygon(px, py, polygon):
+    """Even-odd ray casting"""
+    inside = False
+    n = len(polygon)
+    for i in range(n):
+        x0, y0 = polygon[i]
+        x1, y1 = polygon[(i + 1) % n]
+        if (y0 > py) != (y1 > py):
+            x_cross = x0 + (py - y0) * (x1 - x0) / (y1 - y0)
+            if px < x_cross:
+                inside = not inside
+    return inside
+
+
+def camera_areas(camera):
+    if "areas" in camera:
+        return camera["areas"]
+    return [camera]
+
+
+def shape_bbox(area):
+    if "rect" in area:
+        x0, y0, x1, y1 = area["rect"]
+        return min(x0, x1), min(y0, y1), max(x0, x1), max(y0, y1)
+    xs = [p[0] for p in area["polygon"]]
+    ys = [p[1] for p in area["polygon"]]
+    return min(xs), min(ys), max(xs), max(ys)
+
+
+def area_contains(area, px, py):
+    if "rect" in area:
+        return point_in_rect(px, py, area["rect"])
+    return point_in_polygon(px, py, area["polygon"])
+
+
+def build_grid(geometry):
+    cell_size = int(geometry["cell_size"])
+    cols = (int(geometry["width"]) + cell_size - 1) // cell_size
+    rows = (int(geometry["height"]) + cell_size - 1) // cell_size
+    if cell_size <= 0 or cols * rows > GRID_MAX_CELLS:
+        raise ValueError(f"{cols}x{rows} cells of size {cell_size} exceed GRID_MAX_CELLS={GRID_MAX_CELLS}")
+
+    cells = [[0] * CAMERA_BITMAP_WORDS for _ in range(cols * rows)]
+
+    for camera in geometry["cameras"]:
+        camera_id = int(camera["id"])
+        if not 0 <= camera_id < NUM_CAMERAS:
+            raise ValueError(f"camera id {camera_id} out of range 0..{NUM_CAMERAS - 1}")
+        word, bit = camera_id // 64, 1 << (camera_id % 64)
+
+        for area in camera_areas(camera):
+            # only visit the cells under the shape's bounding box
+            bx0, by0, bx1, by1 = shape_bbox(area)
+            c0, c1 = max(0, int(bx0) // cell_size), min(cols - 1, int(bx1) // cell_size)
+            r0, r1 = max(0, int(by0) // cell_size), min(rows - 1, int(by1) // cell_size)
+            for row in range(r0, r1 + 1):
+                cy = row * cell_size + cell_size / 2
+                for col in range(c0, c1 + 1):
+                    cx = col * cell_size + cell_size / 2
+                    if area_contains(area, cx, cy):
+                        cells[row * cols + col][word] |= bit
+
+    return cell_size, cols, rows, cells
+
+
+def synthetic_geometry(num_cameras, cell_size, width, height, seed):
+    """Randomly placed, overlapping rectangular views for benchmarking"""
+    rng = random.Random(seed)
+    cameras = []
+    for camera_id in range(num_cameras):
+        w, h = rng.randint(50, 250), rng.randint(50, 250)
+        x, y = rng.randint(0, width - w), rng.randint(0, height - h)
+        cameras.append({"id": camera_id, "rect": [x, y, x + w, y + h]})
+    return {"cell_size": cell_size, "width": width, "height": height, "cameras": cameras}
+
+
+def write_grid_config(config_map, enabled, cell_size, cols, rows):
+    config_map[0] = struct.pack("<IIII", enabled, cell_size, cols, rows)
+
+
+def load(grid_map, config_map, cell_size, cols, rows, cells):
+    # Disable while the cells are rewritten so that no robot position is
+    # matched against a half-built index
+    write_grid_config(config_map, 0, 0, 0, 0)
+    for cell, words in enumerate(cells):
+        grid_map[cell] = struct.pack(f"<{CAMERA_BITMAP_WORDS}Q", *words)
+    write_grid_config(config_map, 1, cell_size, cols, rows)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Load camera field-of-view geometry into the XDP visibility grid")
+    parser.add_argument("geometry", nargs="?", help="camera geometry JSON file")
+    parser.add_argument("--synthetic", type=int, metavar="N", help="generate N random cameras instead of reading a file")
+    parser.add_argument("--cell-size", type=int, default=10, help="grid resolution for --synthetic (default: 10)")
+    parser.add_argument("--width", type=int, default=1000, help="floor width for --synthetic (default: 1000)")
+    parser.add_argument("--height", type=int, default=1000, help="floor height for --synthetic (default: 1000)")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--disable", action="store_true", help="switch back to the built-in strip layout")
+    parser.add_argument("--grid-map", default="visibility_grid")
+    parser.add_argument("--config-map", default="grid_config")
+    args = parser.parse_args()
+
+    config_map = BPFMap(args.config_map)
+    if args.disable:
+        write_grid_config(config_map, 0, 0, 0, 0)
+        print("Grid geometry disabled, using strips")
+        return 0
+
+    if args.synthetic:
+        geometry = synthetic_geometry(args.synthetic, args.cell_size, args.width, args.height, args.seed)
+    elif args.geometry:
+        with open(args.geometry) as f:
+            geometry = json.load(f)
+    else:
+        parser.error("either a geometry file or --synthetic is required")
+
+    start = time.time()
+    cell_size, cols, rows, cells = build_grid(geometry)
+    built = time.time()
+
+    grid_map = BPFMap(args.grid_map)
+    load(grid_map, config_map, cell_size, cols, rows, cells)
+    loaded = time.time()
+
+    covered = sum(1 for words in cells if any(words))
+    print(f"{len(geometry['cameras'])} cameras, {cols}x{rows} cells of {cell_size} units, "
+          f"{covered} cells covered")
+    print(f"Built in {(built - start) * 1000:.1f} ms, loaded in {(loaded - built) * 1000:.1f} ms")
+
+    grid_map.close()
+    config_map.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
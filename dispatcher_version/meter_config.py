@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+Configure the two-rate three-colour meters of stage2 (meter_config map,
+see bpf/stage2_video_filter.c), the XDP counterpart of the P4 bottleneck_m
+meter that scripts/set-bottleneck.sh sets.
+
+Over the committed rate (yellow) sub-layer non-reference slices are
+dropped, over the peak rate (red) every non-IRAP slice. IRAP frames always
+pass. Without --cir the committed rate equals the peak rate, which gives a
+single-rate meter like set-bottleneck.sh.
+
+Usage:
+    sudo python3 meter_config.py --aggregate --pir 200
+    sudo python3 meter_config.py --cameras 0-99 --cir 1.5 --pir 2 --pbs 64000
+    sudo python3 meter_config.py --cameras 0-99 --off
+    sudo python3 meter_config.py --aggregate --cameras 0-3 --show
+"""
+
+import argparse
+import struct
+import sys
+
+from bpf_maps import BPFMap
+from camera_decimation import NUM_CAMERAS, parse_cameras
+
+# Must match stage2_video_filter.c
+METER_AGGREGATE = NUM_CAMERAS
+CONFIG_FMT = "<QQQQ"
+CONFIG_SIZE = struct.calcsize(CONFIG_FMT)
+DEFAULT_BURST = 32000
+# Tokens are kept in bytes * METER_SCALE in a __u64; stage2 cuts rates
+# (bytes/s) and bursts (bytes) above METER_MAX_TOKENS to it
+METER_SCALE = 1000000000
+METER_MAX_TOKENS = (1 << 63) // METER_SCALE
+
+
+def mbps_to_bytes(mbps):
+    return int(mbps * 1e6 / 8)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Configure the stage2 video meters")
+    parser.add_argument("--cameras", help="per-camera meters, e.g. 0-99 or 1,5,7")
+    parser.add_argument("--aggregate", action="store_true", help="the meter of all cameras together")
+    parser.add_argument("--pir", type=float, help="peak rate, Mbit/s")
+    parser.add_argument("--cir", type=float, help="committed rate, Mbit/s (default: the peak rate)")
+    parser.add_argument("--pbs", type=int, default=DEFAULT_BURST, help="peak burst, bytes")
+    parser.add_argument("--cbs", type=int, help="committed burst, bytes (default: the peak burst)")
+    parser.add_argument("--off", action="store_true", help="turn the meters off")
+    parser.add_argument("--show", action="store_true", help="print the meters instead")
+    args = parser.parse_args()
+
+    try:
+        indexes = parse_cameras(args.cameras) if args.cameras else []
+    except ValueError as e:
+        parser.error(str(e))
+    if args.aggregate:
+        indexes.append(METER_AGGREGATE)
+    if not indexes:
+        parser.error("give --cameras and/or --aggregate")
+
+    configs = BPFMap("meter_config")
+
+    if args.show:
+        for index in indexes:
+            cir, cbs, pir, pbs = struct.unpack(CONFIG_FMT, configs.lookup(index, CONFIG_SIZE))
+            name = "aggregate" if index == METER_AGGREGATE else f"camera {index}"
+            if not pir:
+                print(f"{name}: off")
+            else:
+                print(f"{name}: cir {cir * 8 / 1e6:.2f} Mbit/s cbs {cbs} B, "
+                      f"pir {pir * 8 / 1e6:.2f} Mbit/s pbs {pbs} B")
+        configs.close()
+        return 0
+
+    if args.off:
+        value = struct.pack(CONFIG_FMT, 0, 0, 0, 0)
+    else:
+        if args.pir is None or args.pir <= 0:
+            parser.error("--pir must be given and positive")
+        cir = args.pir if args.cir is None else args.cir
+        cbs = args.pbs if args.cbs is None else args.cbs
+        if not 0 < cir <= args.pir:
+            parser.error("--cir must be positive and not above --pir")
+        if mbps_to_bytes(args.pir) > METER_MAX_TOKENS:
+            parser.error(f"--pir must be at most {METER_MAX_TOKENS * 8 / 1e6:.0f} Mbit/s")
+        if not 0 < cbs <= METER_MAX_TOKENS or not 0 < args.pbs <= METER_MAX_TOKENS:
+            parser.error(f"bursts must be positive and at most {METER_MAX_TOKENS} bytes")
+        value = struct.pack(CONFIG_FMT, mbps_to_bytes(cir), cbs, mbps_to_bytes(args.pir), args.pbs)
+
+    for index in indexes:
+        configs[index] = value
+    configs.close()
+
+    print(f"{'Turned off' if args.off else 'Set'} {len(indexes)} meter(s)")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
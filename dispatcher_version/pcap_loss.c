@@ -0,0 +1,839 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <linux/types.h>
+
+/* Loss and one-way delay from the TX (before the filter) and RX (after it)
+ * captures, replacing the scapy loop of actual_loss_from_stats.py. Both
+ * pcap and pcapng are streamed through a large read buffer, so the files
+ * may still be growing (-F follows them like tcpdump writes them).
+ *
+ * TX packets are keyed by (port, RTP seq, RTP timestamp) into a hash table;
+ * RX packets probe it. RX is only read up to the newest TX timestamp, so an
+ * RX packet never arrives before its TX packet, and a TX packet counts as
+ * lost once RX has moved grace seconds past it. Lost P-slice packets are the
+ * intended loss (what stage2 drops), all other lost packets unintended.
+ *
+ * Per interval of TX capture time one JSON record in the format
+ * influx_forwarder.py reads goes to stdout; -C adds one per camera. */
+
+#define READ_CHUNK (4 << 20)
+#define RTP_HDR_LEN 12
+#define MAX_IFACES 16
+/* Packets whose hash slots are prefetched together */
+#define BATCH 16
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+
+#define PCAPNG_SHB 0x0A0D0D0A
+#define PCAPNG_IDB 1
+#define PCAPNG_EPB 6
+#define PCAPNG_BOM 0x1A2B3C4D
+
+#define SLOT_EMPTY 0
+#define SLOT_TOMB (~0ULL)
+
+enum fmt {
+    FMT_UNKNOWN,
+    FMT_PCAP,
+    FMT_PCAPNG,
+};
+
+struct iface {
+    __u32 linktype;
+    __u64 ts_per_sec;       /* timestamp units per second */
+};
+
+struct reader {
+    const char *path;
+    int fd;
+    unsigned char *buf;
+    size_t start, end, size;
+    enum fmt fmt;
+    int swap;
+    struct iface ifaces[MAX_IFACES];
+    __u32 nr_ifaces;
+};
+
+/* One captured RTP packet */
+struct rtp_ref {
+    __u64 key;              /* port << 48 | seq << 32 | rtp_ts */
+    __u64 ts_ns;
+    __u16 port;
+    __u8 is_p;
+};
+
+struct tx_entry {
+    __u64 key;
+    __u64 tx_ns;
+    __u64 rx_ns;            /* 0 = not received (yet) */
+    __u16 port;
+    __u8 is_p;
+    __u8 replaced;          /* a later packet reused the key */
+};
+
+struct slot {
+    __u64 key;
+    __u64 ref;              /* absolute ring index + 1 */
+};
+
+/* TX packets in capture order, indexed by key */
+struct join {
+    struct tx_entry *ring;
+    __u64 head, tail, ring_mask;
+    struct slot *slots;
+    __u64 slot_mask, slots_used;
+};
+
+struct counts {
+    __u64 tx, tx_p, rx, lost, lost_p;
+    double delay_sum_ms;
+    __u64 delay_count;
+};
+
+struct window {
+    __u64 index;
+    int valid;
+    struct counts total;
+    struct counts *cameras;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -t tx.pcap -r rx.pcap [-i interval] [-P first-last] [-g grace] [-F] [-C]\n"
+            "  -t/-r  captures before and after the filter (pcap or pcapng)\n"
+            "  -i  seconds of TX capture time per record (default: 0.5)\n"
+            "  -P  camera port range (default: 5000-5099)\n"
+            "  -g  seconds after which an unmatched TX packet counts as lost (default: 1.0)\n"
+            "  -F  follow captures that are still being written, until interrupted\n"
+            "  -C  also print one record per camera\n",
+            prog);
+}
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __u32 rd32(const struct reader *r, const unsigned char *p)
+{
+    __u32 v;
+
+    memcpy(&v, p, 4);
+    return r->swap ? __builtin_bswap32(v) : v;
+}
+
+static __u16 rd16(const struct reader *r, const unsigned char *p)
+{
+    __u16 v;
+
+    memcpy(&v, p, 2);
+    return r->swap ? __builtin_bswap16(v) : v;
+}
+
+/* Makes need bytes available at buf + start; 0 when the file has fewer yet */
+static int reader_fill(struct reader *r, size_t need)
+{
+    if (r->end - r->start >= need)
+        return 1;
+
+    if (r->start) {
+        memmove(r->buf, r->buf + r->start, r->end - r->start);
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (need > r->size) {
+        unsigned char *buf = realloc(r->buf, need);
+
+        if (!buf)
+            return -ENOMEM;
+        r->buf = buf;
+        r->size = need;
+    }
+
+    while (r->end < need) {
+        ssize_t n = read(r->fd, r->buf + r->end, r->size - r->end);
+
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        if (!n)
+            return 0;
+        r->end += n;
+    }
+    return 1;
+}
+
+static int reader_open(struct reader *r, const char *path)
+{
+    memset(r, 0, sizeof(*r));
+    r->path = path;
+    r->fd = open(path, O_RDONLY);
+    if (r->fd < 0)
+        return -errno;
+    posix_fadvise(r->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    r->size = READ_CHUNK;
+    r->buf = malloc(r->size);
+    if (!r->buf) {
+        close(r->fd);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+static void reader_close(struct reader *r)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r->buf);
+}
+
+static __u64 ts_to_ns(__u64 ts, __u64 per_sec)
+{
+    if (per_sec == 1000000000ULL)
+        return ts;
+    if (per_sec == 1000000ULL)
+        return ts * 1000;
+    return (__u64)((unsigned __int128)ts * 1000000000ULL / per_sec);
+}
+
+/* if_tsresol of an interface description block, in units per second */
+static __u64 idb_ts_per_sec(const struct reader *r, const unsigned char *opt, const unsigned char *end)
+{
+    while (opt + 4 <= end) {
+        __u16 code = rd16(r, opt), len = rd16(r, opt + 2);
+
+        if (!code)
+            break;
+        if (code == 9 && len >= 1 && opt + 5 <= end) {
+            __u8 res = opt[4];
+            __u64 per_sec = 1;
+            int i;
+
+            if (res & 0x80)
+                return res & 0x7F ? 1ULL << (res & 0x7F) : 1;
+            for (i = 0; i < res && i < 19; i++)
+                per_sec *= 10;
+            return per_sec;
+        }
+        opt += 4 + ((len + 3) & ~3U);
+    }
+    return 1000000;
+}
+
+/* Next captured frame: 1 with *frame, *len, *linktype and *ts_ns set, 0 when
+ * no complete record is available (yet), negative on errors */
+static int reader_next(struct reader *r, const unsigned char **frame, __u32 *len, __u32 *linktype,
+                       __u64 *ts_ns)
+{
+    int err;
+
+    for (;;) {
+        if (r->fmt == FMT_UNKNOWN) {
+            __u32 magic;
+
+            err = reader_fill(r, 24);
+            if (err <= 0)
+                return err;
+            memcpy(&magic, r->buf + r->start, 4);
+            if (magic == PCAPNG_SHB) {
+                r->fmt = FMT_PCAPNG;
+                continue;
+            }
+            r->swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+            if (!r->swap && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+                fprintf(stderr, "%s is neither pcap nor pcapng\n", r->path);
+                return -EINVAL;
+            }
+            r->fmt = FMT_PCAP;
+            r->nr_ifaces = 1;
+            r->ifaces[0].linktype = rd32(r, r->buf + r->start + 20);
+            r->ifaces[0].ts_per_sec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1 ? 1000000000ULL : 1000000ULL;
+            r->start += 24;
+        }
+
+        if (r->fmt == FMT_PCAP) {
+            const unsigned char *rec;
+            __u32 incl;
+
+            err = reader_fill(r, 16);
+            if (err <= 0)
+                return err;
+            rec = r->buf + r->start;
+            incl = rd32(r, rec + 8);
+            if (incl > (1U << 24))
+                return -EINVAL;
+            err = reader_fill(r, 16 + incl);
+            if (err <= 0)
+                return err;
+            rec = r->buf + r->start;
+            *ts_ns = ts_to_ns((__u64)rd32(r, rec) * r->ifaces[0].ts_per_sec + rd32(r, rec + 4),
+                              r->ifaces[0].ts_per_sec);
+            *frame = rec + 16;
+            *len = incl;
+            *linktype = r->ifaces[0].linktype;
+            r->start += 16 + incl;
+            return 1;
+        }
+
+        /* pcapng: every block is type, total length, body, total length */
+        const unsigned char *blk;
+        __u32 type, blk_len;
+
+        err = reader_fill(r, 12);
+        if (err <= 0)
+            return err;
+        blk = r->buf + r->start;
+        memcpy(&type, blk, 4);
+        if (type == PCAPNG_SHB) {
+            __u32 bom;
+
+            memcpy(&bom, blk + 8, 4);
+            r->swap = bom != PCAPNG_BOM;
+            r->nr_ifaces = 0;
+        }
+        type = rd32(r, blk);
+        blk_len = rd32(r, blk + 4);
+        if (blk_len < 12 || blk_len > (1U << 24) || blk_len & 3)
+            return -EINVAL;
+        err = reader_fill(r, blk_len);
+        if (err <= 0)
+            return err;
+        blk = r->buf + r->start;
+        r->start += blk_len;
+
+        if (type == PCAPNG_IDB && blk_len >= 20 && r->nr_ifaces < MAX_IFACES) {
+            struct iface *ifc = &r->ifaces[r->nr_ifaces++];
+
+            ifc->linktype = rd16(r, blk + 8);
+            ifc->ts_per_sec = idb_ts_per_sec(r, blk + 16, blk + blk_len - 4);
+        } else if (type == PCAPNG_EPB && blk_len >= 32) {
+            __u32 ifc_id = rd32(r, blk + 8), caplen = rd32(r, blk + 20);
+            __u64 ts;
+
+            if (ifc_id >= r->nr_ifaces || 28 + caplen > blk_len - 4)
+                continue;
+            ts = (__u64)rd32(r, blk + 12) << 32 | rd32(r, blk + 16);
+            *ts_ns = ts_to_ns(ts, r->ifaces[ifc_id].ts_per_sec);
+            *frame = blk + 28;
+            *len = caplen;
+            *linktype = r->ifaces[ifc_id].linktype;
+            return 1;
+        }
+        /* Other blocks (statistics, name resolution, simple packets) carry nothing we use */
+    }
+}
+
+/* Offset of the UDP header in a captured frame, -1 if it is no IPv4/UDP */
+static int udp_offset(const unsigned char *frame, __u32 len, __u32 linktype)
+{
+    __u32 l3;
+    __u16 proto;
+
+    switch (linktype) {
+    case LINKTYPE_ETHERNET:
+        if (len < 14)
+            return -1;
+        proto = frame[12] << 8 | frame[13];
+        l3 = 14;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16)
+            return -1;
+        proto = frame[14] << 8 | frame[15];
+        l3 = 16;
+        break;
+    case LINKTYPE_RAW:
+        proto = 0x0800;
+        l3 = 0;
+        break;
+    default:
+        return -1;
+    }
+
+    if (proto != 0x0800 || len < l3 + 20 || (frame[l3] >> 4) != 4 || frame[l3 + 9] != IPPROTO_UDP)
+        return -1;
+    l3 += (frame[l3] & 0x0F) * 4;
+    return len >= l3 + 8 ? (int)l3 : -1;
+}
+
+/* The stage2 P-slice rule (must match bpf/stage2_video_filter.c): H.265 NAL
+ * types 1-9, or an FU (49) carrying one */
+static int is_p_slice(const unsigned char *rtp, __u32 len)
+{
+    __u8 nal_type;
+
+    if (len < RTP_HDR_LEN + 2)
+        return 0;
+    nal_type = (rtp[12] >> 1) & 0x3F;
+    if (nal_type == 49) {
+        if (len < RTP_HDR_LEN + 3)
+            return 0;
+        nal_type = rtp[14] & 0x3F;
+    }
+    return nal_type >= 1 && nal_type <= 9;
+}
+
+/* The RTP packet of a frame to or from a camera port, 0 if there is none */
+static int parse_rtp(const unsigned char *frame, __u32 len, __u32 linktype, __u16 first_port,
+                     __u16 last_port, __u64 ts_ns, struct rtp_ref *ref)
+{
+    const unsigned char *udp, *rtp;
+    __u16 sport, dport, port;
+    __u32 rtp_len;
+    int l4 = udp_offset(frame, len, linktype);
+
+    if (l4 < 0)
+        return 0;
+    udp = frame + l4;
+    sport = udp[0] << 8 | udp[1];
+    dport = udp[2] << 8 | udp[3];
+    if (dport >= first_port && dport <= last_port)
+        port = dport;
+    else if (sport >= first_port && sport <= last_port)
+        port = sport;
+    else
+        return 0;
+
+    rtp = udp + 8;
+    rtp_len = len - l4 - 8;
+    if (rtp_len < RTP_HDR_LEN || (rtp[0] >> 6) != 2)
+        return 0;
+
+    ref->port = port;
+    ref->key = (__u64)port << 48 | (__u64)(rtp[2] << 8 | rtp[3]) << 32 |
+               ((__u32)rtp[4] << 24 | rtp[5] << 16 | rtp[6] << 8 | rtp[7]);
+    ref->ts_ns = ts_ns;
+    ref->is_p = is_p_slice(rtp, rtp_len);
+    return 1;
+}
+
+/* Folds port and seq into the low bits first: cameras often share RTP
+ * timestamps, which alone would put them all on one probe chain */
+static inline __u64 key_hash(__u64 key)
+{
+    key ^= key >> 32;
+    key *= 0x9E3779B97F4A7C15ULL;
+    return key ^ (key >> 29);
+}
+
+static int join_init(struct join *j)
+{
+    memset(j, 0, sizeof(*j));
+    j->ring_mask = (1 << 16) - 1;
+    j->slot_mask = (1 << 17) - 1;
+    j->ring = malloc((j->ring_mask + 1) * sizeof(*j->ring));
+    j->slots = calloc(j->slot_mask + 1, sizeof(*j->slots));
+    return j->ring && j->slots ? 0 : -ENOMEM;
+}
+
+static void join_free(struct join *j)
+{
+    free(j->ring);
+    free(j->slots);
+}
+
+/* The key's slot, or the empty slot ending its probe sequence */
+static struct slot *join_find(const struct join *j, __u64 key)
+{
+    __u64 i = key_hash(key) & j->slot_mask;
+    struct slot *s;
+
+    for (;; i = (i + 1) & j->slot_mask) {
+        s = &j->slots[i];
+        if (s->ref == SLOT_EMPTY || (s->key == key && s->ref != SLOT_TOMB))
+            return s;
+    }
+}
+
+static struct tx_entry *join_lookup(const struct join *j, __u64 key)
+{
+    struct slot *s = join_find(j, key);
+
+    return s->ref == SLOT_EMPTY ? NULL : &j->ring[(s->ref - 1) & j->ring_mask];
+}
+
+/* Sizes the index for the live entries and drops its tombstones */
+static int join_rehash(struct join *j)
+{
+    __u64 live = j->tail - j->head, size = 1 << 17, abs;
+
+    while (size < live * 4)
+        size <<= 1;
+    free(j->slots);
+    j->slots = calloc(size, sizeof(*j->slots));
+    if (!j->slots)
+        return -ENOMEM;
+    j->slot_mask = size - 1;
+    j->slots_used = 0;
+    for (abs = j->head; abs != j->tail; abs++) {
+        struct tx_entry *e = &j->ring[abs & j->ring_mask];
+        struct slot *s;
+
+        /* A repeated key points at its newest packet only */
+        if (e->replaced)
+            continue;
+        s = join_find(j, e->key);
+        s->key = e->key;
+        s->ref = abs + 1;
+        j->slots_used++;
+    }
+    return 0;
+}
+
+static int join_insert(struct join *j, const struct rtp_ref *ref)
+{
+    struct tx_entry *e;
+    struct slot *s;
+
+    if (j->tail - j->head > j->ring_mask) {
+        __u64 cap = (j->ring_mask + 1) * 2, abs;
+        struct tx_entry *ring = malloc(cap * sizeof(*ring));
+
+        if (!ring)
+            return -ENOMEM;
+        for (abs = j->head; abs != j->tail; abs++)
+            ring[abs & (cap - 1)] = j->ring[abs & j->ring_mask];
+        free(j->ring);
+        j->ring = ring;
+        j->ring_mask = cap - 1;
+    }
+    if (j->slots_used * 2 > j->slot_mask && join_rehash(j))
+        return -ENOMEM;
+
+    /* Like the old dict, a repeated key replaces the earlier packet.
+     * Tombstones are not reused; join_rehash clears them. */
+    s = join_find(j, ref->key);
+    if (s->ref == SLOT_EMPTY) {
+        s->key = ref->key;
+        j->slots_used++;
+    } else {
+        j->ring[(s->ref - 1) & j->ring_mask].replaced = 1;
+    }
+    s->ref = j->tail + 1;
+
+    e = &j->ring[j->tail & j->ring_mask];
+    e->key = ref->key;
+    e->tx_ns = ref->ts_ns;
+    e->rx_ns = 0;
+    e->port = ref->port;
+    e->is_p = ref->is_p;
+    e->replaced = 0;
+    j->tail++;
+    return 0;
+}
+
+/* Removes the oldest entry from the index; the caller advances head */
+static void join_forget_head(struct join *j)
+{
+    struct tx_entry *e = &j->ring[j->head & j->ring_mask];
+
+    if (!e->replaced)
+        join_find(j, e->key)->ref = SLOT_TOMB;
+}
+
+static void join_prefetch(const struct join *j, const struct rtp_ref *refs, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+        __builtin_prefetch(&j->slots[key_hash(refs[i].key) & j->slot_mask]);
+}
+
+static int join_insert_batch(struct join *j, const struct rtp_ref *refs, int n)
+{
+    int i;
+
+    join_prefetch(j, refs, n);
+    for (i = 0; i < n; i++)
+        if (join_insert(j, &refs[i]))
+            return -ENOMEM;
+    return 0;
+}
+
+/* Marks the TX packets of the RX packets refs as received */
+static void join_match_batch(struct join *j, const struct rtp_ref *refs, int n)
+{
+    struct tx_entry *entries[BATCH];
+    int i;
+
+    join_prefetch(j, refs, n);
+    for (i = 0; i < n; i++) {
+        entries[i] = join_lookup(j, refs[i].key);
+        if (entries[i])
+            __builtin_prefetch(entries[i], 1);
+    }
+    for (i = 0; i < n; i++)
+        if (entries[i] && !entries[i]->rx_ns)
+            entries[i]->rx_ns = refs[i].ts_ns;
+}
+
+static void counts_add(struct counts *c, const struct tx_entry *e)
+{
+    c->tx++;
+    c->tx_p += e->is_p;
+    if (e->rx_ns) {
+        c->rx++;
+        if (e->rx_ns >= e->tx_ns) {
+            c->delay_sum_ms += (e->rx_ns - e->tx_ns) / 1e6;
+            c->delay_count++;
+        }
+    } else {
+        c->lost++;
+        c->lost_p += e->is_p;
+    }
+}
+
+static void print_counts(const struct counts *c, int camera)
+{
+    double tx = c->tx ? (double)c->tx : 1.0;
+    __u64 unintended = c->lost - c->lost_p;
+
+    printf("{");
+    if (camera >= 0)
+        printf("\"camera\": %d, ", camera);
+    printf("\"delay_ms\": %.3f, \"loss_percent\": %.3f, \"unintended_loss_percent\": %.3f, "
+           "\"total_tx_packets\": %llu, \"total_rx_packets\": %llu, \"total_lost_packets\": %llu, "
+           "\"total_unintended_lost_packets\": %llu, \"intended_loss_percent\": %.3f, "
+           "\"intended_lost_packets\": %llu}\n",
+           c->delay_count ? c->delay_sum_ms / c->delay_count : 0.0, c->lost * 100 / tx, unintended * 100 / tx,
+           (unsigned long long)c->tx, (unsigned long long)c->rx, (unsigned long long)c->lost,
+           (unsigned long long)unintended, c->lost_p * 100 / tx, (unsigned long long)c->lost_p);
+}
+
+static void window_emit(struct window *w, __u32 nr_cameras, int per_camera)
+{
+    __u32 i;
+
+    if (!w->valid || !w->total.tx)
+        return;
+    print_counts(&w->total, -1);
+    if (per_camera)
+        for (i = 0; i < nr_cameras; i++)
+            if (w->cameras[i].tx)
+                print_counts(&w->cameras[i], i);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    const char *tx_path = NULL, *rx_path = NULL;
+    double interval = 0.5, grace = 1.0;
+    int follow = 0, per_camera = 0, opt, rc = 1, have_pending = 0, tx_eof = 0, rx_eof = 0;
+    unsigned int first_port = 5000, last_port = 5099;
+    struct reader tx, rx;
+    struct join join = { 0 };
+    struct window win = { 0 };
+    struct rtp_ref pending, batch[BATCH];
+    __u64 interval_ns, grace_ns, t0 = 0, tx_wm = 0, rx_wm = 0, nr_frames = 0;
+    __u64 start = now_ns(), last_debug = start;
+    __u32 nr_cameras;
+
+    while ((opt = getopt(argc, argv, "t:r:i:P:g:FCh")) != -1) {
+        switch (opt) {
+        case 't':
+            tx_path = optarg;
+            break;
+        case 'r':
+            rx_path = optarg;
+            break;
+        case 'i':
+            interval = atof(optarg);
+            break;
+        case 'P':
+            if (sscanf(optarg, "%u-%u", &first_port, &last_port) != 2)
+                first_port = last_port + 1;
+            break;
+        case 'g':
+            grace = atof(optarg);
+            break;
+        case 'F':
+            follow = 1;
+            break;
+        case 'C':
+            per_camera = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!tx_path || !rx_path || interval <= 0 || grace < 0 || first_port > last_port || last_port > 65535) {
+        usage(argv[0]);
+        return 1;
+    }
+    interval_ns = (__u64)(interval * 1e9);
+    grace_ns = (__u64)(grace * 1e9);
+    nr_cameras = last_port - first_port + 1;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+
+    /* tcpdump may not have created the files yet */
+    while (reader_open(&tx, tx_path)) {
+        if (!follow || stop) {
+            fprintf(stderr, "Failed to open %s: %s\n", tx_path, strerror(errno));
+            return 1;
+        }
+        usleep(500000);
+    }
+    while (reader_open(&rx, rx_path)) {
+        if (!follow || stop) {
+            fprintf(stderr, "Failed to open %s: %s\n", rx_path, strerror(errno));
+            reader_close(&tx);
+            return 1;
+        }
+        usleep(500000);
+    }
+
+    win.cameras = calloc(nr_cameras, sizeof(*win.cameras));
+    if (!win.cameras || join_init(&join))
+        goto out_nomem;
+
+    while (!stop) {
+        const unsigned char *frame;
+        __u32 len, linktype;
+        __u64 ts;
+        int progress = 0, n, nb, err;
+
+        for (n = 0, nb = 0; n < 65536; n++) {
+            err = reader_next(&tx, &frame, &len, &linktype, &ts);
+            if (err < 0) {
+                fprintf(stderr, "Failed to read %s: %s\n", tx_path, strerror(-err));
+                goto out;
+            }
+            if (!err) {
+                tx_eof = !follow;
+                break;
+            }
+            nr_frames++;
+            if (!parse_rtp(frame, len, linktype, first_port, last_port, ts, &batch[nb]))
+                continue;
+            if (!t0)
+                t0 = ts;
+            if (ts > tx_wm)
+                tx_wm = ts;
+            if (++nb == BATCH) {
+                if (join_insert_batch(&join, batch, nb))
+                    goto out_nomem;
+                nb = 0;
+            }
+        }
+        if (join_insert_batch(&join, batch, nb))
+            goto out_nomem;
+        progress |= n;
+
+        /* RX only up to the newest TX, so its TX packet is already indexed */
+        for (n = 0, nb = 0; n < 65536; n++) {
+            if (!have_pending) {
+                err = reader_next(&rx, &frame, &len, &linktype, &ts);
+                if (err < 0) {
+                    fprintf(stderr, "Failed to read %s: %s\n", rx_path, strerror(-err));
+                    goto out;
+                }
+                if (!err) {
+                    rx_eof = !follow;
+                    break;
+                }
+                nr_frames++;
+                if (!parse_rtp(frame, len, linktype, first_port, last_port, ts, &pending))
+                    continue;
+                have_pending = 1;
+            }
+            if (pending.ts_ns > rx_wm)
+                rx_wm = pending.ts_ns;
+            if (pending.ts_ns > tx_wm && !tx_eof)
+                break;
+
+            batch[nb] = pending;
+            have_pending = 0;
+            if (++nb == BATCH) {
+                join_match_batch(&join, batch, nb);
+                nb = 0;
+            }
+        }
+        join_match_batch(&join, batch, nb);
+        progress |= n;
+
+        /* Settle the TX packets RX has moved grace past. If RX stalls while
+         * following (everything dropped), settle them later by TX time. */
+        while (join.head != join.tail) {
+            struct tx_entry *e = &join.ring[join.head & join.ring_mask];
+            __u64 w;
+
+            if (!rx_eof && e->tx_ns + grace_ns > rx_wm && (!follow || e->tx_ns + 4 * grace_ns > tx_wm))
+                break;
+
+            w = e->tx_ns > t0 ? (e->tx_ns - t0) / interval_ns : 0;
+            if (!win.valid || w > win.index) {
+                window_emit(&win, nr_cameras, per_camera);
+                memset(&win.total, 0, sizeof(win.total));
+                memset(win.cameras, 0, nr_cameras * sizeof(*win.cameras));
+                win.index = w;
+                win.valid = 1;
+            }
+            if (!e->replaced) {
+                counts_add(&win.total, e);
+                counts_add(&win.cameras[e->port - first_port], e);
+            }
+            join_forget_head(&join);
+            join.head++;
+        }
+
+        if (now_ns() - last_debug >= 10000000000ULL) {
+            fprintf(stderr, "[DEBUG] %llu frames read, %llu TX packets pending, window %llu: "
+                    "TX %llu (%llu P), lost %llu (%llu P)\n",
+                    (unsigned long long)nr_frames, (unsigned long long)(join.tail - join.head),
+                    (unsigned long long)win.index, (unsigned long long)win.total.tx,
+                    (unsigned long long)win.total.tx_p, (unsigned long long)win.total.lost,
+                    (unsigned long long)win.total.lost_p);
+            last_debug = now_ns();
+        }
+
+        if (tx_eof && rx_eof && join.head == join.tail)
+            break;
+        if (!progress)
+            usleep(50000);
+    }
+
+    /* The last, possibly partial, window */
+    window_emit(&win, nr_cameras, per_camera);
+    double secs = (now_ns() - start) / 1e9;
+    fprintf(stderr, "[SHUTDOWN] %llu frames in %.2f s (%.2f Mpps)\n", (unsigned long long)nr_frames, secs,
+            nr_frames / secs / 1e6);
+    rc = 0;
+    goto out;
+
+out_nomem:
+    fprintf(stderr, "Out of memory\n");
+out:
+    join_free(&join);
+    free(win.cameras);
+    reader_close(&tx);
+    reader_close(&rx);
+    return rc;
+}
@@ -0,0 +1,96 @@
+#!/usr/bin/env python3
+"""
+Set the stage order and enable mask of a tail-call pipeline (pipeline_config
+map, see bpf/pipeline.h). Stages are installed into stage_progs slots with
+attach_ext <obj> slot:<n> ...; a pipeline lists the slots in the order the
+packet visits them. Pipeline 0 ignores this map when pipeline_loader froze
+its order into the programs (freeze_pipeline = 1 in pipeline.conf).
+
+Usage:
+    sudo python3 pipeline_config.py --order 0,1          # run slot 0, then slot 1
+    sudo python3 pipeline_config.py --order 0,2,1 --enable 0,1
+    sudo python3 pipeline_config.py --disable-slot 2
+    sudo python3 pipeline_config.py --show
+"""
+
+import argparse
+import struct
+import sys
+
+from bpf_maps import BPFMap
+
+# Must match bpf/pipeline.h
+PIPELINE_MAX = 4
+PIPELINE_MAX_STAGES = 16
+CONFIG_FMT = f"<II{PIPELINE_MAX_STAGES}I"
+CONFIG_SIZE = struct.calcsize(CONFIG_FMT)
+
+
+def parse_slots(text):
+    slots = [int(s) for s in text.split(",") if s.strip() != ""]
+    for slot in slots:
+        if not 0 <= slot < PIPELINE_MAX_STAGES:
+            raise ValueError(f"slot {slot} out of range 0..{PIPELINE_MAX_STAGES - 1}")
+    return slots
+
+
+def read_config(config_map, pipeline):
+    nr_stages, enabled, *order = struct.unpack(CONFIG_FMT, config_map.lookup(pipeline, CONFIG_SIZE))
+    return order[:min(nr_stages, PIPELINE_MAX_STAGES)], enabled
+
+
+def write_config(config_map, pipeline, order, enabled):
+    padded = order + [0] * (PIPELINE_MAX_STAGES - len(order))
+    config_map[pipeline] = struct.pack(CONFIG_FMT, len(order), enabled, *padded)
+
+
+def mask_of(slots):
+    mask = 0
+    for slot in slots:
+        mask |= 1 << slot
+    return mask
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Configure the XDP stage pipeline")
+    parser.add_argument("--pipeline", type=int, default=0, help="pipeline to configure (default: 0)")
+    parser.add_argument("--order", help="comma separated stage_progs slots, in visiting order")
+    parser.add_argument("--enable", help="slots to enable (default with --order: all of them)")
+    parser.add_argument("--enable-slot", type=int, action="append", default=[], metavar="SLOT")
+    parser.add_argument("--disable-slot", type=int, action="append", default=[], metavar="SLOT")
+    parser.add_argument("--show", action="store_true", help="print the configuration")
+    parser.add_argument("--map", default="pipeline_config")
+    args = parser.parse_args()
+
+    if not 0 <= args.pipeline < PIPELINE_MAX:
+        parser.error(f"pipeline must be in 0..{PIPELINE_MAX - 1}")
+
+    config_map = BPFMap(args.map)
+    order, enabled = read_config(config_map, args.pipeline)
+
+    try:
+        if args.order is not None:
+            order = parse_slots(args.order)
+            if len(order) > PIPELINE_MAX_STAGES:
+                parser.error(f"at most {PIPELINE_MAX_STAGES} stages")
+            enabled = mask_of(parse_slots(args.enable) if args.enable is not None else order)
+        elif args.enable is not None:
+            enabled = mask_of(parse_slots(args.enable))
+        enabled |= mask_of(parse_slots(",".join(map(str, args.enable_slot))))
+        enabled &= ~mask_of(parse_slots(",".join(map(str, args.disable_slot))))
+    except ValueError as e:
+        parser.error(str(e))
+
+    if args.order is not None or args.enable is not None or args.enable_slot or args.disable_slot:
+        write_config(config_map, args.pipeline, order, enabled)
+
+    if args.show or args.order is None:
+        stages = " -> ".join(f"{slot}{'' if enabled & (1 << slot) else ' (off)'}" for slot in order)
+        print(f"pipeline {args.pipeline}: {stages or 'empty'}")
+
+    config_map.close()
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
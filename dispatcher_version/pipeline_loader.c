@@ -0,0 +1,747 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "xdp_obj.h"
+#include "pipeline_defs.h"
+#include "video_filter_defs.h"
+#include "xdp_dispatcher.skel.h"
+#include "stage0_parser.skel.h"
+#include "stage1_passthrough.skel.h"
+#include "stage2_video_filter.skel.h"
+
+/* One-shot loader for the whole pipeline: opens the dispatcher and stage
+ * skeletons (make skel), specialises them with the load-time constants of
+ * bpf/pipeline.h, shares the dispatcher's maps with the stages, installs
+ * the stages into stage_progs, seeds the camera maps in batches, pins
+ * everything under pin_dir and attaches the dispatcher. The maps are
+ * created by this run, so all stats start at zero.
+ *
+ * -r re-specialises a running pipeline after a load-time setting changed
+ * (forward mode, bridge, stage list): the programs are loaded again on
+ * the pinned maps, except generation_maps, which the new dispatcher gets
+ * fresh copies of. The new stages go into the new stage_progs, so the
+ * running pipeline never sees them, and one XDP_FLAGS_REPLACE swap of the
+ * dispatcher switches programs, stages and settings together. Map
+ * contents are kept; stage2's robot sweep moves to the new program with
+ * the next robot report (rearm_robot_sweep()). -r needs -c: settings the
+ * config does not give fall back to their defaults.
+ *
+ * Individual stages can later be replaced with attach_ext -u. */
+
+struct loader_config {
+    char iface[IF_NAMESIZE];
+    int native;
+    int respecialise;
+    char pin_dir[128];
+    char stages[PIPELINE_MAX_STAGES][16];
+    int nr_stages;
+    __u32 freeze_pipeline;
+    __u32 lazy_visibility;
+    __u64 robot_timeout_ms;
+    __u64 resync_timeout_ms;
+    __u32 gop_drop;
+    __u32 forward_mode;
+    char output_iface[IF_NAMESIZE];
+    char bridge_peer[IF_NAMESIZE];
+    __u32 bridge_mode;
+    __u32 cameras;
+    __u32 camera_mode;
+    __u32 camera_egress;
+    __u32 camera_max_tid;
+    __u32 filtering_mode;
+};
+
+/* Sets the load-time constants of bpf/pipeline.h in a skeleton before load.
+ * Every object carries its own copy, so all of them get the same values. */
+#define SET_PIPELINE_RODATA(skel, cfg, pcfg, output_ifindex, peer_ifindex)             \
+    do {                                                                                \
+        (skel)->rodata->cfg_bridge_mode = (cfg)->bridge_mode;                           \
+        (skel)->rodata->cfg_peer_ifindex = (peer_ifindex);                              \
+        (skel)->rodata->cfg_output_ifindex = (output_ifindex);                          \
+        (skel)->rodata->cfg_forward_mode = (cfg)->forward_mode;                         \
+        (skel)->rodata->cfg_frozen_pipeline = (cfg)->freeze_pipeline;                   \
+        (skel)->rodata->cfg_nr_stages = (pcfg)->nr_stages;                              \
+        (skel)->rodata->cfg_stages_enabled = (pcfg)->enabled;                           \
+        memcpy((void *)(skel)->rodata->cfg_stage_order, (pcfg)->order, sizeof((pcfg)->order)); \
+    } while (0)
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-r] [-c config] [key=value ...]\n"
+            "  Loads the dispatcher and its stages, seeds the maps and attaches to iface.\n"
+            "  key=value arguments override the config file (see pipeline.conf).\n"
+            "  -r  re-specialise the running pipeline on iface for the given config\n"
+            "      (-c required), keeping its maps, and swap the programs atomically\n",
+            prog);
+}
+
+static char *trim(char *s)
+{
+    char *end;
+
+    while (isspace((unsigned char)*s))
+        s++;
+    end = s + strlen(s);
+    while (end > s && isspace((unsigned char)end[-1]))
+        *--end = '\0';
+    return s;
+}
+
+static int parse_stages(struct loader_config *cfg, const char *value)
+{
+    char buf[256], *tok, *save = NULL;
+
+    snprintf(buf, sizeof(buf), "%s", value);
+    cfg->nr_stages = 0;
+    for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (cfg->nr_stages == PIPELINE_MAX_STAGES)
+            return -E2BIG;
+        snprintf(cfg->stages[cfg->nr_stages++], sizeof(cfg->stages[0]), "%s", trim(tok));
+    }
+    return 0;
+}
+
+static int set_option(struct loader_config *cfg, const char *key, const char *value)
+{
+    unsigned long long v = strtoull(value, NULL, 0);
+
+    if (!strcmp(key, "iface"))
+        snprintf(cfg->iface, sizeof(cfg->iface), "%s", value);
+    else if (!strcmp(key, "xdp_mode")) {
+        if (strcmp(value, "native") && strcmp(value, "generic"))
+            return -EINVAL;
+        cfg->native = !strcmp(value, "native");
+    }
+    else if (!strcmp(key, "pin_dir"))
+        snprintf(cfg->pin_dir, sizeof(cfg->pin_dir), "%s", value);
+    else if (!strcmp(key, "stages"))
+        return parse_stages(cfg, value);
+    else if (!strcmp(key, "freeze_pipeline"))
+        cfg->freeze_pipeline = v;
+    else if (!strcmp(key, "lazy_visibility"))
+        cfg->lazy_visibility = v;
+    else if (!strcmp(key, "robot_timeout_ms"))
+        cfg->robot_timeout_ms = v;
+    else if (!strcmp(key, "resync_timeout_ms"))
+        cfg->resync_timeout_ms = v;
+    else if (!strcmp(key, "gop_drop"))
+        cfg->gop_drop = v;
+    else if (!strcmp(key, "forward_mode")) {
+        if (!strcmp(value, "pass"))
+            cfg->forward_mode = FORWARD_PASS;
+        else if (!strcmp(value, "redirect"))
+            cfg->forward_mode = FORWARD_REDIRECT;
+        else if (!strcmp(value, "devmap"))
+            cfg->forward_mode = FORWARD_DEVMAP;
+        else
+            cfg->forward_mode = v;
+    } else if (!strcmp(key, "output_iface"))
+        snprintf(cfg->output_iface, sizeof(cfg->output_iface), "%s", value);
+    else if (!strcmp(key, "bridge_peer"))
+        snprintf(cfg->bridge_peer, sizeof(cfg->bridge_peer), "%s", value);
+    else if (!strcmp(key, "bridge_mode"))
+        cfg->bridge_mode = v;
+    else if (!strcmp(key, "cameras"))
+        cfg->cameras = v;
+    else if (!strcmp(key, "camera_mode"))
+        cfg->camera_mode = v;
+    else if (!strcmp(key, "camera_egress"))
+        cfg->camera_egress = v;
+    else if (!strcmp(key, "camera_max_tid"))
+        cfg->camera_max_tid = v;
+    else if (!strcmp(key, "filtering_mode"))
+        cfg->filtering_mode = v;
+    else
+        return -ENOENT;
+    return 0;
+}
+
+/* "key = value" per line, '#' starts a comment */
+static int parse_config_file(struct loader_config *cfg, const char *path)
+{
+    char line[512];
+    int lineno = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    while (fgets(line, sizeof(line), f)) {
+        char *hash = strchr(line, '#'), *sep, *key;
+
+        lineno++;
+        if (hash)
+            *hash = '\0';
+        key = trim(line);
+        if (!*key)
+            continue;
+
+        sep = strchr(key, '=');
+        if (!sep) {
+            fprintf(stderr, "%s:%d: expected key = value\n", path, lineno);
+            fclose(f);
+            return -EINVAL;
+        }
+        *sep = '\0';
+        if (set_option(cfg, trim(key), trim(sep + 1))) {
+            fprintf(stderr, "%s:%d: unknown or invalid option %s\n", path, lineno, trim(key));
+            fclose(f);
+            return -EINVAL;
+        }
+    }
+    fclose(f);
+    return 0;
+}
+
+/* Maps of the dispatcher that -r creates anew instead of reusing: they
+ * tie a dispatcher to its stages and settings, so the new ones are filled
+ * while the running dispatcher still uses the old ones, and the swap
+ * switches over in one step. Entries the loader does not set (stages
+ * attach_ext installed, other pipelines) are copied by inherit_entries(). */
+static const char *const generation_maps[] = { "stage_progs", "pipeline_config", "tx_ports" };
+
+#define NR_GENERATION_MAPS (sizeof(generation_maps) / sizeof(generation_maps[0]))
+
+static int is_generation_map(const struct bpf_map *map)
+{
+    size_t i;
+
+    for (i = 0; i < NR_GENERATION_MAPS; i++)
+        if (!strcmp(bpf_map__name(map), generation_maps[i]))
+            return 1;
+    return 0;
+}
+
+/* Lets obj use the pinned instance of every map pinned under pin_dir
+ * (-r: the running pipeline's maps) but the generation_maps. Maps without
+ * a pin are created. */
+static int reuse_pinned(struct bpf_object *obj, const char *pin_dir)
+{
+    struct bpf_map *map;
+    char path[256];
+    int fd, err;
+
+    bpf_object__for_each_map(map, obj) {
+        if (bpf_map__is_internal(map) || is_generation_map(map))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", pin_dir, bpf_map__name(map));
+        fd = bpf_obj_get(path);
+        if (fd < 0)
+            continue;
+        err = bpf_map__reuse_fd(map, fd);
+        close(fd);
+        if (err) {
+            fprintf(stderr, "Failed to reuse %s: %s\n", path, strerror(-err));
+            return err;
+        }
+    }
+    return 0;
+}
+
+/* Copies the entries of the running pipeline's pinned instance of a
+ * generation map into the new one; prog arrays hold program ids */
+static int inherit_entries(struct bpf_map *map, const char *pin_dir)
+{
+    __u32 key, value_size = bpf_map__value_size(map);
+    char path[256], value[sizeof(struct pipeline_config)];
+    int old_fd, err = 0;
+
+    if (value_size > sizeof(value))
+        return -E2BIG;
+    snprintf(path, sizeof(path), "%s/%s", pin_dir, bpf_map__name(map));
+    old_fd = bpf_obj_get(path);
+    if (old_fd < 0)
+        return 0;
+
+    for (key = 0; key < bpf_map__max_entries(map) && !err; key++) {
+        if (bpf_map_lookup_elem(old_fd, &key, value))
+            continue;
+        if (bpf_map__type(map) == BPF_MAP_TYPE_PROG_ARRAY) {
+            int prog_fd = bpf_prog_get_fd_by_id(*(__u32 *)value);
+
+            if (prog_fd < 0)
+                continue;
+            err = bpf_map_update_elem(bpf_map__fd(map), &key, &prog_fd, BPF_ANY) ? -errno : 0;
+            close(prog_fd);
+        } else {
+            err = bpf_map_update_elem(bpf_map__fd(map), &key, value, BPF_ANY) ? -errno : 0;
+        }
+    }
+    if (err)
+        fprintf(stderr, "Failed to copy %s: %s\n", path, strerror(-err));
+    close(old_fd);
+    return err;
+}
+
+/* Pins the maps of obj that are not pinned yet (shared maps come first
+ * through the dispatcher). Stale pins were removed by unpin_stale(). */
+static int pin_maps(struct bpf_object *obj, const char *pin_dir)
+{
+    struct bpf_map *map;
+    char path[256];
+    int err;
+
+    bpf_object__for_each_map(map, obj) {
+        if (bpf_map__is_internal(map))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", pin_dir, bpf_map__name(map));
+        if (!access(path, F_OK))
+            continue;
+        err = bpf_map__pin(map, path);
+        if (err) {
+            fprintf(stderr, "Failed to pin map %s: %s\n", path, strerror(-err));
+            return err;
+        }
+    }
+    return 0;
+}
+
+static void unpin_stale(struct bpf_object *obj, const char *pin_dir)
+{
+    struct bpf_map *map;
+    char path[256];
+
+    bpf_object__for_each_map(map, obj) {
+        if (bpf_map__is_internal(map))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", pin_dir, bpf_map__name(map));
+        unlink(path);
+    }
+}
+
+/* Pins fd next to path and renames it over path, so a re-specialised
+ * program or generation map replaces the pin without a moment where path
+ * is missing */
+static int replace_pin(int fd, const char *path)
+{
+    char tmp_path[256];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.new", path);
+    unlink(tmp_path);
+    if (bpf_obj_pin(fd, tmp_path) || rename(tmp_path, path)) {
+        fprintf(stderr, "Failed to pin %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return -errno;
+    }
+    return 0;
+}
+
+static int pin_prog(struct bpf_program *prog, const char *path)
+{
+    return replace_pin(bpf_program__fd(prog), path);
+}
+
+/* After the swap: the pins of the generation maps follow the dispatcher */
+static int repin_generation_maps(struct bpf_object *obj, const char *pin_dir)
+{
+    struct bpf_map *map;
+    char path[256];
+
+    bpf_object__for_each_map(map, obj) {
+        if (!is_generation_map(map))
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", pin_dir, bpf_map__name(map));
+        if (replace_pin(bpf_map__fd(map), path))
+            return -1;
+    }
+    return 0;
+}
+
+/* After the swap: the reused visibility_state still has the old stage2's
+ * sweep timer armed, which runs the old program with its robot_timeout_ns.
+ * Rewriting the entry frees that timer, and ROBOTS_REARM makes the next
+ * robot report arm the new stage2's; until then no robot expires. The
+ * epoch moves on, so that a change the rewrite overwrote is still seen. */
+static int rearm_robot_sweep(struct bpf_map *map)
+{
+    struct visibility_state vs;
+    __u32 key = 0;
+
+    if (bpf_map_lookup_elem(bpf_map__fd(map), &key, &vs))
+        return -errno;
+    if (vs.robots_seen == ROBOTS_NONE)
+        return 0;
+    vs.robots_seen = ROBOTS_REARM;
+    vs.epoch++;
+    return bpf_map_update_elem(bpf_map__fd(map), &key, &vs, BPF_EXIST) ? -errno : 0;
+}
+
+/* Replaces the program attached to ifindex by prog_fd in one step. Fails
+ * if no program or another one than found is attached by then. */
+static int replace_xdp(__u32 ifindex, int prog_fd, __u32 flags)
+{
+    LIBBPF_OPTS(bpf_xdp_attach_opts, opts);
+    __u32 old_id = 0;
+    int err;
+
+    err = bpf_xdp_query_id(ifindex, flags, &old_id);
+    if (err || !old_id) {
+        fprintf(stderr, "No XDP program attached to re-specialise\n");
+        return err ? err : -ENOENT;
+    }
+    opts.old_prog_fd = bpf_prog_get_fd_by_id(old_id);
+    if (opts.old_prog_fd < 0)
+        return -errno;
+    err = bpf_xdp_attach(ifindex, prog_fd, flags | XDP_FLAGS_REPLACE, &opts);
+    close(opts.old_prog_fd);
+    return err;
+}
+
+/* One batch update for the whole array, element by element on kernels
+ * without batch support for the map type */
+static int seed_u32_map(struct bpf_map *map, const __u32 *keys, const __u32 *values, __u32 count)
+{
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    int fd = bpf_map__fd(map);
+    __u32 n = count, i;
+
+    if (!count || !bpf_map_update_batch(fd, keys, values, &n, &opts))
+        return 0;
+
+    for (i = 0; i < count; i++) {
+        if (bpf_map_update_elem(fd, &keys[i], &values[i], BPF_ANY)) {
+            fprintf(stderr, "Failed to seed %s: %s\n", bpf_map__name(map), strerror(errno));
+            return -errno;
+        }
+    }
+    return 0;
+}
+
+static int seed_camera_map(struct bpf_map *map, __u32 cameras, __u32 value)
+{
+    __u32 *keys, *values, i;
+    int err;
+
+    if (cameras > bpf_map__max_entries(map)) {
+        fprintf(stderr, "%u cameras, %s holds %u\n", cameras, bpf_map__name(map), bpf_map__max_entries(map));
+        return -E2BIG;
+    }
+
+    keys = calloc(cameras ? cameras : 1, sizeof(__u32));
+    values = calloc(cameras ? cameras : 1, sizeof(__u32));
+    if (!keys || !values) {
+        free(keys);
+        free(values);
+        return -ENOMEM;
+    }
+    for (i = 0; i < cameras; i++) {
+        keys[i] = i;
+        values[i] = value;
+    }
+    err = seed_u32_map(map, keys, values, cameras);
+    free(keys);
+    free(values);
+    return err;
+}
+
+static int ifindex_of(const char *name, __u32 *ifindex)
+{
+    *ifindex = 0;
+    if (!name[0])
+        return 0;
+    *ifindex = if_nametoindex(name);
+    if (!*ifindex) {
+        fprintf(stderr, "Unknown interface %s\n", name);
+        return -ENODEV;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct loader_config cfg = {
+        .pin_dir = "/sys/fs/bpf/xdp_pipeline",
+        .stages = { "parser", "stage2" },
+        .nr_stages = 2,
+        .robot_timeout_ms = 2000,
+        .resync_timeout_ms = 1000,
+        .gop_drop = 1,
+        .cameras = 100,
+        .camera_max_tid = 6,
+    };
+    const char *config_path = NULL;
+    struct xdp_dispatcher *disp = NULL;
+    struct stage0_parser *s0 = NULL;
+    struct stage1_passthrough *s1 = NULL;
+    struct stage2_video_filter *s2 = NULL;
+    struct pipeline_config pcfg = { 0 };
+    __u32 ifindex, output_ifindex, peer_ifindex;
+    double t_start, t_loaded, t_seeded, t_attached;
+    int opt, err, i, rc = 1;
+
+    while ((opt = getopt(argc, argv, "rc:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            cfg.respecialise = 1;
+            break;
+        case 'c':
+            config_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config_path && parse_config_file(&cfg, config_path))
+        return 1;
+    for (i = optind; i < argc; i++) {
+        char *sep = strchr(argv[i], '=');
+        if (!sep) {
+            fprintf(stderr, "Expected key=value, got %s\n", argv[i]);
+            return 1;
+        }
+        *sep = '\0';
+        if (set_option(&cfg, argv[i], sep + 1)) {
+            fprintf(stderr, "Unknown or invalid option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if (!cfg.iface[0]) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (cfg.respecialise && !config_path) {
+        fprintf(stderr, "-r needs the pipeline's config (-c), settings missing from it would be reset\n");
+        return 1;
+    }
+    if (ifindex_of(cfg.iface, &ifindex) || ifindex_of(cfg.output_iface, &output_ifindex) ||
+        ifindex_of(cfg.bridge_peer, &peer_ifindex))
+        return 1;
+
+    /* Stage i goes into slot i; frozen into the programs with freeze_pipeline */
+    for (i = 0; i < cfg.nr_stages; i++) {
+        pcfg.order[pcfg.nr_stages++] = i;
+        pcfg.enabled |= 1U << i;
+    }
+
+    t_start = now_ms();
+
+    disp = xdp_dispatcher__open();
+    if (!disp) {
+        fprintf(stderr, "Failed to open the dispatcher: %s\n", strerror(errno));
+        goto out;
+    }
+    SET_PIPELINE_RODATA(disp, &cfg, &pcfg, output_ifindex, peer_ifindex);
+    /* Run-time settings (pipeline_runtime) survive re-specialisation */
+    if (cfg.respecialise) {
+        char path[256];
+        int fd;
+
+        snprintf(path, sizeof(path), "%s/dispatcher_data", cfg.pin_dir);
+        fd = bpf_obj_get(path);
+        if (fd >= 0) {
+            err = bpf_map__reuse_fd(disp->maps.data, fd);
+            close(fd);
+            if (err) {
+                fprintf(stderr, "Failed to reuse %s: %s\n", path, strerror(-err));
+                goto out;
+            }
+        }
+    }
+    if ((cfg.respecialise && reuse_pinned(disp->obj, cfg.pin_dir)) || xdp_dispatcher__load(disp)) {
+        fprintf(stderr, "Failed to load the dispatcher\n");
+        goto out;
+    }
+    if (cfg.respecialise) {
+        struct bpf_map *map;
+
+        bpf_object__for_each_map(map, disp->obj)
+            if (is_generation_map(map) && inherit_entries(map, cfg.pin_dir))
+                goto out;
+    }
+
+    for (i = 0; i < cfg.nr_stages; i++) {
+        struct bpf_program *prog;
+        __u32 slot = i;
+        int prog_fd;
+
+        if (!strcmp(cfg.stages[i], "parser") && !s0) {
+            s0 = stage0_parser__open();
+            if (!s0) {
+                fprintf(stderr, "Failed to open parser: %s\n", strerror(errno));
+                goto out;
+            }
+            SET_PIPELINE_RODATA(s0, &cfg, &pcfg, output_ifindex, peer_ifindex);
+            if ((cfg.respecialise && reuse_pinned(s0->obj, cfg.pin_dir)) ||
+                share_maps(s0->obj, disp->obj) || stage0_parser__load(s0)) {
+                fprintf(stderr, "Failed to load parser\n");
+                goto out;
+            }
+            prog = s0->progs.parser;
+        } else if (!strcmp(cfg.stages[i], "stage1") && !s1) {
+            s1 = stage1_passthrough__open();
+            if (!s1) {
+                fprintf(stderr, "Failed to open stage1: %s\n", strerror(errno));
+                goto out;
+            }
+            SET_PIPELINE_RODATA(s1, &cfg, &pcfg, output_ifindex, peer_ifindex);
+            if ((cfg.respecialise && reuse_pinned(s1->obj, cfg.pin_dir)) ||
+                share_maps(s1->obj, disp->obj) || stage1_passthrough__load(s1)) {
+                fprintf(stderr, "Failed to load stage1\n");
+                goto out;
+            }
+            prog = s1->progs.stage1;
+        } else if (!strcmp(cfg.stages[i], "stage2") && !s2) {
+            s2 = stage2_video_filter__open();
+            if (!s2) {
+                fprintf(stderr, "Failed to open stage2: %s\n", strerror(errno));
+                goto out;
+            }
+            SET_PIPELINE_RODATA(s2, &cfg, &pcfg, output_ifindex, peer_ifindex);
+            s2->rodata->lazy_visibility = cfg.lazy_visibility;
+            s2->rodata->robot_timeout_ns = cfg.robot_timeout_ms * 1000000ULL;
+            s2->rodata->resync_timeout_ns = cfg.resync_timeout_ms * 1000000ULL;
+            s2->rodata->gop_drop = cfg.gop_drop;
+            if ((cfg.respecialise && reuse_pinned(s2->obj, cfg.pin_dir)) ||
+                share_maps(s2->obj, disp->obj) || stage2_video_filter__load(s2)) {
+                fprintf(stderr, "Failed to load stage2\n");
+                goto out;
+            }
+            prog = s2->progs.stage2;
+        } else {
+            fprintf(stderr, "Unknown or repeated stage %s\n", cfg.stages[i]);
+            goto out;
+        }
+
+        /* -r: the new stage_progs, unused until the dispatcher swap */
+        prog_fd = bpf_program__fd(prog);
+        if (bpf_map_update_elem(bpf_map__fd(disp->maps.stage_progs), &slot, &prog_fd, BPF_ANY)) {
+            fprintf(stderr, "Failed to install %s into slot %u: %s\n", cfg.stages[i], slot, strerror(errno));
+            goto out;
+        }
+    }
+
+    t_loaded = now_ms();
+
+    if (output_ifindex) {
+        __u32 key = TX_PORT_OUTPUT;
+        if (bpf_map_update_elem(bpf_map__fd(disp->maps.tx_ports), &key, &output_ifindex, BPF_ANY)) {
+            fprintf(stderr, "Failed to set tx_ports[%u]: %s\n", key, strerror(errno));
+            goto out;
+        }
+    }
+    if (peer_ifindex) {
+        __u32 key = TX_PORT_PEER;
+        if (bpf_map_update_elem(bpf_map__fd(disp->maps.tx_ports), &key, &peer_ifindex, BPF_ANY)) {
+            fprintf(stderr, "Failed to set tx_ports[%u]: %s\n", key, strerror(errno));
+            goto out;
+        }
+    }
+    /* A re-specialised pipeline keeps the camera state it has */
+    if (s2 && !cfg.respecialise) {
+        __u32 key = 0;
+
+        if (seed_camera_map(s2->maps.camera_filtering_mode, cfg.cameras, cfg.camera_mode) ||
+            seed_camera_map(s2->maps.camera_egress, cfg.cameras, cfg.camera_egress) ||
+            seed_camera_map(s2->maps.camera_max_tid, cfg.cameras, cfg.camera_max_tid) ||
+            seed_u32_map(s2->maps.filtering_mode, &key, &cfg.filtering_mode, 1))
+            goto out;
+    }
+
+    /* Last, so that no packet enters a half-seeded pipeline. With
+     * freeze_pipeline the programs ignore it, but tools still show it. */
+    {
+        __u32 key = 0;
+        if (bpf_map_update_elem(bpf_map__fd(disp->maps.pipeline_config), &key, &pcfg, BPF_ANY)) {
+            fprintf(stderr, "Failed to set pipeline_config: %s\n", strerror(errno));
+            goto out;
+        }
+    }
+
+    if (mkdir(cfg.pin_dir, 0700) && errno != EEXIST) {
+        fprintf(stderr, "Failed to create %s: %s\n", cfg.pin_dir, strerror(errno));
+        goto out;
+    }
+    if (!cfg.respecialise) {
+        char path[256];
+
+        unpin_stale(disp->obj, cfg.pin_dir);
+        if (s0)
+            unpin_stale(s0->obj, cfg.pin_dir);
+        if (s1)
+            unpin_stale(s1->obj, cfg.pin_dir);
+        if (s2)
+            unpin_stale(s2->obj, cfg.pin_dir);
+
+        snprintf(path, sizeof(path), "%s/dispatcher_data", cfg.pin_dir);
+        unlink(path);
+        err = bpf_map__pin(disp->maps.data, path);
+        if (err) {
+            fprintf(stderr, "Failed to pin %s: %s\n", path, strerror(-err));
+            goto out;
+        }
+    }
+    if (pin_maps(disp->obj, cfg.pin_dir) ||
+        (s0 && pin_maps(s0->obj, cfg.pin_dir)) ||
+        (s1 && pin_maps(s1->obj, cfg.pin_dir)) ||
+        (s2 && pin_maps(s2->obj, cfg.pin_dir)))
+        goto out;
+
+    t_seeded = now_ms();
+
+    /* Switches dispatcher, stages and generation maps at once */
+    if (cfg.respecialise)
+        err = replace_xdp(ifindex, bpf_program__fd(disp->progs.xdp_dispatcher),
+                          cfg.native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE);
+    else
+        err = bpf_xdp_attach(ifindex, bpf_program__fd(disp->progs.xdp_dispatcher),
+                             cfg.native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE, NULL);
+    if (err) {
+        fprintf(stderr, "Failed to attach to %s (%s mode): %s\n",
+                cfg.iface, cfg.native ? "native" : "generic", strerror(-err));
+        goto out;
+    }
+
+    if (cfg.respecialise && s2) {
+        err = rearm_robot_sweep(s2->maps.visibility_state);
+        if (err)
+            fprintf(stderr, "Warning: robots keep the old robot_timeout_ms: %s\n", strerror(-err));
+    }
+
+    /* Pinned once attached, so the pins always show what runs */
+    if ((cfg.respecialise && repin_generation_maps(disp->obj, cfg.pin_dir)) ||
+        pin_prog(disp->progs.xdp_dispatcher, "/sys/fs/bpf/xdp_disp") ||
+        (s0 && pin_prog(s0->progs.parser, "/sys/fs/bpf/parser_prog")) ||
+        (s1 && pin_prog(s1->progs.stage1, "/sys/fs/bpf/stage1_prog")) ||
+        (s2 && pin_prog(s2->progs.stage2, "/sys/fs/bpf/stage2_prog")))
+        goto out;
+
+    t_attached = now_ms();
+
+    printf("Pipeline on %s (%s): %d stages%s, %u cameras%s\n",
+           cfg.iface, cfg.native ? "native" : "generic", cfg.nr_stages,
+           cfg.freeze_pipeline ? " (frozen)" : "", cfg.cameras, cfg.respecialise ? ", re-specialised" : "");
+    printf("Loaded in %.1f ms (load %.1f, seed+pin %.1f, attach %.1f)\n",
+           t_attached - t_start, t_loaded - t_start, t_seeded - t_loaded, t_attached - t_seeded);
+    rc = 0;
+
+out:
+    /* Pins and the attachment keep everything alive after exit */
+    stage2_video_filter__destroy(s2);
+    stage1_passthrough__destroy(s1);
+    stage0_parser__destroy(s0);
+    xdp_dispatcher__destroy(disp);
+    return rc;
+}
@@ -3,80 +3,11 @@
 import time
 import math
 import argparse
-import ctypes
-import os
-from ctypes import c_int, c_uint32, c_uint64, c_void_p, POINTER
+import socket
+import struct
 
-libc = ctypes.CDLL("libc.so.6", use_errno=True)
+from bpf_maps import BPFMap
 
-BPF_MAP_UPDATE_ELEM = 2
-BPF_ANY = 0
-
-def bpf_obj_get(pathname):
-    """Open a pinned BPF object and return its file descriptor"""
-    BPF_OBJ_GET = 7
-    
-    class bpf_attr_obj_get(ctypes.Structure):
-        _fields_ = [
-            ("pathname", c_uint64),
-            ("bpf_fd", c_uint32),
-            ("file_flags", c_uint32),
-        ]
-    
-    path_bytes = pathname.encode('utf-8') + b'\0'
-    path_buf = ctypes.create_string_buffer(path_bytes)
-    
-    attr = bpf_attr_obj_get()
-    attr.pathname = ctypes.cast(path_buf, c_void_p).value
-    attr.bpf_fd = 0
-    attr.file_flags = 0
-    
-    fd = libc.syscall(321, BPF_OBJ_GET, ctypes.byref(attr), ctypes.sizeof(attr))
-    if fd < 0:
-        errno = ctypes.get_errno()
-        raise OSError(errno, f"Failed to open pinned BPF map {pathname}: {os.strerror(errno)}")
-    
-    return fd
-
-def bpf_map_update(map_fd, key, value):
-    """Update BPF map element"""
-    class bpf_attr_map_elem(ctypes.Structure):
-        _fields_ = [
-            ("map_fd", c_uint32),
-            ("_pad1", c_uint32),
-            ("key", c_uint64),
-            ("value", c_uint64),
-            ("flags", c_uint64),
-        ]
-    
-    attr = bpf_attr_map_elem()
-    attr.map_fd = map_fd
-    attr.key = ctypes.cast(ctypes.byref(key), c_void_p).value
-    attr.value = ctypes.cast(ctypes.byref(value), c_void_p).value
-    attr.flags = BPF_ANY
-    
-    ret = libc.syscall(321, BPF_MAP_UPDATE_ELEM, ctypes.byref(attr), ctypes.sizeof(attr))
-    if ret < 0:
-        errno = ctypes.get_errno()
-        raise OSError(errno, f"Failed to update BPF map: {os.strerror(errno)}")
-
-class BPFMap:
-    """Simple wrapper for pinned BPF map access"""
-    def __init__(self, path):
-        self.fd = bpf_obj_get(path)
-        self.path = path
-    
-    def __setitem__(self, key, value):
-        if not isinstance(key, c_uint32):
-            key = c_uint32(key)
-        if not isinstance(value, c_uint32):
-            value = c_uint32(value)
-        bpf_map_update(self.fd, key, value)
-    
-    def close(self):
-        if self.fd >= 0:
-            os.close(self.fd)
-            self.fd = -1
 
 def circular_path(center_x, center_y, radius, duration_seconds, update_hz):
     total_updates = int(duration_seconds * update_hz)
@@ -107,27 +38,39 @@ def circular_path(center_x, center_y, radius, duration_seconds, update_hz):
             
             yield (x, y)
 
-def update_camera_modes(camera_map, robot_coords_map, x, y):
+def update_camera_modes(camera_map, robot_coords_map, positions):
     """
-    Update camera filtering modes based on robot position
+    Update camera filtering modes based on robot positions
     Directly updates BPF maps from userspace
+    A camera is unfiltered if any of the robots is in its view
     """
-    horizontal_camera = min(49, y // 20)
-    vertical_camera = 50 + min(49, x // 20)
+    visible_cameras = set()
+    for x, y in positions:
+        visible_cameras.add(min(49, y // 20))
+        visible_cameras.add(50 + min(49, x // 20))
     
     # Update all 100 cameras
     MODE_OFF = 0
     MODE_DROP_P = 1
     
     for camera_id in range(100):
-        if camera_id == horizontal_camera or camera_id == vertical_camera:
+        if camera_id in visible_cameras:
             camera_map[camera_id] = MODE_OFF
         else:
             camera_map[camera_id] = MODE_DROP_P
     
+    x, y = positions[0]
     robot_coords_map[0] = x
     robot_coords_map[1] = y
 
+def send_positions(sock, dst, positions):
+    """
+    Report robot positions as position packets (x, y, robot_id),
+    leaving the camera mode updates to the XDP stage
+    """
+    for robot_id, (x, y) in enumerate(positions):
+        sock.sendto(struct.pack('!III', x, y, robot_id), dst)
+
 def main():
     parser = argparse.ArgumentParser(description='Robot simulator with direct BPF map updates')
     parser.add_argument('--center-x', type=int, default=500, help='Circle center X (default: 500)')
@@ -140,28 +83,43 @@ def main():
                         help='Path to camera_filtering_mode BPF map')
     parser.add_argument('--coords-map-path', default='/sys/fs/bpf/xdp_pipeline/robot_coords_debug',
                         help='Path to robot_coords_debug BPF map')
+    parser.add_argument('--robots', type=int, default=1,
+                        help='Number of robots, spread evenly along the path (default: 1)')
+    parser.add_argument('--dst-ip', default=None,
+                        help='Send position packets to this address instead of updating the maps directly')
+    parser.add_argument('--dst-port', type=int, default=5555, help='Position packet UDP port (default: 5555)')
     
     args = parser.parse_args()
     
-    print(f"Robot Simulator Starting (Direct BPF Map Updates)")
-    print(f"Camera filtering map: {args.map_path}")
-    print(f"Robot coords map: {args.coords_map_path}")
+    if args.dst_ip:
+        print(f"Robot Simulator Starting (Position Packets to {args.dst_ip}:{args.dst_port})")
+    else:
+        print(f"Robot Simulator Starting (Direct BPF Map Updates)")
+        print(f"Camera filtering map: {args.map_path}")
+        print(f"Robot coords map: {args.coords_map_path}")
+    print(f"Robots: {args.robots}")
     print(f"Circular path: center=({args.center_x}, {args.center_y}), radius={args.radius}")
     print(f"Duration: {args.duration} seconds/round")
     print(f"Update rate: {args.update_hz} Hz")
     print(f"Loops: {'infinite' if args.loops == 0 else args.loops}")
     print()
     
-    try:
-        camera_map = BPFMap(args.map_path)
-        robot_coords_map = BPFMap(args.coords_map_path)
-        print(f"Successfully opened BPF maps")
-        print(f"Camera map FD: {camera_map.fd}")
-        print(f"Robot coords map FD: {robot_coords_map.fd}")
-    except Exception as e:
-        print(f"Failed to open BPF maps: {e}")
-        print(f"Make sure XDP programs are loaded and maps are pinned")
-        return 1
+    camera_map = None
+    robot_coords_map = None
+    sock = None
+    if args.dst_ip:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    else:
+        try:
+            camera_map = BPFMap(args.map_path)
+            robot_coords_map = BPFMap(args.coords_map_path)
+            print(f"Successfully opened BPF maps")
+            print(f"Camera map FD: {camera_map.fd}")
+            print(f"Robot coords map FD: {robot_coords_map.fd}")
+        except Exception as e:
+            print(f"Failed to open BPF maps: {e}")
+            print(f"Make sure XDP programs are loaded and maps are pinned")
+            return 1
     
     sleep_time = 1.0 / args.update_hz
     
@@ -173,9 +131,16 @@ def main():
             
             start_time = time.time()
             
-            for x, y in circular_path(args.center_x, args.center_y, args.radius, 
-                                     args.duration, args.update_hz):
-                update_camera_modes(camera_map, robot_coords_map, x, y)
+            path = list(circular_path(args.center_x, args.center_y, args.radius,
+                                      args.duration, args.update_hz))
+            spacing = max(1, len(path) // args.robots)
+            
+            for step, (x, y) in enumerate(path):
+                positions = [path[(step + i * spacing) % len(path)] for i in range(args.robots)]
+                if sock:
+                    send_positions(sock, (args.dst_ip, args.dst_port), positions)
+                else:
+                    update_camera_modes(camera_map, robot_coords_map, positions)
                 print(f"  Position: ({x:4d}, {y:4d})", end='\r')
                 
                 time.sleep(sleep_time)
@@ -190,8 +155,12 @@ def main():
     except KeyboardInterrupt:
         print("\n\nStopped by user")
     finally:
-        camera_map.close()
-        robot_coords_map.close()
+        if camera_map:
+            camera_map.close()
+        if robot_coords_map:
+            robot_coords_map.close()
+        if sock:
+            sock.close()
         print(f"Total rounds completed: {loop_count}")
         return 0
 
@@ -0,0 +1,622 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <linux/types.h>
+
+/* Multi-camera RTP/H.265 traffic generator. Loads the RTP packets of one
+ * recorded stream from a pcap once, then replays them as num_cameras
+ * virtual cameras from a single process: camera i sends to port
+ * base_port + i with its own SSRC, sequence numbers and RTP timestamps,
+ * at the packet times of the capture, shifted by a per-camera phase so
+ * the cameras' frames do not line up. The capture is looped seamlessly
+ * (timestamps and sequence numbers keep counting).
+ *
+ * Sends go out in sendmmsg batches of everything that is due, so one core
+ * can drive far more streams than one encoder per camera.
+ *
+ * Like a real encoder, a camera answers an RTCP PLI or FIR (sent to the
+ * RTP source port + 1) with a keyframe: its next frame is the next IRAP
+ * frame of the capture, with sequence numbers, timestamps and send times
+ * carrying on. Make a capture once with e.g.
+ *
+ *   tcpdump -i lo -w cam.pcap udp port 5999 &
+ *   ffmpeg -f lavfi -i testsrc=size=1280x720:rate=30 -t 4 -c:v libx265 \
+ *       -x265-params keyint=4:bframes=0 -f rtp rtp://127.0.0.1:5999 */
+
+#define BATCH 64
+#define MAX_PAYLOAD 1500
+#define RTP_HDR_LEN 12
+#define RTP_CLOCK 90000
+/* Sleep instead of spinning when the next packet is further away */
+#define SPIN_NS 50000
+/* How often incoming RTCP is checked for keyframe requests */
+#define RTCP_POLL_NS 1000000
+#define SSRC_BASE 0x10000000
+
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+
+struct rtp_pkt {
+    __u64 offset_ns;        /* from the first packet of the capture */
+    __u32 rtp_ts;           /* relative to the first packet */
+    __u16 seq;              /* relative to the first packet */
+    __u16 len;
+    int keyframe;           /* first packet of a frame holding an IRAP slice */
+    unsigned char *data;
+};
+
+struct capture {
+    struct rtp_pkt *pkts;
+    __u32 nr_pkts;
+    __u64 period_ns;        /* one loop, including the gap after the last frame */
+    __u32 period_ts;        /* the same in RTP clock units */
+    __u64 bytes;
+    __u64 first_ns;         /* of the first packet, as captured */
+    __u32 first_ts;
+    __u16 first_seq;
+    __u32 nr_keyframes;
+};
+
+struct camera {
+    __u64 next_ns;          /* send time of the next packet */
+    __u64 loop_start_ns;
+    __u32 idx;              /* next packet of the capture */
+    __u32 loops;
+    __u32 ssrc;
+    __u16 seq_base;
+    __u32 ts_base;
+    int key_request;        /* PLI / FIR received, not answered yet */
+    struct sockaddr_in addr;
+};
+
+/* Min-heap of cameras by next_ns */
+struct heap {
+    __u32 *ids;
+    __u32 size;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s -f capture.pcap [-n num_cameras] [-a dst_ip] [-p base_port] [-P capture_port]\n"
+            "          [-d seconds] [-s speed]\n"
+            "  -f  pcap (Ethernet, Linux cooked or raw IP) holding one H.265 RTP stream\n"
+            "  -n  virtual cameras (default: 100)\n"
+            "  -a  destination address (default: 10.1.1.2)\n"
+            "  -p  camera i sends to base_port + i (default: 5000)\n"
+            "  -P  only replay UDP packets to this port of the capture (default: all)\n"
+            "  -d  stop after this many seconds (default: until interrupted)\n"
+            "  -s  replay speed factor (default: 1.0)\n"
+            "  Keyframe requests (RTCP PLI / FIR) are answered on the source port + 1.\n",
+            prog);
+}
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(__u64 ns)
+{
+    struct timespec ts = { .tv_sec = ns / 1000000000ULL, .tv_nsec = ns % 1000000000ULL };
+
+    clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Offset of the UDP header in a captured frame, -1 if it is no IPv4/UDP */
+static int udp_offset(const unsigned char *frame, __u32 len, __u32 linktype)
+{
+    __u32 l3;
+    __u16 proto;
+
+    switch (linktype) {
+    case LINKTYPE_ETHERNET:
+        if (len < 14)
+            return -1;
+        proto = frame[12] << 8 | frame[13];
+        l3 = 14;
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16)
+            return -1;
+        proto = frame[14] << 8 | frame[15];
+        l3 = 16;
+        break;
+    case LINKTYPE_RAW:
+        proto = 0x0800;
+        l3 = 0;
+        break;
+    default:
+        return -1;
+    }
+
+    if (proto != 0x0800 || len < l3 + 20 || (frame[l3] >> 4) != 4 || frame[l3 + 9] != IPPROTO_UDP)
+        return -1;
+    l3 += (frame[l3] & 0x0F) * 4;
+    return len >= l3 + 8 ? (int)l3 : -1;
+}
+
+static int capture_add(struct capture *cap, __u32 *cap_alloc, const unsigned char *rtp, __u32 len,
+                       __u64 ts_ns)
+{
+    struct rtp_pkt *p;
+
+    if (len < RTP_HDR_LEN || len > MAX_PAYLOAD || (rtp[0] >> 6) != 2)
+        return 0;
+
+    if (cap->nr_pkts == *cap_alloc) {
+        __u32 n = *cap_alloc ? *cap_alloc * 2 : 4096;
+        struct rtp_pkt *pkts = realloc(cap->pkts, n * sizeof(*pkts));
+
+        if (!pkts)
+            return -ENOMEM;
+        cap->pkts = pkts;
+        *cap_alloc = n;
+    }
+
+    p = &cap->pkts[cap->nr_pkts];
+    p->data = malloc(len);
+    if (!p->data)
+        return -ENOMEM;
+    memcpy(p->data, rtp, len);
+    p->len = len;
+
+    __u32 rtp_ts = (__u32)rtp[4] << 24 | rtp[5] << 16 | rtp[6] << 8 | rtp[7];
+    __u16 seq = rtp[2] << 8 | rtp[3];
+    if (!cap->nr_pkts) {
+        cap->first_ns = ts_ns;
+        cap->first_ts = rtp_ts;
+        cap->first_seq = seq;
+    }
+    p->offset_ns = ts_ns - cap->first_ns;
+    p->rtp_ts = rtp_ts - cap->first_ts;
+    p->seq = seq - cap->first_seq;
+    cap->nr_pkts++;
+    cap->bytes += len;
+    return 0;
+}
+
+/* 1 if the RTP packet carries an IRAP slice (H.265 NAL types 16-21),
+ * directly or as an FU fragment */
+static int is_irap(const struct rtp_pkt *p)
+{
+    __u32 off = RTP_HDR_LEN + (p->data[0] & 0x0F) * 4;
+    __u8 nal_type;
+
+    if ((p->data[0] & 0x10) && off + 4 <= p->len)
+        off += 4 + (p->data[off + 2] << 8 | p->data[off + 3]) * 4;
+    if (off + 3 > p->len)
+        return 0;
+    nal_type = (p->data[off] >> 1) & 0x3F;
+    if (nal_type == 49)
+        nal_type = p->data[off + 2] & 0x3F;
+    return nal_type >= 16 && nal_type <= 21;
+}
+
+/* Marks the first packet of every IRAP frame, parameter sets included */
+static void mark_keyframes(struct capture *cap)
+{
+    __u32 i, j;
+
+    for (i = 0; i < cap->nr_pkts; i++) {
+        if (!is_irap(&cap->pkts[i]))
+            continue;
+        for (j = i; j > 0 && cap->pkts[j - 1].rtp_ts == cap->pkts[i].rtp_ts; j--)
+            ;
+        if (!cap->pkts[j].keyframe) {
+            cap->pkts[j].keyframe = 1;
+            cap->nr_keyframes++;
+        }
+    }
+}
+
+static int load_pcap(const char *path, int port, struct capture *cap)
+{
+    unsigned char hdr[24], rec[16], *frame = NULL;
+    __u32 cap_alloc = 0, linktype, snaplen;
+    int swap, nsec, err = 0;
+    FILE *f = fopen(path, "rb");
+
+    if (!f) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    if (fread(hdr, 1, sizeof(hdr), f) != sizeof(hdr)) {
+        err = -EINVAL;
+        goto out;
+    }
+
+    __u32 magic;
+    memcpy(&magic, hdr, 4);
+    swap = magic == 0xd4c3b2a1 || magic == 0x4d3cb2a1;
+    nsec = magic == 0xa1b23c4d || magic == 0x4d3cb2a1;
+    if (!swap && magic != 0xa1b2c3d4 && magic != 0xa1b23c4d) {
+        fprintf(stderr, "%s is not a pcap file (pcapng is not supported)\n", path);
+        err = -EINVAL;
+        goto out;
+    }
+#define PCAP32(p) (swap ? __builtin_bswap32(*(__u32 *)(p)) : *(__u32 *)(p))
+    snaplen = PCAP32(hdr + 16);
+    linktype = PCAP32(hdr + 20);
+    frame = malloc(snaplen > 65535 ? 262144 : 65536);
+    if (!frame) {
+        err = -ENOMEM;
+        goto out;
+    }
+
+    while (fread(rec, 1, sizeof(rec), f) == sizeof(rec)) {
+        __u32 sec = PCAP32(rec), frac = PCAP32(rec + 4), incl = PCAP32(rec + 8);
+        __u64 ts_ns = (__u64)sec * 1000000000ULL + (nsec ? frac : frac * 1000ULL);
+        int l4;
+
+        if (incl > 262144 || fread(frame, 1, incl, f) != incl)
+            break;
+        l4 = udp_offset(frame, incl, linktype);
+        if (l4 < 0)
+            continue;
+        if (port && (frame[l4 + 2] << 8 | frame[l4 + 3]) != port)
+            continue;
+        err = capture_add(cap, &cap_alloc, frame + l4 + 8, incl - l4 - 8, ts_ns);
+        if (err)
+            break;
+    }
+#undef PCAP32
+
+    if (!err && cap->nr_pkts < 2) {
+        fprintf(stderr, "%s holds fewer than 2 RTP packets%s\n", path, port ? " to that port" : "");
+        err = -EINVAL;
+    }
+    if (!err) {
+        /* Loop after one more frame interval, guessed from the last two frames */
+        struct rtp_pkt *last = &cap->pkts[cap->nr_pkts - 1];
+        __u32 i = cap->nr_pkts - 1, frame_ts = 3000;
+
+        while (i > 0 && cap->pkts[i].rtp_ts == last->rtp_ts)
+            i--;
+        if (cap->pkts[i].rtp_ts != last->rtp_ts)
+            frame_ts = last->rtp_ts - cap->pkts[i].rtp_ts;
+        cap->period_ts = last->rtp_ts + frame_ts;
+        cap->period_ns = (__u64)cap->period_ts * 1000000000ULL / RTP_CLOCK;
+        if (cap->period_ns <= last->offset_ns)
+            cap->period_ns = last->offset_ns + 1;
+        mark_keyframes(cap);
+    }
+
+out:
+    free(frame);
+    fclose(f);
+    return err;
+}
+
+static void heap_swap(struct heap *h, __u32 a, __u32 b)
+{
+    __u32 t = h->ids[a];
+
+    h->ids[a] = h->ids[b];
+    h->ids[b] = t;
+}
+
+static void heap_down(struct heap *h, const struct camera *cams, __u32 i)
+{
+    for (;;) {
+        __u32 l = 2 * i + 1, r = l + 1, min = i;
+
+        if (l < h->size && cams[h->ids[l]].next_ns < cams[h->ids[min]].next_ns)
+            min = l;
+        if (r < h->size && cams[h->ids[r]].next_ns < cams[h->ids[min]].next_ns)
+            min = r;
+        if (min == i)
+            return;
+        heap_swap(h, i, min);
+        i = min;
+    }
+}
+
+/* Sequence number and RTP timestamp of the camera's current packet */
+static __u16 camera_seq(const struct camera *c, const struct capture *cap)
+{
+    return c->seq_base + cap->pkts[c->idx].seq + c->loops * (cap->pkts[cap->nr_pkts - 1].seq + 1);
+}
+
+static __u32 camera_ts(const struct camera *c, const struct capture *cap)
+{
+    return c->ts_base + cap->pkts[c->idx].rtp_ts + c->loops * cap->period_ts;
+}
+
+/* Sends the next keyframe of the capture in place of the frame that is
+ * due, at its time and with its sequence number and timestamp */
+static void camera_keyframe(struct camera *c, const struct capture *cap, double speed)
+{
+    __u64 due_ns = c->loop_start_ns + (__u64)(cap->pkts[c->idx].offset_ns / speed);
+    __u16 seq = camera_seq(c, cap);
+    __u32 ts = camera_ts(c, cap);
+
+    c->key_request = 0;
+    while (!cap->pkts[c->idx].keyframe) {
+        if (++c->idx == cap->nr_pkts) {
+            c->idx = 0;
+            c->loops++;
+        }
+    }
+    c->seq_base += seq - camera_seq(c, cap);
+    c->ts_base += ts - camera_ts(c, cap);
+    c->loop_start_ns = due_ns - (__u64)(cap->pkts[c->idx].offset_ns / speed);
+}
+
+/* Schedules the camera's next packet, wrapping to the next loop. A
+ * pending keyframe request is served at the next frame boundary. */
+static void camera_advance(struct camera *c, const struct capture *cap, double speed)
+{
+    __u32 prev = c->idx;
+
+    if (++c->idx == cap->nr_pkts) {
+        c->idx = 0;
+        c->loops++;
+        c->loop_start_ns += (__u64)(cap->period_ns / speed);
+    }
+    if (c->key_request && cap->pkts[c->idx].rtp_ts != cap->pkts[prev].rtp_ts)
+        camera_keyframe(c, cap, speed);
+    c->next_ns = c->loop_start_ns + (__u64)(cap->pkts[c->idx].offset_ns / speed);
+}
+
+/* The camera's current packet, rewritten into buf */
+static __u32 camera_packet(const struct camera *c, const struct capture *cap, unsigned char *buf)
+{
+    const struct rtp_pkt *p = &cap->pkts[c->idx];
+    __u16 seq = camera_seq(c, cap);
+    __u32 ts = camera_ts(c, cap);
+
+    memcpy(buf, p->data, p->len);
+    buf[2] = seq >> 8;
+    buf[3] = seq;
+    buf[4] = ts >> 24;
+    buf[5] = ts >> 16;
+    buf[6] = ts >> 8;
+    buf[7] = ts;
+    buf[8] = c->ssrc >> 24;
+    buf[9] = c->ssrc >> 16;
+    buf[10] = c->ssrc >> 8;
+    buf[11] = c->ssrc;
+    return p->len;
+}
+
+/* Binds the RTP socket to an even port and the RTCP socket to the next
+ * one, where receivers send their feedback */
+static int open_sockets(int *fd, int *rtcp_fd)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET };
+    __u16 port;
+
+    srandom(getpid());
+    for (int tries = 0; tries < 64; tries++) {
+        port = 32768 + (random() % 14000) * 2;
+        addr.sin_port = htons(port);
+        if (bind(*fd, (struct sockaddr *)&addr, sizeof(addr)))
+            continue;
+        addr.sin_port = htons(port + 1);
+        if (!bind(*rtcp_fd, (struct sockaddr *)&addr, sizeof(addr)))
+            return fcntl(*rtcp_fd, F_SETFL, O_NONBLOCK);
+        /* The RTP socket is bound now; start over with a fresh one */
+        close(*fd);
+        *fd = socket(AF_INET, SOCK_DGRAM, 0);
+        if (*fd < 0)
+            return -1;
+    }
+    errno = EADDRINUSE;
+    return -1;
+}
+
+/* Flags the cameras named in pending PLIs and FIRs, returns how many */
+static __u32 read_rtcp(int rtcp_fd, struct camera *cams, __u32 nr_cameras)
+{
+    unsigned char buf[1500];
+    __u32 requests = 0;
+    ssize_t len;
+
+    while ((len = recv(rtcp_fd, buf, sizeof(buf), 0)) > 0) {
+        /* Compound packet: walk the RTCP packets by their length fields */
+        for (ssize_t off = 0; off + 4 <= len; ) {
+            __u32 plen = ((buf[off + 2] << 8 | buf[off + 3]) + 1) * 4;
+            __u32 fmt = buf[off] & 0x1F, ssrc_off = 0, ssrc, camera;
+
+            if ((buf[off] >> 6) != 2 || off + (ssize_t)plen > len)
+                break;
+            if (buf[off + 1] == 206 && fmt == 1 && plen >= 12)
+                ssrc_off = off + 8;         /* PLI: media source */
+            else if (buf[off + 1] == 206 && fmt == 4 && plen >= 20)
+                ssrc_off = off + 12;        /* FIR: first FCI entry */
+            if (ssrc_off) {
+                ssrc = (__u32)buf[ssrc_off] << 24 | buf[ssrc_off + 1] << 16 | buf[ssrc_off + 2] << 8 |
+                       buf[ssrc_off + 3];
+                camera = ssrc - SSRC_BASE;
+                if (camera < nr_cameras && !cams[camera].key_request) {
+                    cams[camera].key_request = 1;
+                    requests++;
+                }
+            }
+            off += plen;
+        }
+    }
+    return requests;
+}
+
+int main(int argc, char **argv)
+{
+    const char *path = NULL, *dst = "10.1.1.2";
+    int nr_cameras = 100, base_port = 5000, cap_port = 0, opt, fd, rtcp_fd, rc = 1;
+    double duration = 0, speed = 1.0;
+    struct capture cap = { 0 };
+    struct camera *cams = NULL;
+    struct heap heap = { 0 };
+    static unsigned char bufs[BATCH][MAX_PAYLOAD];
+    struct mmsghdr msgs[BATCH];
+    struct iovec iovs[BATCH];
+    __u64 start, end_ns, sent = 0, bytes = 0, send_errors = 0, max_late = 0, keyframes = 0, rtcp_ns = 0;
+    struct in_addr dst_addr;
+    __u32 i;
+
+    while ((opt = getopt(argc, argv, "f:n:a:p:P:d:s:h")) != -1) {
+        switch (opt) {
+        case 'f':
+            path = optarg;
+            break;
+        case 'n':
+            nr_cameras = atoi(optarg);
+            break;
+        case 'a':
+            dst = optarg;
+            break;
+        case 'p':
+            base_port = atoi(optarg);
+            break;
+        case 'P':
+            cap_port = atoi(optarg);
+            break;
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 's':
+            speed = atof(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!path || nr_cameras <= 0 || base_port <= 0 || base_port + nr_cameras > 65536 || speed <= 0 ||
+        !inet_aton(dst, &dst_addr)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (load_pcap(path, cap_port, &cap))
+        return 1;
+    printf("Loaded %u RTP packets (%.2f s loop, %.1f Mbit/s per camera, %u keyframes)\n", cap.nr_pkts,
+           cap.period_ns / 1e9, cap.bytes * 8 / (cap.period_ns / 1e9) / 1e6 * speed, cap.nr_keyframes);
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    rtcp_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    cams = calloc(nr_cameras, sizeof(*cams));
+    heap.ids = calloc(nr_cameras, sizeof(*heap.ids));
+    if (fd < 0 || rtcp_fd < 0 || !cams || !heap.ids || open_sockets(&fd, &rtcp_fd)) {
+        fprintf(stderr, "Setup failed: %s\n", strerror(errno));
+        goto out;
+    }
+
+    /* Cameras start spread over one loop so their frames interleave */
+    start = now_ns() + 10000000ULL;
+    for (i = 0; i < (__u32)nr_cameras; i++) {
+        struct camera *c = &cams[i];
+
+        c->ssrc = SSRC_BASE + i;
+        c->seq_base = random();
+        c->ts_base = random();
+        c->addr.sin_family = AF_INET;
+        c->addr.sin_addr = dst_addr;
+        c->addr.sin_port = htons(base_port + i);
+        c->loop_start_ns = start + (__u64)(cap.period_ns / speed) * i / nr_cameras;
+        c->next_ns = c->loop_start_ns;
+        heap.ids[heap.size++] = i;
+    }
+    for (i = heap.size / 2 + 1; i-- > 0; )
+        heap_down(&heap, cams, i);
+
+    for (i = 0; i < BATCH; i++) {
+        iovs[i].iov_base = bufs[i];
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    end_ns = duration > 0 ? start + (__u64)(duration * 1e9) : 0;
+
+    while (!stop) {
+        __u64 now = now_ns(), next = cams[heap.ids[0]].next_ns;
+        int n = 0, done;
+
+        if (end_ns && now >= end_ns)
+            break;
+        if (cap.nr_keyframes && now - rtcp_ns >= RTCP_POLL_NS) {
+            keyframes += read_rtcp(rtcp_fd, cams, nr_cameras);
+            rtcp_ns = now;
+        }
+        if (next > now) {
+            if (next - now > SPIN_NS)
+                sleep_until(next - SPIN_NS / 2);
+            continue;
+        }
+
+        /* Everything due, in send-time order */
+        while (n < BATCH && cams[heap.ids[0]].next_ns <= now) {
+            struct camera *c = &cams[heap.ids[0]];
+
+            if (now - c->next_ns > max_late)
+                max_late = now - c->next_ns;
+            iovs[n].iov_len = camera_packet(c, &cap, bufs[n]);
+            msgs[n].msg_hdr.msg_name = &c->addr;
+            n++;
+            camera_advance(c, &cap, speed);
+            heap_down(&heap, cams, 0);
+        }
+
+        for (done = 0; done < n; ) {
+            int r = sendmmsg(fd, msgs + done, n - done, 0);
+
+            if (r < 0) {
+                if (errno == EINTR)
+                    continue;
+                /* Full socket buffer or ICMP errors: count and move on */
+                send_errors += n - done;
+                break;
+            }
+            for (i = done; i < (__u32)(done + r); i++)
+                bytes += iovs[i].iov_len;
+            sent += r;
+            done += r;
+        }
+    }
+
+    double secs = (now_ns() - start) / 1e9;
+    printf("Sent %llu packets (%llu failed) in %.1f s: %.0f pps, %.1f Mbit/s, max lateness %.1f us, "
+           "%llu keyframe requests\n",
+           (unsigned long long)sent, (unsigned long long)send_errors, secs, sent / secs,
+           bytes * 8 / secs / 1e6, max_late / 1e3, (unsigned long long)keyframes);
+    rc = 0;
+
+out:
+    if (fd >= 0)
+        close(fd);
+    if (rtcp_fd >= 0)
+        close(rtcp_fd);
+    for (i = 0; i < cap.nr_pkts; i++)
+        free(cap.pkts[i].data);
+    free(cap.pkts);
+    free(cams);
+    free(heap.ids);
+    return rc;
+}
@@ -11,11 +11,37 @@ fi
 ACTUAL_USER=${SUDO_USER:-$USER}
 NUM_STREAMS=${1:-100}
 BOTTLENECK_MBPS=${2:-200}
+# 1 = robot packets only store the position, video packets decide visibility
+LAZY_VISIBILITY=${LAZY_VISIBILITY:-0}
+# tbf = ifb+tbf qdisc behind the receiver, meter = stage2 aggregate meter
+# (drops by frame type, see meter_config.py)
+BOTTLENECK=${BOTTLENECK:-tbf}
+# 1 = bw_controller picks the camera modes to fit BOTTLENECK_MBPS; it needs
+# lazy visibility, so robot packets don't rewrite its modes
+CONTROLLER=${CONTROLLER:-0}
+if [ "$CONTROLLER" = "1" ]; then
+    LAZY_VISIBILITY=1
+fi
+# ffmpeg = one libx265 encoder per camera, rtp_gen = record one camera once
+# and replay it for all of them from a single process
+GENERATOR=${GENERATOR:-ffmpeg}
+# Frames between IRAP frames of the cameras. Long GOPs show what stage2's
+# resync (PLI on leaving a P-dropping mode) saves; rtp_gen answers PLIs,
+# ffmpeg does not. RESYNC_TIMEOUT_MS=0 turns the resync off for comparison
+# (camera_stats resync_ns / resyncs = mean time to a decodable frame).
+KEYINT=${KEYINT:-4}
+RESYNC_TIMEOUT_MS=${RESYNC_TIMEOUT_MS:-1000}
+# GOP_DROP=0 forwards the slices after a damaged reference frame anyway
+# (pipeline.conf gop_drop)
+GOP_DROP=${GOP_DROP:-1}
+CAPTURE=logs/camera_rtp_keyint${KEYINT}.pcap
 
 INFLUXDB_URL="http://localhost:8086"
 INFLUXDB_TOKEN="my-super-secret-auth-token"
 INFLUXDB_ORG="myorg"
 INFLUXDB_BUCKET="network_metrics"
+# xdp_exporter serves the pipeline maps here (also scraped by Prometheus)
+METRICS_URL="http://localhost:9101/metrics"
 
 if [ -d "/home/$ACTUAL_USER/dispatcher/venv" ]; then
     PYTHON_BIN="/home/$ACTUAL_USER/dispatcher/venv/bin/python3"
@@ -25,13 +51,20 @@ else
     PYTHON_BIN="python3"
 fi
 
-if [ $NUM_STREAMS -lt 1 ] || [ $NUM_STREAMS -gt 100 ]; then
-    echo "Error: num_streams must be between 1 and 100"
+# One encoder per camera does not scale further; stage2's built-in port
+# layout knows 200 cameras (CAMERA_PORTS)
+MAX_STREAMS=100
+if [ "$GENERATOR" = "rtp_gen" ]; then
+    MAX_STREAMS=200
+fi
+
+if [ $NUM_STREAMS -lt 1 ] || [ $NUM_STREAMS -gt $MAX_STREAMS ]; then
+    echo "Error: num_streams must be between 1 and $MAX_STREAMS"
     echo "Usage: sudo $0 [num_streams]"
     exit 1
 fi
 
-echo "==== Robot-Based Filtering Test (100 Cameras) ===="
+echo "==== Robot-Based Filtering Test ($NUM_STREAMS Cameras) ===="
 
 # Cleanup
 cleanup() {
@@ -50,10 +83,23 @@ cleanup() {
         kill $METRICS_MONITOR_PID 2>/dev/null || true
     fi
     
+    if [ ! -z "$CONTROLLER_PID" ]; then
+        kill $CONTROLLER_PID 2>/dev/null || true
+    fi
+    
+    if [ ! -z "$EXPORTER_PID" ]; then
+        kill $EXPORTER_PID 2>/dev/null || true
+    fi
+    
+    if [ ! -z "$GENERATOR_PID" ]; then
+        kill $GENERATOR_PID 2>/dev/null || true
+    fi
+    
     pkill -f "mock-robot.py" 2>/dev/null || true
     pkill -f "robot_simulator.py" 2>/dev/null || true
     pkill -f "live_metrics_monitor.py" 2>/dev/null || true
     pkill -f "loss_to_influx.py" 2>/dev/null || true
+    pkill -f "pcap_loss" 2>/dev/null || true
     pkill -f "influx_forwarder.py" 2>/dev/null || true
     pkill -f "vlc.*HEVC" 2>/dev/null || true  
     pkill -f "ffmpeg.*udp" 2>/dev/null || true
@@ -81,50 +127,43 @@ ip link set veth0 up
 ip addr add 10.1.1.3/24 dev veth1
 ip link set veth1 up
 
-echo "Compiling eBPF..."
-clang -O2 -g -target bpf -D__TARGET_ARCH_x86 \
-    -I/usr/include -I/usr/include/x86_64-linux-gnu \
-    -c bpf/xdp_dispatcher.c -o bpf/xdp_dispatcher.o
-clang -O2 -g -target bpf -D__TARGET_ARCH_x86 \
-    -I/usr/include -I/usr/include/x86_64-linux-gnu \
-    -c bpf/stage1_passthrough.c -o bpf/stage1_passthrough.o
-clang -O2 -g -target bpf -D__TARGET_ARCH_x86 \
-    -I/usr/include -I/usr/include/x86_64-linux-gnu \
-    -c bpf/stage2_video_filter.c -o bpf/stage2_video_filter.o
+echo "Building eBPF and user-space tools..."
+make -s attach_ext xdp_stats pipeline_loader bw_controller xdp_exporter || exit 1
 
-echo "Loading XDP programs..."
-rm -rf /sys/fs/bpf/xdp* /sys/fs/bpf/stage* 2>/dev/null || true
-mkdir -p /sys/fs/bpf/xdp_pipeline
-
-bpftool prog load bpf/xdp_dispatcher.o /sys/fs/bpf/xdp_disp \
-    type xdp pinmaps /sys/fs/bpf/xdp_pipeline 2>&1 | grep -v "libbpf:"
+# video_stats counter with the given key, from the exporter (in enum order)
+read_stat() {
+    local value
+    value=$(curl -s "$METRICS_URL" | grep '^xdp_video_stat_total' | sed -n "$(($1 + 1))p" | awk '{print $2}')
+    echo "${value:-0}"
+}
 
-ip link set dev veth1 xdpgeneric pinned /sys/fs/bpf/xdp_disp 2>&1
+# Cameras whose camera_filtering_mode is the given mode
+count_mode() {
+    curl -s "$METRICS_URL" | grep -c "^xdp_camera_mode{.*} $1\$" || true
+}
 
-DISP_ID=$(bpftool prog show pinned /sys/fs/bpf/xdp_disp --json | jq -r '.id')
-if [ -f "./attach_ext" ]; then
-    ./attach_ext bpf/stage1_passthrough.o $DISP_ID stage1 /sys/fs/bpf/stage1_ext 2>&1 | grep -v "libbpf:"
+# FILTER_OFF, or FILTER_AUTO when visibility is decided per packet
+if [ "$LAZY_VISIBILITY" = "1" ]; then
+    INITIAL_MODE=0xff
 else
-    bpftool prog load bpf/stage1_passthrough.o /sys/fs/bpf/stage1_ext \
-        type ext pinmaps /sys/fs/bpf/xdp_pipeline 2>&1 | grep -v "libbpf:"
-    bpftool prog attach pinned /sys/fs/bpf/stage1_ext \
-        freplace pinned /sys/fs/bpf/xdp_disp target_name stage1 2>&1
+    INITIAL_MODE=0
 fi
 
-if [ -f "./attach_ext" ]; then
-    ./attach_ext bpf/stage2_video_filter.o $DISP_ID stage2 /sys/fs/bpf/stage2_ext 2>&1 | grep -v "libbpf:"
-else
-    bpftool prog load bpf/stage2_video_filter.o /sys/fs/bpf/stage2_ext \
-        type ext pinmaps /sys/fs/bpf/xdp_pipeline 2>&1 | grep -v "libbpf:"
-    bpftool prog attach pinned /sys/fs/bpf/stage2_ext \
-        freplace pinned /sys/fs/bpf/xdp_disp target_name stage2 2>&1
-fi
+echo "Loading XDP programs..."
+rm -rf /sys/fs/bpf/xdp* /sys/fs/bpf/stage* /sys/fs/bpf/parser_prog 2>/dev/null || true
 
-bpftool map update pinned /sys/fs/bpf/xdp_pipeline/control_map \
-    key hex 00 00 00 00 value hex 01 00 00 00 2>&1
+# Dispatcher, parser -> stage2 and the camera maps in one go (pipeline.conf).
+# A rebuilt stage can replace a running one without a restart:
+#   ./attach_ext -u bpf/stage2_video_filter.o slot:1 stage2 /sys/fs/bpf/stage2_prog
+./pipeline_loader -c pipeline.conf iface=veth1 lazy_visibility=$LAZY_VISIBILITY \
+    camera_mode=$INITIAL_MODE resync_timeout_ms=$RESYNC_TIMEOUT_MS gop_drop=$GOP_DROP 2>&1 | grep -v "libbpf:"
 
-bpftool map update pinned /sys/fs/bpf/xdp_pipeline/control_map \
-    key hex 01 00 00 00 value hex 01 00 00 00 2>&1
+mkdir -p logs
+# Also writes stage2's live per-camera loss (unintended = before the
+# verdict, intended = added by it) and jitter as xdp_rtp_monitor
+./xdp_exporter -n $NUM_STREAMS -I $INFLUXDB_URL -O $INFLUXDB_ORG -B $INFLUXDB_BUCKET -T $INFLUXDB_TOKEN \
+    > logs/xdp_exporter.log 2>&1 &
+EXPORTER_PID=$!
 
 ip link set veth1 down
 ip addr del 10.1.1.3/24 dev veth1 2>/dev/null || true
@@ -133,23 +172,21 @@ ip netns exec testns ip addr add 10.1.1.2/24 dev veth1
 ip netns exec testns ip link set veth1 up
 ip netns exec testns ip link set lo up
 
-modprobe ifb numifbs=1 2>/dev/null || true
-ip netns exec testns ip link add ifb0 type ifb 2>/dev/null || ip netns exec testns ip link set ifb0 down
-ip netns exec testns ip link set ifb0 up
-
-ip netns exec testns tc qdisc del dev veth1 ingress 2>/dev/null || true
-ip netns exec testns tc qdisc add dev veth1 ingress
-ip netns exec testns tc filter add dev veth1 parent ffff: protocol ip u32 match u32 0 0 flowid 1:1 action mirred egress redirect dev ifb0
+if [ "$BOTTLENECK" = "meter" ]; then
+    $PYTHON_BIN meter_config.py --aggregate --pir $BOTTLENECK_MBPS --pbs 4000
+else
+    modprobe ifb numifbs=1 2>/dev/null || true
+    ip netns exec testns ip link add ifb0 type ifb 2>/dev/null || ip netns exec testns ip link set ifb0 down
+    ip netns exec testns ip link set ifb0 up
 
-ip netns exec testns tc qdisc del dev ifb0 root 2>/dev/null || true
-ip netns exec testns tc qdisc add dev ifb0 root tbf rate ${BOTTLENECK_MBPS}mbit burst 32kbit latency 400ms
+    ip netns exec testns tc qdisc del dev veth1 ingress 2>/dev/null || true
+    ip netns exec testns tc qdisc add dev veth1 ingress
+    ip netns exec testns tc filter add dev veth1 parent ffff: protocol ip u32 match u32 0 0 flowid 1:1 action mirred egress redirect dev ifb0
 
+    ip netns exec testns tc qdisc del dev ifb0 root 2>/dev/null || true
+    ip netns exec testns tc qdisc add dev ifb0 root tbf rate ${BOTTLENECK_MBPS}mbit burst 32kbit latency 400ms
+fi
 
-for camera_id in {0..99}; do
-    key_hex=$(printf "%02x %02x %02x %02x" $((camera_id & 0xFF)) $(((camera_id >> 8) & 0xFF)) $(((camera_id >> 16) & 0xFF)) $(((camera_id >> 24) & 0xFF)))
-    sudo bpftool map update pinned /sys/fs/bpf/xdp_pipeline/camera_filtering_mode \
-        key hex $key_hex value hex 00 00 00 00 2>/dev/null
-done
 
 sleep 2
 
@@ -160,15 +197,45 @@ mkdir -p logs
 VLC_PIDS=()
 FFMPEG_PIDS=()
 
+# The capture is made once per KEYINT and reused by later runs; it holds
+# at least two GOPs
+if [ "$GENERATOR" = "rtp_gen" ] && [ ! -f $CAPTURE ]; then
+    echo "Recording the camera capture for rtp_gen..."
+    tcpdump -i lo -w $CAPTURE -n -s 65535 'udp dst port 5999' > /dev/null 2>&1 &
+    RECORD_PID=$!
+    sleep 1
+    sudo -u $ACTUAL_USER ffmpeg \
+        -f lavfi -i testsrc=size=1280x720:rate=30 -t $(( KEYINT > 60 ? KEYINT / 15 : 4 )) \
+        -c:v libx265 \
+        -preset ultrafast \
+        -x265-params "keyint=$KEYINT:min-keyint=$KEYINT:scenecut=0:bframes=0" \
+        -g $KEYINT \
+        -sc_threshold 0 \
+        -pix_fmt yuv420p \
+        -f rtp rtp://127.0.0.1:5999 \
+        > logs/ffmpeg_rtp_gen_capture.log 2>&1
+    sleep 1
+    kill $RECORD_PID 2>/dev/null || true
+    wait $RECORD_PID 2>/dev/null
+fi
+
 for i in $(seq 0 $((NUM_STREAMS - 1))); do
     RTP_PORT=$((5000 + i))
     
+    if [ "$GENERATOR" = "rtp_gen" ]; then
+        ip netns exec testns ffmpeg -i "udp://10.1.1.2:$RTP_PORT" \
+            -vcodec copy -acodec copy -f null - \
+            > logs/ffmpeg_receiver_camera${i}.log 2>&1 &
+        FFMPEG_PIDS+=($!)
+        continue
+    fi
+    
     sudo -u $ACTUAL_USER ffmpeg \
         -f lavfi -i testsrc=size=1280x720:rate=30 \
         -c:v libx265 \
         -preset ultrafast \
-        -x265-params "keyint=4:min-keyint=4:scenecut=0:bframes=0" \
-        -g 4 \
+        -x265-params "keyint=$KEYINT:min-keyint=$KEYINT:scenecut=0:bframes=0" \
+        -g $KEYINT \
         -sc_threshold 0 \
         -pix_fmt yuv420p \
         -f rtp rtp://10.1.1.2:$RTP_PORT \
@@ -182,15 +249,21 @@ for i in $(seq 0 $((NUM_STREAMS - 1))); do
     FFMPEG_PIDS+=($!)
 done
 
+if [ "$GENERATOR" = "rtp_gen" ]; then
+    sudo -u $ACTUAL_USER ./rtp_gen -f $CAPTURE -n $NUM_STREAMS -a 10.1.1.2 -p 5000 \
+        > logs/rtp_gen.log 2>&1 &
+    GENERATOR_PID=$!
+fi
+
 sleep 5
 
 STREAMER_RUNNING=$(ps aux | grep 'ffmpeg.*rtp://10.1.1.2:50' | grep -v grep | wc -l)
 RECEIVER_RUNNING=$(ps aux | grep 'ffmpeg.*udp://10.1.1.2:50' | grep -v grep | wc -l)
 SOCKETS_LISTENING=$(netstat -an 2>/dev/null | grep -E ':(500[0-9]|50[1-9][0-9])' | wc -l)
 
-ROBOT_PKTS=$(sudo bpftool map dump pinned /sys/fs/bpf/xdp_pipeline/video_stats 2>/dev/null | grep -A1 '"key": 6,' | grep value | awk '{print $2}' | tr -d ',' || echo 0)
-ROBOT_UPDATES=$(sudo bpftool map dump pinned /sys/fs/bpf/xdp_pipeline/video_stats 2>/dev/null | grep -A1 '"key": 12,' | grep value | awk '{print $2}' | tr -d ',' || echo 0)
-ROBOT_PORT_MATCHED=$(sudo bpftool map dump pinned /sys/fs/bpf/xdp_pipeline/video_stats 2>/dev/null | grep -A1 '"key": 13,' | grep value | awk '{print $2}' | tr -d ',' || echo 0)
+ROBOT_PKTS=$(read_stat 6)
+ROBOT_UPDATES=$(read_stat 12)
+ROBOT_PORT_MATCHED=$(read_stat 13)
 
 if [ "$ROBOT_PORT_MATCHED" -gt "$ROBOT_PKTS" ]; then
     echo "    ⚠ More port matches than processed packets - validation failing!"
@@ -205,16 +278,23 @@ TIMESTAMP=$(date +%Y%m%d_%H%M%S)
 PCAP_DIR="pcaps_robot_${TIMESTAMP}"
 mkdir -p $PCAP_DIR
 
-tcpdump -i veth0 -w ${PCAP_DIR}/tx_before_filter.pcap -n -s 65535 'udp portrange 5000-5099' &
+# Rates are recorded for offline replay: make controller-sim TRACE=...
+if [ "$CONTROLLER" = "1" ]; then
+    ./bw_controller -b $BOTTLENECK_MBPS -w logs/rates_${TIMESTAMP}.csv > logs/bw_controller.log 2>&1 &
+    CONTROLLER_PID=$!
+fi
+
+tcpdump -i veth0 -w ${PCAP_DIR}/tx_before_filter.pcap -n -s 65535 "udp portrange 5000-$((5000 + NUM_STREAMS - 1))" &
 TCPDUMP_TX_PID=$!
 
-ip netns exec testns tcpdump -i veth1 -w ${PCAP_DIR}/rx_after_filter.pcap -n -s 65535 'udp portrange 5000-5099' &
+ip netns exec testns tcpdump -i veth1 -w ${PCAP_DIR}/rx_after_filter.pcap -n -s 65535 "udp portrange 5000-$((5000 + NUM_STREAMS - 1))" &
 TCPDUMP_RX_PID=$!
 
-$PYTHON_BIN -u actual_loss_from_stats.py \
-    --tx-pcap ${PCAP_DIR}/tx_before_filter.pcap \
-    --rx-pcap ${PCAP_DIR}/rx_after_filter.pcap \
-    --interval 0.5 \
+./pcap_loss -F \
+    -t ${PCAP_DIR}/tx_before_filter.pcap \
+    -r ${PCAP_DIR}/rx_after_filter.pcap \
+    -P 5000-$((5000 + NUM_STREAMS - 1)) \
+    -i 0.5 \
     2> logs/loss_to_influx.log | \
     sudo -u $ACTUAL_USER $PYTHON_BIN -u influx_forwarder.py \
     2> logs/influx_forwarder.log &
@@ -265,10 +345,8 @@ while true; do
         rm -f /tmp/enable_filtering
     fi
     
-    active_count=$(sudo bpftool map dump pinned /sys/fs/bpf/xdp_pipeline/camera_filtering_mode 2>/dev/null | \
-        grep -c '"value": 0' || echo 0)
-    filtering_count=$(sudo bpftool map dump pinned /sys/fs/bpf/xdp_pipeline/camera_filtering_mode 2>/dev/null | \
-        grep -c '"value": 1' || echo 0)
+    active_count=$(count_mode 0)
+    filtering_count=$(count_mode 1)
     
     if [ "$FILTERING_ENABLED" = "true" ]; then
         MODE_STATUS="FILTERING ACTIVE ($filtering_count cameras)"
@@ -293,7 +371,7 @@ while true; do
     fi
     
     if [ "$FILTERING_ENABLED" = "true" ]; then
-        DROPPED_NOW=$(sudo bpftool map dump pinned /sys/fs/bpf/xdp_pipeline/video_stats 2>/dev/null | grep -A1 '"key": 4,' | grep value | awk '{print $2}' | tr -d ',' || echo 0)
+        DROPPED_NOW=$(read_stat 4)
         echo "T+$((ITERATION*MEASUREMENT_INTERVAL))s: $MODE_STATUS P-drops: $DROPPED_NOW"
     else
         echo "T+$((ITERATION*MEASUREMENT_INTERVAL))s: $MODE_STATUS"
@@ -0,0 +1,733 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "xdp_stats.h"
+#include "pipeline_defs.h"
+#include "video_filter_defs.h"
+
+/* Long-running stats exporter. Opens the pinned pipeline maps once, reads
+ * them with one batched lookup per map every interval, computes rates from
+ * consecutive snapshots and
+ *  - serves the latest values on http://0.0.0.0:port/metrics (Prometheus),
+ *  - optionally buffers them as InfluxDB line protocol and writes the
+ *    buffer with one HTTP request per flush interval.
+ * Everything runs in one thread around poll(); the exporter's own CPU time
+ * is exported as xdp_exporter_cpu_seconds_total. */
+
+/* Time a scrape client gets to send its request and to take the answer */
+#define CLIENT_TIMEOUT_MS 200
+
+static const char *const video_stat_names[] = {
+    "total_pkts", "rtp_pkts", "fu_start", "p_slices", "dropped", "forwarded",
+    "robot_position_pkts", "mode_off", "mode_drop_p", "mode_forward_p",
+    "camera_out_of_range", "map_lookup_failed", "robot_coords_updated",
+    "robot_port_matched", "stage2_entry", "ipv4_packets", "udp_packets",
+    "pre_port_check", "wrong_ip", "wrong_port_range", "rtp_version_fail",
+    "frame_state_reset", "camera_mode_writes", "robot_state_race", "mode_auto",
+    "new_robot", "robot_expired", "flow_static", "flow_learned_hit", "flow_new",
+    "flow_unknown", "mode_decimate", "decimate_kept", "decimate_dropped",
+    "meter_yellow", "meter_red", "meter_dropped", "resync_start", "resync_done",
+    "resync_timeout", "resync_dropped", "pli_sent", "mode_temporal",
+    "temporal_dropped", "temporal_switch_up", "gop_seq_gap", "gop_broken",
+    "gop_frame_dropped", "gop_dependent_dropped", "camera_cpu_moved",
+};
+
+#define NR_VIDEO_STATS (sizeof(video_stat_names) / sizeof(video_stat_names[0]))
+
+/* PIPELINE_CNT_* */
+static const char *const pipeline_counter_names[] = {
+    "packets", "empty_slot", "hop_limit",
+};
+
+#define NR_PIPELINE_COUNTERS (sizeof(pipeline_counter_names) / sizeof(pipeline_counter_names[0]))
+
+/* camera_stats fields; resync_ns / resyncs is the mean time to the first
+ * decodable frame after a P-dropping mode */
+static const char *const camera_field_names[] = {
+    "rx_pkts", "rx_bytes", "dropped_pkts", "dropped_bytes", "resyncs", "resync_ns", "plis_sent",
+};
+
+#define NR_CAMERA_FIELDS (sizeof(camera_field_names) / sizeof(camera_field_names[0]))
+
+/* rtp_monitor counters; entries [0, NUM_CAMERAS) count the packets before
+ * stage2's verdict, [RTP_MONITOR_OUT, RTP_MONITOR_OUT + NUM_CAMERAS) the
+ * forwarded ones. The field after them is 16 * the jitter in 90 kHz
+ * units, the rest is sequence state. */
+static const char *const rtp_field_names[] = {
+    "received", "expected", "reordered", "duplicates",
+};
+
+#define NR_RTP_FIELDS (sizeof(rtp_field_names) / sizeof(rtp_field_names[0]))
+#define RTP_FIELD_JITTER (offsetof(struct rtp_monitor, jitter) / sizeof(__u64))
+
+struct buf {
+    char *data;
+    size_t len;
+    size_t cap;
+};
+
+struct source {
+    const char *name;
+    struct xdp_stats_map map;
+    struct xdp_stats_snapshot cur;
+    struct xdp_stats_snapshot prev;
+    double *rate;           /* per second, nr_entries * nr_fields */
+    __u32 first_state;      /* fields from here on are read from owner's CPU */
+    const __u32 *owner;
+    int open;
+};
+
+struct influx {
+    char host[128];
+    char port[8];
+    char path[512];
+    char token[128];
+    struct buf lines;
+};
+
+struct exporter {
+    struct source video;
+    struct source camera_stats;
+    struct source rtp;
+    struct source pipeline;
+    int modes_fd;
+    __u32 modes[NUM_CAMERAS];
+    int cpu_fd;
+    __u32 rtp_owner[2 * NUM_CAMERAS];   /* camera_cpu of each rtp_monitor entry */
+    __u32 cameras;
+    __u64 polls;
+    __u64 read_ns;          /* time spent reading the maps */
+    struct influx *influx;
+    __u64 influx_errors;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stop = 1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-p port] [-i interval_ms] [-n cameras] [-I influx_url -O org -B bucket -T token]\n"
+            "          [-F flush_ms] [-v]\n"
+            "  -p  Prometheus port, 0 to disable (default: 9101)\n"
+            "  -i  poll interval (default: 100)\n"
+            "  -n  export cameras [0, n) (default: %d)\n"
+            "  -I  InfluxDB v2 base URL, e.g. http://localhost:8086\n"
+            "  -F  InfluxDB flush interval (default: 1000)\n"
+            "  -v  print the exporter's own cost every 10 s\n",
+            prog, NUM_CAMERAS);
+}
+
+static __u64 mono_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static __u64 real_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+static void buf_printf(struct buf *b, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    for (;;) {
+        va_start(ap, fmt);
+        n = vsnprintf(b->data ? b->data + b->len : NULL, b->data ? b->cap - b->len : 0, fmt, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if (b->data && b->len + n < b->cap) {
+            b->len += n;
+            return;
+        }
+
+        size_t cap = b->cap ? b->cap * 2 : 65536;
+        while (cap <= b->len + n)
+            cap *= 2;
+        char *data = realloc(b->data, cap);
+        if (!data)
+            return;
+        b->data = data;
+        b->cap = cap;
+    }
+}
+
+static void source_close(struct source *s)
+{
+    if (!s->open)
+        return;
+    free(s->rate);
+    xdp_stats_snapshot_free(&s->cur);
+    xdp_stats_snapshot_free(&s->prev);
+    xdp_stats_close(&s->map);
+    s->open = 0;
+}
+
+static int source_open(struct source *s, const char *name)
+{
+    s->name = name;
+    if (xdp_stats_open(&s->map, name))
+        return -1;
+    s->open = 1;
+    s->first_state = s->map.nr_fields;
+    if (xdp_stats_snapshot_init(&s->map, &s->cur) || xdp_stats_snapshot_init(&s->map, &s->prev))
+        goto err;
+    s->rate = calloc((size_t)s->map.max_entries * s->map.nr_fields, sizeof(double));
+    if (!s->rate)
+        goto err;
+    return 0;
+
+err:
+    source_close(s);
+    return -ENOMEM;
+}
+
+/* New snapshot; rates against the previous one (0 on the first read) */
+static int source_poll(struct source *s)
+{
+    struct xdp_stats_snapshot tmp = s->prev;
+    size_t i, n;
+    double dt;
+    int err;
+
+    if (!s->open)
+        return 0;
+
+    s->prev = s->cur;
+    s->cur = tmp;
+    err = xdp_stats_read_state(&s->map, &s->cur, s->first_state, s->owner);
+    if (err)
+        return err;
+
+    n = (size_t)s->cur.nr_entries * s->cur.nr_fields;
+    dt = s->prev.ts_ns ? (s->cur.ts_ns - s->prev.ts_ns) / 1e9 : 0;
+    for (i = 0; i < n; i++)
+        s->rate[i] = dt > 0 ? (s->cur.values[i] - s->prev.values[i]) / dt : 0;
+    return 0;
+}
+
+static double source_rate(const struct source *s, __u32 key, __u32 field)
+{
+    if (key >= s->cur.nr_entries || field >= s->cur.nr_fields)
+        return 0;
+    return s->rate[(size_t)key * s->cur.nr_fields + field];
+}
+
+/* Lost share of the sequence numbers expected in the last interval */
+static double rtp_loss_percent(const struct source *s, __u32 key)
+{
+    double expected = source_rate(s, key, 1), received = source_rate(s, key, 0);
+
+    return expected > 0 && received < expected ? 100 * (expected - received) / expected : 0;
+}
+
+static double rtp_jitter_ms(const struct source *s, __u32 key)
+{
+    if (key >= s->cur.nr_entries || RTP_FIELD_JITTER >= s->cur.nr_fields)
+        return 0;
+    return xdp_stats_get(&s->cur, key, RTP_FIELD_JITTER) / 16.0 / 90.0;
+}
+
+/* Loss before stage2's verdict is unintended, what its drops add on top
+ * is intended */
+static void rtp_loss(const struct source *s, __u32 camera, double *unintended, double *intended)
+{
+    double out = rtp_loss_percent(s, RTP_MONITOR_OUT + camera);
+
+    *unintended = rtp_loss_percent(s, camera);
+    *intended = out > *unintended ? out - *unintended : 0;
+}
+
+/* camera_filtering_mode holds __u32 values, outside what xdp_stats reads */
+static void read_modes(struct exporter *e)
+{
+    if (e->modes_fd >= 0)
+        xdp_stats_read_u32(e->modes_fd, e->modes, NUM_CAMERAS);
+}
+
+/* The CPU holding each camera's flow state (camera_cpu), for the jitter
+ * and sequence state of both of its rtp_monitor entries */
+static void read_owners(struct exporter *e)
+{
+    __u32 cpus[NUM_CAMERAS], i;
+
+    if (e->cpu_fd < 0 || xdp_stats_read_u32(e->cpu_fd, cpus, NUM_CAMERAS))
+        return;
+    for (i = 0; i < NUM_CAMERAS; i++)
+        e->rtp_owner[i] = e->rtp_owner[RTP_MONITOR_OUT + i] = cpus[i];
+}
+
+static int poll_maps(struct exporter *e)
+{
+    __u64 start = mono_ns();
+    int err;
+
+    err = source_poll(&e->video);
+    if (!err)
+        err = source_poll(&e->camera_stats);
+    read_owners(e);
+    if (!err)
+        err = source_poll(&e->rtp);
+    if (!err)
+        err = source_poll(&e->pipeline);
+    read_modes(e);
+    e->read_ns += mono_ns() - start;
+    e->polls++;
+    return err;
+}
+
+static void render_metrics(const struct exporter *e, struct buf *b)
+{
+    __u32 i, f;
+
+    if (e->video.open) {
+        buf_printf(b, "# TYPE xdp_video_stat_total counter\n");
+        for (i = 0; i < NR_VIDEO_STATS; i++)
+            buf_printf(b, "xdp_video_stat_total{stat=\"%s\"} %llu\n", video_stat_names[i],
+                       (unsigned long long)xdp_stats_get(&e->video.cur, i, 0));
+        buf_printf(b, "# TYPE xdp_video_stat_rate gauge\n");
+        for (i = 0; i < NR_VIDEO_STATS; i++)
+            buf_printf(b, "xdp_video_stat_rate{stat=\"%s\"} %.1f\n", video_stat_names[i],
+                       source_rate(&e->video, i, 0));
+    }
+
+    if (e->pipeline.open) {
+        buf_printf(b, "# TYPE xdp_pipeline_counter_total counter\n");
+        for (i = 0; i < NR_PIPELINE_COUNTERS; i++)
+            buf_printf(b, "xdp_pipeline_counter_total{counter=\"%s\"} %llu\n", pipeline_counter_names[i],
+                       (unsigned long long)xdp_stats_get(&e->pipeline.cur, i, 0));
+    }
+
+    if (e->camera_stats.open) {
+        for (f = 0; f < NR_CAMERA_FIELDS; f++) {
+            buf_printf(b, "# TYPE xdp_camera_%s_total counter\n", camera_field_names[f]);
+            for (i = 0; i < e->cameras; i++)
+                buf_printf(b, "xdp_camera_%s_total{camera=\"%u\"} %llu\n", camera_field_names[f], i,
+                           (unsigned long long)xdp_stats_get(&e->camera_stats.cur, i, f));
+            buf_printf(b, "# TYPE xdp_camera_%s_rate gauge\n", camera_field_names[f]);
+            for (i = 0; i < e->cameras; i++)
+                buf_printf(b, "xdp_camera_%s_rate{camera=\"%u\"} %.1f\n", camera_field_names[f], i,
+                           source_rate(&e->camera_stats, i, f));
+        }
+    }
+
+    if (e->rtp.open) {
+        double unintended, intended;
+
+        for (f = 0; f < NR_RTP_FIELDS; f++) {
+            buf_printf(b, "# TYPE xdp_rtp_%s_total counter\n", rtp_field_names[f]);
+            for (i = 0; i < e->cameras; i++)
+                buf_printf(b, "xdp_rtp_%s_total{camera=\"%u\",point=\"in\"} %llu\n"
+                           "xdp_rtp_%s_total{camera=\"%u\",point=\"out\"} %llu\n",
+                           rtp_field_names[f], i, (unsigned long long)xdp_stats_get(&e->rtp.cur, i, f),
+                           rtp_field_names[f], i,
+                           (unsigned long long)xdp_stats_get(&e->rtp.cur, RTP_MONITOR_OUT + i, f));
+        }
+        buf_printf(b, "# TYPE xdp_rtp_jitter_ms gauge\n");
+        for (i = 0; i < e->cameras; i++)
+            buf_printf(b, "xdp_rtp_jitter_ms{camera=\"%u\",point=\"in\"} %.3f\n"
+                       "xdp_rtp_jitter_ms{camera=\"%u\",point=\"out\"} %.3f\n",
+                       i, rtp_jitter_ms(&e->rtp, i), i, rtp_jitter_ms(&e->rtp, RTP_MONITOR_OUT + i));
+        buf_printf(b, "# TYPE xdp_rtp_loss_percent gauge\n");
+        for (i = 0; i < e->cameras; i++) {
+            rtp_loss(&e->rtp, i, &unintended, &intended);
+            buf_printf(b, "xdp_rtp_loss_percent{camera=\"%u\",kind=\"unintended\"} %.2f\n"
+                       "xdp_rtp_loss_percent{camera=\"%u\",kind=\"intended\"} %.2f\n",
+                       i, unintended, i, intended);
+        }
+    }
+
+    if (e->modes_fd >= 0) {
+        buf_printf(b, "# TYPE xdp_camera_mode gauge\n");
+        for (i = 0; i < e->cameras; i++)
+            buf_printf(b, "xdp_camera_mode{camera=\"%u\"} %u\n", i, e->modes[i]);
+    }
+
+    buf_printf(b, "# TYPE xdp_exporter_cpu_seconds_total counter\n");
+    buf_printf(b, "xdp_exporter_cpu_seconds_total %.3f\n", cpu_seconds());
+    buf_printf(b, "# TYPE xdp_exporter_polls_total counter\n");
+    buf_printf(b, "xdp_exporter_polls_total %llu\n", (unsigned long long)e->polls);
+    buf_printf(b, "# TYPE xdp_exporter_influx_errors_total counter\n");
+    buf_printf(b, "xdp_exporter_influx_errors_total %llu\n", (unsigned long long)e->influx_errors);
+}
+
+/* One point per source and camera, all with the poll's timestamp */
+static void append_influx(struct exporter *e)
+{
+    struct buf *b = &e->influx->lines;
+    __u64 ts = real_ns();
+    __u32 i, f;
+
+    if (e->video.open) {
+        buf_printf(b, "xdp_video_stats ");
+        for (i = 0; i < NR_VIDEO_STATS; i++)
+            buf_printf(b, "%s%s=%llui,%s_rate=%.1f", i ? "," : "", video_stat_names[i],
+                       (unsigned long long)xdp_stats_get(&e->video.cur, i, 0), video_stat_names[i],
+                       source_rate(&e->video, i, 0));
+        buf_printf(b, " %llu\n", (unsigned long long)ts);
+    }
+
+    for (i = 0; e->camera_stats.open && i < e->cameras; i++) {
+        buf_printf(b, "xdp_camera_stats,camera=%u mode=%ui", i, e->modes[i]);
+        for (f = 0; f < NR_CAMERA_FIELDS; f++)
+            buf_printf(b, ",%s=%llui,%s_rate=%.1f", camera_field_names[f],
+                       (unsigned long long)xdp_stats_get(&e->camera_stats.cur, i, f), camera_field_names[f],
+                       source_rate(&e->camera_stats, i, f));
+        buf_printf(b, " %llu\n", (unsigned long long)ts);
+    }
+
+    for (i = 0; e->rtp.open && i < e->cameras; i++) {
+        double unintended, intended;
+
+        rtp_loss(&e->rtp, i, &unintended, &intended);
+        buf_printf(b, "xdp_rtp_monitor,camera=%u unintended_loss_percent=%.2f,intended_loss_percent=%.2f,"
+                   "jitter_ms=%.3f,out_jitter_ms=%.3f", i, unintended, intended, rtp_jitter_ms(&e->rtp, i),
+                   rtp_jitter_ms(&e->rtp, RTP_MONITOR_OUT + i));
+        for (f = 0; f < NR_RTP_FIELDS; f++)
+            buf_printf(b, ",%s=%llui,out_%s=%llui", rtp_field_names[f],
+                       (unsigned long long)xdp_stats_get(&e->rtp.cur, i, f), rtp_field_names[f],
+                       (unsigned long long)xdp_stats_get(&e->rtp.cur, RTP_MONITOR_OUT + i, f));
+        buf_printf(b, " %llu\n", (unsigned long long)ts);
+    }
+}
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, data, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM }, *res, *ai;
+    int fd = -1;
+
+    if (getaddrinfo(host, port, &hints, &res))
+        return -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0)
+            continue;
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen))
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* Writes the buffered lines with one POST; returns 0 on HTTP 204 */
+static int flush_influx(struct exporter *e)
+{
+    struct influx *in = e->influx;
+    char header[1024], status[64] = "";
+    int fd, n, err = -1;
+
+    if (!in->lines.len)
+        return 0;
+
+    fd = connect_to(in->host, in->port);
+    if (fd >= 0) {
+        n = snprintf(header, sizeof(header),
+                     "POST %s HTTP/1.1\r\nHost: %s:%s\r\nAuthorization: Token %s\r\n"
+                     "Content-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\n"
+                     "Connection: close\r\n\r\n",
+                     in->path, in->host, in->port, in->token, in->lines.len);
+        if (!write_all(fd, header, n) && !write_all(fd, in->lines.data, in->lines.len)) {
+            n = read(fd, status, sizeof(status) - 1);
+            if (n > 0) {
+                status[n] = '\0';
+                err = strncmp(status + 9, "204", 3) ? -1 : 0;
+            }
+        }
+        close(fd);
+    }
+
+    if (err)
+        e->influx_errors++;
+    in->lines.len = 0;
+    return err;
+}
+
+/* http://host[:port] plus org, bucket and token */
+static struct influx *influx_init(const char *url, const char *org, const char *bucket, const char *token)
+{
+    struct influx *in;
+    const char *host = url, *colon;
+    size_t len;
+
+    if (!strncmp(host, "http://", 7))
+        host += 7;
+    len = strcspn(host, ":/");
+    if (!len || len >= sizeof(in->host) || !org || !bucket)
+        return NULL;
+
+    in = calloc(1, sizeof(*in));
+    if (!in)
+        return NULL;
+    memcpy(in->host, host, len);
+    colon = host[len] == ':' ? host + len + 1 : NULL;
+    snprintf(in->port, sizeof(in->port), "%.*s", colon ? (int)strcspn(colon, "/") : 4, colon ? colon : "8086");
+    snprintf(in->path, sizeof(in->path), "/api/v2/write?org=%s&bucket=%s&precision=ns", org, bucket);
+    snprintf(in->token, sizeof(in->token), "%s", token ? token : "");
+    return in;
+}
+
+static int listen_on(int port)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = INADDR_ANY };
+    int fd, one = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 16)) {
+        fprintf(stderr, "Failed to listen on port %d: %s\n", port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Reads the request head into req, 0 once the blank line that ends it
+ * arrived before the deadline */
+static int read_request(int fd, char *req, size_t size, __u64 deadline)
+{
+    size_t len = 0;
+
+    req[0] = '\0';
+    while (!strstr(req, "\r\n\r\n")) {
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        __u64 now = mono_ns();
+        ssize_t n;
+
+        if (now >= deadline || len == size - 1)
+            return -1;
+        if (poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000)) <= 0)
+            return -1;
+        n = read(fd, req + len, size - 1 - len);
+        if (n <= 0)
+            return -1;
+        len += n;
+        req[len] = '\0';
+    }
+    return 0;
+}
+
+/* Answers one scrape. A client that stalls is dropped after
+ * CLIENT_TIMEOUT_MS instead of stopping the polling. */
+static void serve_client(const struct exporter *e, int listen_fd, struct buf *body)
+{
+    struct timeval send_timeout = { .tv_usec = CLIENT_TIMEOUT_MS * 1000 };
+    char req[1024], header[256];
+    int fd, n;
+
+    fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0)
+        return;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+
+    if (!read_request(fd, req, sizeof(req), mono_ns() + CLIENT_TIMEOUT_MS * 1000000ULL)) {
+        if (!strncmp(req, "GET /metrics", 12)) {
+            body->len = 0;
+            render_metrics(e, body);
+            n = snprintf(header, sizeof(header),
+                         "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                         "Content-Length: %zu\r\nConnection: close\r\n\r\n", body->len);
+            if (!write_all(fd, header, n))
+                write_all(fd, body->data, body->len);
+        } else {
+            n = snprintf(header, sizeof(header),
+                         "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+            write_all(fd, header, n);
+        }
+    }
+    close(fd);
+}
+
+int main(int argc, char **argv)
+{
+    struct exporter e = { .modes_fd = -1, .cpu_fd = -1, .cameras = NUM_CAMERAS };
+    const char *influx_url = NULL, *org = NULL, *bucket = NULL, *token = NULL;
+    int port = 9101, interval_ms = 100, flush_ms = 1000, verbose = 0, opt, listen_fd = -1, rc = 1;
+    __u64 next_poll, next_flush, next_report, start_ns;
+    double start_cpu;
+    struct buf body = { 0 };
+
+    while ((opt = getopt(argc, argv, "p:i:n:I:O:B:T:F:vh")) != -1) {
+        switch (opt) {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'n':
+            e.cameras = strtoul(optarg, NULL, 0);
+            break;
+        case 'I':
+            influx_url = optarg;
+            break;
+        case 'O':
+            org = optarg;
+            break;
+        case 'B':
+            bucket = optarg;
+            break;
+        case 'T':
+            token = optarg;
+            break;
+        case 'F':
+            flush_ms = atoi(optarg);
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (interval_ms <= 0 || flush_ms <= 0 || !e.cameras || e.cameras > NUM_CAMERAS) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (influx_url) {
+        e.influx = influx_init(influx_url, org, bucket, token);
+        if (!e.influx) {
+            fprintf(stderr, "Invalid InfluxDB settings, -I needs -O and -B\n");
+            return 1;
+        }
+    }
+
+    /* A pipeline without stage2 has no video maps; export what exists */
+    if (source_open(&e.pipeline, "counters") < 0)
+        goto out;
+    source_open(&e.video, "video_stats");
+    source_open(&e.camera_stats, "camera_stats");
+    source_open(&e.rtp, "rtp_monitor");
+    e.modes_fd = bpf_obj_get(XDP_PIPELINE_PIN_DIR "/camera_filtering_mode");
+    e.cpu_fd = bpf_obj_get(XDP_PIPELINE_PIN_DIR "/camera_cpu");
+    if (e.cpu_fd >= 0 && e.rtp.open && e.rtp.map.max_entries == 2 * NUM_CAMERAS) {
+        e.rtp.first_state = RTP_FIELD_JITTER;
+        e.rtp.owner = e.rtp_owner;
+    }
+
+    if (port && (listen_fd = listen_on(port)) < 0)
+        goto out;
+
+    signal(SIGINT, on_signal);
+    signal(SIGTERM, on_signal);
+    signal(SIGPIPE, SIG_IGN);
+
+    start_ns = mono_ns();
+    start_cpu = cpu_seconds();
+    next_poll = start_ns;
+    next_flush = start_ns + flush_ms * 1000000ULL;
+    next_report = start_ns + 10000000000ULL;
+
+    while (!stop) {
+        struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+        __u64 now = mono_ns();
+        int timeout_ms;
+
+        if (now >= next_poll) {
+            if (poll_maps(&e)) {
+                fprintf(stderr, "Failed to read the maps\n");
+                break;
+            }
+            if (e.influx)
+                append_influx(&e);
+            next_poll += interval_ms * 1000000ULL;
+            if (next_poll <= now)
+                next_poll = now + interval_ms * 1000000ULL;
+        }
+        if (e.influx && now >= next_flush) {
+            if (flush_influx(&e) && verbose)
+                fprintf(stderr, "InfluxDB write failed\n");
+            next_flush = now + flush_ms * 1000000ULL;
+        }
+        if (verbose && now >= next_report) {
+            double wall = (now - start_ns) / 1e9;
+
+            fprintf(stderr, "%llu polls, %.1f us per poll, %.3f%% of a core\n",
+                    (unsigned long long)e.polls, e.read_ns / 1e3 / (e.polls ? e.polls : 1),
+                    100.0 * (cpu_seconds() - start_cpu) / wall);
+            next_report = now + 10000000000ULL;
+        }
+
+        now = mono_ns();
+        timeout_ms = next_poll > now ? (int)((next_poll - now + 999999) / 1000000) : 0;
+        if (poll(listen_fd >= 0 ? &pfd : NULL, listen_fd >= 0, timeout_ms) > 0)
+            serve_client(&e, listen_fd, &body);
+    }
+    if (e.influx)
+        flush_influx(&e);
+    rc = 0;
+
+out:
+    if (listen_fd >= 0)
+        close(listen_fd);
+    if (e.modes_fd >= 0)
+        close(e.modes_fd);
+    if (e.cpu_fd >= 0)
+        close(e.cpu_fd);
+    source_close(&e.video);
+    source_close(&e.camera_stats);
+    source_close(&e.rtp);
+    source_close(&e.pipeline);
+    if (e.influx)
+        free(e.influx->lines.data);
+    free(e.influx);
+    free(body.data);
+    return rc;
+}
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <bpf/libbpf.h>
+#include <bpf/btf.h>
+
+#include "xdp_obj.h"
+
+void *rodata_var(struct bpf_object *obj, const char *name, __u32 *var_size)
+{
+    struct btf *btf = bpf_object__btf(obj);
+    const struct btf_type *sec;
+    struct btf_var_secinfo *vsi;
+    struct bpf_map *map;
+    char *data = NULL;
+    size_t size;
+    __s32 sec_id;
+    int i;
+
+    if (!btf)
+        return NULL;
+
+    bpf_object__for_each_map(map, obj) {
+        const char *map_name = bpf_map__name(map);
+        size_t len = strlen(map_name);
+
+        if (bpf_map__is_internal(map) && len >= 7 && !strcmp(map_name + len - 7, ".rodata")) {
+            data = bpf_map__initial_value(map, &size);
+            break;
+        }
+    }
+
+    sec_id = btf__find_by_name_kind(btf, ".rodata", BTF_KIND_DATASEC);
+    if (!data || sec_id < 0)
+        return NULL;
+
+    sec = btf__type_by_id(btf, sec_id);
+    vsi = btf_var_secinfos(sec);
+    for (i = 0; i < btf_vlen(sec); i++, vsi++) {
+        const struct btf_type *var = btf__type_by_id(btf, vsi->type);
+
+        if (strcmp(btf__name_by_offset(btf, var->name_off), name))
+            continue;
+        if (vsi->offset + vsi->size > size)
+            return NULL;
+        *var_size = vsi->size;
+        return data + vsi->offset;
+    }
+    return NULL;
+}
+
+int set_rodata(struct bpf_object *obj, const char *name, const void *value, __u32 size)
+{
+    __u32 var_size;
+    void *var = rodata_var(obj, name, &var_size);
+
+    if (!var)
+        return -ENOENT;
+    if (var_size != size)
+        return -EINVAL;
+    memcpy(var, value, size);
+    return 0;
+}
+
+int share_maps(struct bpf_object *obj, struct bpf_object *disp_obj)
+{
+    struct bpf_map *map;
+    int err;
+
+    bpf_object__for_each_map(map, obj) {
+        struct bpf_map *disp_map;
+
+        if (bpf_map__is_internal(map))
+            continue;
+        disp_map = bpf_object__find_map_by_name(disp_obj, bpf_map__name(map));
+        if (!disp_map)
+            continue;
+        err = bpf_map__reuse_fd(map, bpf_map__fd(disp_map));
+        if (err) {
+            fprintf(stderr, "Failed to share map %s: %s\n", bpf_map__name(map), strerror(-err));
+            return err;
+        }
+    }
+    return 0;
+}
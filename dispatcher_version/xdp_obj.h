@@ -0,0 +1,23 @@
+#ifndef XDP_OBJ_H
+#define XDP_OBJ_H
+
+#include <linux/types.h>
+
+struct bpf_object;
+
+/* Helpers for BPF objects that are opened but not loaded yet, shared by
+ * the loaders and the benches. */
+
+/* The bytes of the .rodata variable `name` in obj's initial .rodata image
+ * and its size, NULL if obj has no such variable */
+void *rodata_var(struct bpf_object *obj, const char *name, __u32 *var_size);
+
+/* Sets the .rodata variable `name` of obj, any size. -ENOENT if obj has
+ * no such variable, -EINVAL if its size is not size. */
+int set_rodata(struct bpf_object *obj, const char *name, const void *value, __u32 size);
+
+/* Lets obj use the instance of every map that disp_obj, already loaded,
+ * also defines (matched by name) */
+int share_maps(struct bpf_object *obj, struct bpf_object *disp_obj);
+
+#endif /* XDP_OBJ_H */
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "xdp_stats.h"
+#include "pipeline_defs.h"
+
+/* Toggles the dispatcher's latency profiling (pipeline_runtime, at the
+ * start of its .data, pinned as dispatcher_data) and prints the
+ * per-CPU-summed prof_hist histograms as percentiles. Buckets are log2 of
+ * the duration in ns; percentiles are interpolated linearly inside their
+ * bucket, so they are estimates within a factor of two. */
+
+static const char *const decision_names[PROF_DECISIONS] = {
+    "pass", "drop", "call_next", "return", "jump", "decision 5", "decision 6", "decision 7",
+};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-e | -d] [-r] [-i interval_ms] [-c count]\n"
+            "  Prints p50/p99/p999 of the per-stage and whole-packet latency histograms.\n"
+            "  -e  enable profiling      -d  disable profiling (without -i: only toggle)\n"
+            "  -r  reset the histograms\n"
+            "  -i  print the histograms of every interval_ms window\n"
+            "  -c  stop after count windows (with -i)\n",
+            prog);
+}
+
+/* Read-modify-write of the dispatcher's .data, a single-entry array */
+static int set_enabled(__u32 enabled)
+{
+    struct bpf_map_info info;
+    __u32 key = 0, info_len = sizeof(info);
+    char *data = NULL;
+    int fd = bpf_obj_get(XDP_PIPELINE_PIN_DIR "/dispatcher_data"), rc = -1;
+
+    memset(&info, 0, sizeof(info));
+    if (fd < 0 || bpf_obj_get_info_by_fd(fd, &info, &info_len) ||
+        info.value_size < sizeof(struct pipeline_runtime) || !(data = malloc(info.value_size)) ||
+        bpf_map_lookup_elem(fd, &key, data)) {
+        fprintf(stderr, "Failed to read dispatcher_data: %s\n", strerror(errno));
+        goto out;
+    }
+    ((struct pipeline_runtime *)data)->prof_enabled = enabled;
+    if (bpf_map_update_elem(fd, &key, data, BPF_ANY)) {
+        fprintf(stderr, "Failed to update dispatcher_data: %s\n", strerror(errno));
+        goto out;
+    }
+    rc = 0;
+out:
+    free(data);
+    if (fd >= 0)
+        close(fd);
+    return rc;
+}
+
+/* Zeroes every CPU's slot of every histogram */
+static int reset(const struct xdp_stats_map *m)
+{
+    size_t size = (size_t)((m->value_size + 7) & ~7U) * m->nr_cpus;
+    void *zero = calloc(1, size);
+    __u32 key;
+    int err = 0;
+
+    if (!zero)
+        return -ENOMEM;
+    for (key = 0; key < m->max_entries && !err; key++)
+        if (bpf_map_update_elem(m->fd, &key, zero, BPF_ANY))
+            err = -errno;
+    free(zero);
+    return err;
+}
+
+/* Duration (ns) below which a fraction q of the samples falls */
+static double percentile(const __u64 *buckets, __u64 total, double q)
+{
+    double target = q * total, seen = 0;
+    int i;
+
+    for (i = 0; i < PROF_BUCKETS; i++) {
+        double lo = i ? (double)(1ULL << i) : 0, hi = (double)(1ULL << (i + 1));
+
+        if (buckets[i] && seen + buckets[i] >= target)
+            return lo + (hi - lo) * (target - seen) / buckets[i];
+        seen += buckets[i];
+    }
+    return (double)(1ULL << PROF_BUCKETS);
+}
+
+static void print_hist(const char *name, const __u64 *buckets)
+{
+    __u64 total = 0;
+    int i;
+
+    for (i = 0; i < PROF_BUCKETS; i++)
+        total += buckets[i];
+    if (!total)
+        return;
+    printf("%-22s %12llu %10.0f %10.0f %10.0f\n", name, (unsigned long long)total,
+           percentile(buckets, total, 0.5), percentile(buckets, total, 0.99),
+           percentile(buckets, total, 0.999));
+}
+
+/* Histograms of cur, minus prev when given */
+static void print_snapshot(const struct xdp_stats_snapshot *cur, const struct xdp_stats_snapshot *prev)
+{
+    __u64 buckets[PROF_BUCKETS];
+    char name[32];
+    __u32 h;
+    int i;
+
+    printf("%-22s %12s %10s %10s %10s\n", "histogram", "samples", "p50 ns", "p99 ns", "p999 ns");
+    for (h = 0; h < cur->nr_entries; h++) {
+        for (i = 0; i < PROF_BUCKETS; i++)
+            buckets[i] = xdp_stats_get(cur, h, i) - (prev ? xdp_stats_get(prev, h, i) : 0);
+        if (h < PROF_HIST_TOTAL)
+            snprintf(name, sizeof(name), "stage slot %u", h - PROF_HIST_STAGE);
+        else
+            snprintf(name, sizeof(name), "packet, %s", decision_names[(h - PROF_HIST_TOTAL) % PROF_DECISIONS]);
+        print_hist(name, buckets);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct xdp_stats_map map;
+    struct xdp_stats_snapshot snap[2];
+    int enable = -1, do_reset = 0, interval_ms = 0, count = 0, opt, n, rc = 1;
+
+    while ((opt = getopt(argc, argv, "edri:c:h")) != -1) {
+        switch (opt) {
+        case 'e':
+            enable = 1;
+            break;
+        case 'd':
+            enable = 0;
+            break;
+        case 'r':
+            do_reset = 1;
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (xdp_stats_open(&map, "prof_hist"))
+        return 1;
+    if (map.nr_fields != PROF_BUCKETS) {
+        fprintf(stderr, "prof_hist has %u buckets, expected %d\n", map.nr_fields, PROF_BUCKETS);
+        xdp_stats_close(&map);
+        return 1;
+    }
+
+    if (do_reset && reset(&map)) {
+        fprintf(stderr, "Failed to reset prof_hist\n");
+        goto out_map;
+    }
+    if (enable >= 0) {
+        if (set_enabled(enable))
+            goto out_map;
+        /* Only toggling was asked for */
+        if (!interval_ms) {
+            rc = 0;
+            goto out_map;
+        }
+    }
+
+    if (xdp_stats_snapshot_init(&map, &snap[0]))
+        goto out_map;
+    if (xdp_stats_snapshot_init(&map, &snap[1]))
+        goto out_snap0;
+
+    if (xdp_stats_read(&map, &snap[0]))
+        goto out_snap;
+    if (!interval_ms) {
+        print_snapshot(&snap[0], NULL);
+        rc = 0;
+        goto out_snap;
+    }
+
+    for (n = 0; !count || n < count; n++) {
+        usleep(interval_ms * 1000);
+        if (xdp_stats_read(&map, &snap[(n + 1) & 1]))
+            goto out_snap;
+        print_snapshot(&snap[(n + 1) & 1], &snap[n & 1]);
+        printf("\n");
+        fflush(stdout);
+    }
+    rc = 0;
+
+out_snap:
+    xdp_stats_snapshot_free(&snap[1]);
+out_snap0:
+    xdp_stats_snapshot_free(&snap[0]);
+out_map:
+    xdp_stats_close(&map);
+    return rc;
+}
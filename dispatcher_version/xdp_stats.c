@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "xdp_stats.h"
+
+static __u64 now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (__u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t slot_size(const struct xdp_stats_map *m)
+{
+    /* the kernel lays out per-CPU values at 8-byte strides */
+    size_t sz = (m->value_size + 7) & ~7U;
+    return m->percpu ? sz * m->nr_cpus : sz;
+}
+
+int xdp_stats_open(struct xdp_stats_map *m, const char *name)
+{
+    char path[256];
+    struct bpf_map_info info;
+    __u32 info_len = sizeof(info);
+
+    memset(m, 0, sizeof(*m));
+    m->fd = -1;
+
+    if (name[0] == '/')
+        snprintf(path, sizeof(path), "%s", name);
+    else
+        snprintf(path, sizeof(path), "%s/%s", XDP_PIPELINE_PIN_DIR, name);
+
+    m->fd = bpf_obj_get(path);
+    if (m->fd < 0) {
+        fprintf(stderr, "Failed to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    memset(&info, 0, sizeof(info));
+    if (bpf_obj_get_info_by_fd(m->fd, &info, &info_len)) {
+        fprintf(stderr, "Failed to query %s: %s\n", path, strerror(errno));
+        xdp_stats_close(m);
+        return -errno;
+    }
+
+    if (info.key_size != sizeof(__u32) || info.value_size % sizeof(__u64)) {
+        fprintf(stderr, "%s is not a __u32 -> __u64[] counter map\n", path);
+        xdp_stats_close(m);
+        return -EINVAL;
+    }
+
+    m->percpu = info.type == BPF_MAP_TYPE_PERCPU_ARRAY ||
+                info.type == BPF_MAP_TYPE_PERCPU_HASH ||
+                info.type == BPF_MAP_TYPE_LRU_PERCPU_HASH;
+    m->nr_cpus = m->percpu ? libbpf_num_possible_cpus() : 1;
+    if (m->nr_cpus <= 0) {
+        xdp_stats_close(m);
+        return -EINVAL;
+    }
+    m->max_entries = info.max_entries;
+    m->value_size = info.value_size;
+    m->nr_fields = info.value_size / sizeof(__u64);
+
+    m->keys = calloc(m->max_entries, sizeof(__u32));
+    m->raw = calloc(m->max_entries, slot_size(m));
+    if (!m->keys || !m->raw) {
+        xdp_stats_close(m);
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void xdp_stats_close(struct xdp_stats_map *m)
+{
+    if (m->fd >= 0)
+        close(m->fd);
+    free(m->keys);
+    free(m->raw);
+    m->fd = -1;
+    m->keys = NULL;
+    m->raw = NULL;
+}
+
+int xdp_stats_snapshot_init(const struct xdp_stats_map *m, struct xdp_stats_snapshot *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->nr_entries = m->max_entries;
+    s->nr_fields = m->nr_fields;
+    s->values = calloc((size_t)s->nr_entries * s->nr_fields, sizeof(__u64));
+    return s->values ? 0 : -ENOMEM;
+}
+
+void xdp_stats_snapshot_free(struct xdp_stats_snapshot *s)
+{
+    free(s->values);
+    s->values = NULL;
+}
+
+/* Fills m->keys / m->raw for the whole map, returns the number of entries read */
+static int read_batch(struct xdp_stats_map *m)
+{
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 batch = 0, total = 0;
+    void *in = NULL;
+    int err;
+
+    while (total < m->max_entries) {
+        __u32 count = m->max_entries - total;
+
+        err = bpf_map_lookup_batch(m->fd, in, &batch,
+                                   m->keys + total,
+                                   (char *)m->raw + total * slot_size(m),
+                                   &count, &opts);
+        total += count;
+        if (err) {
+            if (errno == ENOENT)
+                break;
+            return -errno;
+        }
+        in = &batch;
+    }
+    return total;
+}
+
+static int read_per_key(struct xdp_stats_map *m)
+{
+    __u32 key;
+
+    for (key = 0; key < m->max_entries; key++) {
+        m->keys[key] = key;
+        if (bpf_map_lookup_elem(m->fd, &key, (char *)m->raw + key * slot_size(m)))
+            memset((char *)m->raw + key * slot_size(m), 0, slot_size(m));
+    }
+    return m->max_entries;
+}
+
+int xdp_stats_read(struct xdp_stats_map *m, struct xdp_stats_snapshot *s)
+{
+    return xdp_stats_read_state(m, s, m->nr_fields, NULL);
+}
+
+int xdp_stats_read_state(struct xdp_stats_map *m, struct xdp_stats_snapshot *s,
+                         __u32 first_state, const __u32 *owner)
+{
+    size_t stride = (m->value_size + 7) & ~7U;
+    int n, i, cpu;
+    __u32 f;
+
+    if (s->nr_entries != m->max_entries || s->nr_fields != m->nr_fields)
+        return -EINVAL;
+
+    n = read_batch(m);
+    if (n < 0)
+        n = read_per_key(m);
+
+    s->ts_ns = now_ns();
+    memset(s->values, 0, (size_t)s->nr_entries * s->nr_fields * sizeof(__u64));
+
+    for (i = 0; i < n; i++) {
+        __u32 key = m->keys[i];
+        const char *slot = (const char *)m->raw + (size_t)i * slot_size(m);
+
+        if (key >= s->nr_entries)
+            continue;
+        for (cpu = 0; cpu < m->nr_cpus; cpu++) {
+            const __u64 *v = (const __u64 *)(slot + cpu * stride);
+            for (f = 0; f < m->nr_fields && f < first_state; f++)
+                s->values[(size_t)key * s->nr_fields + f] += v[f];
+        }
+        if (!owner || !owner[key] || (int)owner[key] > m->nr_cpus)
+            continue;
+        for (f = first_state; f < m->nr_fields; f++) {
+            const __u64 *v = (const __u64 *)(slot + (owner[key] - 1) * stride);
+            s->values[(size_t)key * s->nr_fields + f] = v[f];
+        }
+    }
+    return 0;
+}
+
+int xdp_stats_read_u32(int fd, __u32 *values, __u32 n)
+{
+    LIBBPF_OPTS(bpf_map_batch_opts, opts);
+    __u32 *keys, *batch_values, batch, count = n, i, key;
+
+    keys = calloc(n, sizeof(__u32));
+    batch_values = calloc(n, sizeof(__u32));
+    if (!keys || !batch_values) {
+        free(keys);
+        free(batch_values);
+        return -ENOMEM;
+    }
+
+    memset(values, 0, n * sizeof(__u32));
+    if (!bpf_map_lookup_batch(fd, NULL, &batch, keys, batch_values, &count, &opts) || errno == ENOENT) {
+        for (i = 0; i < count; i++)
+            if (keys[i] < n)
+                values[keys[i]] = batch_values[i];
+    } else {
+        for (key = 0; key < n; key++)
+            bpf_map_lookup_elem(fd, &key, &values[key]);
+    }
+    free(keys);
+    free(batch_values);
+    return 0;
+}
@@ -0,0 +1,58 @@
+#ifndef XDP_STATS_H
+#define XDP_STATS_H
+
+#include <linux/types.h>
+
+#define XDP_PIPELINE_PIN_DIR "/sys/fs/bpf/xdp_pipeline"
+
+/* A pinned counter map. Values are one or more __u64 counters per entry;
+ * per-CPU maps are summed across all possible CPUs on every snapshot. */
+struct xdp_stats_map {
+    int fd;
+    int percpu;
+    int nr_cpus;
+    __u32 max_entries;
+    __u32 value_size;
+    __u32 nr_fields;
+    __u32 *keys;
+    void *raw;
+};
+
+struct xdp_stats_snapshot {
+    __u64 ts_ns;            /* CLOCK_MONOTONIC when the map was read */
+    __u32 nr_entries;
+    __u32 nr_fields;
+    __u64 *values;          /* nr_entries * nr_fields, summed over CPUs */
+};
+
+/* name is either a map name under XDP_PIPELINE_PIN_DIR or an absolute pin path */
+int xdp_stats_open(struct xdp_stats_map *m, const char *name);
+void xdp_stats_close(struct xdp_stats_map *m);
+
+int xdp_stats_snapshot_init(const struct xdp_stats_map *m, struct xdp_stats_snapshot *s);
+void xdp_stats_snapshot_free(struct xdp_stats_snapshot *s);
+
+/* Reads every entry of the map into s. The whole map is fetched with one
+ * batched lookup when the kernel supports it (per-key lookups otherwise), so
+ * all counters in a snapshot come from a single pass over the map. */
+int xdp_stats_read(struct xdp_stats_map *m, struct xdp_stats_snapshot *s);
+
+/* Like xdp_stats_read(), for per-CPU maps whose fields from first_state
+ * on are flow state rather than counters (rtp_monitor): entry key takes
+ * them from CPU owner[key] - 1 alone, 0 when owner[key] is 0, instead of
+ * their sum. owner has an element per map entry. */
+int xdp_stats_read_state(struct xdp_stats_map *m, struct xdp_stats_snapshot *s,
+                         __u32 first_state, const __u32 *owner);
+
+/* Reads entries [0, n) of a __u32 array map such as camera_cpu (owners
+ * of the flow state, CPU + 1) with one batched lookup if possible */
+int xdp_stats_read_u32(int fd, __u32 *values, __u32 n);
+
+static inline __u64 xdp_stats_get(const struct xdp_stats_snapshot *s, __u32 key, __u32 field)
+{
+    if (key >= s->nr_entries || field >= s->nr_fields)
+        return 0;
+    return s->values[(size_t)key * s->nr_fields + field];
+}
+
+#endif
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <bpf/libbpf.h>
+#include <bpf/bpf.h>
+
+#include "xdp_stats.h"
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-j] [-i interval_ms] [-c count] [-s field] <map_name|pin_path> [key...]\n"
+            "  Prints the per-CPU-summed counters of a pinned stats map.\n"
+            "  -j  print one JSON object per snapshot instead of \"key value\" lines\n"
+            "  -i  keep printing a snapshot every interval_ms milliseconds\n"
+            "  -c  stop after count snapshots (with -i)\n"
+            "  -s  fields from this one on are flow state, printed from the CPU that\n"
+            "      camera_cpu names for the key modulo its size (rtp_monitor: -s 4)\n",
+            prog);
+}
+
+static void print_entry(const struct xdp_stats_snapshot *s, __u32 key, int json, int first)
+{
+    __u32 f;
+
+    if (json) {
+        printf("%s\"%u\": ", first ? "" : ", ", key);
+        if (s->nr_fields == 1) {
+            printf("%llu", (unsigned long long)xdp_stats_get(s, key, 0));
+            return;
+        }
+        printf("[");
+        for (f = 0; f < s->nr_fields; f++)
+            printf("%s%llu", f ? ", " : "", (unsigned long long)xdp_stats_get(s, key, f));
+        printf("]");
+        return;
+    }
+
+    printf("%u", key);
+    for (f = 0; f < s->nr_fields; f++)
+        printf(" %llu", (unsigned long long)xdp_stats_get(s, key, f));
+    printf("\n");
+}
+
+/* owner[key] = camera_cpu[key % its size] for every entry of the map */
+static __u32 *read_owners(const struct xdp_stats_map *map)
+{
+    struct bpf_map_info info = { 0 };
+    __u32 info_len = sizeof(info), *cpus, *owner = NULL, key;
+    int fd;
+
+    fd = bpf_obj_get(XDP_PIPELINE_PIN_DIR "/camera_cpu");
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open camera_cpu\n");
+        return NULL;
+    }
+    if (bpf_obj_get_info_by_fd(fd, &info, &info_len) || !info.max_entries) {
+        close(fd);
+        return NULL;
+    }
+    cpus = calloc(info.max_entries, sizeof(__u32));
+    if (cpus && !xdp_stats_read_u32(fd, cpus, info.max_entries))
+        owner = calloc(map->max_entries, sizeof(__u32));
+    if (owner)
+        for (key = 0; key < map->max_entries; key++)
+            owner[key] = cpus[key % info.max_entries];
+    free(cpus);
+    close(fd);
+    return owner;
+}
+
+int main(int argc, char **argv)
+{
+    struct xdp_stats_map map;
+    struct xdp_stats_snapshot snap;
+    int json = 0, interval_ms = 0, count = 0, opt, i, n;
+    __u32 *keys = NULL, *owner = NULL, first_state = 0;
+    int nr_keys, rc = 0;
+
+    while ((opt = getopt(argc, argv, "ji:c:s:h")) != -1) {
+        switch (opt) {
+        case 'j':
+            json = 1;
+            break;
+        case 'i':
+            interval_ms = atoi(optarg);
+            break;
+        case 'c':
+            count = atoi(optarg);
+            break;
+        case 's':
+            first_state = strtoul(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (xdp_stats_open(&map, argv[optind]))
+        return 1;
+
+    if (xdp_stats_snapshot_init(&map, &snap)) {
+        xdp_stats_close(&map);
+        return 1;
+    }
+
+    nr_keys = argc - optind - 1;
+    if (nr_keys == 0)
+        nr_keys = map.max_entries;
+    keys = calloc(nr_keys, sizeof(__u32));
+    if (!keys) {
+        xdp_stats_snapshot_free(&snap);
+        xdp_stats_close(&map);
+        return 1;
+    }
+    for (i = 0; i < nr_keys; i++)
+        keys[i] = argc - optind - 1 ? (__u32)strtoul(argv[optind + 1 + i], NULL, 0) : (__u32)i;
+
+    for (n = 0; ; n++) {
+        if (first_state) {
+            free(owner);
+            owner = read_owners(&map);
+        }
+        if (first_state ? !owner || xdp_stats_read_state(&map, &snap, first_state, owner)
+                        : xdp_stats_read(&map, &snap)) {
+            fprintf(stderr, "Failed to read %s\n", argv[optind]);
+            rc = 1;
+            break;
+        }
+
+        if (json)
+            printf("{\"ts_ns\": %llu, \"values\": {", (unsigned long long)snap.ts_ns);
+        for (i = 0; i < nr_keys; i++)
+            print_entry(&snap, keys[i], json, i == 0);
+        if (json)
+            printf("}}\n");
+        fflush(stdout);
+
+        if (interval_ms <= 0 || (count > 0 && n + 1 >= count))
+            break;
+        usleep(interval_ms * 1000);
+    }
+
+    free(keys);
+    free(owner);
+    xdp_stats_snapshot_free(&snap);
+    xdp_stats_close(&map);
+    return rc;
+}
@@ -27,6 +27,7 @@ parser.add_argument("--interactive", help="read positions from the standard inpu
 parser.add_argument("--step-interval", help="time (s) between two steps",default=0.1,type=float)
 parser.add_argument("--dst-ip", help="IPv4 address of the destination",default="20.0.0.2",type=str)
 parser.add_argument("--dst-port", help="UDP destination port",default="5555",type=int)
+parser.add_argument("--robots", help="number of robots to drive, each sends its robot_id after x,y",default=0,type=int)
 
 
 args = parser.parse_args()
@@ -34,13 +35,19 @@ args = parser.parse_args()
 s = socket.socket(socket.AF_INET,socket.SOCK_DGRAM)
 
 
-def report_position(x:int,y:int):
-    s.sendto(struct.pack('!II',x,y),(args.dst_ip,args.dst_port))
+def report_position(x:int,y:int,robot_id=None):
+    if robot_id is None:
+        s.sendto(struct.pack('!II',x,y),(args.dst_ip,args.dst_port))
+    else:
+        s.sendto(struct.pack('!III',x,y,robot_id),(args.dst_ip,args.dst_port))
     try:
-            write_api.write(bucket=bucket, org=org, record=[{"measurement": measurement, "tags": tags, "fields": {"x":x,"y":y}}])
+            write_api.write(bucket=bucket, org=org, record=[{"measurement": measurement, "tags": tags if robot_id is None else {"entity_id": str(robot_id)}, "fields": {"x":x,"y":y}}])
     except:
         print("Couldn't write InfluxDB")
-    print('Sent:',x,y)
+    if robot_id is None:
+        print('Sent:',x,y)
+    else:
+        print('Sent:',robot_id,x,y)
 
 def interactive_mode():
     print("type 'quit' to exit")
@@ -83,7 +90,21 @@ def automated_mode():
             time.sleep(args.step_interval)
 
 
+def fleet_mode(robots:int):
+    # every robot follows the same trajectory, spread evenly along it
+    trajectory = get_rectangle_trajectory(25,25,75,75)
+    spacing = max(1,len(trajectory)//robots)
+    while True:
+        for step in range(len(trajectory)):
+            for robot_id in range(robots):
+                x,y = trajectory[(step+robot_id*spacing)%len(trajectory)]
+                report_position(x,y,robot_id)
+            time.sleep(args.step_interval)
+
+
 if args.interactive:
     interactive_mode()
+elif args.robots>0:
+    fleet_mode(args.robots)
 else:
     automated_mode()
\ No newline at end of file